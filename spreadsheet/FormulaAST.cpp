@@ -1,481 +1,680 @@
-#include "FormulaAST.h"
-
-#include "FormulaBaseListener.h"
-#include "FormulaLexer.h"
-#include "FormulaParser.h"
-
-#include <cassert>
-#include <cmath>
-#include <memory>
-#include <optional>
-#include <sstream>
-#include <string>
-
-namespace ASTImpl {
-
-    enum ExprPrecedence {
-        EP_ADD,
-        EP_SUB,
-        EP_MUL,
-        EP_DIV,
-        EP_UNARY,
-        EP_ATOM,
-        EP_END,
-    };
-
-    // a bit is set when the parentheses are needed
-    enum PrecedenceRule {
-        PR_NONE = 0b00,                // never needed
-        PR_LEFT = 0b01,                // needed for a left child
-        PR_RIGHT = 0b10,               // needed for a right child
-        PR_BOTH = PR_LEFT | PR_RIGHT,  // needed for both children
-    };
-
-    // PRECEDENCE_RULES[parent][child] determines if parentheses need
-    // to be inserted between a parent and a child of specific precedences;
-    // for some nodes rules are different for left and right children:
-    // (X c Y) p Z  vs  X p (Y c Z)
-    //
-    // The interesting cases are the ones where removing the parens would change the AST.
-    // It may happen when our precedence rules for parentheses are different from
-    // the grammatic precedence of operations.
-    //
-    // Case analysis:
-    // A + (B + C) - always okay (nothing of lower grammatic precedence could have been written to the
-    // right)
-    //    (e.g. if we had A + (B + C) / D, it wouldn't parse in a way
-    //    that woudld have given us A + (B + C) as a subexpression to deal with)
-    // A + (B - C) - always okay (nothing of lower grammatic precedence could have been written to the
-    // right) A - (B + C) - never okay A - (B - C) - never okay A * (B * C) - always okay (the parent
-    // has the highest grammatic precedence) A * (B / C) - always okay (the parent has the highest
-    // grammatic precedence) A / (B * C) - never okay A / (B / C) - never okay
-    // -(A + B) - never okay
-    // -(A - B) - never okay
-    // -(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
-    // -(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
-    // +(A + B) - **sometimes okay** (e.g. parens in +(A + B) / C are **not** optional)
-    //     (currently in the table we're always putting in the parentheses)
-    // +(A - B) - **sometimes okay** (same)
-    //     (currently in the table we're always putting in the parentheses)
-    // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
-    // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
-    constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-        /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    };
-
-    class Expr {
-    public:
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const SheetInterface& sheet) const = 0;
-
-        // higher is tighter
-        virtual ExprPrecedence GetPrecedence() const = 0;
-
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-            bool right_child = false) const {
-            auto precedence = GetPrecedence();
-            auto mask = right_child ? PR_RIGHT : PR_LEFT;
-            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-            if (parens_needed) {
-                out << '(';
-            }
-
-            DoPrintFormula(out, precedence);
-
-            if (parens_needed) {
-                out << ')';
-            }
-        }
-    };
-
-    namespace {
-        class BinaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                Add = '+',
-                Subtract = '-',
-                Multiply = '*',
-                Divide = '/',
-            };
-
-        public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-                : type_(type)
-                , lhs_(std::move(lhs))
-                , rhs_(std::move(rhs)) {
-            }
-
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-            }
-
-            ExprPrecedence GetPrecedence() const override {
-                switch (type_) {
-                case Add:
-                    return EP_ADD;
-                case Subtract:
-                    return EP_SUB;
-                case Multiply:
-                    return EP_MUL;
-                case Divide:
-                    return EP_DIV;
-                default:
-                    // have to do this because VC++ has a buggy warning
-                    assert(false);
-                    return static_cast<ExprPrecedence>(INT_MAX);
-                }
-            }
-
-            double Evaluate(const SheetInterface& sheet) const override {
-                // Скопируйте ваше решение из предыдущих уроков.
-                double res = 0;
-                if (type_ == Type::Add) {
-                    res = lhs_->Evaluate(sheet) + rhs_->Evaluate(sheet);
-                }
-                else if (type_ == Type::Subtract) {
-                    res = lhs_->Evaluate(sheet) - rhs_->Evaluate(sheet);
-                }
-                else if (type_ == Type::Multiply) {
-                    res = lhs_->Evaluate(sheet) * rhs_->Evaluate(sheet);
-                }
-                else if (type_ == Type::Divide) {
-
-                    res = lhs_->Evaluate(sheet) / rhs_->Evaluate(sheet);
-                }
-                else {
-                    throw std::logic_error("Unknown type");
-                }
-
-                if (std::isfinite(res)) {
-                    return res;
-                }
-                //***To Implement***
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-
-        private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
-        };
-
-        class UnaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                UnaryPlus = '+',
-                UnaryMinus = '-',
-            };
-
-        public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-                : type_(type)
-                , operand_(std::move(operand)) {
-            }
-
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
-                out << ')';
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
-            }
-
-            ExprPrecedence GetPrecedence() const override {
-                return EP_UNARY;
-            }
-
-            double Evaluate(const SheetInterface& sheet) const override {
-                // Скопируйте ваше решение из предыдущих уроков.
-                if (type_ == Type::UnaryPlus) {
-                    return operand_->Evaluate(sheet);
-                }
-                else if (type_ == Type::UnaryMinus) {
-                    return -1.0 * (operand_->Evaluate(sheet));
-                }
-
-                throw std::logic_error("Unknown type");
-            }
-
-        private:
-            Type type_;
-            std::unique_ptr<Expr> operand_;
-        };
-
-        class CellExpr final : public Expr {
-        public:
-            explicit CellExpr(const Position* cell)
-                : cell_(cell) {
-            }
-
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
-                    out << FormulaError::Category::Ref;
-                }
-                else {
-                    out << cell_->ToString();
-                }
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
-            }
-
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
-            }
-
-            //*** TO IMPLEMENT***
-            double Evaluate(const SheetInterface& sheet) const override {
-                // реализуйте метод.
-                const CellInterface* cell_ptr = sheet.GetCell(*cell_);
-                if (cell_ptr == nullptr) {
-                    return 0;
-                }
-                std::variant<std::string, double, FormulaError> value = cell_ptr->GetValue();
-                if (std::holds_alternative<double>(value)) {
-                    return std::get<double>(value);
-                }
-                if (std::holds_alternative<std::string>(value)) {
-                    std::string val = std::get<std::string>(value);
-                    return EvaluateString(val);
-                }
-                else {
-                    FormulaError error = std::get<FormulaError>(value);
-                    throw error;
-                }
-            }
-
-        private:
-
-            double static EvaluateString(std::string val) {
-                if (val == "") {
-                    return 0;
-                }
-                try {
-                    double num_val = strict_stod(val);
-                    return num_val;
-                }
-                catch (...) {
-                    throw FormulaError(FormulaError::Category::Value);
-                }
-            }
-
-            double static strict_stod(const std::string& s) {
-                std::size_t pos;
-                double result = std::stod(s, &pos);
-                if (pos != s.size()) {
-                    throw std::invalid_argument("Cannot convert string to double");
-                }
-                return result;
-            }
-
-            const Position* cell_;
-        };
-
-        class NumberExpr final : public Expr {
-        public:
-            explicit NumberExpr(double value)
-                : value_(value) {
-            }
-
-            void Print(std::ostream& out) const override {
-                out << value_;
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                out << value_;
-            }
-
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
-            }
-
-            double Evaluate(const SheetInterface&) const override {
-                return value_;
-            }
-
-        private:
-            double value_;
-        };
-
-        class ParseASTListener final : public FormulaBaseListener {
-        public:
-            std::unique_ptr<Expr> MoveRoot() {
-                assert(args_.size() == 1);
-                auto root = std::move(args_.front());
-                args_.clear();
-
-                return root;
-            }
-
-            std::forward_list<Position> MoveCells() {
-                return std::move(cells_);
-            }
-
-        public:
-            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-                assert(args_.size() >= 1);
-
-                auto operand = std::move(args_.back());
-
-                UnaryOpExpr::Type type;
-                if (ctx->SUB()) {
-                    type = UnaryOpExpr::UnaryMinus;
-                }
-                else {
-                    assert(ctx->ADD() != nullptr);
-                    type = UnaryOpExpr::UnaryPlus;
-                }
-
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
-            }
-
-            void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-                double value = 0;
-                auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-                std::istringstream in(valueStr);
-                in >> value;
-                if (!in) {
-                    throw ParsingError("Invalid number: " + valueStr);
-                }
-
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
-            }
-
-            void exitCell(FormulaParser::CellContext* ctx) override {
-                auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
-                if (!value.IsValid()) {
-                    throw FormulaException("Invalid position: " + value_str);
-                }
-
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
-            }
-
-            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-                assert(args_.size() >= 2);
-
-                auto rhs = std::move(args_.back());
-                args_.pop_back();
-
-                auto lhs = std::move(args_.back());
-
-                BinaryOpExpr::Type type;
-                if (ctx->ADD()) {
-                    type = BinaryOpExpr::Add;
-                }
-                else if (ctx->SUB()) {
-                    type = BinaryOpExpr::Subtract;
-                }
-                else if (ctx->MUL()) {
-                    type = BinaryOpExpr::Multiply;
-                }
-                else {
-                    assert(ctx->DIV() != nullptr);
-                    type = BinaryOpExpr::Divide;
-                }
-
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
-            }
-
-            void visitErrorNode(antlr4::tree::ErrorNode* node) override {
-                throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
-            }
-
-        private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
-        };
-
-        class BailErrorListener : public antlr4::BaseErrorListener {
-        public:
-            void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
-                size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
-                std::exception_ptr /* e */
-            ) override {
-                throw ParsingError("Error when lexing: " + msg);
-            }
-        };
-
-    }  // namespace
-}  // namespace ASTImpl
-
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
-
-    ANTLRInputStream input(in);
-
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
-
-    CommonTokenStream tokens(&lexer);
-
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
-
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
-
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
-
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
-}
-
-void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
-    }
-}
-
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
-}
-
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
-}
-
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
-}
-
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
-}
-
-FormulaAST::~FormulaAST() = default;
+#include "FormulaAST.h"
+
+#include "FormulaBaseListener.h"
+#include "FormulaLexer.h"
+#include "FormulaParser.h"
+#include "formula.h"
+
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+namespace ASTImpl {
+
+    enum ExprPrecedence {
+        EP_ADD,
+        EP_SUB,
+        EP_MUL,
+        EP_DIV,
+        EP_UNARY,
+        EP_ATOM,
+        EP_END,
+    };
+
+    // a bit is set when the parentheses are needed
+    enum PrecedenceRule {
+        PR_NONE = 0b00,                // never needed
+        PR_LEFT = 0b01,                // needed for a left child
+        PR_RIGHT = 0b10,               // needed for a right child
+        PR_BOTH = PR_LEFT | PR_RIGHT,  // needed for both children
+    };
+
+    // PRECEDENCE_RULES[parent][child] determines if parentheses need
+    // to be inserted between a parent and a child of specific precedences;
+    // for some nodes rules are different for left and right children:
+    // (X c Y) p Z  vs  X p (Y c Z)
+    //
+    // The interesting cases are the ones where removing the parens would change the AST.
+    // It may happen when our precedence rules for parentheses are different from
+    // the grammatic precedence of operations.
+    //
+    // Case analysis:
+    // A + (B + C) - always okay (nothing of lower grammatic precedence could have been written to the
+    // right)
+    //    (e.g. if we had A + (B + C) / D, it wouldn't parse in a way
+    //    that woudld have given us A + (B + C) as a subexpression to deal with)
+    // A + (B - C) - always okay (nothing of lower grammatic precedence could have been written to the
+    // right) A - (B + C) - never okay A - (B - C) - never okay A * (B * C) - always okay (the parent
+    // has the highest grammatic precedence) A * (B / C) - always okay (the parent has the highest
+    // grammatic precedence) A / (B * C) - never okay A / (B / C) - never okay
+    // -(A + B) - never okay
+    // -(A - B) - never okay
+    // -(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // -(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // +(A + B) - **sometimes okay** (e.g. parens in +(A + B) / C are **not** optional)
+    //     (currently in the table we're always putting in the parentheses)
+    // +(A - B) - **sometimes okay** (same)
+    //     (currently in the table we're always putting in the parentheses)
+    // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+    constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
+        /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    };
+
+    class Expr {
+    public:
+        virtual ~Expr() = default;
+        virtual void Print(std::ostream& out) const = 0;
+        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
+        virtual double Evaluate(const SheetInterface& sheet) const = 0;
+
+        // appends the expression in postfix order
+        virtual void Compile(BatchProgram& program) const = 0;
+
+        // deep copy (the cell nodes keep pointing to the same positions)
+        virtual std::unique_ptr<Expr> Clone() const = 0;
+
+        // points the cell nodes of the subtree to the positions given by cells
+        // (old position -> new position)
+        virtual void RebindCells(const std::unordered_map<const Position*, const Position*>& /* cells */) {
+        }
+
+        // constant folding and identity removal;
+        // returns nullptr when nothing in the subtree can be simplified
+        virtual std::unique_ptr<Expr> Simplify() const {
+            return nullptr;
+        }
+
+        // value of the expression if it does not depend on any cell
+        virtual std::optional<double> GetConstant() const {
+            return std::nullopt;
+        }
+
+        // the value is never inf or nan (a cell holding the text "inf" is read as inf)
+        virtual bool IsFinite() const {
+            return false;
+        }
+
+        // higher is tighter
+        virtual ExprPrecedence GetPrecedence() const = 0;
+
+        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+            bool right_child = false) const {
+            auto precedence = GetPrecedence();
+            auto mask = right_child ? PR_RIGHT : PR_LEFT;
+            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+            if (parens_needed) {
+                out << '(';
+            }
+
+            DoPrintFormula(out, precedence);
+
+            if (parens_needed) {
+                out << ')';
+            }
+        }
+    };
+
+    namespace {
+        class BinaryOpExpr final : public Expr {
+        public:
+            enum Type : char {
+                Add = '+',
+                Subtract = '-',
+                Multiply = '*',
+                Divide = '/',
+            };
+
+        public:
+            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+                : type_(type)
+                , lhs_(std::move(lhs))
+                , rhs_(std::move(rhs)) {
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << static_cast<char>(type_) << ' ';
+                lhs_->Print(out);
+                out << ' ';
+                rhs_->Print(out);
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                lhs_->PrintFormula(out, precedence);
+                out << static_cast<char>(type_);
+                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                switch (type_) {
+                case Add:
+                    return EP_ADD;
+                case Subtract:
+                    return EP_SUB;
+                case Multiply:
+                    return EP_MUL;
+                case Divide:
+                    return EP_DIV;
+                default:
+                    // have to do this because VC++ has a buggy warning
+                    assert(false);
+                    return static_cast<ExprPrecedence>(INT_MAX);
+                }
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                // Скопируйте ваше решение из предыдущих уроков.
+                double lhs = lhs_->Evaluate(sheet);
+                double rhs = rhs_->Evaluate(sheet);
+                return Apply(lhs, rhs);
+            }
+
+            double Apply(double lhs, double rhs) const {
+                double res = 0;
+                if (type_ == Type::Add) {
+                    res = lhs + rhs;
+                }
+                else if (type_ == Type::Subtract) {
+                    res = lhs - rhs;
+                }
+                else if (type_ == Type::Multiply) {
+                    res = lhs * rhs;
+                }
+                else if (type_ == Type::Divide) {
+
+                    res = lhs / rhs;
+                }
+                else {
+                    throw std::logic_error("Unknown type");
+                }
+
+                if (std::isfinite(res)) {
+                    return res;
+                }
+                //***To Implement***
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+
+            void Compile(BatchProgram& program) const override {
+                lhs_->Compile(program);
+                rhs_->Compile(program);
+                BatchInstruction instruction;
+                switch (type_) {
+                case Add:
+                    instruction.code = BatchInstruction::Code::Add;
+                    break;
+                case Subtract:
+                    instruction.code = BatchInstruction::Code::Subtract;
+                    break;
+                case Multiply:
+                    instruction.code = BatchInstruction::Code::Multiply;
+                    break;
+                case Divide:
+                    instruction.code = BatchInstruction::Code::Divide;
+                    break;
+                default:
+                    throw std::logic_error("Unknown type");
+                }
+                program.push_back(instruction);
+            }
+
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(), rhs_->Clone());
+            }
+
+            void RebindCells(const std::unordered_map<const Position*, const Position*>& cells) override {
+                lhs_->RebindCells(cells);
+                rhs_->RebindCells(cells);
+            }
+
+            std::unique_ptr<Expr> Simplify() const override;
+
+            // Apply turns inf and nan into an error
+            bool IsFinite() const override {
+                return true;
+            }
+
+        private:
+            // x op c is exactly x for every finite x (including -0 and the errors of x):
+            // the operation is kept if x may be inf or nan, Apply turns them into an error
+            bool IsRightIdentity(double c) const {
+                switch (type_) {
+                case Subtract:
+                    // x - 0 == x; x + 0 is kept as it turns -0 into 0
+                    return c == 0 && !std::signbit(c);
+                case Add:
+                    return c == 0 && std::signbit(c);
+                case Multiply:
+                case Divide:
+                    return c == 1;
+                default:
+                    return false;
+                }
+            }
+
+            bool IsLeftIdentity(double c) const {
+                return type_ == Multiply && c == 1;
+            }
+
+            Type type_;
+            std::unique_ptr<Expr> lhs_;
+            std::unique_ptr<Expr> rhs_;
+        };
+
+        class UnaryOpExpr final : public Expr {
+        public:
+            enum Type : char {
+                UnaryPlus = '+',
+                UnaryMinus = '-',
+            };
+
+        public:
+            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+                : type_(type)
+                , operand_(std::move(operand)) {
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << static_cast<char>(type_) << ' ';
+                operand_->Print(out);
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                out << static_cast<char>(type_);
+                operand_->PrintFormula(out, precedence);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_UNARY;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                // Скопируйте ваше решение из предыдущих уроков.
+                if (type_ == Type::UnaryPlus) {
+                    return operand_->Evaluate(sheet);
+                }
+                else if (type_ == Type::UnaryMinus) {
+                    return -1.0 * (operand_->Evaluate(sheet));
+                }
+
+                throw std::logic_error("Unknown type");
+            }
+
+            void Compile(BatchProgram& program) const override {
+                operand_->Compile(program);
+                if (type_ == Type::UnaryMinus) {
+                    BatchInstruction instruction;
+                    instruction.code = BatchInstruction::Code::Negate;
+                    program.push_back(instruction);
+                }
+            }
+
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<UnaryOpExpr>(type_, operand_->Clone());
+            }
+
+            void RebindCells(const std::unordered_map<const Position*, const Position*>& cells) override {
+                operand_->RebindCells(cells);
+            }
+
+            std::unique_ptr<Expr> Simplify() const override;
+
+            bool IsFinite() const override {
+                return operand_->IsFinite();
+            }
+
+        private:
+            Type type_;
+            std::unique_ptr<Expr> operand_;
+        };
+
+        class CellExpr final : public Expr {
+        public:
+            explicit CellExpr(const Position* cell)
+                : cell_(cell) {
+            }
+
+            void Print(std::ostream& out) const override {
+                if (!cell_->IsValid()) {
+                    out << FormulaError::Category::Ref;
+                }
+                else {
+                    char name[Position::MAX_STRING_LENGTH];
+                    out.write(name, cell_->ToChars(name));
+                }
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                Print(out);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<CellExpr>(cell_);
+            }
+
+            void RebindCells(const std::unordered_map<const Position*, const Position*>& cells) override {
+                cell_ = cells.at(cell_);
+            }
+
+            //*** TO IMPLEMENT***
+            double Evaluate(const SheetInterface& sheet) const override {
+                // реализуйте метод.
+                if (!cell_->IsValid()) {
+                    //the referenced cell was deleted
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                FormulaInterface::Value value = GetCellNumber(sheet.GetCell(*cell_));
+                if (std::holds_alternative<FormulaError>(value)) {
+                    throw std::get<FormulaError>(value);
+                }
+                return std::get<double>(value);
+            }
+
+            void Compile(BatchProgram& program) const override {
+                BatchInstruction instruction;
+                instruction.code = BatchInstruction::Code::Cell;
+                instruction.cell = *cell_;
+                program.push_back(instruction);
+            }
+
+        private:
+            const Position* cell_;
+        };
+
+        class NumberExpr final : public Expr {
+        public:
+            explicit NumberExpr(double value)
+                : value_(value) {
+            }
+
+            void Print(std::ostream& out) const override {
+                out << value_;
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                out << value_;
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface&) const override {
+                return value_;
+            }
+
+            void Compile(BatchProgram& program) const override {
+                BatchInstruction instruction;
+                instruction.code = BatchInstruction::Code::Number;
+                instruction.number = value_;
+                program.push_back(instruction);
+            }
+
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
+            std::optional<double> GetConstant() const override {
+                return value_;
+            }
+
+            bool IsFinite() const override {
+                return std::isfinite(value_);
+            }
+
+        private:
+            double value_;
+        };
+
+        // simplified child, or a copy of the child if it could not be simplified:
+        // the child is simplified only once, by the caller
+        std::unique_ptr<Expr> TakeOrClone(std::unique_ptr<Expr>& simplified, const Expr& child) {
+            return simplified ? std::move(simplified) : child.Clone();
+        }
+
+        std::unique_ptr<Expr> BinaryOpExpr::Simplify() const {
+            std::unique_ptr<Expr> lhs = lhs_->Simplify();
+            std::unique_ptr<Expr> rhs = rhs_->Simplify();
+            const Expr& lhs_ref = lhs ? *lhs : *lhs_;
+            const Expr& rhs_ref = rhs ? *rhs : *rhs_;
+            std::optional<double> lhs_value = lhs_ref.GetConstant();
+            std::optional<double> rhs_value = rhs_ref.GetConstant();
+
+            if (lhs_value && rhs_value) {
+                try {
+                    return std::make_unique<NumberExpr>(Apply(*lhs_value, *rhs_value));
+                }
+                catch (const FormulaError&) {
+                    // e.g. 1/0: keep the operation, it yields the same error on every evaluation
+                    return std::make_unique<BinaryOpExpr>(type_, TakeOrClone(lhs, *lhs_), TakeOrClone(rhs, *rhs_));
+                }
+            }
+            if (rhs_value && IsRightIdentity(*rhs_value) && lhs_ref.IsFinite()) {
+                return TakeOrClone(lhs, *lhs_);
+            }
+            if (lhs_value && IsLeftIdentity(*lhs_value) && rhs_ref.IsFinite()) {
+                return TakeOrClone(rhs, *rhs_);
+            }
+            if (!lhs && !rhs) {
+                return nullptr;
+            }
+            return std::make_unique<BinaryOpExpr>(type_, TakeOrClone(lhs, *lhs_), TakeOrClone(rhs, *rhs_));
+        }
+
+        std::unique_ptr<Expr> UnaryOpExpr::Simplify() const {
+            std::unique_ptr<Expr> operand = operand_->Simplify();
+            const Expr& operand_ref = operand ? *operand : *operand_;
+            if (type_ == UnaryPlus) {
+                return operand ? std::move(operand) : operand_->Clone();
+            }
+            if (std::optional<double> value = operand_ref.GetConstant()) {
+                return std::make_unique<NumberExpr>(-1.0 * *value);
+            }
+            if (!operand) {
+                return nullptr;
+            }
+            return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+        }
+
+        class ParseASTListener final : public FormulaBaseListener {
+        public:
+            std::unique_ptr<Expr> MoveRoot() {
+                assert(args_.size() == 1);
+                auto root = std::move(args_.front());
+                args_.clear();
+
+                return root;
+            }
+
+            std::forward_list<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+        public:
+            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+                assert(args_.size() >= 1);
+
+                auto operand = std::move(args_.back());
+
+                UnaryOpExpr::Type type;
+                if (ctx->SUB()) {
+                    type = UnaryOpExpr::UnaryMinus;
+                }
+                else {
+                    assert(ctx->ADD() != nullptr);
+                    type = UnaryOpExpr::UnaryPlus;
+                }
+
+                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+                args_.back() = std::move(node);
+            }
+
+            void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+                double value = 0;
+                auto valueStr = ctx->NUMBER()->getSymbol()->getText();
+                std::istringstream in(valueStr);
+                in >> value;
+                if (!in) {
+                    throw ParsingError("Invalid number: " + valueStr);
+                }
+
+                auto node = std::make_unique<NumberExpr>(value);
+                args_.push_back(std::move(node));
+            }
+
+            void exitCell(FormulaParser::CellContext* ctx) override {
+                auto value_str = ctx->CELL()->getSymbol()->getText();
+                auto value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + value_str);
+                }
+
+                cells_.push_front(value);
+                auto node = std::make_unique<CellExpr>(&cells_.front());
+                args_.push_back(std::move(node));
+            }
+
+            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+                assert(args_.size() >= 2);
+
+                auto rhs = std::move(args_.back());
+                args_.pop_back();
+
+                auto lhs = std::move(args_.back());
+
+                BinaryOpExpr::Type type;
+                if (ctx->ADD()) {
+                    type = BinaryOpExpr::Add;
+                }
+                else if (ctx->SUB()) {
+                    type = BinaryOpExpr::Subtract;
+                }
+                else if (ctx->MUL()) {
+                    type = BinaryOpExpr::Multiply;
+                }
+                else {
+                    assert(ctx->DIV() != nullptr);
+                    type = BinaryOpExpr::Divide;
+                }
+
+                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+                args_.back() = std::move(node);
+            }
+
+            void visitErrorNode(antlr4::tree::ErrorNode* node) override {
+                throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+            }
+
+        private:
+            std::vector<std::unique_ptr<Expr>> args_;
+            std::forward_list<Position> cells_;
+        };
+
+        class BailErrorListener : public antlr4::BaseErrorListener {
+        public:
+            void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
+                size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
+                std::exception_ptr /* e */
+            ) override {
+                throw ParsingError("Error when lexing: " + msg);
+            }
+        };
+
+    }  // namespace
+}  // namespace ASTImpl
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    using namespace antlr4;
+
+    ANTLRInputStream input(in);
+
+    FormulaLexer lexer(&input);
+    ASTImpl::BailErrorListener error_listener;
+    lexer.removeErrorListeners();
+    lexer.addErrorListener(&error_listener);
+
+    CommonTokenStream tokens(&lexer);
+
+    FormulaParser parser(&tokens);
+    auto error_handler = std::make_shared<BailErrorStrategy>();
+    parser.setErrorHandler(error_handler);
+    parser.removeErrorListeners();
+
+    tree::ParseTree* tree = parser.main();
+    ASTImpl::ParseASTListener listener;
+    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+    FormulaAST ast(listener.MoveRoot(), listener.MoveCells());
+    ast.Simplify();
+    return ast;
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str) {
+    std::istringstream in(in_str);
+    return ParseFormulaAST(in);
+}
+
+void FormulaAST::PrintCells(std::ostream& out) const {
+    for (auto cell : cells_) {
+        out << cell.ToString() << ' ';
+    }
+}
+
+void FormulaAST::Print(std::ostream& out) const {
+    root_expr_->Print(out);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+}
+
+double FormulaAST::Execute(const SheetInterface& sheet) const {
+    return (simplified_expr_ ? simplified_expr_ : root_expr_)->Evaluate(sheet);
+}
+
+void FormulaAST::Compile(BatchProgram& program) const {
+    (simplified_expr_ ? simplified_expr_ : root_expr_)->Compile(program);
+}
+
+void FormulaAST::Simplify() {
+    simplified_expr_ = root_expr_->Simplify();
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+    : root_expr_(std::move(root_expr))
+    , cells_(std::move(cells)) {
+    cells_.sort();  // to avoid sorting in GetReferencedCells
+}
+
+FormulaAST::FormulaAST(const FormulaAST& other)
+    : root_expr_(other.root_expr_->Clone())
+    , simplified_expr_(other.simplified_expr_ ? other.simplified_expr_->Clone() : nullptr)
+    , cells_(other.cells_) {
+    // the clones point to the cells of other
+    std::unordered_map<const Position*, const Position*> cells;
+    auto it = cells_.begin();
+    for (const Position& cell : other.cells_) {
+        cells.emplace(&cell, &*it++);
+    }
+    root_expr_->RebindCells(cells);
+    if (simplified_expr_) {
+        simplified_expr_->RebindCells(cells);
+    }
+}
+
+FormulaAST::~FormulaAST() = default;
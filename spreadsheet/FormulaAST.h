@@ -1,51 +1,62 @@
-﻿#pragma once
-
-#include "FormulaLexer.h"
-#include "common.h"
-
-#include <forward_list>
-#include <functional>
-#include <stdexcept>
-
-namespace ASTImpl {
-    class Expr;
-}
-
-class ParsingError : public std::runtime_error {
-    using std::runtime_error::runtime_error;
-};
-
-class FormulaAST {
-public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
-    ~FormulaAST();
-
-    double Execute(const SheetInterface& sheet) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
-
-    std::forward_list<Position>& GetCells() {
-        return cells_;
-    }
-
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
-    }
-
-private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-
-    // physically stores cells so that they can be
-    // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
-};
-
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
-
-
+#pragma once
+
+#include "FormulaLexer.h"
+#include "batch.h"
+#include "common.h"
+
+#include <forward_list>
+#include <functional>
+#include <stdexcept>
+
+namespace ASTImpl {
+    class Expr;
+}
+
+class ParsingError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+class FormulaAST {
+public:
+    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
+        std::forward_list<Position> cells);
+    // deep copy
+    FormulaAST(const FormulaAST& other);
+    FormulaAST(FormulaAST&&) = default;
+    FormulaAST& operator=(FormulaAST&&) = default;
+    ~FormulaAST();
+
+    double Execute(const SheetInterface& sheet) const;
+    // folds constant subexpressions and drops identity operations (x*1, x-0, +x)
+    // for Execute; Print and PrintFormula keep the formula as it was written
+    void Simplify();
+    // appends the evaluated (simplified) expression to program in postfix order
+    void Compile(BatchProgram& program) const;
+    void PrintCells(std::ostream& out) const;
+    void Print(std::ostream& out) const;
+    void PrintFormula(std::ostream& out) const;
+
+    std::forward_list<Position>& GetCells() {
+        return cells_;
+    }
+
+    const std::forward_list<Position>& GetCells() const {
+        return cells_;
+    }
+
+private:
+    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // simplified copy of root_expr_ used for evaluation, null if root_expr_ can't be simplified;
+    // its cell nodes point to the same cells_ elements
+    std::unique_ptr<ASTImpl::Expr> simplified_expr_;
+
+    // physically stores cells so that they can be
+    // efficiently traversed without going through
+    // the whole AST
+    std::forward_list<Position> cells_;
+};
+
+FormulaAST ParseFormulaAST(std::istream& in);
+FormulaAST ParseFormulaAST(const std::string& in_str);
+
+
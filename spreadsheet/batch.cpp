@@ -0,0 +1,256 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <cmath>
+
+//MSVC does not define __SSE2__, SSE2 is always available on x64
+#if defined(__AVX2__)
+#define BATCH_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#define BATCH_SSE2
+#endif
+
+#if defined(BATCH_AVX2) || defined(BATCH_SSE2)
+#include <immintrin.h>
+#endif
+
+bool BatchInstruction::operator==(const BatchInstruction& rhs) const {
+    return code == rhs.code && number == rhs.number && cell == rhs.cell;
+}
+
+bool IsShiftedProgram(const BatchProgram& base, const BatchProgram& program, int row_shift) {
+    if (base.size() != program.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < base.size(); ++i) {
+        const BatchInstruction& expected = base[i];
+        const BatchInstruction& actual = program[i];
+        if (expected.code != actual.code) {
+            return false;
+        }
+        if (expected.code == BatchInstruction::Code::Number && expected.number != actual.number) {
+            return false;
+        }
+        if (expected.code == BatchInstruction::Code::Cell) {
+            if (expected.cell.IsValid() != actual.cell.IsValid()) {
+                return false;
+            }
+            if (expected.cell.IsValid()
+                && !(Position{ expected.cell.row + row_shift, expected.cell.col } == actual.cell)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+BatchError ToBatchError(FormulaError error) {
+    return static_cast<BatchError>(static_cast<int>(error.GetCategory()) + 1);
+}
+
+FormulaError FromBatchError(BatchError error) {
+    return FormulaError(static_cast<FormulaError::Category>(error - 1));
+}
+
+namespace {
+const BatchError DIV0_ERROR = ToBatchError(FormulaError(FormulaError::Category::Div0));
+
+//The arithmetic of the instructions on doubles and on the vectors of doubles.
+struct AddOp {
+    double operator()(double lhs, double rhs) const { return lhs + rhs; }
+#if defined(BATCH_AVX2)
+    __m256d operator()(__m256d lhs, __m256d rhs) const { return _mm256_add_pd(lhs, rhs); }
+#elif defined(BATCH_SSE2)
+    __m128d operator()(__m128d lhs, __m128d rhs) const { return _mm_add_pd(lhs, rhs); }
+#endif
+};
+
+struct SubtractOp {
+    double operator()(double lhs, double rhs) const { return lhs - rhs; }
+#if defined(BATCH_AVX2)
+    __m256d operator()(__m256d lhs, __m256d rhs) const { return _mm256_sub_pd(lhs, rhs); }
+#elif defined(BATCH_SSE2)
+    __m128d operator()(__m128d lhs, __m128d rhs) const { return _mm_sub_pd(lhs, rhs); }
+#endif
+};
+
+struct MultiplyOp {
+    double operator()(double lhs, double rhs) const { return lhs * rhs; }
+#if defined(BATCH_AVX2)
+    __m256d operator()(__m256d lhs, __m256d rhs) const { return _mm256_mul_pd(lhs, rhs); }
+#elif defined(BATCH_SSE2)
+    __m128d operator()(__m128d lhs, __m128d rhs) const { return _mm_mul_pd(lhs, rhs); }
+#endif
+};
+
+struct DivideOp {
+    double operator()(double lhs, double rhs) const { return lhs / rhs; }
+#if defined(BATCH_AVX2)
+    __m256d operator()(__m256d lhs, __m256d rhs) const { return _mm256_div_pd(lhs, rhs); }
+#elif defined(BATCH_SSE2)
+    __m128d operator()(__m128d lhs, __m128d rhs) const { return _mm_div_pd(lhs, rhs); }
+#endif
+};
+
+//Set the #ARITHM! error of the lanes whose bit is not set in finite_mask
+//(unless they already have an error).
+void MarkNotFinite(int finite_mask, int width, BatchError* errors) {
+    for (int bit = 0; bit < width; ++bit) {
+        if ((finite_mask & (1 << bit)) == 0 && errors[bit] == 0) {
+            errors[bit] = DIV0_ERROR;
+        }
+    }
+}
+
+//result = op(lhs, rhs) for n lanes, a result which is not finite is a #ARITHM! error
+//as in BinaryOpExpr::Evaluate.
+template <typename Op>
+void ApplyBinary(Op op, const double* lhs, const double* rhs, double* result, BatchError* errors, size_t n) {
+    size_t i = 0;
+#if defined(BATCH_AVX2)
+    const __m256d sign_mask = _mm256_set1_pd(-0.0);
+    const __m256d infinity = _mm256_set1_pd(INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        __m256d value = op(_mm256_loadu_pd(lhs + i), _mm256_loadu_pd(rhs + i));
+        _mm256_storeu_pd(result + i, value);
+        //NaN compares false as well
+        __m256d finite = _mm256_cmp_pd(_mm256_andnot_pd(sign_mask, value), infinity, _CMP_LT_OQ);
+        int finite_mask = _mm256_movemask_pd(finite);
+        if (finite_mask != 0xF) {
+            MarkNotFinite(finite_mask, 4, errors + i);
+        }
+    }
+#elif defined(BATCH_SSE2)
+    const __m128d sign_mask = _mm_set1_pd(-0.0);
+    const __m128d infinity = _mm_set1_pd(INFINITY);
+    for (; i + 2 <= n; i += 2) {
+        __m128d value = op(_mm_loadu_pd(lhs + i), _mm_loadu_pd(rhs + i));
+        _mm_storeu_pd(result + i, value);
+        __m128d finite = _mm_cmplt_pd(_mm_andnot_pd(sign_mask, value), infinity);
+        int finite_mask = _mm_movemask_pd(finite);
+        if (finite_mask != 0x3) {
+            MarkNotFinite(finite_mask, 2, errors + i);
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        result[i] = op(lhs[i], rhs[i]);
+        if (!std::isfinite(result[i]) && errors[i] == 0) {
+            errors[i] = DIV0_ERROR;
+        }
+    }
+}
+
+//Keep the first error of every lane.
+void MergeErrors(const BatchError* operand_errors, BatchError* errors, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (errors[i] == 0) {
+            errors[i] = operand_errors[i];
+        }
+    }
+}
+}  // namespace
+
+BatchEvaluator::BatchEvaluator(const BatchProgram& program)
+    : program_(program) {
+    size_t depth = 0;
+    for (const BatchInstruction& instruction : program_) {
+        switch (instruction.code) {
+        case BatchInstruction::Code::Cell: {
+            auto it = std::find(operands_.begin(), operands_.end(), instruction.cell);
+            instruction_operands_.push_back(it - operands_.begin());
+            if (it == operands_.end()) {
+                operands_.push_back(instruction.cell);
+            }
+            ++depth;
+            break;
+        }
+        case BatchInstruction::Code::Number:
+            ++depth;
+            break;
+        case BatchInstruction::Code::Negate:
+            break;
+        default:
+            --depth;
+            break;
+        }
+        max_depth_ = std::max(max_depth_, depth);
+    }
+    scratch_.resize(max_depth_ * CHUNK_LANES);
+    stack_.reserve(max_depth_);
+}
+
+const std::vector<Position>& BatchEvaluator::GetOperands() const {
+    return operands_;
+}
+
+void BatchEvaluator::Execute(size_t lanes, const double* operand_values, const BatchError* operand_errors,
+    double* results, BatchError* errors) {
+    std::fill(errors, errors + lanes, BatchError{ 0 });
+    for (size_t first = 0; first < lanes; first += CHUNK_LANES) {
+        size_t n = std::min(CHUNK_LANES, lanes - first);
+        BatchError* chunk_errors = errors + first;
+        size_t cell_instruction = 0;
+        stack_.clear();
+        for (const BatchInstruction& instruction : program_) {
+            //buffer of the level the instruction writes to
+            double* top = nullptr;
+            switch (instruction.code) {
+            case BatchInstruction::Code::Number:
+                top = scratch_.data() + stack_.size() * CHUNK_LANES;
+                std::fill(top, top + n, instruction.number);
+                stack_.push_back(top);
+                break;
+            case BatchInstruction::Code::Cell: {
+                //the operands are read in place
+                size_t operand = instruction_operands_[cell_instruction++];
+                stack_.push_back(operand_values + operand * lanes + first);
+                MergeErrors(operand_errors + operand * lanes + first, chunk_errors, n);
+                break;
+            }
+            case BatchInstruction::Code::Negate: {
+                top = scratch_.data() + (stack_.size() - 1) * CHUNK_LANES;
+                const double* operand_value = stack_.back();
+                for (size_t i = 0; i < n; ++i) {
+                    top[i] = -1.0 * operand_value[i];
+                }
+                stack_.back() = top;
+                break;
+            }
+            default: {
+                const double* rhs = stack_.back();
+                stack_.pop_back();
+                const double* lhs = stack_.back();
+                top = scratch_.data() + (stack_.size() - 1) * CHUNK_LANES;
+                switch (instruction.code) {
+                case BatchInstruction::Code::Add:
+                    ApplyBinary(AddOp{}, lhs, rhs, top, chunk_errors, n);
+                    break;
+                case BatchInstruction::Code::Subtract:
+                    ApplyBinary(SubtractOp{}, lhs, rhs, top, chunk_errors, n);
+                    break;
+                case BatchInstruction::Code::Multiply:
+                    ApplyBinary(MultiplyOp{}, lhs, rhs, top, chunk_errors, n);
+                    break;
+                default:
+                    ApplyBinary(DivideOp{}, lhs, rhs, top, chunk_errors, n);
+                    break;
+                }
+                stack_.back() = top;
+                break;
+            }
+            }
+        }
+        std::copy(stack_.back(), stack_.back() + n, results + first);
+    }
+}
+
+const char* BatchEvaluator::GetInstructionSet() {
+#if defined(BATCH_AVX2)
+    return "avx2";
+#elif defined(BATCH_SSE2)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
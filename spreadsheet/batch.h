@@ -0,0 +1,77 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//One step of a formula compiled in postfix order for the batch evaluation.
+struct BatchInstruction {
+    enum class Code : char {
+        Number,     //push number
+        Cell,       //push the value of cell
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+    };
+
+    Code code = Code::Number;
+    double number = 0;
+    //Position::NONE for a reference to a deleted cell.
+    Position cell = Position::NONE;
+
+    bool operator==(const BatchInstruction& rhs) const;
+};
+
+using BatchProgram = std::vector<BatchInstruction>;
+
+//True if program is base with every cell reference moved down by row_shift rows:
+//the formulas of a column filled with the same formula have the same shape.
+bool IsShiftedProgram(const BatchProgram& base, const BatchProgram& program, int row_shift);
+
+//Error of a lane: 0 if there is no error, FormulaError::Category + 1 otherwise.
+using BatchError = std::uint8_t;
+
+BatchError ToBatchError(FormulaError error);
+FormulaError FromBatchError(BatchError error);
+
+/// <summary>
+/// Evaluates one compiled formula for many lanes (rows) at once.
+/// The k-th operand is the k-th distinct cell referenced by the program (a cell
+/// referenced twice is gathered once), the values and the errors of the lanes
+/// are read from operand_values[k * lanes + lane] and operand_errors[k * lanes + lane].
+/// The arithmetic runs on AVX2 (4 lanes) or SSE2 (2 lanes) vectors when the
+/// compiler targets them, the remaining lanes use the scalar loop.
+/// Every lane reports the first error met in postfix order, which is the error
+/// thrown by the evaluation of the formula alone.
+/// </summary>
+class BatchEvaluator {
+public:
+    explicit BatchEvaluator(const BatchProgram& program);
+
+    //Distinct cells referenced by the program (for the first lane).
+    const std::vector<Position>& GetOperands() const;
+
+    void Execute(size_t lanes, const double* operand_values, const BatchError* operand_errors,
+        double* results, BatchError* errors);
+
+    //Vector instruction set used by Execute: "avx2", "sse2" or "scalar".
+    static const char* GetInstructionSet();
+
+private:
+    //Lanes evaluated together, so that the intermediate results stay in the L1 cache.
+    static constexpr size_t CHUNK_LANES = 256;
+
+    const BatchProgram& program_;
+    std::vector<Position> operands_;
+    //Operand of every Cell instruction, in program order.
+    std::vector<size_t> instruction_operands_;
+    size_t max_depth_ = 0;
+
+    //CHUNK_LANES intermediate results per level of the evaluation stack.
+    std::vector<double> scratch_;
+    std::vector<const double*> stack_;
+};
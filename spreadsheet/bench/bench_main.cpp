@@ -0,0 +1,1076 @@
+#include "bench_runner.h"
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#ifndef _WIN32
+#include "shard.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//Benchmark suite of the spreadsheet.
+//Usage: spreadsheet_bench [--size N] [--repeat N] [--seed N] [--filter SUBSTR] [--output FILE]
+// * size: number of cells of a scenario.
+// * repeat: number of measured rounds of the scenarios measuring a recalculation.
+// * seed: seed of the random generator (scenarios are reproducible for a given seed).
+// * filter: run only the scenarios whose name contains SUBSTR.
+// * output: write the JSON report to FILE instead of the standard output.
+
+namespace {
+
+struct BenchParams {
+    int size = 1000;
+    int repeat = 100;
+    unsigned seed = 42;
+};
+
+//Keeps the results alive so that the compiler does not drop the measured code.
+double g_sink = 0;
+
+void Consume(const CellInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        g_sink += *number;
+    }
+    else if (const std::string* text = std::get_if<std::string>(&value)) {
+        g_sink += text->size();
+    }
+}
+
+//Cells of the scenarios are laid out row by row, 100 columns per row.
+Position GridPosition(int index) {
+    return Position{ index / 100, index % 100 };
+}
+
+std::string Ref(Position pos) {
+    return pos.ToString();
+}
+
+ScenarioResult MakeResult(std::string name, const BenchParams& params) {
+    ScenarioResult result;
+    result.name = std::move(name);
+    result.params = { {"size", params.size}, {"repeat", params.repeat}, {"seed", params.seed} };
+    return result;
+}
+
+ScenarioResult BenchSetText(const BenchParams& params) {
+    ScenarioResult result = MakeResult("set_text", params);
+    auto sheet = CreateSheet();
+    result.sample.Reserve(params.size);
+    for (int i = 0; i < params.size; ++i) {
+        std::string text = "label_" + std::to_string(i % 97);
+        result.sample.Measure([&]() {
+            sheet->SetCell(GridPosition(i), text);
+        });
+    }
+    return result;
+}
+
+ScenarioResult BenchSetFormula(const BenchParams& params) {
+    ScenarioResult result = MakeResult("set_formula", params);
+    auto sheet = CreateSheet();
+    for (int r = 0; r < params.size; ++r) {
+        sheet->SetCell(Position{ r, 0 }, std::to_string(r));
+    }
+    result.sample.Reserve(params.size);
+    for (int r = 0; r < params.size; ++r) {
+        std::string formula = "=" + Ref(Position{ r, 0 }) + "*2+1";
+        result.sample.Measure([&]() {
+            sheet->SetCell(Position{ r, 1 }, formula);
+        });
+    }
+    return result;
+}
+
+ScenarioResult BenchParseFormula(const BenchParams& params) {
+    ScenarioResult result = MakeResult("parse_formula", params);
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<int> row(0, 9999);
+    const std::vector<std::string> templates = {
+        "{0}+{1}", "({0}+{1})*({0}-{1})/2", "-{0}*3.5e2+{1}/(1+{0})", "{0}*(1/3600)*(24*365)",
+    };
+
+    result.sample.Reserve(params.size);
+    for (int i = 0; i < params.size; ++i) {
+        std::string expression = templates[i % templates.size()];
+        std::string a = Ref(Position{ row(generator), 0 });
+        std::string b = Ref(Position{ row(generator), 1 });
+        for (size_t p = expression.find("{0}"); p != std::string::npos; p = expression.find("{0}")) {
+            expression.replace(p, 3, a);
+        }
+        for (size_t p = expression.find("{1}"); p != std::string::npos; p = expression.find("{1}")) {
+            expression.replace(p, 3, b);
+        }
+        result.sample.Measure([&]() {
+            g_sink += ParseFormula(expression)->GetReferencedCells().size();
+        });
+    }
+    return result;
+}
+
+//A1 <- A2 <- ... <- A{size}
+std::unique_ptr<SheetInterface> MakeChain(int size) {
+    auto sheet = CreateSheet();
+    sheet->SetCell(Position{ 0, 0 }, "1");
+    for (int r = 1; r < size; ++r) {
+        sheet->SetCell(Position{ r, 0 }, "=" + Ref(Position{ r - 1, 0 }) + "+1");
+    }
+    return sheet;
+}
+
+ScenarioResult BenchLongChainBuild(const BenchParams& params) {
+    ScenarioResult result = MakeResult("long_chain_build", params);
+    auto sheet = CreateSheet();
+    sheet->SetCell(Position{ 0, 0 }, "1");
+    result.sample.Reserve(params.size);
+    for (int r = 1; r < params.size; ++r) {
+        std::string formula = "=" + Ref(Position{ r - 1, 0 }) + "+1";
+        result.sample.Measure([&]() {
+            sheet->SetCell(Position{ r, 0 }, formula);
+        });
+    }
+    return result;
+}
+
+ScenarioResult BenchLongChainRecalc(const BenchParams& params) {
+    ScenarioResult result = MakeResult("long_chain_recalc", params);
+    auto sheet = MakeChain(params.size);
+    Position tail{ params.size - 1, 0 };
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        result.sample.Measure([&]() {
+            sheet->SetCell(Position{ 0, 0 }, std::to_string(i));
+            Consume(sheet->GetCell(tail)->GetValue());
+        });
+    }
+    return result;
+}
+
+//B{r} = A1 + r: one edit of A1 invalidates size cells.
+ScenarioResult BenchFanOut(const BenchParams& params) {
+    ScenarioResult result = MakeResult("fan_out", params);
+    auto sheet = CreateSheet();
+    sheet->SetCell(Position{ 0, 0 }, "0");
+    for (int r = 0; r < params.size; ++r) {
+        sheet->SetCell(Position{ r, 1 }, "=A1+" + std::to_string(r));
+    }
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        result.sample.Measure([&]() {
+            sheet->SetCell(Position{ 0, 0 }, std::to_string(i));
+            for (int r = 0; r < params.size; ++r) {
+                Consume(sheet->GetCell(Position{ r, 1 })->GetValue());
+            }
+        });
+    }
+    return result;
+}
+
+//C1 = A1 + A2 + ... + A{size}: one formula reading size cells.
+ScenarioResult BenchFanIn(const BenchParams& params) {
+    ScenarioResult result = MakeResult("fan_in", params);
+    auto sheet = CreateSheet();
+    std::string formula = "=";
+    for (int r = 0; r < params.size; ++r) {
+        sheet->SetCell(Position{ r, 0 }, std::to_string(r));
+        formula += (r == 0 ? "" : "+") + Ref(Position{ r, 0 });
+    }
+    sheet->SetCell(Position{ 0, 2 }, formula);
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        Position input{ i % params.size, 0 };
+        result.sample.Measure([&]() {
+            sheet->SetCell(input, std::to_string(i));
+            Consume(sheet->GetCell(Position{ 0, 2 })->GetValue());
+        });
+    }
+    return result;
+}
+
+//Every cell references up to 3 random cells placed before it.
+ScenarioResult BenchRandomDag(const BenchParams& params) {
+    ScenarioResult result = MakeResult("random_dag", params);
+    std::mt19937 generator(params.seed);
+    auto sheet = CreateSheet();
+    result.sample.Reserve(params.size);
+    for (int i = 0; i < params.size; ++i) {
+        std::string text;
+        if (i < 10) {
+            text = std::to_string(i);
+        }
+        else {
+            std::uniform_int_distribution<int> parent(0, i - 1);
+            std::uniform_int_distribution<int> parents_count(1, 3);
+            text = "=1";
+            for (int p = parents_count(generator); p > 0; --p) {
+                text += "+" + Ref(GridPosition(parent(generator)));
+            }
+        }
+        result.sample.Measure([&]() {
+            sheet->SetCell(GridPosition(i), text);
+        });
+    }
+    for (int i = 0; i < params.size; ++i) {
+        Consume(sheet->GetCell(GridPosition(i))->GetValue());
+    }
+    return result;
+}
+
+ScenarioResult BenchCycleRejection(const BenchParams& params) {
+    ScenarioResult result = MakeResult("cycle_rejection", params);
+    auto sheet = MakeChain(params.size);
+    std::string closing_formula = "=" + Ref(Position{ params.size - 1, 0 });
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        result.sample.Measure([&]() {
+            try {
+                sheet->SetCell(Position{ 0, 0 }, closing_formula);
+            }
+            catch (const CircularDependencyException&) {
+                g_sink += 1;
+            }
+        });
+    }
+    return result;
+}
+
+//Square region of size cells: numbers, labels and formulas.
+std::unique_ptr<SheetInterface> MakeRegion(int size) {
+    auto sheet = CreateSheet();
+    for (int i = 0; i < size; ++i) {
+        Position pos = GridPosition(i);
+        if (i % 3 == 0) {
+            sheet->SetCell(pos, std::to_string(i));
+        }
+        else if (i % 3 == 1) {
+            sheet->SetCell(pos, "label_" + std::to_string(i % 97));
+        }
+        else {
+            sheet->SetCell(pos, "=" + Ref(GridPosition(i - 2)) + "*2");
+        }
+    }
+    return sheet;
+}
+
+ScenarioResult BenchPrint(const BenchParams& params, bool values) {
+    ScenarioResult result = MakeResult(values ? "print_values" : "print_texts", params);
+    auto sheet = MakeRegion(params.size);
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        std::ostringstream out;
+        result.sample.Measure([&]() {
+            if (values) {
+                sheet->PrintValues(out);
+            }
+            else {
+                sheet->PrintTexts(out);
+            }
+        });
+        g_sink += out.str().size();
+    }
+    return result;
+}
+
+//size cells filled with 2000 distinct labels of 18-22 characters (product codes,
+//region names), repeated across the sheet. Reports the memory used by the cells.
+ScenarioResult BenchPrintLabels(const BenchParams& params) {
+    ScenarioResult result = MakeResult("print_labels", params);
+    static const char* const regions[] = { "NORTH-EAST", "SOUTH-WEST", "CENTRAL", "OVERSEAS" };
+    Sheet sheet;
+    for (int i = 0; i < params.size; ++i) {
+        int label = i * 7919 % 2000;
+        sheet.SetCell(GridPosition(i), std::string(regions[label % 4]) + "/PRD-" + std::to_string(100000 + label));
+    }
+    SheetMemoryReport report = sheet.GetMemoryReport();
+    result.params.push_back({ "memory_bytes", static_cast<long long>(report.total_bytes) });
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        std::ostringstream out;
+        result.sample.Measure([&]() {
+            sheet.PrintValues(out);
+        });
+        g_sink += out.str().size();
+    }
+    return result;
+}
+
+//Region of size cells, every round edits 10 cells and exports the delta since
+//the previous round: the export must not depend on the size of the sheet.
+ScenarioResult BenchExportDelta(const BenchParams& params) {
+    ScenarioResult result = MakeResult("export_delta", params);
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<int> index(0, params.size - 1);
+    Sheet sheet;
+    for (int i = 0; i < params.size; ++i) {
+        sheet.SetCell(GridPosition(i), std::to_string(i));
+    }
+    sheet.SetDeltaExport(true);
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        SheetVersion since = sheet.GetVersion();
+        for (int edit = 0; edit < 10; ++edit) {
+            sheet.SetCell(GridPosition(index(generator)), "edit_" + std::to_string(i));
+        }
+        std::ostringstream out;
+        result.sample.Measure([&]() {
+            sheet.ExportDelta(since, out);
+        });
+        g_sink += out.str().size();
+    }
+    return result;
+}
+
+//Region of size cells: 5 columns of numbers and 5 columns of formulas filled down
+//(F{r} = A{r}+B{r}, ...), every round inserts a row in the middle, sets a formula in
+//it and deletes it again. The rows below move: the cost must depend on the moved
+//lines, not on the cells of the sheet (the logs, the graph and the pager).
+ScenarioResult BenchStructuralEdits(const BenchParams& params) {
+    ScenarioResult result = MakeResult("structural_edits", params);
+    int rows = std::max(std::min(params.size / 10, int{ Position::MAX_ROWS } - 1), 2);
+    Sheet sheet;
+    for (int r = 0; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        for (int c = 0; c < 5; ++c) {
+            sheet.SetCell(Position{ r, c }, std::to_string(r + c));
+        }
+        for (int c = 0; c < 5; ++c) {
+            std::string lhs = Ref(Position{ r, c });
+            std::string rhs = Ref(Position{ r, (c + 1) % 5 });
+            sheet.SetCell(Position{ r, 5 + c }, "=" + lhs + "+" + rhs);
+        }
+    }
+    int middle = rows / 2;
+    std::string formula = "=" + Ref(Position{ middle - 1, 5 }) + "*2";
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        result.sample.Measure([&]() {
+            sheet.InsertRows(middle);
+            sheet.SetCell(Position{ middle, 0 }, formula);
+            sheet.DeleteRows(middle);
+        });
+    }
+    Consume(sheet.GetCell(Position{ rows - 1, 9 })->GetValue());
+    result.params.push_back({ "rows", rows });
+    return result;
+}
+
+//Columns of formulas A{r} = E1+r, B{r} = A{r}*2 over size rows, all dirty after
+//an edit of E1: every round scrolls a 30x50 window down by 30 rows and prints its
+//values, evaluating only the formulas of the window.
+ScenarioResult BenchPrintViewport(const BenchParams& params) {
+    ScenarioResult result = MakeResult("print_viewport", params);
+    const int window_rows = 30;
+    int rows = std::max(std::min(params.size, int{ Position::MAX_ROWS }), window_rows);
+    Sheet sheet;
+    for (int r = 0; r < rows; ++r) {
+        sheet.SetCell(Position{ r, 0 }, "=E1+" + std::to_string(r));
+        sheet.SetCell(Position{ r, 1 }, "=A" + std::to_string(r + 1) + "*2");
+    }
+    sheet.SetCell(Position{ 0, 4 }, "1");
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        int top = i * window_rows % (rows - window_rows + 1);
+        std::ostringstream out;
+        result.sample.Measure([&]() {
+            sheet.PrintValues(out, Position{ top, 0 }, Position{ top + window_rows - 1, 49 });
+        });
+        g_sink += out.str().size();
+    }
+    return result;
+}
+
+//Size text cells with a memory budget of a quarter of their grid and cells:
+//random reads go through the paging file. Reports the page faults.
+ScenarioResult BenchPagedReads(const BenchParams& params) {
+    ScenarioResult result = MakeResult("paged_reads", params);
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<int> index(0, params.size - 1);
+    Sheet sheet;
+    for (int i = 0; i < params.size; ++i) {
+        sheet.SetCell(GridPosition(i), "label " + std::to_string(i));
+    }
+    sheet.SetMemoryBudget(std::max<size_t>(sheet.GetPagingStats().resident_bytes / 4, 1));
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        Position pos = GridPosition(index(generator));
+        result.sample.Measure([&]() {
+            g_sink += sheet.GetCell(pos)->GetTextView().size();
+        });
+    }
+    PagingStats stats = sheet.GetPagingStats();
+    result.params.push_back({ "page_faults", static_cast<long long>(stats.page_faults) });
+    result.params.push_back({ "resident_bytes", static_cast<long long>(stats.resident_bytes) });
+    return result;
+}
+
+//Model of size text cells with a chain of formulas down column CW, one every 10 rows
+//(CW{r} = A{r}*B{r}+CW{r-10}). Every round forks the model, edits the A cell of a random
+//formula of the chain and reads the end of the chain: the fork only evaluates the formulas
+//below the edit. The forks are kept: reports the time to build the model, its memory and
+//the average memory of a fork (the cells of the blocks it copied).
+ScenarioResult BenchForkWhatIf(const BenchParams& params) {
+    ScenarioResult result = MakeResult("fork_what_if", params);
+    int rows = std::max((params.size + 99) / 100, 10);
+    std::vector<int> formula_rows;
+    for (int r = 9; r < rows; r += 10) {
+        formula_rows.push_back(r);
+    }
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<size_t> index(0, formula_rows.size() - 1);
+
+    Sheet sheet;
+    auto build_start = BenchClock::now();
+    for (int i = 0; i < params.size; ++i) {
+        sheet.SetCell(GridPosition(i), std::to_string(i % 1000));
+    }
+    for (int r : formula_rows) {
+        std::string row = std::to_string(r + 1);
+        std::string chain = r < 10 ? "" : "+CW" + std::to_string(r - 9);
+        sheet.SetCell(Position{ r, 100 }, "=A" + row + "*B" + row + chain);
+    }
+    Position last{ formula_rows.back(), 100 };
+    Consume(sheet.GetCell(last)->GetValue());
+    auto build_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - build_start);
+
+    std::vector<std::unique_ptr<Sheet>> forks;
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        Position edit{ formula_rows[index(generator)], 0 };
+        result.sample.Measure([&]() {
+            forks.push_back(sheet.Fork());
+            forks.back()->SetCell(edit, std::to_string(i));
+            Consume(forks.back()->GetCell(last)->GetValue());
+        });
+    }
+    size_t fork_bytes = 0;
+    for (const auto& fork : forks) {
+        fork_bytes += fork->GetMemoryReport().total_bytes;
+    }
+    result.params.push_back({ "build_ns", static_cast<long long>(build_ns.count()) });
+    result.params.push_back({ "model_bytes", static_cast<long long>(sheet.GetMemoryReport().total_bytes) });
+    result.params.push_back({ "fork_bytes", static_cast<long long>(forks.empty() ? 0 : fork_bytes / forks.size()) });
+    return result;
+}
+
+//Model of size cells, half of them formulas (B{r} = A{r}*2+A{r+1}): every round forks
+//it, edits one input in the fork and reads the two formulas depending on it. The fork
+//must cost the blocks of rows, not the cells or the formulas of the model.
+ScenarioResult BenchForkFormulas(const BenchParams& params) {
+    ScenarioResult result = MakeResult("fork_formulas", params);
+    int rows = std::max(std::min(params.size / 2, int{ Position::MAX_ROWS } - 1), 2);
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<int> index(1, rows - 1);
+
+    Sheet sheet;
+    for (int r = 0; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell(Position{ r, 0 }, std::to_string(r % 1000));
+        sheet.SetCell(Position{ r, 1 }, "=A" + row + "*2+A" + std::to_string(r + 2));
+    }
+    for (int r = 0; r < rows; ++r) {
+        Consume(sheet.GetCell(Position{ r, 1 })->GetValue());
+    }
+
+    std::vector<std::unique_ptr<Sheet>> forks;
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        int edit = index(generator);
+        result.sample.Measure([&]() {
+            forks.push_back(sheet.Fork());
+            forks.back()->SetCell(Position{ edit, 0 }, std::to_string(i));
+            Consume(forks.back()->GetCell(Position{ edit, 1 })->GetValue());
+            Consume(forks.back()->GetCell(Position{ edit - 1, 1 })->GetValue());
+        });
+    }
+    size_t fork_bytes = 0;
+    for (const auto& fork : forks) {
+        fork_bytes += fork->GetMemoryReport().total_bytes;
+    }
+    result.params.push_back({ "model_bytes", static_cast<long long>(sheet.GetMemoryReport().total_bytes) });
+    result.params.push_back({ "fork_bytes", static_cast<long long>(forks.empty() ? 0 : fork_bytes / forks.size()) });
+    return result;
+}
+
+//Random valid positions of the whole table.
+std::vector<Position> RandomPositions(const BenchParams& params) {
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<int> row(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> col(0, Position::MAX_COLS - 1);
+    std::vector<Position> positions(params.size);
+    for (Position& pos : positions) {
+        pos = Position{ row(generator), col(generator) };
+    }
+    return positions;
+}
+
+//Every round converts size positions to strings (one measure per round).
+ScenarioResult BenchPositionToString(const BenchParams& params) {
+    ScenarioResult result = MakeResult("position_to_string", params);
+    std::vector<Position> positions = RandomPositions(params);
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        result.sample.Measure([&]() {
+            for (Position pos : positions) {
+                g_sink += pos.ToString().size();
+            }
+        });
+    }
+    return result;
+}
+
+//Every round parses size position strings (one measure per round).
+ScenarioResult BenchPositionFromString(const BenchParams& params) {
+    ScenarioResult result = MakeResult("position_from_string", params);
+    std::vector<std::string> names;
+    for (Position pos : RandomPositions(params)) {
+        names.push_back(pos.ToString());
+    }
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        result.sample.Measure([&]() {
+            for (const std::string& name : names) {
+                g_sink += Position::FromString(name).row;
+            }
+        });
+    }
+    return result;
+}
+
+//Hash table of size cells of a dense 100-column region, every round looks all of them up.
+ScenarioResult BenchPositionLookup(const BenchParams& params) {
+    ScenarioResult result = MakeResult("position_lookup", params);
+    std::unordered_map<PositionKey, int, PositionHasher> cells;
+    std::vector<Position> positions;
+    for (int i = 0; i < params.size; ++i) {
+        positions.push_back(GridPosition(i));
+        cells[positions.back()] = i;
+    }
+    std::shuffle(positions.begin(), positions.end(), std::mt19937(params.seed));
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        result.sample.Measure([&]() {
+            for (Position pos : positions) {
+                g_sink += cells.find(pos)->second;
+            }
+        });
+    }
+    return result;
+}
+
+ScenarioResult BenchClearChurn(const BenchParams& params) {
+    ScenarioResult result = MakeResult("clear_churn", params);
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<int> index(0, params.size - 1);
+    auto sheet = MakeRegion(params.size);
+    result.sample.Reserve(params.size);
+    for (int i = 0; i < params.size; ++i) {
+        Position pos = GridPosition(index(generator));
+        result.sample.Measure([&]() {
+            sheet->ClearCell(pos);
+            sheet->SetCell(pos, std::to_string(i));
+        });
+    }
+    return result;
+}
+
+//C{r} = (A{r}*1.5+B{r}/4-A{r})*(A{r}-B{r})/(B{r}+1) down a column, A{r} = E1+r:
+//every round edits E1 (not measured) and evaluates the whole column cell by cell
+//or in batches.
+ScenarioResult BenchColumnEvaluation(const BenchParams& params, bool batch) {
+    ScenarioResult result = MakeResult(batch ? "column_batch" : "column_per_cell", params);
+    int rows = std::min(params.size, int{ Position::MAX_ROWS });
+    Sheet sheet;
+    for (int r = 0; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell(Position{ r, 0 }, "=E1+" + std::to_string(r));
+        sheet.SetCell(Position{ r, 1 }, std::to_string(r % 7));
+        sheet.SetCell(Position{ r, 2 }, "=(A" + row + "*1.5+B" + row + "/4-A" + row + ")*(A" + row + "-B" + row
+            + ")/(B" + row + "+1)");
+    }
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        sheet.SetCell(Position{ 0, 4 }, std::to_string(i));
+        result.sample.Measure([&]() {
+            if (batch) {
+                sheet.EvaluateColumn(Position{ 0, 2 }, rows);
+            }
+            for (int r = 0; r < rows; ++r) {
+                Consume(sheet.GetCell(Position{ r, 2 })->GetValue());
+            }
+        });
+    }
+    return result;
+}
+
+//Model of size formulas depending on two inputs E1 and E2: A{r} = E1*r+E2, B{r} = A{r}/4-B{r-1}.
+//10 * repeat rows of input values are evaluated for the outputs B{rows} and A{rows/2},
+//by SetCell round trips (set the inputs, read the outputs, restore the inputs; one
+//measure per row) or by one Sweep (one measure).
+ScenarioResult BenchSweep(const BenchParams& params, bool sweep) {
+    ScenarioResult result = MakeResult(sweep ? "sweep" : "sweep_set_cell", params);
+    int rows = std::max(std::min(params.size / 2, int{ Position::MAX_ROWS }), 2);
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 4 }, "1");
+    sheet.SetCell(Position{ 1, 4 }, "2");
+    for (int r = 0; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell(Position{ r, 0 }, "=E1*" + row + "+E2");
+        sheet.SetCell(Position{ r, 1 }, r == 0 ? "=A1/4" : "=A" + row + "/4-B" + std::to_string(r));
+    }
+    std::vector<Position> inputs = { Position{ 0, 4 }, Position{ 1, 4 } };
+    std::vector<Position> outputs = { Position{ rows - 1, 1 }, Position{ rows / 2, 0 } };
+    std::mt19937 generator(params.seed);
+    std::uniform_real_distribution<double> value(-100, 100);
+    std::vector<std::vector<double>> input_values(10 * params.repeat);
+    for (auto& row : input_values) {
+        row = { value(generator), value(generator) };
+    }
+    if (sweep) {
+        result.sample.Measure([&]() {
+            SweepResult values = sheet.Sweep(inputs, input_values, outputs);
+            g_sink += values.values.size();
+        });
+        return result;
+    }
+    result.sample.Reserve(input_values.size());
+    for (const auto& row : input_values) {
+        result.sample.Measure([&]() {
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                sheet.SetCell(inputs[i], std::to_string(row[i]));
+            }
+            for (Position output : outputs) {
+                Consume(sheet.GetCell(output)->GetValue());
+            }
+            sheet.SetCell(inputs[0], "1");
+            sheet.SetCell(inputs[1], "2");
+        });
+    }
+    return result;
+}
+
+//size/4 rows of one interest model each (B = C*0.05, C = (A+D)/2, D = A+B: a cycle of
+//three formulas), iterative calculation: every round edits the balance A of one row
+//and reads the D of every row, only the cycle of the edited row is iterated again.
+ScenarioResult BenchIterativeCycles(const BenchParams& params) {
+    ScenarioResult result = MakeResult("iterative_cycles", params);
+    int rows = std::max(std::min(params.size / 4, int{ Position::MAX_ROWS }), 1);
+    Sheet sheet;
+    sheet.SetIterativeCalculation(true, 100, 1e-9);
+    for (int r = 0; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell(Position{ r, 0 }, std::to_string(1000 + r));
+        sheet.SetCell(Position{ r, 1 }, "=C" + row + "*0.05");
+        sheet.SetCell(Position{ r, 2 }, "=(A" + row + "+D" + row + ")/2");
+        sheet.SetCell(Position{ r, 3 }, "=A" + row + "+B" + row);
+    }
+    for (int r = 0; r < rows; ++r) {
+        Consume(sheet.GetCell(Position{ r, 3 })->GetValue());
+    }
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<int> row(0, rows - 1);
+    sheet.ResetStats();
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        Position pos{ row(generator), 0 };
+        result.sample.Measure([&]() {
+            sheet.SetCell(pos, std::to_string(2000 + i));
+            for (int r = 0; r < rows; ++r) {
+                Consume(sheet.GetCell(Position{ r, 3 })->GetValue());
+            }
+        });
+    }
+    result.params.push_back({ "cycles", static_cast<long long>(sheet.GetCycleStatus().size()) });
+    result.params.push_back({ "evaluations_per_edit",
+        static_cast<long long>(sheet.GetStats().formulas_evaluated / std::max(params.repeat, 1)) });
+    return result;
+}
+
+//Random DAG of size formulas (like random_dag): every round asks the transitive
+//dependents and precedents of a random cell. The first query builds the index.
+ScenarioResult BenchDependencyQueries(const BenchParams& params) {
+    ScenarioResult result = MakeResult("dependency_queries", params);
+    std::mt19937 generator(params.seed);
+    Sheet sheet;
+    for (int i = 0; i < params.size; ++i) {
+        std::string text = "=1";
+        if (i > 0) {
+            std::uniform_int_distribution<int> parent(0, i - 1);
+            for (int p = 0; p < 2; ++p) {
+                text += "+" + Ref(GridPosition(parent(generator)));
+            }
+        }
+        sheet.SetCell(GridPosition(i), text);
+    }
+    std::uniform_int_distribution<int> cell(0, params.size - 1);
+    auto build_start = BenchClock::now();
+    g_sink += sheet.GetDependents(GridPosition(0), true).size();
+    auto build_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - build_start);
+    size_t reached = 0;
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        Position pos = GridPosition(cell(generator));
+        result.sample.Measure([&]() {
+            reached += sheet.GetDependents(pos, true).size();
+            reached += sheet.GetPrecedents(pos, true).size();
+        });
+    }
+    g_sink += reached;
+    result.params.push_back({ "first_query_ns", static_cast<long long>(build_ns.count()) });
+    result.params.push_back({ "cells_per_query", static_cast<long long>(reached / params.repeat) });
+    return result;
+}
+
+//C{n} = A{n}*B{n} filled down size rows (one measure per formula): the column is one
+//run of edges. Reports the estimated memory of the graph and of the same edges stored
+//one by one, then the time of an edit in the middle of the run (split and join again).
+ScenarioResult BenchFillDown(const BenchParams& params) {
+    ScenarioResult result = MakeResult("fill_down", params);
+    int rows = std::min(params.size, int{ Position::MAX_ROWS });
+    Sheet sheet;
+    for (int r = 0; r < rows; ++r) {
+        sheet.SetCell(Position{ r, 0 }, std::to_string(r));
+        sheet.SetCell(Position{ r, 1 }, "2");
+    }
+    result.sample.Reserve(rows);
+    for (int r = 0; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        std::string text = "=A" + row + "*B" + row;
+        result.sample.Measure([&]() {
+            sheet.SetCell(Position{ r, 2 }, text);
+        });
+    }
+    Consume(sheet.GetCell(Position{ rows - 1, 2 })->GetValue());
+    SheetStats stats = sheet.GetStats();
+    result.params.push_back({ "graph_runs", static_cast<long long>(stats.graph_runs) });
+    result.params.push_back({ "graph_bytes", static_cast<long long>(stats.graph_bytes) });
+    result.params.push_back({ "graph_uncompressed_bytes", static_cast<long long>(stats.graph_uncompressed_bytes) });
+
+    std::string middle = std::to_string(rows / 2 + 1);
+    auto edit_start = BenchClock::now();
+    sheet.SetCell(Position{ rows / 2, 2 }, "=A" + middle + "+1");
+    sheet.SetCell(Position{ rows / 2, 2 }, "=A" + middle + "*B" + middle);
+    auto edit_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - edit_start);
+    result.params.push_back({ "split_join_ns", static_cast<long long>(edit_ns.count()) });
+    return result;
+}
+
+//Chain of size formulas B{n} = B{n-1}+A{n} (like long_chain_recalc): every round edits
+//the head of the chain and reads its tail. Without the background recalculation the
+//read evaluates the whole chain; with it, the edit returns after the invalidation and
+//the read takes the last value (stale until the worker is done).
+ScenarioResult BenchEditLatency(const BenchParams& params, bool background) {
+    ScenarioResult result = MakeResult(background ? "edit_latency_background" : "edit_latency_sync", params);
+    int rows = std::max(std::min(params.size, int{ Position::MAX_ROWS }), 2);
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 1 }, "0");
+    for (int r = 1; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell(Position{ r, 0 }, "1");
+        sheet.SetCell(Position{ r, 1 }, "=B" + std::to_string(r) + "+A" + row);
+    }
+    Position tail{ rows - 1, 1 };
+    Consume(sheet.GetCell(tail)->GetValue());
+    if (background) {
+        sheet.SetBackgroundRecalculation(true);
+    }
+    long long stale_reads = 0;
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        result.sample.Measure([&]() {
+            sheet.SetCell(Position{ 0, 1 }, std::to_string(i));
+            if (background) {
+                CachedValue cached = sheet.GetCachedValue(tail);
+                stale_reads += cached.stale;
+                Consume(cached.value);
+            }
+            else {
+                Consume(sheet.GetCell(tail)->GetValue());
+            }
+        });
+    }
+    sheet.WaitForRecalculation();
+    if (background) {
+        RecalcStats stats = sheet.GetRecalcStats();
+        result.params.push_back({ "stale_reads", stale_reads });
+        result.params.push_back({ "recalculated", static_cast<long long>(stats.recalculated) });
+        result.params.push_back({ "cancelled", static_cast<long long>(stats.cancelled) });
+    }
+    return result;
+}
+
+//size/4 rows of four formulas (A{n} = A{n-1}+1, B..D read A of the row), all dirty:
+//the sheet is recalculated by slices of 1ms (one measure per slice), the first rows
+//being the priority region. Reports the slices needed and the evaluations of the slices.
+ScenarioResult BenchRecalcSlices(const BenchParams& params) {
+    ScenarioResult result = MakeResult("recalc_slices", params);
+    int rows = std::max(std::min(params.size / 4, int{ Position::MAX_ROWS }), 2);
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 0 }, "0");
+    for (int r = 1; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell(Position{ r, 0 }, "=A" + std::to_string(r) + "+1");
+        sheet.SetCell(Position{ r, 1 }, "=A" + row + "*2");
+        sheet.SetCell(Position{ r, 2 }, "=B" + row + "+A" + row);
+        sheet.SetCell(Position{ r, 3 }, "=C" + row + "/2");
+    }
+    CellRange viewport{ Position{ 0, 0 }, Position{ 39, 3 } };
+    long long slices = 0;
+    long long evaluated = 0;
+    for (int i = 0; i < params.repeat; ++i) {
+        sheet.SetCell(Position{ 0, 0 }, std::to_string(i));
+        RecalcProgress progress;
+        while (!progress.complete) {
+            result.sample.Measure([&]() {
+                progress = sheet.RecalculateFor(std::chrono::milliseconds(1), viewport);
+            });
+            ++slices;
+            evaluated += progress.evaluated;
+        }
+    }
+    Consume(sheet.GetCell(Position{ rows - 1, 3 })->GetValue());
+    result.params.push_back({ "slices_per_edit", slices / std::max(params.repeat, 1) });
+    result.params.push_back({ "evaluations_per_slice", evaluated / std::max(slices, 1LL) });
+    return result;
+}
+
+enum class TickPath {
+    SetCell,
+    SetNumber,
+    ApplyTicks,
+};
+
+//size prices in column A, each read by a position B{n} = A{n}*2 and by the total of
+//its group of 16 rows (column C). One measure applies a batch of 64 random ticks
+//(skewed to the first rows: repeated ticks of a batch) and reads the positions and
+//totals they changed: the latency from the ticks to a consistent output. Reports the
+//sustained ticks per second (ticks applied divided by the measured time).
+ScenarioResult BenchTicks(const BenchParams& params, TickPath path) {
+    const char* name = path == TickPath::SetCell ? "ticks_set_cell"
+        : path == TickPath::SetNumber ? "ticks_set_number" : "ticks_apply";
+    ScenarioResult result = MakeResult(name, params);
+    const int batch = 64;
+    int rows = std::max(std::min(params.size, int{ Position::MAX_ROWS }), 16) / 16 * 16;
+    Sheet sheet;
+    for (int r = 0; r < rows; ++r) {
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell(Position{ r, 0 }, "100");
+        sheet.SetCell(Position{ r, 1 }, "=A" + row + "*2");
+        if (r % 16 == 15) {
+            std::string total = "=B" + std::to_string(r - 14);
+            for (int i = r - 14; i <= r; ++i) {
+                total += "+B" + std::to_string(i + 1);
+            }
+            sheet.SetCell(Position{ r, 2 }, total);
+        }
+    }
+    std::mt19937 generator(params.seed);
+    std::geometric_distribution<int> row_index(4.0 / rows);
+    std::uniform_real_distribution<double> price(90.0, 110.0);
+    std::vector<std::pair<Position, double>> ticks;
+    ticks.reserve(batch);
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        ticks.clear();
+        for (int t = 0; t < batch; ++t) {
+            ticks.push_back({ Position{ row_index(generator) % rows, 0 }, std::round(price(generator) * 100) / 100 });
+        }
+        result.sample.Measure([&]() {
+            if (path == TickPath::ApplyTicks) {
+                sheet.ApplyTicks(ticks);
+            }
+            for (const auto& [pos, value] : ticks) {
+                if (path == TickPath::SetCell) {
+                    sheet.SetCell(pos, FormatNumber(value));
+                }
+                else if (path == TickPath::SetNumber) {
+                    sheet.SetNumber(pos, value);
+                }
+            }
+            for (const auto& tick : ticks) {
+                Consume(sheet.GetCell(Position{ tick.first.row, 1 })->GetValue());
+                Consume(sheet.GetCell(Position{ tick.first.row / 16 * 16 + 15, 2 })->GetValue());
+            }
+        });
+    }
+    result.params.push_back({ "ticks_per_batch", batch });
+    result.params.push_back({ "ticks_per_sec", static_cast<long long>(1e9 * batch * params.repeat / std::max<std::int64_t>(result.sample.Total(), 1)) });
+    return result;
+}
+
+#ifndef _WIN32
+//size/8 rows of inputs (column A) and 8 running totals (B..I, {col}{n} = {col}{n-1} +
+//A{n} * k) read by a summary cell. Every round changes 4 random inputs, then the sheet
+//is recalculated by 4 worker processes (one measure per recalculation). Reports the cut
+//edges, the rounds and the values exchanged per recalculation, and the time of the same
+//recalculation in one process.
+ScenarioResult BenchShardedRecalc(const BenchParams& params) {
+    ScenarioResult result = MakeResult("sharded_recalc", params);
+    const int shards = 4;
+    int rows = std::max(std::min(params.size / 8, int{ Position::MAX_ROWS }), 2);
+    Sheet sheet;
+    std::string summary = "=0";
+    for (int c = 1; c <= 8; ++c) {
+        std::string col = Position{ 0, c }.ToString();
+        col.pop_back();
+        sheet.SetCell(Position{ 0, c }, "=A1*" + std::to_string(c));
+        for (int r = 1; r < rows; ++r) {
+            std::string row = std::to_string(r + 1);
+            sheet.SetCell(Position{ r, c }, "=" + col + std::to_string(r) + "+A" + row + "*" + std::to_string(c));
+        }
+        summary += "+" + col + std::to_string(rows);
+    }
+    for (int r = 0; r < rows; ++r) {
+        sheet.SetCell(Position{ r, 0 }, "1");
+    }
+    Position summary_pos{ 0, 10 };
+    sheet.SetCell(summary_pos, summary);
+    Consume(sheet.GetCell(summary_pos)->GetValue());
+
+    ShardedRecalculation sharded(sheet, shards);
+    sharded.Recalculate();
+    std::uint64_t exchanged = sharded.GetStats().values_exchanged;
+    std::mt19937 generator(params.seed);
+    std::uniform_int_distribution<int> row(0, rows - 1);
+    long long single_ns = 0;
+    result.sample.Reserve(params.repeat);
+    for (int i = 0; i < params.repeat; ++i) {
+        std::vector<std::pair<Position, double>> inputs;
+        for (int k = 0; k < 4; ++k) {
+            inputs.push_back({ Position{ row(generator), 0 }, static_cast<double>(i + k) });
+        }
+        result.sample.Measure([&]() {
+            sharded.SetNumbers(inputs);
+            sharded.Recalculate();
+        });
+        auto start = BenchClock::now();
+        sheet.ApplyTicks(inputs);
+        Consume(sheet.GetCell(summary_pos)->GetValue());
+        single_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - start).count();
+    }
+    ShardingStats stats = sharded.GetStats();
+    result.params.push_back({ "shards", shards });
+    result.params.push_back({ "cut_edges", static_cast<long long>(stats.cut_edges) });
+    result.params.push_back({ "rounds", static_cast<long long>(stats.rounds) });
+    result.params.push_back({ "values_per_recalc",
+        static_cast<long long>((stats.values_exchanged - exchanged) / std::max(params.repeat, 1)) });
+    result.params.push_back({ "single_process_ns", single_ns / std::max(params.repeat, 1) });
+    return result;
+}
+#endif
+
+struct Scenario {
+    std::string name;
+    std::function<ScenarioResult(const BenchParams&)> run;
+};
+
+std::vector<Scenario> GetScenarios() {
+    return {
+        {"set_text", BenchSetText},
+        {"set_formula", BenchSetFormula},
+        {"parse_formula", BenchParseFormula},
+        {"long_chain_build", BenchLongChainBuild},
+        {"long_chain_recalc", BenchLongChainRecalc},
+        {"fan_out", BenchFanOut},
+        {"fan_in", BenchFanIn},
+        {"random_dag", BenchRandomDag},
+        {"cycle_rejection", BenchCycleRejection},
+        {"print_values", [](const BenchParams& params) { return BenchPrint(params, true); }},
+        {"print_texts", [](const BenchParams& params) { return BenchPrint(params, false); }},
+        {"print_labels", BenchPrintLabels},
+        {"print_viewport", BenchPrintViewport},
+        {"paged_reads", BenchPagedReads},
+        {"fork_what_if", BenchForkWhatIf},
+        {"fork_formulas", BenchForkFormulas},
+        {"position_to_string", BenchPositionToString},
+        {"position_from_string", BenchPositionFromString},
+        {"position_lookup", BenchPositionLookup},
+        {"clear_churn", BenchClearChurn},
+        {"export_delta", BenchExportDelta},
+        {"structural_edits", BenchStructuralEdits},
+        {"column_per_cell", [](const BenchParams& params) { return BenchColumnEvaluation(params, false); }},
+        {"column_batch", [](const BenchParams& params) { return BenchColumnEvaluation(params, true); }},
+        {"sweep_set_cell", [](const BenchParams& params) { return BenchSweep(params, false); }},
+        {"sweep", [](const BenchParams& params) { return BenchSweep(params, true); }},
+        {"iterative_cycles", BenchIterativeCycles},
+        {"dependency_queries", BenchDependencyQueries},
+        {"fill_down", BenchFillDown},
+        {"edit_latency_sync", [](const BenchParams& params) { return BenchEditLatency(params, false); }},
+        {"edit_latency_background", [](const BenchParams& params) { return BenchEditLatency(params, true); }},
+        {"recalc_slices", BenchRecalcSlices},
+        {"ticks_set_cell", [](const BenchParams& params) { return BenchTicks(params, TickPath::SetCell); }},
+        {"ticks_set_number", [](const BenchParams& params) { return BenchTicks(params, TickPath::SetNumber); }},
+        {"ticks_apply", [](const BenchParams& params) { return BenchTicks(params, TickPath::ApplyTicks); }},
+#ifndef _WIN32
+        {"sharded_recalc", BenchShardedRecalc},
+#endif
+    };
+}
+
+[[noreturn]] void PrintUsageAndExit(const char* program) {
+    std::cerr << "Usage: " << program
+        << " [--size N] [--repeat N] [--seed N] [--filter SUBSTR] [--output FILE]" << std::endl;
+    std::exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    BenchParams params;
+    std::string filter;
+    std::string output_path;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            PrintUsageAndExit(argv[0]);
+        }
+        std::string value = argv[++i];
+        if (arg == "--size") {
+            params.size = std::max(2, std::stoi(value));
+        }
+        else if (arg == "--repeat") {
+            params.repeat = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--seed") {
+            params.seed = static_cast<unsigned>(std::stoul(value));
+        }
+        else if (arg == "--filter") {
+            filter = value;
+        }
+        else if (arg == "--output") {
+            output_path = value;
+        }
+        else {
+            PrintUsageAndExit(argv[0]);
+        }
+    }
+
+    std::vector<ScenarioResult> results;
+    for (const Scenario& scenario : GetScenarios()) {
+        if (scenario.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        std::cerr << "running " << scenario.name << "..." << std::endl;
+        results.push_back(scenario.run(params));
+    }
+
+    if (output_path.empty()) {
+        PrintJsonReport(std::cout, results);
+    }
+    else {
+        std::ofstream out(output_path);
+        PrintJsonReport(out, results);
+    }
+    std::cerr << "checksum: " << g_sink << std::endl;
+    return 0;
+}
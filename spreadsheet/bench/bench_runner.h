@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+//Helpers of the benchmark suite:
+// * Timer of a single operation.
+// * Collection of latencies of one scenario and their percentiles.
+// * JSON report of all scenarios.
+
+namespace BenchRunnerPrivate {
+inline std::string EscapeJson(const std::string& str) {
+    std::string result;
+    result.reserve(str.size());
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+}  // namespace BenchRunnerPrivate
+
+using BenchClock = std::chrono::steady_clock;
+
+//Latencies (in nanoseconds) of the measured operations of a scenario.
+class LatencySample {
+public:
+    void Reserve(size_t n) {
+        latencies_.reserve(n);
+    }
+
+    void Add(std::int64_t nanoseconds) {
+        latencies_.push_back(nanoseconds);
+        sorted_ = false;
+    }
+
+    //Measure one call of func.
+    template <typename Func>
+    void Measure(Func func) {
+        auto start = BenchClock::now();
+        func();
+        auto end = BenchClock::now();
+        Add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+
+    size_t Count() const {
+        return latencies_.size();
+    }
+
+    std::int64_t Total() const {
+        std::int64_t total = 0;
+        for (auto latency : latencies_) {
+            total += latency;
+        }
+        return total;
+    }
+
+    //Nearest-rank percentile, p in [0, 100] (0: the minimum).
+    //The latencies are sorted by the first call after an Add.
+    std::int64_t Percentile(double p) const {
+        if (latencies_.empty()) {
+            return 0;
+        }
+        if (!sorted_) {
+            std::sort(latencies_.begin(), latencies_.end());
+            sorted_ = true;
+        }
+        double rank = std::ceil(p / 100.0 * latencies_.size());
+        size_t index = rank < 1 ? 0 : static_cast<size_t>(rank) - 1;
+        return latencies_[std::min(index, latencies_.size() - 1)];
+    }
+
+private:
+    mutable std::vector<std::int64_t> latencies_;
+    mutable bool sorted_ = true;
+};
+
+//Result of one scenario: its parameters and the measured latencies.
+struct ScenarioResult {
+    std::string name;
+    std::vector<std::pair<std::string, long long>> params;
+    LatencySample sample;
+};
+
+//Write the results as a JSON document:
+//{"suite": ..., "scenarios": [{"name", "params", "ops", "total_ns", "ops_per_sec", "latency_ns": {...}}]}
+inline void PrintJsonReport(std::ostream& out, const std::vector<ScenarioResult>& results) {
+    using BenchRunnerPrivate::EscapeJson;
+    out << "{\n  \"suite\": \"spreadsheet_bench\",\n  \"scenarios\": [";
+    bool first = true;
+    for (const ScenarioResult& result : results) {
+        out << (first ? "\n" : ",\n");
+        first = false;
+
+        const LatencySample& sample = result.sample;
+        std::int64_t total = sample.Total();
+        double ops_per_sec = total == 0 ? 0.0 : sample.Count() * 1e9 / total;
+
+        out << "    {\"name\": \"" << EscapeJson(result.name) << "\", \"params\": {";
+        bool first_param = true;
+        for (const auto& [key, value] : result.params) {
+            out << (first_param ? "" : ", ") << '"' << EscapeJson(key) << "\": " << value;
+            first_param = false;
+        }
+        out << "}, \"ops\": " << sample.Count()
+            << ", \"total_ns\": " << total
+            << ", \"ops_per_sec\": " << static_cast<long long>(ops_per_sec)
+            << ", \"latency_ns\": {\"min\": " << sample.Percentile(0)
+            << ", \"p50\": " << sample.Percentile(50)
+            << ", \"p90\": " << sample.Percentile(90)
+            << ", \"p99\": " << sample.Percentile(99)
+            << ", \"max\": " << sample.Percentile(100) << "}}";
+    }
+    out << "\n  ]\n}\n";
+}
@@ -1,307 +1,1681 @@
-#include "cell.h"
-
-#include <cassert>
-#include <iostream>
-#include <string>
-#include <optional>
-
-// Реализуйте следующие методы
-
-//Graph
-Graph::Graph() {};
-
-Graph::Graph(const Graph& other)
-	: vertex_to_childs_(other.vertex_to_childs_)
-	, vertices_(other.vertices_) {
-}
-
-void Graph::Swap(Graph& other) {
-	std::swap(vertex_to_childs_, other.vertex_to_childs_);
-	std::swap(vertices_, other.vertices_);
-}
-
-void Graph::AddEdge(Position start, Position end) {
-	if (std::count(vertices_.begin(), vertices_.end(), start) == 0) {
-		vertices_.push_back(start);
-	}
-
-	if (std::count(vertices_.begin(), vertices_.end(), end) == 0) {
-		vertices_.push_back(end);
-	}
-
-	if (vertex_to_childs_.find(start) != vertex_to_childs_.end()) {
-		std::vector<Position>& childs = vertex_to_childs_[start];
-		if (count(childs.begin(), childs.end(), end) == 0) {
-			childs.push_back(end);
-		}
-	}
-	else {
-		vertex_to_childs_[start] = { end };
-	}
-}
-
-void Graph::RemoveEdge(Position start, Position end) {
-	std::vector<Position>& childs = vertex_to_childs_[start];
-	auto it = std::find(childs.begin(), childs.end(), end);
-	if (it != childs.end()) {
-		childs.erase(it);
-	}
-}
-
-bool Graph::IsCyclicRecursive(
-	Position current_vertex,
-	std::unordered_map<Position, bool, PositionHasher>& visited,
-	std::unordered_map<Position, bool, PositionHasher>& recStack) const {
-	if (visited[current_vertex] == false) {
-		visited[current_vertex] = true;
-		recStack[current_vertex] = true;
-
-		if (vertex_to_childs_.find(current_vertex) != vertex_to_childs_.end()) {
-
-			std::vector<Position> childs = vertex_to_childs_.at(current_vertex);
-			for (auto vertex : childs) {
-				if (!visited[vertex] && IsCyclicRecursive(vertex, visited, recStack)) {
-					return true;
-				}
-				else if (recStack[vertex] == true) {
-					return true;
-				}
-			}
-		}
-
-	}
-	recStack[current_vertex] = false;
-	return false;
-}
-
-bool Graph::IsCyclic() const {
-	std::unordered_map<Position, bool, PositionHasher> visited;
-	std::unordered_map<Position, bool, PositionHasher> recStack;
-	for (auto vertex : vertices_) {
-		visited[vertex] = false;
-		recStack[vertex] = false;
-	}
-
-	for (auto vertex : vertices_) {
-		if (!visited[vertex] && IsCyclicRecursive(vertex, visited, recStack)) {
-			return true;
-		}
-	}
-	return false;
-}
-
-
-void Graph::TranverseGraphAndInvalidateCache(
-	Position vertex,
-	std::unordered_map< Position, std::optional<CellInterface::Value>, PositionHasher>& cache_storage) {
-	std::unordered_map<Position, bool, PositionHasher> visited;
-	auto nullify_vertex = [&cache_storage](Position vertex) {
-		cache_storage[vertex] = std::nullopt;
-		};
-	DFS(vertex, visited, nullify_vertex);
-}
-
-//Dependencies Manager
-
-bool DependenciesManager::TryAddNewVertex(Position vertex,const std::vector<Position>& parents) {
-	if (parents.size() == 0) {
-		//no-dependencies
-		return true;
-	}
-
-	Graph tmp_grap(dependencies_graph);
-	for (Position parent : parents) {
-		tmp_grap.AddEdge(parent, vertex);
-	}
-	if (tmp_grap.IsCyclic()) {
-		return false;
-	}
-	else {
-		dependencies_graph.Swap(tmp_grap);
-		vertex_to_parents_[vertex] = parents;
-		return true;
-	}
-}
-
-bool DependenciesManager::TryUpdateVertex(Position vertex, const std::vector<Position>& parents) {
-	Graph tmp_grap(dependencies_graph);
-	//get current parents
-	std::vector<Position> current_parents;
-	if (vertex_to_parents_.find(vertex) != vertex_to_parents_.end()) {
-		current_parents = vertex_to_parents_[vertex];
-	}
-	//remove current parents from copy
-	for (Position current_parent : current_parents) {
-		tmp_grap.RemoveEdge(current_parent, vertex);
-	}
-	//Add new parents
-	for (Position parent : parents) {
-		tmp_grap.AddEdge(parent, vertex);
-	}
-	//check if copy is isCyclic
-	if (tmp_grap.IsCyclic()) {
-		//copy_graph IS cyclic => stop operation/throw exception 
-		return false;
-	}
-	else {
-		//copy_graph IS OK 
-		// 1.Update/swap graph.
-		// 2.Invalidate cache.
-		// 3.Update new parents.
-		dependencies_graph.Swap(tmp_grap);
-		InvalidateCache(vertex);
-		vertex_to_parents_[vertex] = parents;
-		return true;
-	}
-}
-
-bool DependenciesManager::IsInCache(Position pos) const {
-	if (vertex_to_cache_.find(pos) == vertex_to_cache_.end()) {
-		return false;
-	}
-	if (vertex_to_cache_.at(pos) == std::nullopt) {
-		return false;
-	}
-	return true;
-}
-
-CellInterface::Value DependenciesManager::GetCache(Position pos) const {
-	return *vertex_to_cache_.at(pos);
-}
-
-void DependenciesManager::AddToCache(Position pos, CellInterface::Value value, std::vector<Position> parents) {
-	vertex_to_cache_[pos] = value;
-}
-
-void DependenciesManager::InvalidateCache(Position vertex) {
-	dependencies_graph.TranverseGraphAndInvalidateCache(vertex, vertex_to_cache_);
-}
-
-
-//Types of cells 
-
-Impl::Impl(std::string expression) :expression_(expression) {
-}
-
-std::string Impl::GetText() const {
-	return expression_;
-}
-
-std::vector<Position> Impl::GetReferencedCells() const {
-	return {};
-}
-
-
-
-EmptyImpl::EmptyImpl() : Impl("") {
-
-}
-
-Impl::ImplValue EmptyImpl::GetValue() const {
-	return "";
-}
-
-TextImpl::TextImpl(std::string text) : Impl(text) {
-
-}
-
-Impl::ImplValue TextImpl::GetValue() const {
-	if (expression_[0] == '\'') {
-		return expression_.substr(1);
-	}
-	return expression_;
-}
-
-FormulaImpl::FormulaImpl(std::string formula, const SheetInterface& sheet)
-	: Impl(formula)
-	, sheet_(sheet)			{
-	formula_ = ParseFormula(expression_.substr(1));
-}
-
-Impl::ImplValue FormulaImpl::GetValue() const {
-	std::variant<double, FormulaError> evaluation = formula_->Evaluate(sheet_);
-	if (auto* value = std::get_if<double>(&evaluation)) {
-		return *value;
-	}
-	else {
-		auto* except = std::get_if<FormulaError>(&evaluation);
-		return *except;
-	}
-}
-
-std::string FormulaImpl::GetText() const {
-	return "=" + formula_->GetExpression();
-}
-
-std::vector<Position> FormulaImpl::GetReferencedCells() const {
-	return formula_->GetReferencedCells();
-}
-
-
-
-Cell::~Cell() {
-}
-
-Cell::Cell(const SheetInterface& sheet, DependenciesManager& manager, Position pos)
-	: sheet_(sheet)
-	, dependencies_manager_(manager)
-	, pos_(pos) {
-}
-
-
-void Cell::Set(std::string text) {
-	//1. Parse the formula.
-	std::unique_ptr<Impl> tmp_ptr;
-	if (text.size() == 0) {
-		tmp_ptr = std::make_unique<EmptyImpl>();
-	}
-	else if (text[0] != '=' || (text[0] == '=' && text.size() == 1)) {
-		tmp_ptr = std::make_unique<TextImpl>(text);
-	}
-	else {
-		tmp_ptr = std::make_unique<FormulaImpl>(text, sheet_);
-	}
-	//2. Check if the dependencies in the formula are valid.
-	CheckValidDependencies(tmp_ptr->GetReferencedCells());
-	//3. Transfer ownership of formula to current object.
-	impl_ = std::move(tmp_ptr);
-}
-
-void Cell::CheckValidDependencies(const std::vector<Position>& parents) const {
-	const CellInterface* current_cell = sheet_.GetCell(pos_);
-	bool valid_dependencies;
-	if (current_cell == nullptr) {
-		//this is a new cell, no invalidation possible
-		valid_dependencies = dependencies_manager_.TryAddNewVertex(pos_, parents);
-	}
-	else {
-		//here we are overwriting an already existing cell
-		//need to invalidate cash
-		valid_dependencies = dependencies_manager_.TryUpdateVertex(pos_, parents);
-	}
-	if (!valid_dependencies) {
-		throw CircularDependencyException("Circular dependency");
-	}
-}
-
-void Cell::Clear() {
-	Set("");
-}
-
-
-CellInterface::Value Cell::GetValue() const {
-	if (dependencies_manager_.IsInCache(pos_)) {
-		return dependencies_manager_.GetCache(pos_);
-	}
-	CellInterface::Value value = impl_->GetValue();
-	dependencies_manager_.AddToCache(pos_,value,impl_->GetReferencedCells());
-	return value;
-}
-
-std::string Cell::GetText() const {
-	return impl_->GetText();
-}
-
-std::vector<Position> Cell::GetReferencedCells() const {
-	return impl_->GetReferencedCells();
-}
\ No newline at end of file
+#include "cell.h"
+#include "recalc.h"
+
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <optional>
+#include <tuple>
+
+// Реализуйте следующие методы
+
+//Graph
+bool CellOffset::operator==(CellOffset rhs) const {
+	return rows == rhs.rows && cols == rhs.cols;
+}
+
+bool CellOffset::operator<(CellOffset rhs) const {
+	return std::tie(rows, cols) < std::tie(rhs.rows, rhs.cols);
+}
+
+Position LineShift::operator()(Position pos) const {
+	int& coordinate = rows ? pos.row : pos.col;
+	if (coordinate >= from) {
+		coordinate += delta;
+	}
+	return pos;
+}
+
+namespace {
+std::vector<CellOffset> GetOffsets(Position child, PositionSpan parents) {
+	std::vector<CellOffset> offsets;
+	offsets.reserve(parents.size());
+	for (Position parent : parents) {
+		offsets.push_back(CellOffset{ parent.row - child.row, parent.col - child.col });
+	}
+	std::sort(offsets.begin(), offsets.end());
+	return offsets;
+}
+
+Position Shift(Position pos, CellOffset offset) {
+	return Position{ pos.row + offset.rows, pos.col + offset.cols };
+}
+
+//Estimated heap bytes of a hash table of vectors of positions.
+size_t EstimateTableBytes(size_t nodes, size_t items) {
+	const size_t node_bytes = sizeof(void*) + sizeof(size_t)
+		+ sizeof(std::pair<const PositionKey, std::vector<Position>>);
+	return nodes * (node_bytes + sizeof(void*)) + items * sizeof(Position);
+}
+
+//Estimated heap bytes of a node of a std::map<int, size_t>.
+const size_t LINE_NODE_BYTES = 4 * sizeof(void*) + sizeof(std::pair<const int, size_t>);
+}  // namespace
+
+Graph::Graph() {};
+
+Graph::Graph(const Graph& other)
+	: vertex_to_childs_(other.vertex_to_childs_)
+	, vertex_to_parents_(other.vertex_to_parents_)
+	, runs_(other.runs_)
+	, next_run_(other.next_run_)
+	, child_lines_(other.child_lines_)
+	, parent_lines_(other.parent_lines_)
+	, counters_(other.counters_) {
+}
+
+void Graph::SetCounters(SheetCounters* counters) {
+	counters_ = counters;
+}
+
+void Graph::FillStats(SheetStats& stats) const {
+	std::unordered_set<PositionKey, PositionHasher> vertices;
+	ForEachVertex([&vertices](Position vertex) {
+		vertices.insert(vertex);
+		});
+	size_t explicit_edges = 0;
+	for (const auto& [vertex, parents] : vertex_to_parents_) {
+		explicit_edges += parents.size();
+	}
+	size_t run_edges = 0;
+	size_t run_childs = 0;
+	size_t runs_bytes = 0;
+	//parents of the runs: with the edges stored one by one, each one has its list of childs
+	std::unordered_set<PositionKey, PositionHasher> parents;
+	for (const auto& [vertex, childs] : vertex_to_childs_) {
+		parents.insert(vertex);
+	}
+	for (const auto& [id, run] : runs_) {
+		run_childs += run.count;
+		run_edges += static_cast<size_t>(run.count) * run.offsets.size();
+		runs_bytes += EstimateTableBytes(1, 0) + run.offsets.size() * sizeof(CellOffset)
+			+ (run.offsets.size() + 1) * LINE_NODE_BYTES;
+		for (int i = 0; i < run.count; ++i) {
+			for (CellOffset offset : run.offsets) {
+				parents.insert(Shift(run.GetChild(i), offset));
+			}
+		}
+	}
+	stats.graph_vertices = vertices.size();
+	stats.graph_edges = explicit_edges + run_edges;
+	stats.graph_runs = runs_.size();
+	stats.graph_bytes = EstimateTableBytes(vertex_to_parents_.size(), explicit_edges)
+		+ EstimateTableBytes(vertex_to_childs_.size(), explicit_edges) + runs_bytes;
+	stats.graph_uncompressed_bytes = EstimateTableBytes(vertex_to_parents_.size() + run_childs, stats.graph_edges)
+		+ EstimateTableBytes(parents.size(), stats.graph_edges);
+}
+
+Position Graph::Run::GetChild(int index) const {
+	return down ? Position{ first.row + index, first.col } : Position{ first.row, first.col + index };
+}
+
+std::uint64_t Graph::GetLineKey(bool down, Position pos) {
+	std::uint64_t line = static_cast<std::uint32_t>(down ? pos.col : pos.row);
+	return (line << 1) | (down ? 1 : 0);
+}
+
+int Graph::GetIndexInLine(bool down, Position pos) {
+	return down ? pos.row : pos.col;
+}
+
+size_t Graph::FindInLine(const LineRuns& runs, int index, int* run_index) const {
+	auto it = runs.upper_bound(index);
+	if (it == runs.begin()) {
+		return NO_RUN;
+	}
+	--it;
+	int offset = index - it->first;
+	if (offset >= runs_.at(it->second).count) {
+		return NO_RUN;
+	}
+	*run_index = offset;
+	return it->second;
+}
+
+size_t Graph::FindRun(Position child, int* index) const {
+	if (runs_.empty()) {
+		return NO_RUN;
+	}
+	for (bool down : { true, false }) {
+		auto it = child_lines_.find(GetLineKey(down, child));
+		if (it != child_lines_.end()) {
+			size_t id = FindInLine(it->second, GetIndexInLine(down, child), index);
+			if (id != NO_RUN) {
+				return id;
+			}
+		}
+	}
+	return NO_RUN;
+}
+
+size_t Graph::AddRun(Run run) {
+	size_t id = next_run_++;
+	child_lines_[GetLineKey(run.down, run.first)][GetIndexInLine(run.down, run.first)] = id;
+	for (CellOffset offset : run.offsets) {
+		Position first_parent = Shift(run.first, offset);
+		std::vector<ParentRuns>& line = parent_lines_[GetLineKey(run.down, first_parent)];
+		auto it = std::find_if(line.begin(), line.end(), [offset](const ParentRuns& parent_runs) {
+			return parent_runs.offset == offset;
+			});
+		if (it == line.end()) {
+			it = line.insert(line.end(), ParentRuns{ offset, {} });
+		}
+		it->runs[GetIndexInLine(run.down, first_parent)] = id;
+	}
+	runs_.emplace(id, std::move(run));
+	return id;
+}
+
+Graph::Run Graph::RemoveRun(size_t id) {
+	auto node = runs_.extract(id);
+	Run& run = node.mapped();
+	auto child_it = child_lines_.find(GetLineKey(run.down, run.first));
+	child_it->second.erase(GetIndexInLine(run.down, run.first));
+	if (child_it->second.empty()) {
+		child_lines_.erase(child_it);
+	}
+	for (CellOffset offset : run.offsets) {
+		Position first_parent = Shift(run.first, offset);
+		auto line_it = parent_lines_.find(GetLineKey(run.down, first_parent));
+		std::vector<ParentRuns>& line = line_it->second;
+		auto it = std::find_if(line.begin(), line.end(), [offset](const ParentRuns& parent_runs) {
+			return parent_runs.offset == offset;
+			});
+		it->runs.erase(GetIndexInLine(run.down, first_parent));
+		if (it->runs.empty()) {
+			line.erase(it);
+		}
+		if (line.empty()) {
+			parent_lines_.erase(line_it);
+		}
+	}
+	return std::move(run);
+}
+
+void Graph::RemoveFromRun(size_t id, int index) {
+	Run run = RemoveRun(id);
+	//the parts left of one formula are stored one by one
+	auto keep = [this, &run](int first, int count) {
+		if (count == 1) {
+			Position child = run.GetChild(first);
+			std::vector<Position> parents;
+			for (CellOffset offset : run.offsets) {
+				parents.push_back(Shift(child, offset));
+			}
+			SetExplicitParents(child, std::move(parents));
+		}
+		else if (count > 1) {
+			AddRun(Run{ run.GetChild(first), count, run.down, run.offsets });
+		}
+	};
+	keep(0, index);
+	keep(index + 1, run.count - index - 1);
+}
+
+bool Graph::TryJoinRun(Position child, const std::vector<CellOffset>& offsets) {
+	for (bool down : { true, false }) {
+		CellOffset step = down ? CellOffset{ 1, 0 } : CellOffset{ 0, 1 };
+		Position before = Shift(child, CellOffset{ -step.rows, -step.cols });
+		Position after = Shift(child, step);
+		Run run{ child, 1, down, offsets };
+
+		int index;
+		size_t before_run = before.IsValid() ? FindRun(before, &index) : NO_RUN;
+		if (before_run != NO_RUN) {
+			const Run& other = runs_.at(before_run);
+			if (other.down == down && index == other.count - 1 && other.offsets == offsets) {
+				run.first = other.first;
+				run.count += other.count;
+				RemoveRun(before_run);
+			}
+		}
+		else if (before.IsValid() && GetExplicitOffsets(before) == offsets) {
+			RemoveExplicitParents(before);
+			run.first = before;
+			++run.count;
+		}
+
+		size_t after_run = after.IsValid() ? FindRun(after, &index) : NO_RUN;
+		if (after_run != NO_RUN) {
+			const Run& other = runs_.at(after_run);
+			if (other.down == down && index == 0 && other.offsets == offsets) {
+				run.count += other.count;
+				RemoveRun(after_run);
+			}
+		}
+		else if (after.IsValid() && GetExplicitOffsets(after) == offsets) {
+			RemoveExplicitParents(after);
+			++run.count;
+		}
+
+		if (run.count > 1) {
+			AddRun(std::move(run));
+			return true;
+		}
+	}
+	return false;
+}
+
+void Graph::SetExplicitParents(Position child, std::vector<Position> parents) {
+	for (Position parent : parents) {
+		vertex_to_childs_[parent].push_back(child);
+	}
+	vertex_to_parents_[child] = std::move(parents);
+}
+
+void Graph::RemoveExplicitParents(Position child) {
+	auto it = vertex_to_parents_.find(child);
+	if (it == vertex_to_parents_.end()) {
+		return;
+	}
+	for (Position parent : it->second) {
+		auto childs_it = vertex_to_childs_.find(parent);
+		std::vector<Position>& childs = childs_it->second;
+		childs.erase(std::find(childs.begin(), childs.end(), child));
+		if (childs.empty()) {
+			vertex_to_childs_.erase(childs_it);
+		}
+	}
+	vertex_to_parents_.erase(it);
+}
+
+std::vector<CellOffset> Graph::GetExplicitOffsets(Position vertex) const {
+	auto it = vertex_to_parents_.find(vertex);
+	if (it == vertex_to_parents_.end()) {
+		return {};
+	}
+	return GetOffsets(vertex, it->second);
+}
+
+void Graph::SetParents(Position child, PositionSpan parents) {
+	//1. Remove the current edges.
+	int index;
+	size_t run = FindRun(child, &index);
+	if (run != NO_RUN) {
+		RemoveFromRun(run, index);
+	}
+	else {
+		RemoveExplicitParents(child);
+	}
+	if (parents.size() == 0) {
+		return;
+	}
+	//2. Join a run of a neighbour with the same offsets, or store the edges one by one.
+	if (!TryJoinRun(child, GetOffsets(child, parents))) {
+		SetExplicitParents(child, std::vector<Position>(parents.begin(), parents.end()));
+	}
+}
+
+std::vector<Position> Graph::GetParents(Position vertex) const {
+	auto it = vertex_to_parents_.find(vertex);
+	if (it != vertex_to_parents_.end()) {
+		return it->second;
+	}
+	std::vector<Position> parents;
+	int index;
+	size_t run = FindRun(vertex, &index);
+	if (run != NO_RUN) {
+		for (CellOffset offset : runs_.at(run).offsets) {
+			parents.push_back(Shift(vertex, offset));
+		}
+	}
+	return parents;
+}
+
+bool Graph::HasParents(Position vertex) const {
+	int index;
+	return vertex_to_parents_.count(vertex) > 0 || FindRun(vertex, &index) != NO_RUN;
+}
+
+std::vector<Position> Graph::GetChilds(Position vertex) const {
+	std::vector<Position> childs;
+	ForEachChild(vertex, [&childs](Position child) {
+		childs.push_back(child);
+		});
+	return childs;
+}
+
+bool Graph::HasChilds(Position vertex) const {
+	bool has_childs = false;
+	ForEachChild(vertex, [&has_childs](Position) {
+		has_childs = true;
+		});
+	return has_childs;
+}
+
+void Graph::RenameVertices(const std::unordered_map<PositionKey, Position, PositionHasher>& renames,
+	const LineShift& shift) {
+	//1. The runs with their childs and parents before the shifted lines keep their edges,
+	//the others move as a whole: they are cut only where their offsets change, the
+	//childs and parents of each part being on the same side of the first shifted line.
+	std::vector<size_t> moved_runs;
+	std::vector<Run> renamed_runs;
+	std::vector<std::pair<Position, std::vector<Position>>> renamed_formulas;
+	std::vector<int> cuts;
+	std::vector<CellOffset> offsets;
+	for (const auto& [id, run] : runs_) {
+		bool along = run.down == shift.rows;
+		int first = shift.rows ? run.first.row : run.first.col;
+		int last = along ? first + run.count - 1 : first;
+		int max_offset = 0;
+		for (CellOffset offset : run.offsets) {
+			max_offset = std::max(max_offset, shift.rows ? offset.rows : offset.cols);
+		}
+		if (last + max_offset < shift.from) {
+			continue;
+		}
+		moved_runs.push_back(id);
+
+		cuts.assign({ 0, run.count });
+		if (along) {
+			cuts.push_back(shift.from - first);
+			for (CellOffset offset : run.offsets) {
+				cuts.push_back(shift.from - first - (shift.rows ? offset.rows : offset.cols));
+			}
+			for (int& cut : cuts) {
+				cut = std::clamp(cut, 0, run.count);
+			}
+			std::sort(cuts.begin(), cuts.end());
+			cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+		}
+		Run current;
+		auto flush = [&]() {
+			if (current.count == 1) {
+				std::vector<Position> parents;
+				for (CellOffset offset : current.offsets) {
+					parents.push_back(Shift(current.first, offset));
+				}
+				renamed_formulas.emplace_back(current.first, std::move(parents));
+			}
+			else if (current.count > 1) {
+				renamed_runs.push_back(std::move(current));
+			}
+		};
+		for (size_t i = 0; i + 1 < cuts.size(); ++i) {
+			Position child = run.GetChild(cuts[i]);
+			int count = cuts[i + 1] - cuts[i];
+			Position new_child = shift(child);
+			offsets.clear();
+			for (CellOffset offset : run.offsets) {
+				Position new_parent = shift(Shift(child, offset));
+				offsets.push_back(CellOffset{ new_parent.row - new_child.row, new_parent.col - new_child.col });
+			}
+			std::sort(offsets.begin(), offsets.end());
+			if (current.count > 0 && new_child == current.GetChild(current.count) && offsets == current.offsets) {
+				current.count += count;
+				continue;
+			}
+			flush();
+			current = Run{ new_child, count, run.down, offsets };
+		}
+		flush();
+	}
+	//removed before any is added back: a moved run may take the place of another one
+	for (size_t id : moved_runs) {
+		RemoveRun(id);
+	}
+
+	//2. Edges stored one by one: the lists holding a renamed vertex (childs of its
+	//parents and parents of its childs) are updated with the old keys before any key changes.
+	std::unordered_set<PositionKey, PositionHasher> parents_to_update;
+	std::unordered_set<PositionKey, PositionHasher> childs_to_update;
+	for (const auto& [old_vertex, new_vertex] : renames) {
+		auto parents_it = vertex_to_parents_.find(old_vertex);
+		if (parents_it != vertex_to_parents_.end()) {
+			parents_to_update.insert(parents_it->second.begin(), parents_it->second.end());
+		}
+		auto childs_it = vertex_to_childs_.find(old_vertex);
+		if (childs_it != vertex_to_childs_.end()) {
+			childs_to_update.insert(childs_it->second.begin(), childs_it->second.end());
+		}
+	}
+	auto rename_list = [&renames](std::vector<Position>& list) {
+		for (Position& vertex : list) {
+			auto rename_it = renames.find(vertex);
+			if (rename_it != renames.end()) {
+				vertex = rename_it->second;
+			}
+		}
+	};
+	for (PositionKey parent : parents_to_update) {
+		rename_list(vertex_to_childs_.at(parent));
+	}
+	for (PositionKey child : childs_to_update) {
+		rename_list(vertex_to_parents_.at(child));
+	}
+	//extract everything first: a new name may still be used by a vertex not renamed yet
+	std::vector<decltype(vertex_to_childs_)::node_type> childs_nodes;
+	std::vector<decltype(vertex_to_parents_)::node_type> parents_nodes;
+	for (const auto& [old_vertex, new_vertex] : renames) {
+		auto childs_node = vertex_to_childs_.extract(old_vertex);
+		if (!childs_node.empty()) {
+			childs_node.key() = new_vertex;
+			childs_nodes.push_back(std::move(childs_node));
+		}
+		auto parents_node = vertex_to_parents_.extract(old_vertex);
+		if (!parents_node.empty()) {
+			parents_node.key() = new_vertex;
+			parents_nodes.push_back(std::move(parents_node));
+		}
+	}
+	for (auto& node : childs_nodes) {
+		vertex_to_childs_.insert(std::move(node));
+	}
+	for (auto& node : parents_nodes) {
+		vertex_to_parents_.insert(std::move(node));
+	}
+
+	//3. The renamed runs, and the formulas cut out of them.
+	for (Run& run : renamed_runs) {
+		AddRun(std::move(run));
+	}
+	for (auto& [child, parents] : renamed_formulas) {
+		SetExplicitParents(child, std::move(parents));
+	}
+}
+
+void Graph::RemoveVertex(Position vertex) {
+	SetParents(vertex, {});
+	for (Position child : GetChilds(vertex)) {
+		std::vector<Position> parents = GetParents(child);
+		parents.erase(std::remove(parents.begin(), parents.end(), vertex), parents.end());
+		SetParents(child, parents);
+	}
+}
+
+bool Graph::IsCyclic() const {
+	//depth-first search without recursion: a child on the path of the search closes a cycle
+	std::unordered_map<PositionKey, bool, PositionHasher> on_path;
+	std::vector<std::pair<Position, std::vector<Position>>> stack;
+	bool is_cyclic = false;
+	ForEachVertex([&](Position root) {
+		if (is_cyclic || on_path.count(root) > 0) {
+			return;
+		}
+		on_path[root] = true;
+		stack.push_back({ root, GetChilds(root) });
+		while (!stack.empty() && !is_cyclic) {
+			std::vector<Position>& childs = stack.back().second;
+			if (childs.empty()) {
+				on_path[stack.back().first] = false;
+				stack.pop_back();
+				continue;
+			}
+			Position child = childs.back();
+			childs.pop_back();
+			auto it = on_path.find(child);
+			if (it == on_path.end()) {
+				on_path[child] = true;
+				stack.push_back({ child, GetChilds(child) });
+			}
+			else if (it->second) {
+				is_cyclic = true;
+			}
+		}
+		stack.clear();
+		});
+#if SPREADSHEET_STATS
+	if (counters_ != nullptr) {
+		counters_->OnCycleCheck(on_path.size());
+	}
+#endif
+	return is_cyclic;
+}
+
+bool Graph::Reaches(Position vertex, PositionSpan targets) const {
+	std::unordered_set<PositionKey, PositionHasher> visited;
+	bool reached = false;
+	std::vector<Position> stack = { vertex };
+	visited.insert(vertex);
+	while (!stack.empty() && !reached) {
+		Position current = stack.back();
+		stack.pop_back();
+		if (std::binary_search(targets.begin(), targets.end(), current)) {
+			reached = true;
+			break;
+		}
+		ForEachChild(current, [&visited, &stack](Position child) {
+			if (visited.insert(child).second) {
+				stack.push_back(child);
+			}
+			});
+	}
+#if SPREADSHEET_STATS
+	if (counters_ != nullptr) {
+		counters_->OnCycleCheck(visited.size());
+	}
+#endif
+	return reached;
+}
+
+
+size_t Graph::TranverseGraphAndInvalidateCache(
+	PositionSpan vertices,
+	CacheStorage& cache_storage,
+	std::vector<Position>* invalidated) const {
+	std::unordered_set<PositionKey, PositionHasher> visited;
+	auto nullify_vertex = [&cache_storage, invalidated](Position vertex) {
+		//the texts have no cache slot
+		auto it = cache_storage.find(vertex);
+		if (it != cache_storage.end()) {
+			//the value is kept for the stale reads
+			it->second.state.store(CacheState::Dirty, std::memory_order_release);
+		}
+		if (invalidated != nullptr) {
+			invalidated->push_back(vertex);
+		}
+		};
+	for (Position vertex : vertices) {
+		DFS(vertex, visited, nullify_vertex);
+	}
+	return visited.size();
+}
+
+//Dependencies Manager
+
+DependenciesManager::DependenciesManager()
+	: dependencies_graph(std::make_shared<Graph>()) {
+	dependencies_graph->SetCounters(&counters_);
+}
+
+DependenciesManager::~DependenciesManager() {
+	//the forks keep the values they did not copy yet
+	DetachCacheShares();
+}
+
+void DependenciesManager::ShareDependencies(const DependenciesManager& other) {
+	DetachCacheShares();
+	dependencies_graph = other.dependencies_graph;
+	iterative_ = other.iterative_;
+	max_iterations_ = other.max_iterations_;
+	epsilon_ = other.epsilon_;
+	cycles_outdated_ = true;
+	//the graph is the same: so is its index
+	std::lock_guard<std::mutex> lock(other.reachability_mutex_);
+	reachability_ = other.reachability_;
+	//the slots are registered when the formulas are copied (InheritVertex)
+	vertex_to_cache_.clear();
+	inherited_cache_ = other.GetCacheShare();
+}
+
+std::shared_ptr<CacheShare> DependenciesManager::GetCacheShare() const {
+	//no value copied yet: the last share is still the cache as it is
+	if (!cache_shares_.empty() && cache_shares_.back()->values.empty()) {
+		return cache_shares_.back();
+	}
+	auto share = std::make_shared<CacheShare>();
+	share->source = this;
+	cache_shares_.push_back(share);
+	return share;
+}
+
+std::vector<std::unique_lock<std::mutex>> DependenciesManager::LockCacheShares() {
+	//a share held by this manager only is read by no fork: no fork gets it anymore either
+	cache_shares_.erase(std::remove_if(cache_shares_.begin(), cache_shares_.end(), [](const auto& share) {
+		return share.use_count() == 1;
+		}), cache_shares_.end());
+	std::vector<std::unique_lock<std::mutex>> locks;
+	locks.reserve(cache_shares_.size());
+	for (const auto& share : cache_shares_) {
+		locks.emplace_back(share->mutex);
+	}
+	return locks;
+}
+
+void DependenciesManager::PreserveSharedValues(const std::vector<Position>& vertices) {
+	for (Position vertex : vertices) {
+		std::optional<CellInterface::Value> value = FindSharedValue(vertex);
+		for (const auto& share : cache_shares_) {
+			share->values.try_emplace(vertex, value);
+		}
+	}
+}
+
+void DependenciesManager::DetachCacheShares() {
+	auto locks = LockCacheShares();
+	for (const auto& share : cache_shares_) {
+		for (const auto& [vertex, entry] : vertex_to_cache_) {
+			std::optional<CellInterface::Value> value;
+			if (entry.state.load(std::memory_order_acquire) == CacheState::Clean) {
+				value = entry.value;
+			}
+			share->values.try_emplace(vertex, std::move(value));
+		}
+		share->source = nullptr;
+		share->next = inherited_cache_;
+	}
+	locks.clear();
+	cache_shares_.clear();
+}
+
+std::optional<CellInterface::Value> DependenciesManager::FindSharedValue(Position vertex) const {
+	auto it = vertex_to_cache_.find(vertex);
+	if (it != vertex_to_cache_.end()) {
+		if (it->second.state.load(std::memory_order_acquire) != CacheState::Clean) {
+			return std::nullopt;
+		}
+		return it->second.value;
+	}
+	if (inherited_cache_ != nullptr) {
+		//a formula not copied yet: its value is the one of the sheet it was copied from
+		return FindSharedValue(*inherited_cache_, vertex);
+	}
+	return std::nullopt;
+}
+
+std::optional<CellInterface::Value> DependenciesManager::FindSharedValue(CacheShare& share, Position vertex) {
+	//the shares are locked from the forks to the sheets they were forked from
+	std::lock_guard<std::mutex> lock(share.mutex);
+	auto it = share.values.find(vertex);
+	if (it != share.values.end()) {
+		return it->second;
+	}
+	if (share.source != nullptr) {
+		return share.source->FindSharedValue(vertex);
+	}
+	if (share.next != nullptr) {
+		return FindSharedValue(*share.next, vertex);
+	}
+	return std::nullopt;
+}
+
+Graph& DependenciesManager::GetGraphForUpdate() {
+	OnGraphChanged();
+	if (dependencies_graph.use_count() > 1) {
+		dependencies_graph = std::make_shared<Graph>(*dependencies_graph);
+		dependencies_graph->SetCounters(&counters_);
+	}
+	return *dependencies_graph;
+}
+
+bool DependenciesManager::TryAddNewVertex(Position vertex, PositionSpan parents) {
+	if (parents.size() == 0) {
+		//no-dependencies
+		return true;
+	}
+	{
+		StatsTimer cycle_check_timer([this](std::uint64_t nanoseconds) {
+			counters_.OnPhase(SheetCounters::Phase::CycleCheck, nanoseconds);
+			});
+		//the graph is acyclic: a cycle would go from vertex to one of its parents
+		//(the iterative calculation accepts the cycles)
+		if (!iterative_ && dependencies_graph->Reaches(vertex, parents)) {
+			return false;
+		}
+	}
+	GetGraphForUpdate().SetParents(vertex, parents);
+	return true;
+}
+
+bool DependenciesManager::TryUpdateVertex(Position vertex, PositionSpan parents) {
+	{
+		StatsTimer cycle_check_timer([this](std::uint64_t nanoseconds) {
+			counters_.OnPhase(SheetCounters::Phase::CycleCheck, nanoseconds);
+			});
+		//the graph is acyclic: a cycle would go through the new edges, from vertex
+		//to one of its parents (the graph is checked before the change); a cell
+		//without parents closes no cycle
+		if (!iterative_ && parents.size() > 0 && dependencies_graph->Reaches(vertex, parents)) {
+			return false;
+		}
+	}
+	// 1.Update the parents.
+	// 2.Invalidate cache.
+	if (parents.size() > 0 || dependencies_graph->HasParents(vertex)) {
+		//a text cell without parents before leaves the (maybe shared) graph alone
+		GetGraphForUpdate().SetParents(vertex, parents);
+	}
+	InvalidateCache(vertex);
+	return true;
+}
+
+bool DependenciesManager::IsInCache(Position pos) const {
+	auto it = vertex_to_cache_.find(pos);
+	if (it == vertex_to_cache_.end()) {
+		return false;
+	}
+	return it->second.state.load(std::memory_order_acquire) == CacheState::Clean;
+}
+
+bool DependenciesManager::IsDirty(Position pos) const {
+	auto it = vertex_to_cache_.find(pos);
+	if (it == vertex_to_cache_.end()) {
+		return false;
+	}
+	return it->second.state.load(std::memory_order_acquire) != CacheState::Clean;
+}
+
+CellInterface::Value DependenciesManager::GetCache(Position pos) const {
+	return *vertex_to_cache_.at(pos).value;
+}
+
+std::optional<CachedValue> DependenciesManager::PeekCache(Position pos) {
+	auto it = vertex_to_cache_.find(pos);
+	if (it == vertex_to_cache_.end()) {
+		return std::nullopt;
+	}
+	CacheEntry& entry = it->second;
+	CacheState state = entry.state.load(std::memory_order_acquire);
+	while (true) {
+		if (state == CacheState::Clean) {
+			return CachedValue{ *entry.value, false };
+		}
+		if (state == CacheState::Dirty) {
+			//the value is read while this thread owns the entry: no evaluation writes it meanwhile
+			if (entry.state.compare_exchange_weak(state, CacheState::Computing, std::memory_order_acquire)) {
+				std::optional<CachedValue> cached;
+				if (entry.value.has_value()) {
+					cached = CachedValue{ *entry.value, true };
+				}
+				PublishCache(pos, entry, CacheState::Dirty);
+				return cached;
+			}
+		}
+		else {
+			WaitWhileComputing(pos, entry);
+			state = entry.state.load(std::memory_order_acquire);
+		}
+	}
+}
+
+std::vector<Position> DependenciesManager::GetDirtyVertices() const {
+	std::vector<Position> vertices;
+	for (const auto& [vertex, entry] : vertex_to_cache_) {
+		if (entry.state.load(std::memory_order_acquire) != CacheState::Clean) {
+			vertices.push_back(vertex.ToPosition());
+		}
+	}
+	std::sort(vertices.begin(), vertices.end());
+	return vertices;
+}
+
+size_t DependenciesManager::GetCacheSize() const {
+	return vertex_to_cache_.size();
+}
+
+void DependenciesManager::RegisterVertex(Position vertex) {
+	auto locks = LockCacheShares();
+	vertex_to_cache_.try_emplace(vertex);
+}
+
+void DependenciesManager::InheritVertex(Position vertex) {
+	auto locks = LockCacheShares();
+	InheritSlot(vertex);
+}
+
+void DependenciesManager::InheritSlot(Position vertex) {
+	auto [it, inserted] = vertex_to_cache_.try_emplace(vertex);
+	if (!inserted || inherited_cache_ == nullptr) {
+		return;
+	}
+	if (std::optional<CellInterface::Value> value = FindSharedValue(*inherited_cache_, vertex)) {
+		it->second.value = std::move(value);
+		it->second.state.store(CacheState::Clean, std::memory_order_relaxed);
+	}
+}
+
+void DependenciesManager::ReleaseInheritedCache() {
+	auto locks = LockCacheShares();
+	//the shares of the forks only read the slots of this manager from now on
+	inherited_cache_ = nullptr;
+}
+
+void DependenciesManager::UnregisterVertex(Position vertex) {
+	auto locks = LockCacheShares();
+	if (!cache_shares_.empty()) {
+		PreserveSharedValues({ vertex });
+	}
+	vertex_to_cache_.erase(vertex);
+}
+
+size_t DependenciesManager::GetWaitSlot(Position pos) const {
+	return PositionHasher{}(pos) % WAIT_SLOTS;
+}
+
+void DependenciesManager::WaitWhileComputing(Position pos, const CacheEntry& entry) {
+	size_t slot = GetWaitSlot(pos);
+	std::unique_lock<std::mutex> lock(wait_mutexes_[slot]);
+	wait_conditions_[slot].wait(lock, [&entry]() {
+		return entry.state.load(std::memory_order_acquire) != CacheState::Computing;
+		});
+}
+
+bool DependenciesManager::StoreCache(Position pos, CellInterface::Value value) {
+	auto it = vertex_to_cache_.find(pos);
+	if (it == vertex_to_cache_.end()) {
+		return false;
+	}
+	CacheEntry& entry = it->second;
+	CacheState state = CacheState::Dirty;
+	if (!entry.state.compare_exchange_strong(state, CacheState::Computing, std::memory_order_acquire)) {
+		return false;
+	}
+	entry.value = std::move(value);
+	PublishCache(pos, entry, CacheState::Clean);
+	return true;
+}
+
+void DependenciesManager::PublishCache(Position pos, CacheEntry& entry, CacheState state) {
+	size_t slot = GetWaitSlot(pos);
+	{
+		//taking the lock guarantees that a waiting thread is either already
+		//blocked on the condition or will see the new state
+		std::lock_guard<std::mutex> lock(wait_mutexes_[slot]);
+		entry.state.store(state, std::memory_order_release);
+	}
+	wait_conditions_[slot].notify_all();
+}
+
+void DependenciesManager::InvalidateCache(Position vertex) {
+	InvalidateCache(PositionSpan(&vertex, 1));
+}
+
+void DependenciesManager::InvalidateCache(PositionSpan vertices) {
+	StatsTimer invalidate_timer([this](std::uint64_t nanoseconds) {
+		counters_.OnPhase(SheetCounters::Phase::Invalidate, nanoseconds);
+		});
+	auto locks = LockCacheShares();
+	if (!cache_shares_.empty() || inherited_cache_ != nullptr) {
+		std::vector<Position> downstream = GetDownstream(std::vector<Position>(vertices.begin(), vertices.end()));
+		//the forks keep the values from before the change
+		PreserveSharedValues(downstream);
+		if (inherited_cache_ != nullptr) {
+			//the dependents not copied yet get their slot to become dirty (the edited
+			//cells themselves were copied by the edit)
+			std::unordered_set<PositionKey, PositionHasher> edited(vertices.begin(), vertices.end());
+			for (Position vertex : downstream) {
+				if (edited.count(vertex) == 0) {
+					InheritSlot(vertex);
+				}
+			}
+		}
+	}
+	size_t invalidated = dependencies_graph->TranverseGraphAndInvalidateCache(vertices, vertex_to_cache_, change_log_);
+	counters_.OnEditInvalidated(invalidated);
+}
+
+void DependenciesManager::SetChangeLog(std::vector<Position>* change_log) {
+	change_log_ = change_log;
+}
+
+bool DependenciesManager::HasDependents(Position vertex) const {
+	return dependencies_graph->HasChilds(vertex);
+}
+
+std::vector<Position> DependenciesManager::GetDependentCells(const std::vector<Position>& vertices) const {
+	std::unordered_set<PositionKey, PositionHasher> dependents;
+	for (Position vertex : vertices) {
+		dependencies_graph->ForEachChild(vertex, [&dependents](Position child) {
+			dependents.insert(child);
+			});
+	}
+	std::vector<Position> result;
+	result.reserve(dependents.size());
+	for (PositionKey dependent : dependents) {
+		result.push_back(dependent.ToPosition());
+	}
+	return result;
+}
+
+std::vector<Position> DependenciesManager::GetDownstream(const std::vector<Position>& vertices) const {
+	//depth-first search without recursion: a vertex is appended after all its childs,
+	//the reversed order puts it before them
+	std::unordered_set<PositionKey, PositionHasher> visited;
+	std::vector<Position> order;
+	//vertices being visited with their childs left to visit
+	std::vector<std::pair<Position, std::vector<Position>>> stack;
+	for (Position vertex : vertices) {
+		if (!visited.insert(vertex).second) {
+			continue;
+		}
+		stack.push_back({ vertex, dependencies_graph->GetChilds(vertex) });
+		while (!stack.empty()) {
+			std::vector<Position>& childs = stack.back().second;
+			if (childs.empty()) {
+				order.push_back(stack.back().first);
+				stack.pop_back();
+				continue;
+			}
+			Position child = childs.back();
+			childs.pop_back();
+			if (visited.insert(child).second) {
+				stack.push_back({ child, dependencies_graph->GetChilds(child) });
+			}
+		}
+	}
+	std::reverse(order.begin(), order.end());
+	return order;
+}
+
+std::vector<Position> DependenciesManager::GetPrecedents(Position vertex, bool transitive) const {
+	if (transitive) {
+		return GetReachabilityIndex()->Collect(vertex, false);
+	}
+	return dependencies_graph->GetParents(vertex);
+}
+
+std::vector<Position> DependenciesManager::GetDependents(Position vertex, bool transitive) const {
+	if (transitive) {
+		return GetReachabilityIndex()->Collect(vertex, true);
+	}
+	std::vector<Position> result = dependencies_graph->GetChilds(vertex);
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+DependenciesManager::ReachabilityIndex::ReachabilityIndex(const Graph& graph) {
+	graph.ForEachVertex([this](Position vertex) {
+		vertices.push_back(vertex);
+		});
+	std::sort(vertices.begin(), vertices.end());
+	vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+	ids.reserve(vertices.size());
+	for (std::uint32_t id = 0; id < vertices.size(); ++id) {
+		ids.emplace(vertices[id], id);
+	}
+	//childs in order, then the parents counted and placed by a counting sort
+	child_offsets.reserve(vertices.size() + 1);
+	parent_offsets.assign(vertices.size() + 1, 0);
+	for (Position vertex : vertices) {
+		child_offsets.push_back(static_cast<std::uint32_t>(childs.size()));
+		graph.ForEachChild(vertex, [this](Position child) {
+			std::uint32_t child_id = ids.at(child);
+			childs.push_back(child_id);
+			++parent_offsets[child_id + 1];
+			});
+	}
+	child_offsets.push_back(static_cast<std::uint32_t>(childs.size()));
+	for (size_t id = 0; id < vertices.size(); ++id) {
+		parent_offsets[id + 1] += parent_offsets[id];
+	}
+	parents.resize(childs.size());
+	std::vector<std::uint32_t> next_parent(parent_offsets.begin(), parent_offsets.end() - 1);
+	for (std::uint32_t id = 0; id < vertices.size(); ++id) {
+		for (std::uint32_t edge = child_offsets[id]; edge < child_offsets[id + 1]; ++edge) {
+			parents[next_parent[childs[edge]]++] = id;
+		}
+	}
+}
+
+std::vector<Position> DependenciesManager::ReachabilityIndex::Collect(Position vertex, bool forward) const {
+	std::vector<Position> result;
+	auto it = ids.find(vertex);
+	if (it == ids.end()) {
+		return result;
+	}
+	const std::vector<std::uint32_t>& offsets = forward ? child_offsets : parent_offsets;
+	const std::vector<std::uint32_t>& edges = forward ? childs : parents;
+	std::vector<std::uint64_t> reached((vertices.size() + 63) / 64);
+	std::vector<std::uint32_t> pending = { it->second };
+	size_t reached_count = 0;
+	while (!pending.empty()) {
+		std::uint32_t id = pending.back();
+		pending.pop_back();
+		for (std::uint32_t edge = offsets[id]; edge < offsets[id + 1]; ++edge) {
+			std::uint32_t next = edges[edge];
+			std::uint64_t bit = std::uint64_t{ 1 } << (next % 64);
+			if ((reached[next / 64] & bit) == 0) {
+				reached[next / 64] |= bit;
+				++reached_count;
+				pending.push_back(next);
+			}
+		}
+	}
+	//the ids follow the positions: the bitset is read back sorted
+	result.reserve(reached_count);
+	for (size_t word = 0; word < reached.size(); ++word) {
+		std::uint64_t bits = reached[word];
+		for (size_t bit = 0; bits != 0; ++bit, bits >>= 1) {
+			if ((bits & 1) != 0) {
+				result.push_back(vertices[word * 64 + bit]);
+			}
+		}
+	}
+	return result;
+}
+
+std::shared_ptr<const DependenciesManager::ReachabilityIndex> DependenciesManager::GetReachabilityIndex() const {
+	std::lock_guard<std::mutex> lock(reachability_mutex_);
+	if (reachability_ == nullptr) {
+		reachability_ = std::make_shared<const ReachabilityIndex>(*dependencies_graph);
+	}
+	return reachability_;
+}
+
+void DependenciesManager::OnGraphChanged() {
+	cycles_outdated_ = true;
+	std::lock_guard<std::mutex> lock(reachability_mutex_);
+	reachability_ = nullptr;
+}
+
+void DependenciesManager::RenameVertices(const std::vector<Position>& vertices, const LineShift& shift) {
+	std::unordered_map<PositionKey, Position, PositionHasher> renames;
+	for (Position vertex : vertices) {
+		Position new_vertex = shift(vertex);
+		if (!(new_vertex == vertex)) {
+			renames[vertex] = new_vertex;
+		}
+	}
+	if (renames.empty()) {
+		return;
+	}
+	//the shares are keyed by the positions before the move
+	DetachCacheShares();
+	inherited_cache_ = nullptr;
+
+	//1. Edges.
+	GetGraphForUpdate().RenameVertices(renames, shift);
+
+	//2. Keys of the cache.
+	std::vector<CacheStorage::node_type> cache_nodes;
+	for (const auto& [old_vertex, new_vertex] : renames) {
+		auto cache_node = vertex_to_cache_.extract(old_vertex);
+		if (!cache_node.empty()) {
+			cache_node.key() = new_vertex;
+			cache_nodes.push_back(std::move(cache_node));
+		}
+	}
+	for (auto& node : cache_nodes) {
+		vertex_to_cache_.insert(std::move(node));
+	}
+}
+
+void DependenciesManager::RemoveVertices(const std::vector<Position>& vertices) {
+	if (vertices.empty()) {
+		return;
+	}
+	DetachCacheShares();
+	inherited_cache_ = nullptr;
+	Graph& graph = GetGraphForUpdate();
+	for (Position vertex : vertices) {
+		graph.RemoveVertex(vertex);
+		vertex_to_cache_.erase(vertex);
+	}
+}
+
+SheetCounters& DependenciesManager::GetCounters() {
+	return counters_;
+}
+
+FormulaProfiler& DependenciesManager::GetProfiler() {
+	return profiler_;
+}
+
+void DependenciesManager::FillStats(SheetStats& stats) const {
+	counters_.FillStats(stats);
+	dependencies_graph->FillStats(stats);
+}
+
+bool DependenciesManager::SetIterative(bool enabled, int max_iterations, double epsilon) {
+	if (!enabled && iterative_ && dependencies_graph->IsCyclic()) {
+		return false;
+	}
+	iterative_ = enabled;
+	max_iterations_ = std::max(max_iterations, 1);
+	epsilon_ = epsilon;
+	return true;
+}
+
+bool DependenciesManager::IsIterative() const {
+	return iterative_;
+}
+
+namespace {
+//Change of the value of a formula between two iterations.
+double GetChange(const CellInterface::Value& before, const CellInterface::Value& after) {
+	const double* before_number = std::get_if<double>(&before);
+	const double* after_number = std::get_if<double>(&after);
+	if (before_number != nullptr && after_number != nullptr) {
+		return std::fabs(*after_number - *before_number);
+	}
+	return before == after ? 0 : INFINITY;
+}
+}  // namespace
+
+void DependenciesManager::SolveCycle(Position pos, const std::function<CellInterface::Value(Position)>& evaluate) {
+	auto entry_it = vertex_to_cache_.find(pos);
+	if (entry_it == vertex_to_cache_.end() || entry_it->second.state.load(std::memory_order_acquire) == CacheState::Clean) {
+		//an edit invalidates all the cells of a cycle: one clean cell means a clean cycle
+		return;
+	}
+	UpdateCycles();
+	auto cycle_it = vertex_to_cycle_.find(pos);
+	if (cycle_it == vertex_to_cycle_.end()) {
+		return;
+	}
+	Cycle& cycle = cycles_[cycle_it->second];
+	if (cycle.solving) {
+		return;
+	}
+	cycle.solving = true;
+
+	const std::vector<Position>& cells = cycle.status.cells;
+	std::vector<CacheEntry*> entries;
+	entries.reserve(cells.size());
+	for (size_t i = 0; i < cells.size(); ++i) {
+		CacheEntry& entry = vertex_to_cache_[cells[i]];
+		entry.value = i < cycle.values.size() ? cycle.values[i] : CellInterface::Value(0.0);
+		entry.state.store(CacheState::Clean, std::memory_order_release);
+		entries.push_back(&entry);
+	}
+	CycleStatus& status = cycle.status;
+	status.converged = false;
+	status.iterations = 0;
+	status.max_change = 0;
+	try {
+		//Gauss-Seidel: a formula reads the values of this iteration of the formulas before it
+		while (!status.converged && status.iterations < max_iterations_) {
+			++status.iterations;
+			status.max_change = 0;
+			for (size_t i = 0; i < cells.size(); ++i) {
+				CellInterface::Value value = evaluate(cells[i]);
+				status.max_change = std::max(status.max_change, GetChange(*entries[i]->value, value));
+				entries[i]->value = std::move(value);
+			}
+			status.converged = status.max_change <= epsilon_;
+		}
+	}
+	catch (...) {
+		for (CacheEntry* entry : entries) {
+			entry->value = std::nullopt;
+			entry->state.store(CacheState::Dirty, std::memory_order_release);
+		}
+		cycle.values.clear();
+		cycle.solving = false;
+		throw;
+	}
+	cycle.values.clear();
+	for (CacheEntry* entry : entries) {
+		cycle.values.push_back(*entry->value);
+	}
+	cycle.solving = false;
+}
+
+bool DependenciesManager::IsInCycle(Position pos) {
+	if (!iterative_) {
+		return false;
+	}
+	UpdateCycles();
+	return vertex_to_cycle_.count(pos) > 0;
+}
+
+std::vector<CycleStatus> DependenciesManager::GetCycleStatus() {
+	std::vector<CycleStatus> result;
+	if (!iterative_) {
+		return result;
+	}
+	UpdateCycles();
+	for (const Cycle& cycle : cycles_) {
+		result.push_back(cycle.status);
+	}
+	return result;
+}
+
+void DependenciesManager::UpdateCycles() {
+	if (!cycles_outdated_) {
+		return;
+	}
+	cycles_outdated_ = false;
+	std::vector<Cycle> old_cycles = std::move(cycles_);
+	std::unordered_map<PositionKey, size_t, PositionHasher> old_vertex_to_cycle = std::move(vertex_to_cycle_);
+	cycles_.clear();
+	vertex_to_cycle_.clear();
+
+	//Tarjan's algorithm without recursion: the stack holds the vertices being
+	//visited and the next child to visit for each of them
+	struct VertexState {
+		size_t index;
+		size_t lowlink;
+		bool on_stack;
+	};
+	const Graph& graph = *dependencies_graph;
+	std::unordered_map<PositionKey, VertexState, PositionHasher> states;
+	std::vector<Position> component_stack;
+	struct Frame {
+		Position vertex;
+		std::vector<Position> childs;
+		size_t next_child = 0;
+	};
+	std::vector<Frame> stack;
+	size_t next_index = 0;
+	auto visit = [&](Position vertex) {
+		states[vertex] = VertexState{ next_index, next_index, true };
+		++next_index;
+		component_stack.push_back(vertex);
+		stack.push_back(Frame{ vertex, graph.GetChilds(vertex) });
+	};
+	graph.ForEachVertex([&](Position root) {
+		if (states.count(root) > 0) {
+			return;
+		}
+		visit(root);
+		while (!stack.empty()) {
+			Position vertex = stack.back().vertex;
+			if (stack.back().next_child < stack.back().childs.size()) {
+				Position child = stack.back().childs[stack.back().next_child++];
+				auto child_it = states.find(child);
+				if (child_it == states.end()) {
+					visit(child);
+				}
+				else if (child_it->second.on_stack) {
+					VertexState& state = states.at(vertex);
+					state.lowlink = std::min(state.lowlink, child_it->second.index);
+				}
+				continue;
+			}
+			const std::vector<Position> childs = std::move(stack.back().childs);
+			stack.pop_back();
+			const VertexState state = states.at(vertex);
+			if (!stack.empty()) {
+				VertexState& parent_state = states.at(stack.back().vertex);
+				parent_state.lowlink = std::min(parent_state.lowlink, state.lowlink);
+			}
+			if (state.lowlink != state.index) {
+				continue;
+			}
+			//vertex is the root of a component: its vertices are on top of it
+			std::vector<Position> cells;
+			Position member;
+			do {
+				member = component_stack.back();
+				component_stack.pop_back();
+				states.at(member).on_stack = false;
+				cells.push_back(member);
+			} while (!(member == vertex));
+			bool is_cycle = cells.size() > 1
+				|| std::find(childs.begin(), childs.end(), vertex) != childs.end();
+			if (!is_cycle) {
+				continue;
+			}
+			std::sort(cells.begin(), cells.end());
+			Cycle cycle;
+			auto old_it = old_vertex_to_cycle.find(cells.front());
+			if (old_it != old_vertex_to_cycle.end() && old_cycles[old_it->second].status.cells == cells) {
+				cycle = std::move(old_cycles[old_it->second]);
+			}
+			else {
+				cycle.status.cells = std::move(cells);
+			}
+			cycles_.push_back(std::move(cycle));
+		}
+	});
+	std::sort(cycles_.begin(), cycles_.end(), [](const Cycle& lhs, const Cycle& rhs) {
+		return lhs.status.cells.front() < rhs.status.cells.front();
+	});
+	for (size_t i = 0; i < cycles_.size(); ++i) {
+		for (Position cell : cycles_[i].status.cells) {
+			vertex_to_cycle_[cell] = i;
+		}
+	}
+}
+
+
+//Types of cells 
+
+CellPayload::CellPayload() {
+	std::memset(bytes_, 0, sizeof(bytes_));
+}
+
+CellPayload::CellPayload(CellPayload&& other) noexcept {
+	std::memcpy(bytes_, other.bytes_, sizeof(bytes_));
+	std::memset(other.bytes_, 0, sizeof(other.bytes_));
+}
+
+CellPayload& CellPayload::operator=(CellPayload&& other) noexcept {
+	if (this != &other) {
+		Reset();
+		std::memcpy(bytes_, other.bytes_, sizeof(bytes_));
+		std::memset(other.bytes_, 0, sizeof(other.bytes_));
+	}
+	return *this;
+}
+
+CellPayload::~CellPayload() {
+	Reset();
+}
+
+void CellPayload::Reset() {
+	if (GetKind() == Kind::Formula) {
+		delete static_cast<FormulaCellData*>(GetPointer());
+	}
+	std::memset(bytes_, 0, sizeof(bytes_));
+}
+
+void CellPayload::SetText(std::string_view text, TextPool& texts) {
+	Reset();
+	if (text.size() <= SHORT_TEXT_CAPACITY) {
+		std::memcpy(bytes_, text.data(), text.size());
+		bytes_[SIZE_BYTE] = static_cast<unsigned char>(text.size());
+		SetKind(Kind::ShortText);
+		return;
+	}
+	//the pool owns the text, the payload only keeps its handle
+	SetPointer(const_cast<char*>(texts.Intern(text)));
+	SetKind(Kind::LongText);
+}
+
+void CellPayload::CopyText(const CellPayload& other) {
+	assert(other.GetKind() != Kind::Formula);
+	Reset();
+	std::memcpy(bytes_, other.bytes_, sizeof(bytes_));
+}
+
+void CellPayload::SetFormula(std::unique_ptr<FormulaCellData> formula) {
+	Reset();
+	SetPointer(formula.release());
+	SetKind(Kind::Formula);
+}
+
+void CellPayload::SetError(FormulaError error) {
+	Reset();
+	bytes_[0] = static_cast<unsigned char>(error.GetCategory());
+	SetKind(Kind::Error);
+}
+
+CellPayload::Kind CellPayload::GetKind() const {
+	return static_cast<Kind>(bytes_[KIND_BYTE]);
+}
+
+std::string_view CellPayload::GetTextView() const {
+	if (GetKind() == Kind::ShortText) {
+		return std::string_view(reinterpret_cast<const char*>(bytes_), bytes_[SIZE_BYTE]);
+	}
+	if (GetKind() == Kind::LongText) {
+		return TextPool::GetText(static_cast<const char*>(GetPointer()));
+	}
+	if (GetKind() == Kind::Error) {
+		return GetError().ToString();
+	}
+	return {};
+}
+
+FormulaCellData* CellPayload::GetFormulaData() const {
+	if (GetKind() != Kind::Formula) {
+		return nullptr;
+	}
+	return static_cast<FormulaCellData*>(GetPointer());
+}
+
+FormulaError CellPayload::GetError() const {
+	assert(GetKind() == Kind::Error);
+	return FormulaError(static_cast<FormulaError::Category>(bytes_[0]));
+}
+
+size_t CellPayload::GetHeapBytes() const {
+	return GetKind() == Kind::Formula ? sizeof(FormulaCellData) : 0;
+}
+
+void CellPayload::SetKind(Kind kind) {
+	bytes_[KIND_BYTE] = static_cast<unsigned char>(kind);
+}
+
+void* CellPayload::GetPointer() const {
+	void* pointer;
+	std::memcpy(&pointer, bytes_, sizeof(pointer));
+	return pointer;
+}
+
+void CellPayload::SetPointer(void* pointer) {
+	std::memcpy(bytes_, &pointer, sizeof(pointer));
+}
+
+
+
+Cell::~Cell() {
+}
+
+Cell::Cell() {
+}
+
+
+void Cell::Set(std::string text, const CellContext& context) {
+	//1. Parse the formula.
+	CellPayload payload;
+	{
+		bool is_formula = text.size() > 1 && text[0] == FORMULA_SIGN;
+		SheetCounters& counters = context.manager.GetCounters();
+		StatsTimer parse_timer([&counters, is_formula](std::uint64_t nanoseconds) {
+			counters.OnPhase(SheetCounters::Phase::Parse, nanoseconds);
+			if (is_formula) {
+				counters.OnFormulaParsed(nanoseconds);
+			}
+			});
+		if (is_formula) {
+			auto data = std::make_unique<FormulaCellData>();
+			data->formula = ParseFormula(text.substr(1));
+			data->sheet = &context.sheet;
+			data->manager = &context.manager;
+			data->pos = context.pos;
+			payload.SetFormula(std::move(data));
+		}
+		else if (!text.empty()) {
+			payload.SetText(text, context.texts);
+		}
+	}
+	Replace(std::move(payload), context);
+}
+
+void Cell::Set(std::unique_ptr<FormulaInterface> formula, const CellContext& context) {
+	auto data = std::make_unique<FormulaCellData>();
+	data->formula = std::move(formula);
+	data->sheet = &context.sheet;
+	data->manager = &context.manager;
+	data->pos = context.pos;
+	CellPayload payload;
+	payload.SetFormula(std::move(data));
+	Replace(std::move(payload), context);
+}
+
+void Cell::Replace(CellPayload&& payload, const CellContext& context) {
+	//2. Check if the dependencies in the formula are valid.
+	PositionSpan parents;
+	if (const FormulaCellData* data = payload.GetFormulaData()) {
+		parents = data->formula->GetReferencedCellsSpan();
+	}
+	CheckValidDependencies(parents, context);
+	if (payload.GetFormulaData() != nullptr) {
+		//only the formulas are cached
+		context.manager.RegisterVertex(context.pos);
+	}
+	else if (payload_.GetFormulaData() != nullptr) {
+		//the formula is freed below: so is its slot, the cell is not evaluated anymore
+		context.manager.UnregisterVertex(context.pos);
+	}
+	//3. Transfer ownership of formula to current object.
+	payload_ = std::move(payload);
+}
+
+void Cell::CheckValidDependencies(PositionSpan parents, const CellContext& context) {
+	const CellInterface* current_cell = context.sheet.GetCell(context.pos);
+	bool valid_dependencies;
+	if (current_cell == nullptr) {
+		//this is a new cell, no invalidation possible
+		valid_dependencies = context.manager.TryAddNewVertex(context.pos, parents);
+	}
+	else {
+		//here we are overwriting an already existing cell
+		//need to invalidate cash
+		valid_dependencies = context.manager.TryUpdateVertex(context.pos, parents);
+	}
+	if (!valid_dependencies) {
+		throw CircularDependencyException("Circular dependency");
+	}
+}
+
+void Cell::Clear(const CellContext& context) {
+	Set("", context);
+}
+
+std::string FormatNumber(double value) {
+	char buffer[32];
+	auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+	assert(error == std::errc());
+	return std::string(buffer, end);
+}
+
+bool Cell::SetNumber(double value, TextPool& texts) {
+	assert(payload_.GetFormulaData() == nullptr);
+	std::string text = FormatNumber(value);
+	if (payload_.GetKind() != CellPayload::Kind::Empty && payload_.GetTextView() == text) {
+		return false;
+	}
+	payload_.SetText(text, texts);
+	return true;
+}
+
+bool Cell::SetError(FormulaError error) {
+	assert(payload_.GetFormulaData() == nullptr);
+	if (payload_.GetKind() == CellPayload::Kind::Error && payload_.GetError() == error) {
+		return false;
+	}
+	payload_.SetError(error);
+	return true;
+}
+
+void Cell::Restore(std::string_view text, TextPool& texts) {
+	if (!text.empty()) {
+		payload_.SetText(text, texts);
+	}
+}
+
+void Cell::SetPosition(Position pos) {
+	if (FormulaCellData* data = payload_.GetFormulaData()) {
+		data->pos = pos;
+	}
+}
+
+void Cell::Share(const Cell& other) {
+	const FormulaCellData* other_data = other.payload_.GetFormulaData();
+	if (other_data == nullptr) {
+		payload_.CopyText(other.payload_);
+		return;
+	}
+	payload_.SetFormula(std::make_unique<FormulaCellData>(*other_data));
+}
+
+void Cell::Bind(const CellContext& context) {
+	if (FormulaCellData* data = payload_.GetFormulaData()) {
+		data->sheet = &context.sheet;
+		data->manager = &context.manager;
+		data->pos = context.pos;
+	}
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+	const FormulaCellData* data = payload_.GetFormulaData();
+	return data == nullptr ? nullptr : data->formula.get();
+}
+
+FormulaInterface* Cell::GetFormulaForUpdate() {
+	FormulaCellData* data = payload_.GetFormulaData();
+	if (data == nullptr) {
+		return nullptr;
+	}
+	if (data->formula.use_count() > 1) {
+		//shared with a fork: the other cells keep the formula as it is
+		data->formula = data->formula->Clone();
+	}
+	return data->formula.get();
+}
+
+const CellPayload& Cell::GetPayload() const {
+	return payload_;
+}
+
+
+namespace {
+//Visible text of a text cell: the escape sign is dropped.
+std::string_view GetVisibleText(std::string_view text) {
+	if (!text.empty() && text[0] == ESCAPE_SIGN) {
+		text.remove_prefix(1);
+	}
+	return text;
+}
+}  // namespace
+
+CellInterface::Value Cell::GetValue() const {
+	if (payload_.GetKind() == CellPayload::Kind::Error) {
+		return payload_.GetError();
+	}
+	const FormulaCellData* data = payload_.GetFormulaData();
+	if (data == nullptr) {
+		//texts are not cached: their value is read from the payload
+		return std::string(GetVisibleText(payload_.GetTextView()));
+	}
+	if (data->manager->IsIterative()) {
+		//the formulas of a cycle are evaluated together
+		data->manager->SolveCycle(data->pos, [sheet = data->sheet](Position pos) {
+			//the cells of a cycle are formulas of the sheet
+			return static_cast<const Cell*>(sheet->GetCell(pos))->EvaluateFormula();
+			});
+	}
+	return data->manager->GetOrComputeCache(data->pos, [this]() {
+		return EvaluateFormula();
+		});
+}
+
+CellInterface::Value Cell::EvaluateFormula() const {
+	//an edit interrupts the background recalculation here
+	RecalcWorker::ThrowIfCancelled();
+	const FormulaCellData* data = payload_.GetFormulaData();
+	data->manager->GetCounters().OnFormulaEvaluated();
+	FormulaProfiler::Scope profile_scope(data->manager->GetProfiler(), data->pos);
+	FormulaInterface::Value evaluation = data->formula->Evaluate(*data->sheet);
+	if (auto* value = std::get_if<double>(&evaluation)) {
+		return CellInterface::Value(*value);
+	}
+	return CellInterface::Value(std::get<FormulaError>(evaluation));
+}
+
+std::string Cell::GetText() const {
+	return std::string(GetTextView());
+}
+
+std::vector<Position> Cell::GetReferencedCells() const {
+	PositionSpan cells = GetReferencedCellsSpan();
+	return std::vector<Position>(cells.begin(), cells.end());
+}
+
+CellInterface::ValueView Cell::GetValueView() const {
+	if (payload_.GetKind() == CellPayload::Kind::Error) {
+		return payload_.GetError();
+	}
+	if (payload_.GetFormulaData() == nullptr) {
+		return GetVisibleText(payload_.GetTextView());
+	}
+	//the value of a formula is a number or an error: copying it does not allocate
+	Value value = GetValue();
+	if (const double* number = std::get_if<double>(&value)) {
+		return *number;
+	}
+	return std::get<FormulaError>(value);
+}
+
+std::string_view Cell::GetTextView() const {
+	if (const FormulaCellData* data = payload_.GetFormulaData()) {
+		return data->formula->GetCanonicalText();
+	}
+	return payload_.GetTextView();
+}
+
+PositionSpan Cell::GetReferencedCellsSpan() const {
+	if (const FormulaCellData* data = payload_.GetFormulaData()) {
+		return data->formula->GetReferencedCellsSpan();
+	}
+	return {};
+}
+
+void Cell::PrintValue(std::ostream& output) const {
+	std::visit(
+		[&](const auto& x) {
+			output << x;
+		},
+		GetValueView());
+}
+
+void Cell::PrintText(std::ostream& output) const {
+	output << GetTextView();
+}
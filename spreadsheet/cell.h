@@ -1,200 +1,727 @@
-#pragma once
-
-#include "common.h"
-#include "formula.h"
-#include "unordered_map"
-#include "optional"
-#include <algorithm>
-
-//Hasher of a Position instance: needed in the graph+cache implementation.
-
-struct PositionHasher {
-    size_t operator()(const Position& pos) const {
-        return static_cast<size_t>(pos.row + 100000 * pos.col);
-    }
-};
-
-//Implementation of a Graph:
-// * Has a DFS traversal.
-// * Has a Cyclicity check.
-// Has Copy-Ctor + Swap = when we add a new edge/vertex:
-// 1. Make a copy of the graph.
-// 2. Add the edge/vertex.
-// 3. Check if the new graph is cyclic.
-// 4. If not cyclic, swap new and current.
-class Graph {
-public:
-    //Ctor.
-    Graph();
-
-    //Copy ctor:
-    Graph(const Graph& other);
-
-    //Swap the data of two graphs.
-    void Swap(Graph& other);
-
-    //Add edge: the end position contain the start in its formula.
-    //Start: parent.
-    //End: child.
-    void AddEdge(Position start, Position end);
-
-    //When the data is invalidated.
-    void RemoveEdge(Position start, Position end);
-
-    bool IsCyclicRecursive(
-        Position current_vertex,
-        std::unordered_map<Position, bool, PositionHasher>& visited,
-        std::unordered_map<Position, bool, PositionHasher>& recStack) const;
-
-    //Check if the graph is cyclic
-    bool IsCyclic() const;
-
-    //Traverse the graph in Depth-First-Search and apply the method func to 
-    //each traversed node.
-    template<typename Func>
-    void DFS(
-        Position vertex,
-        std::unordered_map<Position, bool, PositionHasher>& visited,
-        Func func);
-
-    //Traverse the graph starting from the invalidated vertex
-    //and invalidate the  
-    void TranverseGraphAndInvalidateCache(
-        Position vertex,
-        std::unordered_map< Position, std::optional<CellInterface::Value>, PositionHasher>& cache_storage);
-
-private:
-    //main graph data
-    std::unordered_map< Position, std::vector<Position>, PositionHasher> vertex_to_childs_;
-    std::vector<Position> vertices_;
-};
-
-
-template<typename Func>
-void Graph::DFS(
-    Position vertex,
-    std::unordered_map<Position, bool, PositionHasher>& visited,
-    Func func) {
-
-    visited[vertex] = true;
-    func(vertex);
-
-    if (vertex_to_childs_.find(vertex) != vertex_to_childs_.end()) {
-
-        std::vector<Position> childs = vertex_to_childs_.at(vertex);
-        for (auto vertex : childs) {
-            if (!visited[vertex]) {
-                DFS(vertex, visited, func);
-            }
-        }
-    }
-}
-
-/// <summary>
-/// Stores the dependencies between the cells:
-/// 1. Keep track of the dependencies of the cells.
-/// 2. Keep track of the values in the cache.
-/// </summary>
-class DependenciesManager {
-public:
-    //Return true: do not lead to cyclic dependencies => add new vertex to graph.
-    //Return false: the addition will lead to a cycle, leave graph intact.
-    bool TryAddNewVertex(Position vertex, const std::vector<Position>& parents);
-
-    //Here, we are updating an already existing vertex in the graph.
-    //Possible modification
-    bool TryUpdateVertex(Position vertex,const std::vector<Position>& parents);
-
-    //Check if pos has a value in the cache.
-    bool IsInCache(Position pos) const;
-
-    CellInterface::Value GetCache(Position pos) const;
-
-    //Add the value in the cache for position.
-    void AddToCache(Position pos, CellInterface::Value value, std::vector<Position> parents);
-
-    //When a vertex is invalidated:
-    //* Remove the edges betwen the vertex and its **parents** from the dependencies.
-    //* Remove the value from the cache.
-    void InvalidateCache(Position vertex);
-
-private:
-
-    //Graph to check for cyclic dependencies.
-    Graph dependencies_graph;
-
-    //Need to keep track of the parents for cache-invalidation.
-    std::unordered_map< Position, std::vector<Position>, PositionHasher> vertex_to_parents_;
-
-    //Value of the cache.
-    std::unordered_map< Position, std::optional<CellInterface::Value>, PositionHasher> vertex_to_cache_;
-};
-
-
-
-
-
-
-//TYPES OF CELLS
-class Impl {
-public:
-    using ImplValue = std::variant<std::string, double, FormulaError>;
-    
-    Impl(std::string expression);
-    virtual ImplValue GetValue() const = 0;
-    virtual std::string GetText() const;
-    virtual std::vector<Position> GetReferencedCells() const;
-
-protected:
-    std::string expression_;
-};
-
-class EmptyImpl : public Impl {
-public:
-    EmptyImpl();
-    ImplValue GetValue() const override;
-};
-
-class TextImpl : public Impl {
-public:
-    TextImpl(std::string text);
-    ImplValue GetValue() const override;
-};
-
-class FormulaImpl : public Impl {
-public:
-    FormulaImpl(std::string formula, const SheetInterface& sheet);
-    ImplValue GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-
-private:
-    std::unique_ptr<FormulaInterface> formula_;
-    const SheetInterface& sheet_;
-};
-
-
-
-
-class Cell : public CellInterface {
-public:
-    ~Cell();
-
-    Cell(const SheetInterface& sheet, DependenciesManager& manager, Position pos);
-
-    void Set(std::string text);
-
-    void Clear();
-
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-
-    void CheckValidDependencies(const std::vector<Position>& parents) const;
-
-private:
-    std::unique_ptr<Impl> impl_;
-    const SheetInterface& sheet_;
-    DependenciesManager& dependencies_manager_;
-    Position pos_;
-};
\ No newline at end of file
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "profiler.h"
+#include "stats.h"
+#include "text_pool.h"
+#include "unordered_map"
+#include "optional"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <unordered_set>
+
+//State of a value in the cache:
+// * Dirty: no valid value, the cell must be evaluated (the value, if any, is
+//   the one before the invalidation: DependenciesManager::PeekCache).
+// * Computing: one thread is evaluating the cell, the others wait for it.
+// * Clean: the cache holds the value of the cell.
+enum class CacheState : char {
+    Dirty,
+    Computing,
+    Clean,
+};
+
+//Cache slot of one cell.
+//The state is atomic so that several threads can read the cache at once,
+//the value is only written by the thread that moved the state to Computing.
+struct CacheEntry {
+    std::atomic<CacheState> state{ CacheState::Dirty };
+    std::optional<CellInterface::Value> value;
+};
+
+//Value of a cell read without evaluating it (Sheet::GetCachedValue).
+struct CachedValue {
+    CellInterface::Value value;
+    //the cell was invalidated since value was computed: the recalculation is pending
+    bool stale = false;
+};
+
+//The tables of the cells are keyed by the packed PositionKey.
+using CacheStorage = std::unordered_map<PositionKey, CacheEntry, PositionHasher>;
+
+class DependenciesManager;
+
+//Clean values of the cache of a manager as they were when its forks shared it
+//(DependenciesManager::ShareDependencies). The forks read them through the source
+//manager as they copy their formulas; the source copies a value here before it
+//changes it (copy-on-write), or all of them when it detaches the share.
+struct CacheShare {
+    std::mutex mutex;
+    //manager holding the values not copied yet, null once detached
+    const DependenciesManager* source = nullptr;
+    //once detached: the share the source read its formulas not copied yet from
+    std::shared_ptr<CacheShare> next;
+    //values copied before the source changed them (nullopt: no clean value)
+    std::unordered_map<PositionKey, std::optional<CellInterface::Value>, PositionHasher> values;
+};
+
+//Cycle of formulas (strongly connected component of the dependencies) accepted
+//by the iterative calculation, and the result of its last evaluation.
+struct CycleStatus {
+    //sorted
+    std::vector<Position> cells;
+    bool converged = false;
+    int iterations = 0;
+    //largest change of a value during the last iteration
+    double max_change = 0;
+};
+
+//Offset of a parent from its child: parent = child + offset.
+struct CellOffset {
+    int rows = 0;
+    int cols = 0;
+
+    bool operator==(CellOffset rhs) const;
+    bool operator<(CellOffset rhs) const;
+};
+
+//Renaming of the cells after rows/columns were inserted or deleted: the cells
+//from the row (column) from on move by delta rows (columns), the others stay.
+struct LineShift {
+    bool rows = true;
+    int from = 0;
+    int delta = 0;
+
+    Position operator()(Position pos) const;
+};
+
+//Implementation of a Graph:
+// * Has a DFS traversal.
+// * Has a Cyclicity check.
+// The edges go from a parent to its childs (the formulas referencing it) and are
+// stored in both directions. The parents of a formula are set all at once (SetParents),
+// the graph does not check them: the DependenciesManager checks first (Reaches) that
+// they make no cycle.
+// Formulas filled down a column (or along a row) whose parents are at the same
+// offsets, like C1:C500000 = A{n}*B{n}, are stored as one run of edges whatever
+// their number. Setting the parents of a formula next to a run with the same
+// offsets extends the run (or joins two runs), changing a formula in the middle
+// of a run splits it.
+class Graph {
+public:
+    //Ctor.
+    Graph();
+
+    //Copy ctor:
+    Graph(const Graph& other);
+
+    //Counters updated by the cycle checks (copied along with the graph).
+    void SetCounters(SheetCounters* counters);
+
+    //Vertices (cells with at least one edge), edges, runs and estimated memory,
+    //with the memory of the same edges stored one by one (computed from the edges).
+    void FillStats(SheetStats& stats) const;
+
+    //Replace the edges from the parents of child (no edge if parents is empty).
+    void SetParents(Position child, PositionSpan parents);
+
+    //Parents of the vertex (sorted), empty if it has none.
+    std::vector<Position> GetParents(Position vertex) const;
+    bool HasParents(Position vertex) const;
+
+    //Childs of the vertex (empty if the vertex has none).
+    std::vector<Position> GetChilds(Position vertex) const;
+    bool HasChilds(Position vertex) const;
+
+    //Call func(child) for every child of the vertex.
+    template<typename Func>
+    void ForEachChild(Position vertex, Func func) const;
+
+    //Call func(vertex) for every vertex: a vertex may be given several times.
+    template<typename Func>
+    void ForEachVertex(Func func) const;
+
+    //Rename the vertices after rows/columns were inserted or deleted: renames holds
+    //the renamed vertices (old name -> new name), shift gives the new name of
+    //any vertex. The runs stay runs where the offsets did not change.
+    void RenameVertices(const std::unordered_map<PositionKey, Position, PositionHasher>& renames,
+        const LineShift& shift);
+
+    //Remove the vertex with its edges from its parents and to its childs.
+    void RemoveVertex(Position vertex);
+
+    //Check if the graph is cyclic
+    bool IsCyclic() const;
+
+    //Check if a path leads from vertex to one of targets (sorted), vertex included:
+    //while the graph is acyclic, targets as the parents of vertex would make a cycle.
+    bool Reaches(Position vertex, PositionSpan targets) const;
+
+    //Traverse the graph in Depth-First-Search (without recursion) and apply
+    //the method func to each traversed node.
+    template<typename Func>
+    void DFS(
+        Position vertex,
+        std::unordered_set<PositionKey, PositionHasher>& visited,
+        Func func) const;
+
+    //Traverse the graph starting from the invalidated vertices (every vertex once)
+    //and invalidate the cache of the traversed vertices.
+    //Return the number of invalidated vertices, append them to invalidated if given.
+    size_t TranverseGraphAndInvalidateCache(
+        PositionSpan vertices,
+        CacheStorage& cache_storage,
+        std::vector<Position>* invalidated = nullptr) const;
+
+private:
+    //Run of count formulas from first, down a column (down) or along a row: the
+    //parents of each of them are at offsets from it.
+    struct Run {
+        Position first;
+        int count = 0;
+        bool down = true;
+        //sorted
+        std::vector<CellOffset> offsets;
+
+        Position GetChild(int index) const;
+    };
+
+    //Runs of one line (column of the down runs, row of the others), by the first
+    //index of their range along the line: the ranges of the childs of the runs of
+    //a line, or the ranges of the parents at one offset from them.
+    using LineRuns = std::map<int, size_t>;
+    struct ParentRuns {
+        CellOffset offset;
+        LineRuns runs;
+    };
+
+    static const size_t NO_RUN = static_cast<size_t>(-1);
+
+    static std::uint64_t GetLineKey(bool down, Position pos);
+    static int GetIndexInLine(bool down, Position pos);
+    //Child of the run of this line holding the index along the line, NO_RUN if none.
+    size_t FindInLine(const LineRuns& runs, int index, int* run_index) const;
+
+    //Run holding child, NO_RUN if none (index: position of child in the run).
+    size_t FindRun(Position child, int* index) const;
+    size_t AddRun(Run run);
+    Run RemoveRun(size_t id);
+    //Remove the child at index from the run: the rest of the run keeps its edges.
+    void RemoveFromRun(size_t id, int index);
+    //Store the parents of child in a run with its neighbours in a column or row,
+    //return false if no neighbour has the same offsets.
+    bool TryJoinRun(Position child, const std::vector<CellOffset>& offsets);
+
+    //Edges stored one by one.
+    void SetExplicitParents(Position child, std::vector<Position> parents);
+    void RemoveExplicitParents(Position child);
+    //Offsets of the explicit parents of the vertex, empty if none.
+    std::vector<CellOffset> GetExplicitOffsets(Position vertex) const;
+
+    //main graph data: the edges stored one by one
+    std::unordered_map<PositionKey, std::vector<Position>, PositionHasher> vertex_to_childs_;
+    std::unordered_map<PositionKey, std::vector<Position>, PositionHasher> vertex_to_parents_;
+
+    //the runs and their indexes by the lines of their childs and of their parents
+    std::unordered_map<size_t, Run> runs_;
+    size_t next_run_ = 0;
+    std::unordered_map<std::uint64_t, LineRuns> child_lines_;
+    std::unordered_map<std::uint64_t, std::vector<ParentRuns>> parent_lines_;
+
+    SheetCounters* counters_ = nullptr;
+};
+
+
+template<typename Func>
+void Graph::ForEachChild(Position vertex, Func func) const {
+    auto it = vertex_to_childs_.find(vertex);
+    if (it != vertex_to_childs_.end()) {
+        for (Position child : it->second) {
+            func(child);
+        }
+    }
+    if (parent_lines_.empty()) {
+        return;
+    }
+    for (bool down : { true, false }) {
+        auto line_it = parent_lines_.find(GetLineKey(down, vertex));
+        if (line_it == parent_lines_.end()) {
+            continue;
+        }
+        int index = GetIndexInLine(down, vertex);
+        for (const ParentRuns& parent_runs : line_it->second) {
+            int run_index;
+            size_t id = FindInLine(parent_runs.runs, index, &run_index);
+            if (id != NO_RUN) {
+                func(runs_.at(id).GetChild(run_index));
+            }
+        }
+    }
+}
+
+template<typename Func>
+void Graph::ForEachVertex(Func func) const {
+    for (const auto& [vertex, childs] : vertex_to_childs_) {
+        func(vertex.ToPosition());
+    }
+    for (const auto& [vertex, parents] : vertex_to_parents_) {
+        func(vertex.ToPosition());
+    }
+    for (const auto& [id, run] : runs_) {
+        for (int i = 0; i < run.count; ++i) {
+            Position child = run.GetChild(i);
+            func(child);
+            for (CellOffset offset : run.offsets) {
+                func(Position{ child.row + offset.rows, child.col + offset.cols });
+            }
+        }
+    }
+}
+
+template<typename Func>
+void Graph::DFS(
+    Position vertex,
+    std::unordered_set<PositionKey, PositionHasher>& visited,
+    Func func) const {
+
+    std::vector<Position> stack;
+    if (visited.insert(vertex).second) {
+        stack.push_back(vertex);
+    }
+    while (!stack.empty()) {
+        Position current = stack.back();
+        stack.pop_back();
+        func(current);
+        ForEachChild(current, [&visited, &stack](Position child) {
+            if (visited.insert(child).second) {
+                stack.push_back(child);
+            }
+            });
+    }
+}
+
+/// <summary>
+/// Stores the dependencies between the cells:
+/// 1. Keep track of the dependencies of the cells.
+/// 2. Keep track of the values in the cache.
+/// Reading the cache (GetOrComputeCache) is safe from several threads at once,
+/// modifications of the dependencies must not run concurrently with reads.
+/// The graph is shared with the forks of the sheet (ShareDependencies) and
+/// copied by the first change of one of the managers.
+/// The iterative calculation (SetIterative) accepts cycles: they are evaluated
+/// together by SolveCycle, and the cache must then be read from one thread.
+/// </summary>
+class DependenciesManager {
+public:
+    DependenciesManager();
+    ~DependenciesManager();
+
+    //Start from the dependencies and the cache of other: the graph is shared, so are
+    //the clean values of the cache (copy-on-write: until other changes them, they are
+    //only copied when the formulas are, see InheritVertex). While other is shared,
+    //its changes of the cache copy the values they change first.
+    void ShareDependencies(const DependenciesManager& other);
+
+    //Create the cache slot of a vertex: slots are only created on the write path,
+    //so that concurrent readers never modify the cache map itself.
+    void RegisterVertex(Position vertex);
+    //Same for a formula copied from the sheet shared by ShareDependencies: the slot
+    //starts from the value cached there when it was shared.
+    void InheritVertex(Position vertex);
+    //The formulas shared by ShareDependencies are all copied: stop reading the shared cache.
+    void ReleaseInheritedCache();
+    //Remove the cache slot of a vertex which is no longer a formula.
+    void UnregisterVertex(Position vertex);
+
+    //Return true: do not lead to cyclic dependencies => add new vertex to graph.
+    //Return false: the addition will lead to a cycle, leave graph intact.
+    bool TryAddNewVertex(Position vertex, PositionSpan parents);
+
+    //Here, we are updating an already existing vertex in the graph.
+    //Possible modification
+    bool TryUpdateVertex(Position vertex, PositionSpan parents);
+
+    //Check if pos has a value in the cache.
+    bool IsInCache(Position pos) const;
+    //Check if pos has a cache slot (registered formula) whose value is not clean.
+    bool IsDirty(Position pos) const;
+
+    CellInterface::Value GetCache(Position pos) const;
+
+    //Return the cached value of pos, evaluate it with func if the cache is dirty.
+    //When several threads need the same dirty cell, only one of them calls func,
+    //the others wait for its result.
+    template<typename Func>
+    CellInterface::Value GetOrComputeCache(Position pos, Func func);
+
+    //Value of pos without evaluating it: the cached value, or the value before the
+    //last invalidation (stale). Wait only if another thread is evaluating pos.
+    //Return nullopt if pos has no value: never evaluated, or not a formula.
+    std::optional<CachedValue> PeekCache(Position pos);
+
+    //Formulas whose cache is dirty, sorted.
+    std::vector<Position> GetDirtyVertices() const;
+    //Number of cache slots (formulas registered).
+    size_t GetCacheSize() const;
+
+    //Store a value evaluated outside of GetOrComputeCache (batch evaluation).
+    //Return false if the cache of pos is not dirty: already evaluated or being evaluated.
+    bool StoreCache(Position pos, CellInterface::Value value);
+
+    //When a vertex is invalidated:
+    //* Remove the edges betwen the vertex and its **parents** from the dependencies.
+    //* Mark the value of the cache dirty.
+    void InvalidateCache(Position vertex);
+    //Invalidate the vertices and the union of their dependents in one traversal.
+    void InvalidateCache(PositionSpan vertices);
+
+    //Append the vertices invalidated from now on to change_log (nullptr: stop).
+    void SetChangeLog(std::vector<Position>* change_log);
+
+    //True if some formulas reference the vertex.
+    bool HasDependents(Position vertex) const;
+
+    //Positions of the formulas referencing directly one of the vertices (without duplicates).
+    std::vector<Position> GetDependentCells(const std::vector<Position>& vertices) const;
+
+    //The vertices and the vertices depending on them (transitively), every vertex
+    //after the vertices it depends on.
+    std::vector<Position> GetDownstream(const std::vector<Position>& vertices) const;
+
+    //Vertices referenced by the formula of vertex (transitive: and the vertices they
+    //depend on, and so on), sorted. In a cycle, a vertex is its own precedent.
+    std::vector<Position> GetPrecedents(Position vertex, bool transitive) const;
+    //Formulas referencing vertex (transitive: and the formulas depending on them), sorted.
+    std::vector<Position> GetDependents(Position vertex, bool transitive) const;
+
+    //Rename the vertices after rows/columns were inserted or deleted:
+    //edges, parents and cache follow the vertices, cached values stay valid.
+    void RenameVertices(const std::vector<Position>& vertices, const LineShift& shift);
+
+    //Remove the vertices of deleted cells together with all their edges and their cache.
+    //The dependent formulas keep their cache: invalidate them once their references are updated.
+    void RemoveVertices(const std::vector<Position>& vertices);
+
+    SheetCounters& GetCounters();
+
+    FormulaProfiler& GetProfiler();
+
+    //Fill the statistics of the evaluations, the cache and the graph.
+    void FillStats(SheetStats& stats) const;
+
+    //Iterative calculation: the changes making cycles are accepted. Disabling it
+    //fails (return false) while the graph has a cycle.
+    bool SetIterative(bool enabled, int max_iterations, double epsilon);
+    bool IsIterative() const;
+
+    //If pos belongs to a cycle whose cache is dirty, evaluate the cycle: the values
+    //start from the results of its last evaluation (0 the first time), then every
+    //formula of the cycle is evaluated in turn by evaluate (without the cache, the
+    //other formulas of the cycle read the latest values from the cache) until no
+    //value changes by more than epsilon or max_iterations iterations. The cells
+    //read by the cycle are evaluated through the cache, once.
+    void SolveCycle(Position pos, const std::function<CellInterface::Value(Position)>& evaluate);
+
+    bool IsInCycle(Position pos);
+    //Cycles of the graph, ordered by their first cell.
+    std::vector<CycleStatus> GetCycleStatus();
+
+private:
+    struct Cycle {
+        CycleStatus status;
+        //results of the last evaluation, in the order of the cells
+        std::vector<CellInterface::Value> values;
+        bool solving = false;
+    };
+
+    //Dense copy of the graph for the transitive queries: the vertices are numbered
+    //in the order of their positions, the childs (parents) of the vertex id are
+    //childs[child_offsets[id] .. child_offsets[id + 1]) (same for the parents).
+    //The vertices reached by a search are marked in a bitset, read back in order.
+    struct ReachabilityIndex {
+        std::vector<Position> vertices;
+        std::unordered_map<PositionKey, std::uint32_t, PositionHasher> ids;
+        std::vector<std::uint32_t> child_offsets;
+        std::vector<std::uint32_t> childs;
+        std::vector<std::uint32_t> parent_offsets;
+        std::vector<std::uint32_t> parents;
+
+        explicit ReachabilityIndex(const Graph& graph);
+        //Vertices reachable from vertex by at least one edge, sorted.
+        std::vector<Position> Collect(Position vertex, bool forward) const;
+    };
+
+    //Index of the current graph, built by the first query after a change.
+    std::shared_ptr<const ReachabilityIndex> GetReachabilityIndex() const;
+
+    //The edges changed: the cycles and the reachability index are outdated.
+    void OnGraphChanged();
+
+    //Find the cycles again (Tarjan's algorithm) if the graph changed since the last time.
+    //The cycles found again keep their status and values.
+    void UpdateCycles();
+
+    //Block until the evaluation of entry by another thread is over.
+    void WaitWhileComputing(Position pos, const CacheEntry& entry);
+
+    //Set the new state of entry and wake up the threads waiting for it.
+    void PublishCache(Position pos, CacheEntry& entry, CacheState state);
+
+    //Graph to modify: copied first if shared with another manager.
+    Graph& GetGraphForUpdate();
+
+    //Share of the cache for a new fork: the last one while the cache did not change since.
+    std::shared_ptr<CacheShare> GetCacheShare() const;
+    //Lock the shares read by the forks before changing the cache (the shares no fork
+    //reads anymore are dropped).
+    std::vector<std::unique_lock<std::mutex>> LockCacheShares();
+    //InheritVertex with the shares locked.
+    void InheritSlot(Position vertex);
+    //Copy the values of the vertices into the shares before they change (shares locked).
+    void PreserveSharedValues(const std::vector<Position>& vertices);
+    //Copy all the values into the shares: they do not read this manager anymore.
+    void DetachCacheShares();
+    //Clean value of vertex as a fork sharing this manager sees it (nullopt: not clean).
+    std::optional<CellInterface::Value> FindSharedValue(Position vertex) const;
+    static std::optional<CellInterface::Value> FindSharedValue(CacheShare& share, Position vertex);
+
+    //Threads waiting for a cell share one of these slots (chosen by position).
+    static const size_t WAIT_SLOTS = 64;
+    size_t GetWaitSlot(Position pos) const;
+
+    //Graph to check for cyclic dependencies, with the parents for cache-invalidation.
+    std::shared_ptr<Graph> dependencies_graph;
+
+    //Value of the cache.
+    CacheStorage vertex_to_cache_;
+    //Shares of the cache read by the forks (mutable: shared by the const Sheet::Fork).
+    mutable std::vector<std::shared_ptr<CacheShare>> cache_shares_;
+    //Share of the manager this one was forked from, read by InheritVertex (null: none).
+    std::shared_ptr<CacheShare> inherited_cache_;
+
+    std::vector<Position>* change_log_ = nullptr;
+
+    //iterative calculation
+    bool iterative_ = false;
+    int max_iterations_ = 100;
+    double epsilon_ = 0.001;
+    std::vector<Cycle> cycles_;
+    std::unordered_map<PositionKey, size_t, PositionHasher> vertex_to_cycle_;
+    bool cycles_outdated_ = true;
+
+    mutable std::mutex reachability_mutex_;
+    mutable std::shared_ptr<const ReachabilityIndex> reachability_;
+
+    SheetCounters counters_;
+
+    FormulaProfiler profiler_;
+
+    std::array<std::mutex, WAIT_SLOTS> wait_mutexes_;
+    std::array<std::condition_variable, WAIT_SLOTS> wait_conditions_;
+};
+
+
+template<typename Func>
+CellInterface::Value DependenciesManager::GetOrComputeCache(Position pos, Func func) {
+    auto it = vertex_to_cache_.find(pos);
+    if (it == vertex_to_cache_.end()) {
+        //not registered: nothing to share with other threads
+        return func();
+    }
+    CacheEntry& entry = it->second;
+
+    CacheState state = entry.state.load(std::memory_order_acquire);
+    if (state == CacheState::Clean) {
+        counters_.OnCacheHit();
+    }
+    while (state != CacheState::Clean) {
+        if (state == CacheState::Dirty) {
+            if (entry.state.compare_exchange_weak(state, CacheState::Computing, std::memory_order_acquire)) {
+                //this thread evaluates the cell
+                counters_.OnCacheMiss();
+                //an interrupted evaluation (RecalcCancelled) leaves the cell dirty: the
+                //guard unwinds a deep evaluation at once, without rethrowing at every level
+                struct DirtyGuard {
+                    DependenciesManager& manager;
+                    Position pos;
+                    CacheEntry& entry;
+                    bool published = false;
+                    ~DirtyGuard() {
+                        if (!published) {
+                            manager.PublishCache(pos, entry, CacheState::Dirty);
+                        }
+                    }
+                } guard{ *this, pos, entry };
+                CellInterface::Value value = func();
+                entry.value = value;
+                PublishCache(pos, entry, CacheState::Clean);
+                guard.published = true;
+                return value;
+            }
+        }
+        else {
+            counters_.OnCacheWait();
+            WaitWhileComputing(pos, entry);
+            state = entry.state.load(std::memory_order_acquire);
+        }
+    }
+    return *entry.value;
+}
+
+
+
+
+
+
+//TYPES OF CELLS
+
+//Shortest text read back as value (like "123.45").
+std::string FormatNumber(double value);
+
+//What a cell needs from its sheet to be set or evaluated.
+struct CellContext {
+    const SheetInterface& sheet;
+    DependenciesManager& manager;
+    TextPool& texts;
+    Position pos;
+};
+
+//Out-of-line part of a formula cell: the formula and the context of its evaluation.
+//The formula may be shared with the same cell of the forks of the sheet.
+struct FormulaCellData {
+    std::shared_ptr<FormulaInterface> formula;
+    const SheetInterface* sheet;
+    DependenciesManager* manager;
+    Position pos;
+};
+
+/// <summary>
+/// Content of a cell in 16 bytes:
+/// * Empty.
+/// * ShortText: up to SHORT_TEXT_CAPACITY characters stored inline (labels, numbers).
+/// * LongText: handle of the text interned in the TextPool of the sheet (not owned).
+/// * Formula: pointer to the FormulaCellData of the cell.
+/// * Error: error pinned to a cell which is not a formula (Sheet::ApplyTicks of a
+///   value), its category in the first byte.
+/// The last byte holds the kind, the one before it the size of a short text.
+/// </summary>
+class CellPayload {
+public:
+    enum class Kind : std::uint8_t {
+        Empty,
+        ShortText,
+        LongText,
+        Formula,
+        Error,
+    };
+
+    static const size_t SHORT_TEXT_CAPACITY = 14;
+
+    CellPayload();
+    CellPayload(CellPayload&& other) noexcept;
+    CellPayload& operator=(CellPayload&& other) noexcept;
+    CellPayload(const CellPayload&) = delete;
+    CellPayload& operator=(const CellPayload&) = delete;
+    ~CellPayload();
+
+    //Short texts are stored inline, the longer ones are interned in texts.
+    void SetText(std::string_view text, TextPool& texts);
+    //Same text as other (a long text keeps the handle of the pool of other).
+    void CopyText(const CellPayload& other);
+    void SetFormula(std::unique_ptr<FormulaCellData> formula);
+    void SetError(FormulaError error);
+
+    Kind GetKind() const;
+    //Text of a ShortText or LongText payload, text of the error of an Error payload.
+    std::string_view GetTextView() const;
+    FormulaCellData* GetFormulaData() const;
+    //Error of an Error payload.
+    FormulaError GetError() const;
+
+    //Heap bytes owned by the payload (formula record, without the AST).
+    size_t GetHeapBytes() const;
+
+private:
+    static const size_t SIZE_BYTE = 14;
+    static const size_t KIND_BYTE = 15;
+
+    void Reset();
+    void SetKind(Kind kind);
+    void* GetPointer() const;
+    void SetPointer(void* pointer);
+
+    alignas(void*) unsigned char bytes_[16];
+};
+
+static_assert(sizeof(CellPayload) == 16, "CellPayload must stay 16 bytes");
+
+class Cell : public CellInterface {
+public:
+    ~Cell();
+
+    Cell();
+
+    //Parse text, check the dependencies and replace the content of the cell.
+    //Leave the cell unchanged if an exception is thrown.
+    void Set(std::string text, const CellContext& context);
+    //Same with a formula parsed elsewhere (the copy of the formula of another sheet,
+    //with its references to deleted cells).
+    void Set(std::unique_ptr<FormulaInterface> formula, const CellContext& context);
+
+    void Clear(const CellContext& context);
+
+    //Replace the content of a cell which is not a formula by the text of value
+    //(FormatNumber), without parsing it: the dependencies do not change, the
+    //caller invalidates the dependents. Return false if the cell held the same text.
+    bool SetNumber(double value, TextPool& texts);
+    //Same to pin the cell to error: its value is the error, its text the text of the
+    //error. Return false if the cell held the same error.
+    bool SetError(FormulaError error);
+
+    //Text (or empty) cell read back from the paging file of the sheet:
+    //its dependencies did not change while it was paged out.
+    void Restore(std::string_view text, TextPool& texts);
+
+    //Copy of other (Sheet::Fork): the long texts stay in the pool of other, the
+    //formula is shared until one of the cells updates it. A formula is evaluated
+    //in the context of other until Bind.
+    void Share(const Cell& other);
+    //Evaluate the formula of the cell in context.
+    void Bind(const CellContext& context);
+
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+
+    //The texts are views of the payload, the text and the references of a
+    //formula are cached by the formula: these accessors do not allocate
+    //(except for the first evaluation of a formula).
+    ValueView GetValueView() const override;
+    std::string_view GetTextView() const override;
+    PositionSpan GetReferencedCellsSpan() const override;
+
+    //Write the value (the text) of the cell: the texts are written from the
+    //payload without building a Value or a std::string.
+    void PrintValue(std::ostream& output) const;
+    void PrintText(std::ostream& output) const;
+
+    //The cell was moved by an insertion or deletion of rows/columns.
+    void SetPosition(Position pos);
+
+    //Formula of the cell, nullptr if the cell is not a formula.
+    const FormulaInterface* GetFormula() const;
+    //Same to update the references of the formula: a shared formula is copied first.
+    FormulaInterface* GetFormulaForUpdate();
+
+    const CellPayload& GetPayload() const;
+
+private:
+    //Check the dependencies of payload and replace the content of the cell by it.
+    void Replace(CellPayload&& payload, const CellContext& context);
+    static void CheckValidDependencies(PositionSpan parents, const CellContext& context);
+
+    //Evaluate the formula of the cell, without the cache.
+    Value EvaluateFormula() const;
+
+    CellPayload payload_;
+};
+
+static_assert(sizeof(Cell) <= 24, "Cell must stay within 24 bytes");
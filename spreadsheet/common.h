@@ -1,149 +1,263 @@
-#pragma once
-
-#include <iosfwd>
-#include <memory>
-#include <stdexcept>
-#include <string>
-#include <string_view>
-#include <variant>
-#include <vector>
-
-// Позиция ячейки. Индексация с нуля.
-struct Position {
-    int row = 0;
-    int col = 0;
-
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
-
-    bool IsValid() const;
-    std::string ToString() const;
-
-    static Position FromString(std::string_view str);
-
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
-    static const Position NONE;
-};
-
-struct Size {
-    int rows = 0;
-    int cols = 0;
-
-    bool operator==(Size rhs) const;
-};
-
-// Описывает ошибки, которые могут возникнуть при вычислении формулы.
-class FormulaError {
-public:
-    enum class Category {
-        Ref,    // ссылка на ячейку с некорректной позицией
-        Value,  // ячейка не может быть трактована как число
-        Div0,  // в результате вычисления возникло деление на ноль
-    };
-
-    FormulaError(Category category);
-
-    Category GetCategory() const;
-
-    bool operator==(FormulaError rhs) const;
-
-    std::string_view ToString() const;
-
-private:
-    Category category_;
-};
-
-std::ostream& operator<<(std::ostream& output, FormulaError fe);
-
-// Исключение, выбрасываемое при попытке передать в метод некорректную позицию
-class InvalidPositionException : public std::out_of_range {
-public:
-    using std::out_of_range::out_of_range;
-};
-
-// Исключение, выбрасываемое при попытке задать синтаксически некорректную
-// формулу
-class FormulaException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-// Исключение, выбрасываемое при попытке задать формулу, которая приводит к
-// циклической зависимости между ячейками
-class CircularDependencyException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-class CellInterface {
-public:
-    // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
-    // формулы
-    using Value = std::variant<std::string, double, FormulaError>;
-
-    virtual ~CellInterface() = default;
-
-    // Возвращает видимое значение ячейки.
-    // В случае текстовой ячейки это её текст (без экранирующих символов). В
-    // случае формулы - числовое значение формулы или сообщение об ошибке.
-    virtual Value GetValue() const = 0;
-    // Возвращает внутренний текст ячейки, как если бы мы начали её
-    // редактирование. В случае текстовой ячейки это её текст (возможно,
-    // содержащий экранирующие символы). В случае формулы - её выражение.
-    virtual std::string GetText() const = 0;
-
-    // Возвращает список ячеек, которые непосредственно задействованы в данной
-    // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-inline constexpr char FORMULA_SIGN = '=';
-inline constexpr char ESCAPE_SIGN = '\'';
-
-// Интерфейс таблицы
-class SheetInterface {
-public:
-    virtual ~SheetInterface() = default;
-
-    // Задаёт содержимое ячейки. Если текст начинается со знака "=", то он
-    // интерпретируется как формула. Если задаётся синтаксически некорректная
-    // формула, то бросается исключение FormulaException и значение ячейки не
-    // изменяется. Если задаётся формула, которая приводит к циклической
-    // зависимости (в частности, если формула использует текущую ячейку), то
-    // бросается исключение CircularDependencyException и значение ячейки не
-    // изменяется.
-    // Уточнения по записи формулы:
-    // * Если текст содержит только символ "=" и больше ничего, то он не считается
-    // формулой
-    // * Если текст начинается с символа "'" (апостроф), то при выводе значения
-    // ячейки методом GetValue() он опускается. Можно использовать, если нужно
-    // начать текст со знака "=", но чтобы он не интерпретировался как формула.
-    virtual void SetCell(Position pos, std::string text) = 0;
-
-    // Возвращает значение ячейки.
-    // Если ячейка пуста, может вернуть nullptr.
-    virtual const CellInterface* GetCell(Position pos) const = 0;
-    virtual CellInterface* GetCell(Position pos) = 0;
-
-    // Очищает ячейку.
-    // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
-    // объект с пустым текстом.
-    virtual void ClearCell(Position pos) = 0;
-
-    // Вычисляет размер области, которая участвует в печати.
-    // Определяется как ограничивающий прямоугольник всех ячеек с непустым
-    // текстом.
-    virtual Size GetPrintableSize() const = 0;
-
-    // Выводит всю таблицу в переданный поток. Столбцы разделяются знаком
-    // табуляции. После каждой строки выводится символ перевода строки. Для
-    // преобразования ячеек в строку используются методы GetValue() или GetText()
-    // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
-    virtual void PrintValues(std::ostream& output) const = 0;
-    virtual void PrintTexts(std::ostream& output) const = 0;
-};
-
-// Создаёт готовую к работе пустую таблицу.
-std::unique_ptr<SheetInterface> CreateSheet();
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+// Позиция ячейки. Индексация с нуля.
+struct Position {
+    int row = 0;
+    int col = 0;
+
+    bool operator==(Position rhs) const;
+    bool operator<(Position rhs) const;
+
+    bool IsValid() const;
+    std::string ToString() const;
+    // Записывает позицию в buffer (не менее MAX_STRING_LENGTH символов) без
+    // выделения памяти и возвращает число записанных символов (0 для
+    // недопустимой позиции).
+    size_t ToChars(char* buffer) const;
+
+    static Position FromString(std::string_view str);
+
+    static const int MAX_ROWS = 16384;
+    static const int MAX_COLS = 16384;
+    // "XFD16384"
+    static const size_t MAX_STRING_LENGTH = 8;
+    static const Position NONE;
+};
+
+// Позиция, упакованная в 32-битный ключ: 14 бит строки и 14 бит столбца
+// (MAX_ROWS и MAX_COLS равны 2^14), недопустимые позиции дают INVALID.
+// Ключ хеш-таблиц ячеек: вдвое меньше Position и сравнивается за одну операцию.
+class PositionKey {
+public:
+    static constexpr int COORDINATE_BITS = 14;
+    static constexpr std::uint32_t INVALID = ~std::uint32_t{ 0 };
+
+    PositionKey() = default;
+    // Неявное: таблицы с ключами PositionKey ищутся по Position.
+    PositionKey(Position pos)
+        : value_(static_cast<std::uint32_t>(pos.row) < Position::MAX_ROWS && static_cast<std::uint32_t>(pos.col) < Position::MAX_COLS
+            ? (static_cast<std::uint32_t>(pos.row) << COORDINATE_BITS) | static_cast<std::uint32_t>(pos.col)
+            : INVALID) {
+    }
+
+    Position ToPosition() const {
+        if (value_ == INVALID) {
+            return Position::NONE;
+        }
+        return { static_cast<int>(value_ >> COORDINATE_BITS), static_cast<int>(value_ & COORDINATE_MASK) };
+    }
+
+    std::uint32_t GetValue() const {
+        return value_;
+    }
+
+    bool operator==(PositionKey rhs) const {
+        return value_ == rhs.value_;
+    }
+    bool operator!=(PositionKey rhs) const {
+        return value_ != rhs.value_;
+    }
+
+private:
+    static constexpr std::uint32_t COORDINATE_MASK = (1u << COORDINATE_BITS) - 1;
+
+    std::uint32_t value_ = INVALID;
+};
+
+static_assert(Position::MAX_ROWS <= 1 << PositionKey::COORDINATE_BITS
+    && Position::MAX_COLS <= 1 << PositionKey::COORDINATE_BITS, "Position must fit in PositionKey");
+
+// Хеш позиции для хеш-таблиц (принимает и Position). Столбец перемешивается
+// умножением на нечётную константу (хеширование Фибоначчи), строка прибавляется
+// как есть: соседние ячейки попадают в разные корзины и при размере таблицы,
+// равном степени двойки, а ячейки одного столбца остаются в соседних корзинах
+// (полное перемешивание замедляло копирование графа и проверку циклов).
+struct PositionHasher {
+    size_t operator()(PositionKey key) const noexcept {
+        std::uint64_t row = key.GetValue() >> PositionKey::COORDINATE_BITS;
+        std::uint64_t col = key.GetValue() & ((1u << PositionKey::COORDINATE_BITS) - 1);
+        return static_cast<size_t>(row + col * std::uint64_t{ 0x9E3779B97F4A7C15 });
+    }
+};
+
+// Непрерывный диапазон позиций, не владеющий ими (аналог
+// std::span<const Position> из C++20).
+class PositionSpan {
+public:
+    PositionSpan() = default;
+    PositionSpan(const Position* data, size_t size)
+        : data_(data)
+        , size_(size) {
+    }
+    PositionSpan(const std::vector<Position>& positions)
+        : data_(positions.data())
+        , size_(positions.size()) {
+    }
+
+    const Position* begin() const {
+        return data_;
+    }
+    const Position* end() const {
+        return data_ + size_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    const Position& operator[](size_t index) const {
+        return data_[index];
+    }
+
+private:
+    const Position* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+struct Size {
+    int rows = 0;
+    int cols = 0;
+
+    bool operator==(Size rhs) const;
+};
+
+// Описывает ошибки, которые могут возникнуть при вычислении формулы.
+class FormulaError {
+public:
+    enum class Category {
+        Ref,    // ссылка на ячейку с некорректной позицией
+        Value,  // ячейка не может быть трактована как число
+        Div0,  // в результате вычисления возникло деление на ноль
+    };
+
+    FormulaError(Category category);
+
+    Category GetCategory() const;
+
+    bool operator==(FormulaError rhs) const;
+
+    std::string_view ToString() const;
+
+private:
+    Category category_;
+};
+
+std::ostream& operator<<(std::ostream& output, FormulaError fe);
+
+// Исключение, выбрасываемое при попытке передать в метод некорректную позицию
+class InvalidPositionException : public std::out_of_range {
+public:
+    using std::out_of_range::out_of_range;
+};
+
+// Исключение, выбрасываемое при попытке задать синтаксически некорректную
+// формулу
+class FormulaException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Исключение, выбрасываемое, если вставка строк или столбцов сдвигает ячейки
+// за пределы допустимой области таблицы
+class TableTooBigException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Исключение, выбрасываемое при попытке задать формулу, которая приводит к
+// циклической зависимости между ячейками
+class CircularDependencyException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class CellInterface {
+public:
+    // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
+    // формулы
+    using Value = std::variant<std::string, double, FormulaError>;
+
+    virtual ~CellInterface() = default;
+
+    // Возвращает видимое значение ячейки.
+    // В случае текстовой ячейки это её текст (без экранирующих символов). В
+    // случае формулы - числовое значение формулы или сообщение об ошибке.
+    virtual Value GetValue() const = 0;
+    // Возвращает внутренний текст ячейки, как если бы мы начали её
+    // редактирование. В случае текстовой ячейки это её текст (возможно,
+    // содержащий экранирующие символы). В случае формулы - её выражение.
+    virtual std::string GetText() const = 0;
+
+    // Возвращает список ячеек, которые непосредственно задействованы в данной
+    // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
+    // ячеек. В случае текстовой ячейки список пуст.
+    virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // То же, что GetValue(), GetText() и GetReferencedCells(), но без выделения
+    // памяти. Представления действительны до следующего изменения таблицы.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
+    virtual ValueView GetValueView() const = 0;
+    virtual std::string_view GetTextView() const = 0;
+    virtual PositionSpan GetReferencedCellsSpan() const = 0;
+};
+
+inline constexpr char FORMULA_SIGN = '=';
+inline constexpr char ESCAPE_SIGN = '\'';
+
+// Интерфейс таблицы
+class SheetInterface {
+public:
+    virtual ~SheetInterface() = default;
+
+    // Задаёт содержимое ячейки. Если текст начинается со знака "=", то он
+    // интерпретируется как формула. Если задаётся синтаксически некорректная
+    // формула, то бросается исключение FormulaException и значение ячейки не
+    // изменяется. Если задаётся формула, которая приводит к циклической
+    // зависимости (в частности, если формула использует текущую ячейку), то
+    // бросается исключение CircularDependencyException и значение ячейки не
+    // изменяется.
+    // Уточнения по записи формулы:
+    // * Если текст содержит только символ "=" и больше ничего, то он не считается
+    // формулой
+    // * Если текст начинается с символа "'" (апостроф), то при выводе значения
+    // ячейки методом GetValue() он опускается. Можно использовать, если нужно
+    // начать текст со знака "=", но чтобы он не интерпретировался как формула.
+    virtual void SetCell(Position pos, std::string text) = 0;
+
+    // Возвращает значение ячейки.
+    // Если ячейка пуста, может вернуть nullptr.
+    virtual const CellInterface* GetCell(Position pos) const = 0;
+    virtual CellInterface* GetCell(Position pos) = 0;
+
+    // Очищает ячейку.
+    // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
+    // объект с пустым текстом.
+    virtual void ClearCell(Position pos) = 0;
+
+    // Вычисляет размер области, которая участвует в печати.
+    // Определяется как ограничивающий прямоугольник всех ячеек с непустым
+    // текстом.
+    virtual Size GetPrintableSize() const = 0;
+
+    // Выводит всю таблицу в переданный поток. Столбцы разделяются знаком
+    // табуляции. После каждой строки выводится символ перевода строки. Для
+    // преобразования ячеек в строку используются методы GetValue() или GetText()
+    // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
+    virtual void PrintValues(std::ostream& output) const = 0;
+    virtual void PrintTexts(std::ostream& output) const = 0;
+};
+
+// Создаёт готовую к работе пустую таблицу.
+std::unique_ptr<SheetInterface> CreateSheet();
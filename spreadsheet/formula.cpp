@@ -1,82 +1,213 @@
-#include "formula.h"
-
-#include "FormulaAST.h"
-
-#include <algorithm>
-#include <cassert>
-#include <cctype>
-#include <sstream>
-
-using namespace std::literals;
-
-std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    if (fe.GetCategory() == FormulaError::Category::Div0) {
-        return output << "#ARITHM!";
-    }
-    else if (fe.GetCategory() == FormulaError::Category::Value) {
-        return output << "#VALUE!";
-    }
-    //return output << "#ARITHM!";
-    return output << "#REF!";
-}
-
-
-
-namespace {
-    struct PositionHasher {
-        size_t operator()(const Position& pos) const {
-            return static_cast<size_t>(pos.row + 100000 * pos.col);
-        }
-    };
-
-    class Formula : public FormulaInterface {
-    public:
-    // Реализуйте следующие методы:
-        explicit Formula(std::string expression) try : ast_(ParseFormulaAST(expression)) {
-        
-        }
-        catch (...) {
-            throw  FormulaException("Wrong syntax: could not parse formula.");
-        }
-
-        std::string GetExpression() const override {
-            std::ostringstream stream;
-            ast_.PrintFormula(stream);
-            return stream.str();
-        }
-
-        //***IMPLEMENT THIS METHOD***
-        Value Evaluate(const SheetInterface& sheet) const override {
-            //Add all exception handling here
-            double result = 0;
-            try {
-                result = ast_.Execute(sheet);
-                return result;
-            }
-            catch (const FormulaError& error) {
-                return error;
-            }
-            //return result;
-        }
-
-        //Give back references cells:
-        //*SORTED
-        //*UNIQUE
-        std::vector<Position> GetReferencedCells() const override {
-            //std::unordered_set<Position,PositionHasher> unique_cells;
-            std::set<Position> unique_cells;
-            for (auto cell : ast_.GetCells()) {
-                unique_cells.insert(cell);
-            }
-            return std::vector<Position>(unique_cells.begin(), unique_cells.end());
-        }
-
-
-    private:
-        FormulaAST ast_;
-    };
-}  // namespace
-
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+#include "formula.h"
+
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <sstream>
+
+using namespace std::literals;
+
+std::ostream& operator<<(std::ostream& output, FormulaError fe) {
+    if (fe.GetCategory() == FormulaError::Category::Div0) {
+        return output << "#ARITHM!";
+    }
+    else if (fe.GetCategory() == FormulaError::Category::Value) {
+        return output << "#VALUE!";
+    }
+    //return output << "#ARITHM!";
+    return output << "#REF!";
+}
+
+
+
+namespace {
+    class Formula : public FormulaInterface {
+    public:
+    // Реализуйте следующие методы:
+        explicit Formula(std::string expression) try : ast_(ParseFormulaAST(expression)) {
+            ast_.Compile(program_);
+            UpdateReadCache();
+        }
+        catch (...) {
+            throw  FormulaException("Wrong syntax: could not parse formula.");
+        }
+
+        std::unique_ptr<FormulaInterface> Clone() const override {
+            return std::make_unique<Formula>(*this);
+        }
+
+        std::string GetExpression() const override {
+            return std::string(GetCanonicalText().substr(1));
+        }
+
+        std::string_view GetCanonicalText() const override {
+            return text_;
+        }
+
+        //***IMPLEMENT THIS METHOD***
+        Value Evaluate(const SheetInterface& sheet) const override {
+            //Add all exception handling here
+            double result = 0;
+            try {
+                result = ast_.Execute(sheet);
+                return result;
+            }
+            catch (const FormulaError& error) {
+                return error;
+            }
+            //return result;
+        }
+
+        //Give back references cells:
+        //*SORTED
+        //*UNIQUE
+        const BatchProgram& GetProgram() const override {
+            return program_;
+        }
+
+        std::vector<Position> GetReferencedCells() const override {
+            return referenced_cells_;
+        }
+
+        PositionSpan GetReferencedCellsSpan() const override {
+            return referenced_cells_;
+        }
+
+        HandlingResult HandleInsertedRows(int before, int count) override {
+            return UpdateCells([before, count](Position& cell) {
+                return InsertLines(cell.row, before, count);
+            });
+        }
+
+        HandlingResult HandleInsertedCols(int before, int count) override {
+            return UpdateCells([before, count](Position& cell) {
+                return InsertLines(cell.col, before, count);
+            });
+        }
+
+        HandlingResult HandleDeletedRows(int first, int count) override {
+            return UpdateCells([first, count](Position& cell) {
+                return DeleteLines(cell, cell.row, first, count);
+            });
+        }
+
+        HandlingResult HandleDeletedCols(int first, int count) override {
+            return UpdateCells([first, count](Position& cell) {
+                return DeleteLines(cell, cell.col, first, count);
+            });
+        }
+
+    private:
+        //Apply func to every valid reference and keep the references sorted.
+        //The AST points to the stored positions, so it sees the new references.
+        template <typename Func>
+        HandlingResult UpdateCells(Func func) {
+            HandlingResult result = HandlingResult::NothingChanged;
+            for (Position& cell : ast_.GetCells()) {
+                if (cell.IsValid()) {
+                    result = std::max(result, func(cell));
+                }
+            }
+            if (result != HandlingResult::NothingChanged) {
+                //forward_list::sort relinks the nodes: the AST pointers stay valid
+                ast_.GetCells().sort();
+                program_.clear();
+                ast_.Compile(program_);
+                UpdateReadCache();
+            }
+            return result;
+        }
+
+        //Text and references handed out by the accessors, computed once per change.
+        void UpdateReadCache() {
+            std::ostringstream stream;
+            stream << FORMULA_SIGN;
+            ast_.PrintFormula(stream);
+            text_ = stream.str();
+
+            //the cells of the AST are sorted
+            referenced_cells_.clear();
+            for (Position cell : ast_.GetCells()) {
+                //references to deleted cells are not referenced cells anymore
+                if (cell.IsValid() && (referenced_cells_.empty() || !(referenced_cells_.back() == cell))) {
+                    referenced_cells_.push_back(cell);
+                }
+            }
+        }
+
+        static HandlingResult InsertLines(int& coordinate, int before, int count) {
+            if (coordinate < before) {
+                return HandlingResult::NothingChanged;
+            }
+            coordinate += count;
+            return HandlingResult::ReferencesRenamedOnly;
+        }
+
+        static HandlingResult DeleteLines(Position& cell, int& coordinate, int first, int count) {
+            if (coordinate < first) {
+                return HandlingResult::NothingChanged;
+            }
+            if (coordinate < first + count) {
+                cell = Position::NONE;
+                return HandlingResult::ReferencesChanged;
+            }
+            coordinate -= count;
+            return HandlingResult::ReferencesRenamedOnly;
+        }
+
+        FormulaAST ast_;
+        //compiled once, so that the batch evaluation does not walk the AST of every cell
+        BatchProgram program_;
+        std::string text_;
+        //sorted, without duplicates and without the references to deleted cells
+        std::vector<Position> referenced_cells_;
+    };
+}  // namespace
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    return std::make_unique<Formula>(std::move(expression));
+}
+
+namespace {
+    double StrictStod(const std::string& s) {
+        std::size_t pos;
+        double result = std::stod(s, &pos);
+        if (pos != s.size()) {
+            throw std::invalid_argument("Cannot convert string to double");
+        }
+        return result;
+    }
+}  // namespace
+
+FormulaInterface::Value GetCellNumber(const CellInterface* cell) {
+    if (cell == nullptr) {
+        return 0.0;
+    }
+    CellInterface::ValueView value = cell->GetValueView();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<FormulaError>(value)) {
+        return std::get<FormulaError>(value);
+    }
+    std::string_view text = std::get<std::string_view>(value);
+    if (text.empty()) {
+        return 0.0;
+    }
+    //the plain numbers (SetNumber, most of the texts) are read without a std::string,
+    //stod accepts more forms (spaces, '+'...)
+    double number = 0;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (error == std::errc() && end == text.data() + text.size()) {
+        return number;
+    }
+    try {
+        return StrictStod(std::string(text));
+    }
+    catch (...) {
+        return FormulaError(FormulaError::Category::Value);
+    }
 }
\ No newline at end of file
@@ -1,41 +1,83 @@
-#pragma once
-
-#include "common.h"
-
-#include <memory>
-#include <vector>
-
-// Формула, позволяющая вычислять и обновлять арифметическое выражение.
-// Поддерживаемые возможности:
-// * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
-// * Значения ячеек в качестве переменных: A1+B2*C3
-// Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
-// текст, но он представляет число, тогда его нужно трактовать как число. Пустая
-// ячейка или ячейка с пустым текстом трактуется как число ноль.
-class FormulaInterface {
-public:
-    using Value = std::variant<double, FormulaError>;
-
-    virtual ~FormulaInterface() = default;
-
-    // Обратите внимание, что в метод Evaluate() ссылка на таблицу передаётся 
-    // в качестве аргумента.
-    // Возвращает вычисленное значение формулы для переданного листа либо ошибку.
-    // Если вычисление какой-то из указанных в формуле ячеек приводит к ошибке, то
-    // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
-    // любая.
-    virtual Value Evaluate(const SheetInterface& sheet) const = 0;
-
-    // Возвращает выражение, которое описывает формулу.
-    // Не содержит пробелов и лишних скобок.
-    virtual std::string GetExpression() const = 0;
-
-    // Возвращает список ячеек, которые непосредственно задействованы в вычислении
-    // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-// Парсит переданное выражение и возвращает объект формулы.
-// Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+#pragma once
+
+#include "batch.h"
+#include "common.h"
+
+#include <memory>
+#include <vector>
+
+// Формула, позволяющая вычислять и обновлять арифметическое выражение.
+// Поддерживаемые возможности:
+// * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
+// * Значения ячеек в качестве переменных: A1+B2*C3
+// Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
+// текст, но он представляет число, тогда его нужно трактовать как число. Пустая
+// ячейка или ячейка с пустым текстом трактуется как число ноль.
+class FormulaInterface {
+public:
+    using Value = std::variant<double, FormulaError>;
+
+    virtual ~FormulaInterface() = default;
+
+    // Независимая копия формулы (вместе со ссылками на удалённые ячейки), которую
+    // можно обновлять, не затрагивая исходную.
+    virtual std::unique_ptr<FormulaInterface> Clone() const = 0;
+
+    // Обратите внимание, что в метод Evaluate() ссылка на таблицу передаётся 
+    // в качестве аргумента.
+    // Возвращает вычисленное значение формулы для переданного листа либо ошибку.
+    // Если вычисление какой-то из указанных в формуле ячеек приводит к ошибке, то
+    // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
+    // любая.
+    virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+
+    // Возвращает выражение, которое описывает формулу.
+    // Не содержит пробелов и лишних скобок.
+    virtual std::string GetExpression() const = 0;
+
+    // Возвращает список ячеек, которые непосредственно задействованы в вычислении
+    // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
+    // ячеек.
+    virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Текст формулы в каноническом виде: знак "=" и выражение. Вычисляется один
+    // раз при разборе и после обновления ссылок, поэтому не выделяет память.
+    virtual std::string_view GetCanonicalText() const = 0;
+
+    // Ссылки из GetReferencedCells(), вычисленные один раз при разборе и после
+    // обновления ссылок.
+    virtual PositionSpan GetReferencedCellsSpan() const = 0;
+
+    // Результат обновления ссылок формулы после вставки или удаления строк и
+    // столбцов.
+    enum class HandlingResult {
+        NothingChanged,         // ссылки не изменились
+        ReferencesRenamedOnly,  // ссылки сдвинулись, значение формулы прежнее
+        ReferencesChanged       // часть ссылок удалена (стала #REF!)
+    };
+
+    // Сдвигают ссылки формулы после вставки count строк (столбцов) перед
+    // строкой (столбцом) before.
+    virtual HandlingResult HandleInsertedRows(int before, int count = 1) = 0;
+    virtual HandlingResult HandleInsertedCols(int before, int count = 1) = 0;
+
+    // Сдвигают ссылки формулы после удаления count строк (столбцов), начиная со
+    // строки (столбца) first. Ссылки на удалённые ячейки становятся
+    // некорректными: при выводе выражения они печатаются как #REF!, а при
+    // вычислении дают ошибку FormulaError::Category::Ref.
+    virtual HandlingResult HandleDeletedRows(int first, int count = 1) = 0;
+    virtual HandlingResult HandleDeletedCols(int first, int count = 1) = 0;
+
+    // Выражение формулы (после свёртки констант) в постфиксной записи для
+    // пакетного вычисления (BatchEvaluator). Обновляется вместе со ссылками.
+    virtual const BatchProgram& GetProgram() const = 0;
+};
+
+// Парсит переданное выражение и возвращает объект формулы.
+// Бросает FormulaException в случае, если формула синтаксически некорректна.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Значение ячейки как операнда формулы: пустая ячейка и пустой текст дают ноль,
+// текст должен целиком представлять число (иначе ошибка #VALUE!), ошибка
+// формулы возвращается как есть.
+FormulaInterface::Value GetCellNumber(const CellInterface* cell);
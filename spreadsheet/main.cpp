@@ -1,373 +1,2294 @@
-#include "common.h"
-#include "formula.h"
-#include "test_runner_p.h"
-
-inline std::ostream& operator<<(std::ostream& output, Position pos) {
-    return output << "(" << pos.row << ", " << pos.col << ")";
-}
-
-inline Position operator"" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
-}
-
-inline std::ostream& operator<<(std::ostream& output, Size size) {
-    return output << "(" << size.rows << ", " << size.cols << ")";
-}
-
-inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
-    std::visit(
-        [&](const auto& x) {
-            output << x;
-        },
-        value);
-    return output;
-}
-
-namespace {
-std::string ToString(FormulaError::Category category) {
-    return std::string(FormulaError(category).ToString());
-}
-
-void TestPositionAndStringConversion() {
-    auto testSingle = [](Position pos, std::string_view str) {
-        ASSERT_EQUAL(pos.ToString(), str);
-        ASSERT_EQUAL(Position::FromString(str), pos);
-    };
-
-    for (int i = 0; i < 25; ++i) {
-        testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
-    }
-
-    testSingle(Position{0, 0}, "A1");
-    testSingle(Position{0, 1}, "B1");
-    testSingle(Position{0, 25}, "Z1");
-    testSingle(Position{0, 26}, "AA1");
-    testSingle(Position{0, 27}, "AB1");
-    testSingle(Position{0, 51}, "AZ1");
-    testSingle(Position{0, 52}, "BA1");
-    testSingle(Position{0, 53}, "BB1");
-    testSingle(Position{0, 77}, "BZ1");
-    testSingle(Position{0, 78}, "CA1");
-    testSingle(Position{0, 701}, "ZZ1");
-    testSingle(Position{0, 702}, "AAA1");
-    testSingle(Position{136, 2}, "C137");
-    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
-}
-
-void TestPositionToStringInvalid() {
-    ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
-    ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
-    ASSERT_EQUAL((Position{1, -3}).ToString(), "");
-}
-
-void TestStringToPositionInvalid() {
-    ASSERT(!Position::FromString("").IsValid());
-    ASSERT(!Position::FromString("A").IsValid());
-    ASSERT(!Position::FromString("1").IsValid());
-    ASSERT(!Position::FromString("e2").IsValid());
-    ASSERT(!Position::FromString("A0").IsValid());
-    ASSERT(!Position::FromString("A-1").IsValid());
-    ASSERT(!Position::FromString("A+1").IsValid());
-    ASSERT(!Position::FromString("R2D2").IsValid());
-    ASSERT(!Position::FromString("C3PO").IsValid());
-    ASSERT(!Position::FromString("XFD16385").IsValid());
-    ASSERT(!Position::FromString("XFE16384").IsValid());
-    ASSERT(!Position::FromString("A1234567890123456789").IsValid());
-    ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
-}
-
-void TestEmpty() {
-    auto sheet = CreateSheet();
-    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
-}
-
-void TestInvalidPosition() {
-    auto sheet = CreateSheet();
-    try {
-        sheet->SetCell(Position{-1, 0}, "");
-    } catch (const InvalidPositionException&) {
-    }
-    try {
-        sheet->GetCell(Position{0, -2});
-    } catch (const InvalidPositionException&) {
-    }
-    try {
-        sheet->ClearCell(Position{Position::MAX_ROWS, 0});
-    } catch (const InvalidPositionException&) {
-    }
-}
-
-void TestSetCellPlainText() {
-    auto sheet = CreateSheet();
-
-    auto checkCell = [&](Position pos, std::string text) {
-        sheet->SetCell(pos, text);
-        CellInterface* cell = sheet->GetCell(pos);
-        ASSERT(cell != nullptr);
-        ASSERT_EQUAL(cell->GetText(), text);
-        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
-    };
-
-    checkCell("A1"_pos, "Hello");
-    checkCell("A1"_pos, "World");
-    checkCell("B2"_pos, "Purr");
-    checkCell("A3"_pos, "Meow");
-
-    const SheetInterface& constSheet = *sheet;
-    ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
-
-    sheet->SetCell("A3"_pos, "'=escaped");
-    CellInterface* cell = sheet->GetCell("A3"_pos);
-    ASSERT_EQUAL(cell->GetText(), "'=escaped");
-    ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
-}
-
-void TestClearCell() {
-    auto sheet = CreateSheet();
-
-    sheet->SetCell("C2"_pos, "Me gusta");
-    sheet->ClearCell("C2"_pos);
-    ASSERT(sheet->GetCell("C2"_pos) == nullptr);
-
-    sheet->ClearCell("A1"_pos);
-    sheet->ClearCell("J10"_pos);
-}
-
-void TestFormulaArithmetic() {
-    auto sheet = CreateSheet();
-    auto evaluate = [&](std::string expr) {
-        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-    };
-
-    ASSERT_EQUAL(evaluate("1"), 1);
-    ASSERT_EQUAL(evaluate("42"), 42);
-    ASSERT_EQUAL(evaluate("2 + 2"), 4);
-    ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
-    ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
-    ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
-    ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
-}
-
-void TestFormulaReferences() {
-    auto sheet = CreateSheet();
-    auto evaluate = [&](std::string expr) {
-        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-    };
-
-    sheet->SetCell("A1"_pos, "1");
-    ASSERT_EQUAL(evaluate("A1"), 1);
-    sheet->SetCell("A2"_pos, "2");
-    ASSERT_EQUAL(evaluate("A1+A2"), 3);
-
-    // Тест на нули:
-    sheet->SetCell("B3"_pos, "");
-    ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
-    ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
-    ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
-}
-
-void TestFormulaExpressionFormatting() {
-    auto reformat = [](std::string expr) {
-        return ParseFormula(std::move(expr))->GetExpression();
-    };
-
-    ASSERT_EQUAL(reformat("  1  "), "1");
-    ASSERT_EQUAL(reformat("  -1  "), "-1");
-    ASSERT_EQUAL(reformat("2 + 2"), "2+2");
-    ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
-    ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
-    ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
-}
-
-void TestFormulaReferencedCells() {
-    ASSERT(ParseFormula("1")->GetReferencedCells().empty());
-
-    auto a1 = ParseFormula("A1");
-    ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
-
-    auto b2c3 = ParseFormula("B2+C3");
-    ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
-
-    auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
-    ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
-    ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
-}
-
-void TestErrorValue() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("E2"_pos, "A1");
-    sheet->SetCell("E4"_pos, "=E2");
-    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                 CellInterface::Value(FormulaError::Category::Value));
-
-    sheet->SetCell("E2"_pos, "3D");
-    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                 CellInterface::Value(FormulaError::Category::Value));
-}
-
-void TestErrorDiv0() {
-    auto sheet = CreateSheet();
-
-    constexpr double max = std::numeric_limits<double>::max();
-
-    sheet->SetCell("A1"_pos, "=1/0");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 CellInterface::Value(FormulaError::Category::Div0));
-
-    sheet->SetCell("A1"_pos, "=1e+200/1e-200");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 CellInterface::Value(FormulaError::Category::Div0));
-
-    sheet->SetCell("A1"_pos, "=0/0");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 CellInterface::Value(FormulaError::Category::Div0));
-
-    {
-        std::ostringstream formula;
-        formula << '=' << max << '+' << max;
-        sheet->SetCell("A1"_pos, formula.str());
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-    }
-
-    {
-        std::ostringstream formula;
-        formula << '=' << -max << '-' << max;
-        sheet->SetCell("A1"_pos, formula.str());
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-    }
-
-    {
-        std::ostringstream formula;
-        formula << '=' << max << '*' << max;
-        sheet->SetCell("A1"_pos, formula.str());
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-    }
-}
-
-void TestEmptyCellTreatedAsZero() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "=B2");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0));
-}
-
-void TestFormulaInvalidPosition() {
-    auto sheet = CreateSheet();
-    auto try_formula = [&](const std::string& formula) {
-        try {
-            sheet->SetCell("A1"_pos, formula);
-            ASSERT(false);
-        } catch (const FormulaException&) {
-            // we expect this one
-        }
-    };
-
-    try_formula("=X0");
-    try_formula("=ABCD1");
-    try_formula("=A123456");
-    try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-    try_formula("=XFD16385");
-    try_formula("=XFE16384");
-    try_formula("=R2D2");
-}
-
-void TestPrint() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A2"_pos, "meow");
-    sheet->SetCell("B2"_pos, "=35");
-
-    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
-
-    std::ostringstream texts;
-    sheet->PrintTexts(texts);
-    ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
-
-    std::ostringstream values;
-    sheet->PrintValues(values);
-    ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
-}
-
-void TestCellReferences() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "1");
-    sheet->SetCell("A2"_pos, "=A1");
-    sheet->SetCell("B2"_pos, "=A1");
-
-    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
-    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
-
-    // Ссылка на пустую ячейку
-    sheet->SetCell("B2"_pos, "=B1");
-    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
-    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
-
-    sheet->SetCell("A2"_pos, "");
-    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-    ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
-
-    // Ссылка на ячейку за пределами таблицы
-    sheet->SetCell("B1"_pos, "=C3");
-    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
-}
-
-void TestFormulaIncorrect() {
-    auto isIncorrect = [](std::string expression) {
-        try {
-            ParseFormula(std::move(expression));
-        } catch (const FormulaException&) {
-            return true;
-        }
-        return false;
-    };
-
-    ASSERT(isIncorrect("A2B"));
-    ASSERT(isIncorrect("3X"));
-    ASSERT(isIncorrect("A0++"));
-    ASSERT(isIncorrect("((1)"));
-    ASSERT(isIncorrect("2+4-"));
-}
-
-void TestCellCircularReferences() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("E2"_pos, "=E4");
-    sheet->SetCell("E4"_pos, "=X9");
-    sheet->SetCell("X9"_pos, "=M6");
-    sheet->SetCell("M6"_pos, "Ready");
-
-    bool caught = false;
-    try {
-        sheet->SetCell("M6"_pos, "=E2");
-    } catch (const CircularDependencyException&) {
-        caught = true;
-    }
-
-    ASSERT(caught);
-    ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
-}
-}  // namespace
-
-int main() {
-    TestRunner tr;
-    RUN_TEST(tr, TestPositionAndStringConversion);
-    RUN_TEST(tr, TestPositionToStringInvalid);
-    RUN_TEST(tr, TestStringToPositionInvalid);
-    RUN_TEST(tr, TestEmpty);
-    RUN_TEST(tr, TestInvalidPosition);
-    RUN_TEST(tr, TestSetCellPlainText);
-    RUN_TEST(tr, TestClearCell);
-    RUN_TEST(tr, TestFormulaArithmetic);
-    RUN_TEST(tr, TestFormulaReferences);
-    RUN_TEST(tr, TestFormulaExpressionFormatting);
-    RUN_TEST(tr, TestFormulaReferencedCells);
-    RUN_TEST(tr, TestErrorValue);
-    RUN_TEST(tr, TestErrorDiv0);
-    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
-    RUN_TEST(tr, TestFormulaInvalidPosition);
-    RUN_TEST(tr, TestPrint);
-    RUN_TEST(tr, TestCellReferences);
-    RUN_TEST(tr, TestFormulaIncorrect);
-    RUN_TEST(tr, TestCellCircularReferences);
-}
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+#include "test_runner_p.h"
+
+#ifndef _WIN32
+#include "server.h"
+#include "shard.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <set>
+#include <thread>
+
+namespace {
+// Число выделений памяти: проверяет методы, которые не должны выделять память
+std::atomic<size_t> g_allocations{ 0 };
+}  // namespace
+
+void* operator new(std::size_t size) {
+    ++g_allocations;
+    if (void* memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+// std::stable_sort берёт временный буфер через nothrow-версию
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    ++g_allocations;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+// Не встраивается: иначе GCC видит free() для памяти из operator new
+[[gnu::noinline]] void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+inline std::ostream& operator<<(std::ostream& output, Position pos) {
+    return output << "(" << pos.row << ", " << pos.col << ")";
+}
+
+inline Position operator"" _pos(const char* str, std::size_t) {
+    return Position::FromString(str);
+}
+
+inline std::ostream& operator<<(std::ostream& output, Size size) {
+    return output << "(" << size.rows << ", " << size.cols << ")";
+}
+
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
+namespace {
+std::string ToString(FormulaError::Category category) {
+    return std::string(FormulaError(category).ToString());
+}
+
+void TestPositionAndStringConversion() {
+    auto testSingle = [](Position pos, std::string_view str) {
+        ASSERT_EQUAL(pos.ToString(), str);
+        ASSERT_EQUAL(Position::FromString(str), pos);
+    };
+
+    for (int i = 0; i < 25; ++i) {
+        testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
+    }
+
+    testSingle(Position{0, 0}, "A1");
+    testSingle(Position{0, 1}, "B1");
+    testSingle(Position{0, 25}, "Z1");
+    testSingle(Position{0, 26}, "AA1");
+    testSingle(Position{0, 27}, "AB1");
+    testSingle(Position{0, 51}, "AZ1");
+    testSingle(Position{0, 52}, "BA1");
+    testSingle(Position{0, 53}, "BB1");
+    testSingle(Position{0, 77}, "BZ1");
+    testSingle(Position{0, 78}, "CA1");
+    testSingle(Position{0, 701}, "ZZ1");
+    testSingle(Position{0, 702}, "AAA1");
+    testSingle(Position{136, 2}, "C137");
+    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+}
+
+void TestPositionToStringInvalid() {
+    ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
+    ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
+    ASSERT_EQUAL((Position{1, -3}).ToString(), "");
+}
+
+void TestStringToPositionInvalid() {
+    ASSERT(!Position::FromString("").IsValid());
+    ASSERT(!Position::FromString("A").IsValid());
+    ASSERT(!Position::FromString("1").IsValid());
+    ASSERT(!Position::FromString("e2").IsValid());
+    ASSERT(!Position::FromString("A0").IsValid());
+    ASSERT(!Position::FromString("A-1").IsValid());
+    ASSERT(!Position::FromString("A+1").IsValid());
+    ASSERT(!Position::FromString("R2D2").IsValid());
+    ASSERT(!Position::FromString("C3PO").IsValid());
+    ASSERT(!Position::FromString("XFD16385").IsValid());
+    ASSERT(!Position::FromString("XFE16384").IsValid());
+    ASSERT(!Position::FromString("A1234567890123456789").IsValid());
+    ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
+}
+
+void TestPositionKey() {
+    // Ключ обратим для всех допустимых позиций, недопустимые дают INVALID
+    for (Position pos : { Position{ 0, 0 }, Position{ 0, 1 }, Position{ 1, 0 }, Position{ 136, 2 },
+        Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } }) {
+        ASSERT_EQUAL(PositionKey(pos).ToPosition(), pos);
+    }
+    ASSERT_EQUAL(PositionKey(Position::NONE).GetValue(), PositionKey::INVALID);
+    ASSERT_EQUAL(PositionKey(Position{ Position::MAX_ROWS, 0 }).GetValue(), PositionKey::INVALID);
+    ASSERT(PositionKey(Position{ 1, 0 }) != PositionKey(Position{ 0, 1 }));
+
+    // Соседние ячейки попадают в разные корзины таблицы из 64 корзин
+    std::set<size_t> buckets;
+    for (int row = 0; row < 8; ++row) {
+        buckets.insert(PositionHasher{}(Position{ row, 0 }) % 64);
+    }
+    ASSERT(buckets.size() > 4);
+
+    char buffer[Position::MAX_STRING_LENGTH];
+    ASSERT_EQUAL(std::string(buffer, Position{ 9999, 702 }.ToChars(buffer)), "AAA10000");
+    ASSERT_EQUAL(Position::NONE.ToChars(buffer), 0u);
+    ASSERT_EQUAL(Position::FromString("B007"), (Position{ 6, 1 }));
+    ASSERT(!Position::FromString("A1 ").IsValid());
+    ASSERT(!Position::FromString("a1").IsValid());
+}
+
+void TestEmpty() {
+    auto sheet = CreateSheet();
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestInvalidPosition() {
+    auto sheet = CreateSheet();
+    try {
+        sheet->SetCell(Position{-1, 0}, "");
+    } catch (const InvalidPositionException&) {
+    }
+    try {
+        sheet->GetCell(Position{0, -2});
+    } catch (const InvalidPositionException&) {
+    }
+    try {
+        sheet->ClearCell(Position{Position::MAX_ROWS, 0});
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestSetCellPlainText() {
+    auto sheet = CreateSheet();
+
+    auto checkCell = [&](Position pos, std::string text) {
+        sheet->SetCell(pos, text);
+        CellInterface* cell = sheet->GetCell(pos);
+        ASSERT(cell != nullptr);
+        ASSERT_EQUAL(cell->GetText(), text);
+        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
+    };
+
+    checkCell("A1"_pos, "Hello");
+    checkCell("A1"_pos, "World");
+    checkCell("B2"_pos, "Purr");
+    checkCell("A3"_pos, "Meow");
+
+    const SheetInterface& constSheet = *sheet;
+    ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
+
+    sheet->SetCell("A3"_pos, "'=escaped");
+    CellInterface* cell = sheet->GetCell("A3"_pos);
+    ASSERT_EQUAL(cell->GetText(), "'=escaped");
+    ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
+}
+
+void TestClearCell() {
+    auto sheet = CreateSheet();
+
+    sheet->SetCell("C2"_pos, "Me gusta");
+    sheet->ClearCell("C2"_pos);
+    ASSERT(sheet->GetCell("C2"_pos) == nullptr);
+
+    sheet->ClearCell("A1"_pos);
+    sheet->ClearCell("J10"_pos);
+}
+
+void TestFormulaArithmetic() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+    };
+
+    ASSERT_EQUAL(evaluate("1"), 1);
+    ASSERT_EQUAL(evaluate("42"), 42);
+    ASSERT_EQUAL(evaluate("2 + 2"), 4);
+    ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
+    ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
+    ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
+    ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
+}
+
+void TestFormulaReferences() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+    };
+
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(evaluate("A1"), 1);
+    sheet->SetCell("A2"_pos, "2");
+    ASSERT_EQUAL(evaluate("A1+A2"), 3);
+
+    // Тест на нули:
+    sheet->SetCell("B3"_pos, "");
+    ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
+    ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
+    ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
+}
+
+void TestFormulaExpressionFormatting() {
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+
+    ASSERT_EQUAL(reformat("  1  "), "1");
+    ASSERT_EQUAL(reformat("  -1  "), "-1");
+    ASSERT_EQUAL(reformat("2 + 2"), "2+2");
+    ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
+    ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
+    ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+}
+
+void TestFormulaReferencedCells() {
+    ASSERT(ParseFormula("1")->GetReferencedCells().empty());
+
+    auto a1 = ParseFormula("A1");
+    ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
+
+    auto b2c3 = ParseFormula("B2+C3");
+    ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
+
+    auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
+    ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
+    ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+}
+
+void TestErrorValue() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("E2"_pos, "A1");
+    sheet->SetCell("E4"_pos, "=E2");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    sheet->SetCell("E2"_pos, "3D");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestErrorDiv0() {
+    auto sheet = CreateSheet();
+
+    constexpr double max = std::numeric_limits<double>::max();
+
+    sheet->SetCell("A1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Div0));
+
+    sheet->SetCell("A1"_pos, "=1e+200/1e-200");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Div0));
+
+    sheet->SetCell("A1"_pos, "=0/0");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Div0));
+
+    {
+        std::ostringstream formula;
+        formula << '=' << max << '+' << max;
+        sheet->SetCell("A1"_pos, formula.str());
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+    }
+
+    {
+        std::ostringstream formula;
+        formula << '=' << -max << '-' << max;
+        sheet->SetCell("A1"_pos, formula.str());
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+    }
+
+    {
+        std::ostringstream formula;
+        formula << '=' << max << '*' << max;
+        sheet->SetCell("A1"_pos, formula.str());
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+    }
+}
+
+void TestEmptyCellTreatedAsZero() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0));
+}
+
+void TestFormulaInvalidPosition() {
+    auto sheet = CreateSheet();
+    auto try_formula = [&](const std::string& formula) {
+        try {
+            sheet->SetCell("A1"_pos, formula);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+            // we expect this one
+        }
+    };
+
+    try_formula("=X0");
+    try_formula("=ABCD1");
+    try_formula("=A123456");
+    try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
+    try_formula("=XFD16385");
+    try_formula("=XFE16384");
+    try_formula("=R2D2");
+}
+
+void TestPrint() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A2"_pos, "meow");
+    sheet->SetCell("B2"_pos, "=35");
+
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
+}
+
+void TestCellReferences() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1");
+    sheet->SetCell("B2"_pos, "=A1");
+
+    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+
+    // Ссылка на пустую ячейку
+    sheet->SetCell("B2"_pos, "=B1");
+    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
+
+    sheet->SetCell("A2"_pos, "");
+    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
+
+    // Ссылка на ячейку за пределами таблицы
+    sheet->SetCell("B1"_pos, "=C3");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
+}
+
+void TestFormulaIncorrect() {
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+
+    ASSERT(isIncorrect("A2B"));
+    ASSERT(isIncorrect("3X"));
+    ASSERT(isIncorrect("A0++"));
+    ASSERT(isIncorrect("((1)"));
+    ASSERT(isIncorrect("2+4-"));
+}
+
+void TestCellCircularReferences() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("E2"_pos, "=E4");
+    sheet->SetCell("E4"_pos, "=X9");
+    sheet->SetCell("X9"_pos, "=M6");
+    sheet->SetCell("M6"_pos, "Ready");
+
+    bool caught = false;
+    try {
+        sheet->SetCell("M6"_pos, "=E2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
+}
+
+void TestConcurrentGetValue() {
+    auto sheet = CreateSheet();
+    const int chain_length = 200;
+    const int thread_count = 8;
+
+    // A1 <- A2 <- ... <- A200 и B1..B200, зависящие от конца цепочки
+    sheet->SetCell(Position{0, 0}, "1");
+    for (int r = 1; r < chain_length; ++r) {
+        sheet->SetCell(Position{r, 0}, "=" + Position{r - 1, 0}.ToString() + "+1");
+    }
+    for (int r = 0; r < chain_length; ++r) {
+        sheet->SetCell(Position{r, 1}, "=" + Position{chain_length - 1, 0}.ToString() + "+" + Position{r, 0}.ToString());
+    }
+
+    for (int round = 0; round < 5; ++round) {
+        sheet->SetCell(Position{0, 0}, std::to_string(round));
+
+        std::vector<std::vector<double>> results(thread_count, std::vector<double>(chain_length));
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; ++t) {
+            threads.emplace_back([&sheet, &results, t, chain_length]() {
+                const SheetInterface& const_sheet = *sheet;
+                for (int i = 0; i < chain_length; ++i) {
+                    // потоки обходят ячейки в разном порядке
+                    int r = (t % 2 == 0) ? i : chain_length - 1 - i;
+                    results[t][r] = std::get<double>(const_sheet.GetCell(Position{r, 1})->GetValue());
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (int t = 0; t < thread_count; ++t) {
+            for (int r = 0; r < chain_length; ++r) {
+                ASSERT_EQUAL(results[t][r], 2.0 * round + chain_length - 1 + r);
+            }
+        }
+    }
+}
+
+void TestSheetStats() {
+    Sheet sheet;
+    if (!sheet.GetStats().enabled) {
+        return;
+    }
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 4.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 4.0);
+
+    SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.formulas_parsed, 2u);
+    ASSERT_EQUAL(stats.formulas_evaluated, 2u);
+    // Значения текстовых ячеек читаются без кэша
+    ASSERT_EQUAL(stats.cache_misses, 2u);
+    ASSERT_EQUAL(stats.cache_hits, 1u);
+    ASSERT_EQUAL(stats.graph_vertices, 3u);
+    ASSERT_EQUAL(stats.graph_edges, 2u);
+    ASSERT_EQUAL(stats.set_cell_parse.count, 3u);
+    // Проверка на цикл измеряется при каждом SetCell, и для новых ячеек
+    ASSERT_EQUAL(stats.set_cell_cycle_check.count, 3u);
+
+    // Изменение A1 инвалидирует всю цепочку
+    sheet.ResetStats();
+    sheet.SetCell("A1"_pos, "5");
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.edits, 1u);
+    ASSERT_EQUAL(stats.cells_invalidated, 3u);
+    // Ячейка без ссылок не может замкнуть цикл: проверки нет
+    ASSERT_EQUAL(stats.cycle_checks, 0u);
+    ASSERT_EQUAL(stats.cycle_check_vertices_visited, 0u);
+    ASSERT_EQUAL(stats.formulas_parsed, 0u);
+    ASSERT_EQUAL(stats.set_cell_invalidate.count, 1u);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 12.0);
+
+    // Проверка формулы обходит ячейки, зависящие от неё
+    sheet.ResetStats();
+    sheet.SetCell("A2"_pos, "=A1+2");
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.cycle_checks, 1u);
+    ASSERT_EQUAL(stats.cycle_check_vertices_visited, 2u);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 14.0);
+}
+
+void TestFormulaProfiler() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+    sheet.SetCell("B1"_pos, "=A3+A2");
+
+    // Профилирование выключено по умолчанию
+    sheet.GetCell("B1"_pos)->GetValue();
+    ASSERT(sheet.GetProfiler().GetTopCells().empty());
+
+    sheet.GetProfiler().Enable();
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 9.0);
+    sheet.GetProfiler().Disable();
+
+    auto profiles = sheet.GetProfiler().GetTopCells();
+    ASSERT_EQUAL(profiles.size(), 3u);
+    for (const CellProfile& profile : profiles) {
+        ASSERT_EQUAL(profile.evaluations, 1u);
+        ASSERT(profile.exclusive_ns <= profile.inclusive_ns);
+        if (profile.pos == "B1"_pos) {
+            ASSERT_EQUAL(profile.max_depth, 3);
+        }
+        else if (profile.pos == "A2"_pos) {
+            ASSERT_EQUAL(profile.max_depth, 1);
+        }
+    }
+    ASSERT_EQUAL(sheet.GetProfiler().GetTopCells(1).size(), 1u);
+
+    std::ostringstream folded;
+    sheet.GetProfiler().PrintFoldedStacks(folded);
+    ASSERT(folded.str().find("B1;A3;A2 ") != std::string::npos);
+
+    sheet.GetProfiler().Reset();
+    ASSERT(sheet.GetProfiler().GetTopCells().empty());
+
+    // Глубокая цепочка: каждый стек хранится одним узлом дерева стеков
+    sheet.SetCell("C1"_pos, "1");
+    for (int r = 1; r < 1000; ++r) {
+        sheet.SetCell(Position{ r, 2 }, "=C" + std::to_string(r) + "+1");
+    }
+    sheet.GetProfiler().Enable();
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1000"_pos)->GetValue()), 1000.0);
+    sheet.GetProfiler().Disable();
+    ASSERT_EQUAL(sheet.GetProfiler().GetTopCells().size(), 999u);
+    std::ostringstream deep;
+    sheet.GetProfiler().PrintFoldedStacks(deep);
+    std::istringstream lines(deep.str());
+    size_t line_count = 0;
+    bool has_deepest = false;
+    for (std::string line; std::getline(lines, line); ++line_count) {
+        ASSERT(line.rfind("C1000", 0) == 0);
+        has_deepest = has_deepest || line.find(";C3;C2 ") != std::string::npos;
+    }
+    ASSERT_EQUAL(line_count, 999u);
+    ASSERT(has_deepest);
+}
+
+void TestInsertRowsAndCols() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("B3"_pos, "=A2*2");
+    sheet.SetCell("C1"_pos, "=B3+A1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 5.0);
+
+    sheet.InsertRows(1, 2);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 3}));
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=A4*2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B5+A1");
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetReferencedCells(), std::vector{"A4"_pos});
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 5.0);
+
+    // Зависимости и кэш сдвинулись вместе с ячейками
+    sheet.SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 32.0);
+
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 4}));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=B1+1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=C5+B1");
+    sheet.SetCell("B1"_pos, "0");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 2.0);
+
+    // Цикл через сдвинутые ячейки по-прежнему обнаруживается
+    bool caught = false;
+    try {
+        sheet.SetCell("B1"_pos, "=D1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    sheet.SetCell("A16384"_pos, "bottom");
+    caught = false;
+    try {
+        sheet.InsertRows(0);
+    } catch (const TableTooBigException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestDeleteRowsAndCols() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A1+A3");
+    sheet.SetCell("B4"_pos, "=A2*A3");
+    sheet.SetCell("C4"_pos, "=B4+1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C4"_pos)->GetValue()), 7.0);
+
+    sheet.DeleteRows(1);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 3}));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+A2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 4.0);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=#REF!*A2");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetReferencedCells(), std::vector{"A2"_pos});
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=B3+1");
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+    sheet.SetCell("B3"_pos, "=A2*2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C3"_pos)->GetValue()), 7.0);
+
+    sheet.DeleteCols(0);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=#REF!+#REF!");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=#REF!*2");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A3+1");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+    sheet.DeleteCols(0, 2);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestClearReferencedCell() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("B1"_pos, "=A1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 5.0);
+
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 0.0);
+
+    // Очищенная формула больше не участвует в поиске циклов
+    sheet.ClearCell("B1"_pos);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    sheet.SetCell("A1"_pos, "=B1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 0.0);
+}
+
+void TestFormulaConstantFolding() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "7200");
+    sheet.SetCell("B1"_pos, "=A1*(1/3600)*(24*365)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*1/3600*24*365");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 7200 * (1.0 / 3600) * (24 * 365));
+
+    // Тождественные операции не меняют ни текст формулы, ни значение
+    sheet.SetCell("B2"_pos, "=+A1*1-0/1");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=+A1*1-0/1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 7200.0);
+
+    // Ошибки в свёрнутых и упрощённых выражениях сохраняются
+    sheet.SetCell("B3"_pos, "=1/0");
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B3"_pos)->GetValue()), FormulaError(FormulaError::Category::Div0));
+    sheet.SetCell("B4"_pos, "=0*(2/(1-1))");
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B4"_pos)->GetValue()), FormulaError(FormulaError::Category::Div0));
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("B5"_pos, "=+A2*1");
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B5"_pos)->GetValue()), FormulaError(FormulaError::Category::Value));
+
+    // Знак нуля не меняется: -0 + 0 даёт 0
+    sheet.SetCell("B6"_pos, "=-A3+0");
+    ASSERT(!std::signbit(std::get<double>(sheet.GetCell("B6"_pos)->GetValue())));
+
+    // Упрощённое выражение следит за сдвигом ссылок
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=+A2*1-0/1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 7200.0);
+
+    // Длинные цепочки упрощаются за один проход по дереву
+    std::string chain = "=(A2";
+    for (int i = 0; i < 300; ++i) {
+        chain += "+1";
+    }
+    chain += ")";
+    for (int i = 0; i < 300; ++i) {
+        chain += "*1";
+    }
+    sheet.SetCell("C1"_pos, chain);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 7500.0);
+    // Тождество не убирается, если операнд может быть inf или nan: результат остаётся ошибкой
+    sheet.SetCell("D1"_pos, "inf");
+    sheet.SetCell("D2"_pos, "nan");
+    for (std::string formula : { "=D1*1", "=D1-0", "=D1/1", "=1*D1", "=-D1*1", "=D2*1" }) {
+        sheet.SetCell("E1"_pos, formula);
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("E1"_pos)->GetValue()),
+            FormulaError(FormulaError::Category::Div0));
+    }
+}
+
+void TestEvaluateColumn() {
+    auto fill = [](Sheet& sheet) {
+        for (int r = 0; r < 10; ++r) {
+            std::string row = std::to_string(r + 1);
+            sheet.SetCell(Position{ r, 0 }, std::to_string(r + 1));
+            sheet.SetCell(Position{ r, 2 }, std::to_string(r % 4));
+            sheet.SetCell(Position{ r, 1 }, "=10/A" + row + "-C" + row + "*-1");
+        }
+        sheet.SetCell("A5"_pos, "x");
+        sheet.SetCell("A7"_pos, "");
+        sheet.SetCell("A3"_pos, "=1/0");
+        sheet.SetCell("B6"_pos, "=A6+100");
+        // #VALUE! операнда встречается раньше деления на ноль
+        sheet.SetCell("C5"_pos, "0");
+    };
+    Sheet batch_sheet;
+    Sheet lazy_sheet;
+    fill(batch_sheet);
+    fill(lazy_sheet);
+
+    // Строки 1-5 и 7-10 вычисляются пакетами, B6 остаётся ленивой
+    ASSERT_EQUAL(batch_sheet.EvaluateColumn("B1"_pos, 12), 9u);
+    for (int r = 0; r < 10; ++r) {
+        Position pos{ r, 1 };
+        ASSERT_EQUAL(batch_sheet.GetCell(pos)->GetValue(), lazy_sheet.GetCell(pos)->GetValue());
+    }
+    ASSERT_EQUAL(std::get<FormulaError>(batch_sheet.GetCell("B3"_pos)->GetValue()), FormulaError(FormulaError::Category::Div0));
+    ASSERT_EQUAL(std::get<FormulaError>(batch_sheet.GetCell("B5"_pos)->GetValue()), FormulaError(FormulaError::Category::Value));
+    ASSERT_EQUAL(std::get<FormulaError>(batch_sheet.GetCell("B7"_pos)->GetValue()), FormulaError(FormulaError::Category::Div0));
+
+    // Уже вычисленные ячейки не пересчитываются, изменения сбрасывают кэш как обычно
+    ASSERT_EQUAL(batch_sheet.EvaluateColumn("B1"_pos, 10), 0u);
+    batch_sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(batch_sheet.GetCell("B1"_pos)->GetValue()), 2.0);
+}
+
+void TestCompactCells() {
+    ASSERT(sizeof(Cell) <= 24);
+    Sheet sheet;
+    const std::string short_text = "14 characters!";
+    const std::string long_text = "15 characters!!";
+    sheet.SetCell("A1"_pos, short_text);
+    sheet.SetCell("A2"_pos, long_text);
+    sheet.SetCell("A3"_pos, "'=escaped");
+    sheet.SetCell("A4"_pos, "=A5+1");
+    sheet.SetCell("B1"_pos, "42");
+
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), short_text);
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A2"_pos)->GetValue()), long_text);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "'=escaped");
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A3"_pos)->GetValue()), "=escaped");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValue()), 1.0);
+
+    // Длинный текст заменяется коротким и наоборот
+    sheet.SetCell("A1"_pos, long_text + long_text);
+    sheet.SetCell("A2"_pos, "short");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), long_text + long_text);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "short");
+
+    SheetMemoryReport report = sheet.GetMemoryReport();
+    // A5 создана как пустая ячейка, на которую ссылается формула
+    ASSERT_EQUAL(report.cells, 6u);
+    ASSERT_EQUAL(report.empty_cells, 1u);
+    ASSERT_EQUAL(report.short_texts, 3u);
+    ASSERT_EQUAL(report.long_texts, 1u);
+    ASSERT_EQUAL(report.formulas, 1u);
+    ASSERT_EQUAL(report.cell_bytes, 6 * sizeof(Cell));
+    // Журнал версий не ведётся, пока выгрузка изменений выключена
+    ASSERT_EQUAL(report.version_log_bytes, 0u);
+    ASSERT_EQUAL(report.total_bytes, report.grid_bytes + report.cell_bytes + report.heap_bytes + report.pool_bytes);
+    ASSERT(report.total_bytes < report.legacy_bytes);
+
+    std::ostringstream out;
+    out << report;
+    ASSERT(out.str().find("former layout") != std::string::npos);
+}
+
+void TestTextPool() {
+    const std::string label = "REGION-NORTH-EAST-017";
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, label);
+    sheet.SetCell("B2"_pos, label);
+    sheet.SetCell("C3"_pos, "'" + label);
+    sheet.SetCell("D4"_pos, "=1/2");
+
+    // Одинаковые длинные тексты хранятся в пуле один раз
+    const Cell* a1 = static_cast<const Cell*>(sheet.GetCell("A1"_pos));
+    const Cell* b2 = static_cast<const Cell*>(sheet.GetCell("B2"_pos));
+    ASSERT(a1->GetTextView().data() == b2->GetTextView().data());
+    ASSERT_EQUAL(std::get<std::string>(b2->GetValue()), label);
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("C3"_pos)->GetValue()), label);
+    ASSERT_EQUAL(sheet.GetMemoryReport().pooled_texts, 2u);
+
+    // Очистка и перезапись ячейки не затрагивают текст другой ячейки
+    sheet.ClearCell("A1"_pos);
+    sheet.SetCell("B2"_pos, label + "-X");
+    sheet.SetCell("E5"_pos, label);
+    ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetText(), label);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), label + "-X");
+    ASSERT_EQUAL(sheet.GetMemoryReport().pooled_texts, 3u);
+
+    // Печать из представлений совпадает с печатью через GetValue()/GetText()
+    std::ostringstream values;
+    std::ostringstream texts;
+    sheet.PrintValues(values);
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(values.str(), "\t\t\t\t\n\t" + label + "-X\t\t\t\n\t\t" + label + "\t\t\n\t\t\t0.5\t\n\t\t\t\t" + label + "\n");
+    ASSERT_EQUAL(texts.str(), "\t\t\t\t\n\t" + label + "-X\t\t\t\n\t\t'" + label + "\t\t\n\t\t\t=1/2\t\n\t\t\t\t" + label + "\n");
+}
+
+void TestAllocationFreeReads() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "a label longer than the inline text");
+    sheet.SetCell("A3"_pos, "'=escaped");
+    sheet.SetCell("B1"_pos, "=(A1+C1)*A1+A1");
+    sheet.SetCell("B2"_pos, "=A2");
+    // Первое вычисление формул заполняет кэш
+    sheet.GetCell("B1"_pos)->GetValue();
+    sheet.GetCell("B2"_pos)->GetValue();
+
+    const CellInterface* a2 = sheet.GetCell("A2"_pos);
+    const CellInterface* a3 = sheet.GetCell("A3"_pos);
+    const CellInterface* b1 = sheet.GetCell("B1"_pos);
+    const CellInterface* b2 = sheet.GetCell("B2"_pos);
+    size_t allocations = g_allocations;
+    CellInterface::ValueView a2_value = a2->GetValueView();
+    CellInterface::ValueView a3_value = a3->GetValueView();
+    CellInterface::ValueView b1_value = b1->GetValueView();
+    CellInterface::ValueView b2_value = b2->GetValueView();
+    std::string_view a3_text = a3->GetTextView();
+    std::string_view b1_text = b1->GetTextView();
+    PositionSpan b1_cells = b1->GetReferencedCellsSpan();
+    PositionSpan a2_cells = a2->GetReferencedCellsSpan();
+    size_t read_allocations = g_allocations - allocations;
+
+    ASSERT_EQUAL(read_allocations, 0u);
+    ASSERT_EQUAL(std::get<std::string_view>(a2_value), "a label longer than the inline text");
+    ASSERT_EQUAL(std::get<std::string_view>(a3_value), "=escaped");
+    ASSERT_EQUAL(std::get<double>(b1_value), 6.0);
+    ASSERT_EQUAL(std::get<FormulaError>(b2_value), FormulaError(FormulaError::Category::Value));
+    ASSERT_EQUAL(a3_text, "'=escaped");
+    ASSERT_EQUAL(b1_text, "=(A1+C1)*A1+A1");
+    ASSERT_EQUAL(std::vector<Position>(b1_cells.begin(), b1_cells.end()), (std::vector<Position>{ "A1"_pos, "C1"_pos }));
+    ASSERT(a2_cells.empty());
+
+    // Кэшированные текст и ссылки обновляются вместе со ссылками формулы
+    sheet.InsertRows(0);
+    const CellInterface* b2_moved = sheet.GetCell("B2"_pos);
+    ASSERT_EQUAL(b2_moved->GetTextView(), "=(A2+C2)*A2+A2");
+    ASSERT_EQUAL(b2_moved->GetReferencedCells(), (std::vector<Position>{ "A2"_pos, "C2"_pos }));
+    sheet.DeleteCols(0);
+    const CellInterface* a2_moved = sheet.GetCell("A2"_pos);
+    ASSERT_EQUAL(a2_moved->GetTextView(), "=(#REF!+B2)*#REF!+#REF!");
+    ASSERT_EQUAL(a2_moved->GetReferencedCells(), (std::vector<Position>{ "B2"_pos }));
+}
+
+void TestSubscriptions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("E10"_pos, "far");
+
+    std::vector<SheetChanges> near;
+    size_t far_notifications = 0;
+    SubscriptionId near_id = sheet.Subscribe(CellRange{ "A1"_pos, "B2"_pos }, [&near](const SheetChanges& changes) {
+        near.push_back(changes);
+    });
+    sheet.Subscribe(CellRange{ "Z100"_pos, "Z200"_pos }, [&far_notifications](const SheetChanges&) {
+        ++far_notifications;
+    });
+
+    // Изменённая ячейка и зависящие от неё формулы
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(near.size(), 1u);
+    ASSERT_EQUAL(near[0].cells, (std::vector<Position>{ "A1"_pos, "B1"_pos }));
+    ASSERT(!near[0].layout_changed);
+
+    // Правки между BeginUpdate() и EndUpdate() дают одно уведомление
+    sheet.BeginUpdate();
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("B2"_pos, "=A1");
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(near.size(), 1u);
+    sheet.EndUpdate();
+    ASSERT_EQUAL(near.size(), 2u);
+    ASSERT_EQUAL(near[1].cells, (std::vector<Position>{ "A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos }));
+
+    // Правки вне диапазонов подписок не приходят подписчикам
+    sheet.SetCell("E10"_pos, "still far");
+    sheet.ClearCell("E10"_pos);
+    sheet.SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(near.size(), 3u);
+    ASSERT_EQUAL(near[2].cells, (std::vector<Position>{ "B1"_pos }));
+    ASSERT_EQUAL(far_notifications, 0u);
+
+    // Вставка строк сдвигает только диапазоны ниже вставки
+    sheet.SetCell("C5"_pos, "moved");
+    sheet.InsertRows(3);
+    ASSERT_EQUAL(near.size(), 3u);
+    ASSERT_EQUAL(far_notifications, 1u);
+
+    sheet.Unsubscribe(near_id);
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(near.size(), 3u);
+}
+
+void TestVersionedDelta() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.GetVersion(), 0u);
+    sheet.SetDeltaExport(true);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+C1");
+    sheet.SetCell("A3"_pos, "label");
+    // Пустая ячейка C1 создана вместе с формулой B1 и не меняет версию
+    ASSERT_EQUAL(sheet.GetVersion(), 3u);
+    ASSERT_EQUAL(sheet.GetCellVersion("C1"_pos).text, 0u);
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetVersion(), 4u);
+    ASSERT_EQUAL(sheet.GetCellVersion("A1"_pos).text, 4u);
+    ASSERT_EQUAL(sheet.GetCellVersion("B1"_pos).text, 2u);
+    ASSERT_EQUAL(sheet.GetCellVersion("B1"_pos).value, 4u);
+    // Очистка несуществующей ячейки ничего не меняет
+    sheet.ClearCell("H8"_pos);
+    ASSERT_EQUAL(sheet.GetVersion(), 4u);
+
+    std::ostringstream delta;
+    sheet.ExportDelta(3, delta);
+    ASSERT_EQUAL(delta.str(), "version\t4\ncell\tA1\t2\t2\ncell\tB1\t=A1+C1\t2\n");
+
+    // Вставка строки сдвигает уже записанные изменения
+    sheet.InsertRows(1);
+    sheet.ClearCell("A4"_pos);
+    std::ostringstream layout_delta;
+    sheet.ExportDelta(4, layout_delta);
+    ASSERT_EQUAL(layout_delta.str(), "version\t6\ninsert_rows\t1\t1\ncell\tA4\t\t\n");
+
+    std::ostringstream full;
+    sheet.ExportDelta(0, full);
+    // Ячейки перечислены в порядке их последнего изменения
+    ASSERT_EQUAL(full.str(), "version\t6\ninsert_rows\t1\t1\ncell\tC1\t\t\ncell\tA1\t2\t2\ncell\tB1\t=A1+C1\t2\ncell\tA4\t\t\n");
+
+    // Удалённые ячейки не попадают в выгрузку
+    sheet.SetCell("A5"_pos, "gone");
+    sheet.DeleteRows(4);
+    std::ostringstream deleted;
+    sheet.ExportDelta(6, deleted);
+    ASSERT_EQUAL(deleted.str(), "version\t8\ndelete_rows\t4\t1\n");
+
+    // Изменения, записанные до вставок строк, сдвигаются при чтении и после сжатия журнала
+    Sheet log;
+    log.SetDeltaExport(true);
+    std::vector<SheetVersion> moved;
+    for (int i = 0; i < 3000; ++i) {
+        log.SetCell("A1"_pos, std::to_string(i));
+        if (i % 1000 == 999) {
+            moved.push_back(log.GetVersion());
+            log.InsertRows(0);
+        }
+    }
+    ASSERT_EQUAL(log.GetCellVersion("A1"_pos).text, 0u);
+    ASSERT_EQUAL(log.GetCellVersion("A2"_pos).text, moved[2]);
+    ASSERT_EQUAL(log.GetCellVersion("A3"_pos).text, moved[1]);
+    ASSERT_EQUAL(log.GetCellVersion("A4"_pos).text, moved[0]);
+    std::ostringstream moved_delta;
+    log.ExportDelta(moved[2] - 1, moved_delta);
+    ASSERT_EQUAL(moved_delta.str(), "version\t" + std::to_string(moved[2] + 1) + "\ninsert_rows\t0\t1\ncell\tA2\t2999\t2999\n");
+    log.DeleteRows(1, 2);
+    ASSERT_EQUAL(log.GetCellVersion("A2"_pos).text, moved[0]);
+    ASSERT_EQUAL(log.GetCellVersion("A3"_pos).text, 0u);
+    ASSERT(log.GetMemoryReport().version_log_bytes > 0);
+
+    // Без включённой выгрузки журнал не ведётся: версии и изменения до её включения неизвестны
+    log.SetDeltaExport(false);
+    ASSERT_EQUAL(log.GetMemoryReport().version_log_bytes, 0u);
+    try {
+        log.GetCellVersion("A2"_pos);
+        ASSERT(false);
+    }
+    catch (const std::logic_error&) {
+    }
+    SheetVersion restart = log.GetVersion();
+    log.SetDeltaExport(true);
+    log.SetCell("B1"_pos, "new");
+    ASSERT_EQUAL(log.GetCellVersion("A2"_pos).text, 0u);
+    ASSERT_EQUAL(log.GetCellVersion("B1"_pos).text, restart + 1);
+    std::ostringstream restarted;
+    log.ExportDelta(restart, restarted);
+    ASSERT_EQUAL(restarted.str(), "version\t" + std::to_string(restart + 1) + "\ncell\tB1\tnew\tnew\n");
+    try {
+        std::ostringstream before;
+        log.ExportDelta(restart - 1, before);
+        ASSERT(false);
+    }
+    catch (const std::logic_error&) {
+    }
+
+    // Табуляции, переводы строк и обратные косые черты в тексте экранируются
+    Sheet escaped;
+    escaped.SetDeltaExport(true);
+    const std::string text = "a\tb\nc\\t\r";
+    escaped.SetCell("A1"_pos, text);
+    std::ostringstream escaped_delta;
+    escaped.ExportDelta(0, escaped_delta);
+    std::istringstream lines(escaped_delta.str());
+    std::string line;
+    std::vector<std::string> records;
+    while (std::getline(lines, line)) {
+        records.push_back(line);
+    }
+    ASSERT_EQUAL(records.size(), 2u);
+    std::vector<std::string> fields(1);
+    for (size_t i = 0; i < records[1].size(); ++i) {
+        char c = records[1][i];
+        if (c == '\t') {
+            fields.emplace_back();
+        }
+        else if (c == '\\') {
+            char escape = records[1][++i];
+            fields.back() += escape == 't' ? '\t' : escape == 'n' ? '\n' : escape == 'r' ? '\r' : escape;
+        }
+        else {
+            fields.back() += c;
+        }
+    }
+    ASSERT(fields == std::vector<std::string>({ "cell", "A1", text, text }));
+}
+
+void TestPrintViewport() {
+    Sheet sheet;
+    for (int row = 0; row < 10; ++row) {
+        std::string index = std::to_string(row + 1);
+        sheet.SetCell(Position{ row, 0 }, index);
+        sheet.SetCell(Position{ row, 1 }, "=A" + index + "*2");
+    }
+    sheet.SetCell("D1"_pos, "=B9+1");
+    sheet.SetCell("C3"_pos, "'=text");
+
+    std::ostringstream values;
+    sheet.PrintValues(values, "B2"_pos, "D3"_pos);
+    ASSERT_EQUAL(values.str(), "4\t\t\n6\t=text\t\n");
+    std::ostringstream texts;
+    sheet.PrintTexts(texts, "B2"_pos, "D3"_pos);
+    ASSERT_EQUAL(texts.str(), "=A2*2\t\t\n=A3*2\t'=text\t\n");
+    // Окно за пределами таблицы печатается пустым
+    std::ostringstream outside;
+    sheet.PrintValues(outside, "Z100"_pos, "AA101"_pos);
+    ASSERT_EQUAL(outside.str(), "\t\n\t\n");
+
+    // Вычисляются только формулы окна и ячейки, от которых они зависят
+    if (sheet.GetStats().enabled) {
+        sheet.SetCell("A9"_pos, "90");
+        sheet.ResetStats();
+        std::ostringstream window;
+        sheet.PrintValues(window, "C1"_pos, "D1"_pos);
+        ASSERT_EQUAL(window.str(), "\t181\n");
+        ASSERT_EQUAL(sheet.GetStats().formulas_evaluated, 2u);
+    }
+
+    std::vector<Position> visited;
+    sheet.VisitCells("A9"_pos, "C100"_pos, [&visited](Position pos, const Cell& cell) {
+        visited.push_back(pos);
+        ASSERT(!cell.GetTextView().empty());
+    });
+    ASSERT_EQUAL(visited, (std::vector<Position>{ "A9"_pos, "B9"_pos, "A10"_pos, "B10"_pos }));
+
+    try {
+        sheet.PrintValues(values, "B2"_pos, "A1"_pos);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestPaging() {
+    Sheet paged;
+    Sheet reference;
+    auto set_both = [&paged, &reference](Position pos, const std::string& text) {
+        paged.SetCell(pos, text);
+        reference.SetCell(pos, text);
+    };
+    for (int row = 0; row < 400; ++row) {
+        set_both(Position{ row, 0 }, std::to_string(row + 1));
+        set_both(Position{ row, 2 }, row % 10 == 0 ? "a long label of the row " + std::to_string(row) : "r" + std::to_string(row));
+    }
+    set_both("B1"_pos, "=A300+1");
+    set_both("D1"_pos, "'=escaped");
+    // Закреплённая ошибка выгружается и читается обратно как ошибка
+    for (Sheet* sheet : { &paged, &reference }) {
+        sheet->ApplyValueTicks({ { "C351"_pos, FormulaError(FormulaError::Category::Div0) } });
+    }
+    set_both("B2"_pos, "=C351+1");
+
+    paged.SetMemoryBudget(20000);
+    PagingStats stats = paged.GetPagingStats();
+    ASSERT(stats.paged_blocks > 0);
+    ASSERT(stats.resident_bytes <= 20000);
+    ASSERT(stats.file_bytes > 0);
+
+    // Ячейки выгруженных блоков читаются прозрачно
+    size_t faults = stats.page_faults;
+    ASSERT_EQUAL(paged.GetCell("C391"_pos)->GetText(), "a long label of the row 390");
+    ASSERT(paged.GetPagingStats().page_faults > faults);
+    ASSERT_EQUAL(std::get<double>(paged.GetCell("B1"_pos)->GetValue()), 301.0);
+    ASSERT(paged.GetCell("C351"_pos)->GetValue() == CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+
+    // Изменение ячейки выгруженного блока пересчитывает формулы
+    paged.SetCell("A300"_pos, "1000");
+    reference.SetCell("A300"_pos, "1000");
+    ASSERT_EQUAL(std::get<double>(paged.GetCell("B1"_pos)->GetValue()), 1001.0);
+
+    auto print = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    ASSERT_EQUAL(print(paged), print(reference));
+    ASSERT(paged.GetPagingStats().resident_bytes <= 20000);
+
+    paged.InsertRows(100, 2);
+    reference.InsertRows(100, 2);
+    paged.DeleteCols(0);
+    reference.DeleteCols(0);
+    ASSERT_EQUAL(print(paged), print(reference));
+
+    paged.SetMemoryBudget(0);
+    ASSERT_EQUAL(paged.GetPagingStats().paged_blocks, 0u);
+    ASSERT_EQUAL(print(paged), print(reference));
+    // Счётчики блоков, сдвинутые при включённой выгрузке, совпадают с пересчитанными
+    ASSERT_EQUAL(paged.GetPagingStats().resident_bytes, reference.GetPagingStats().resident_bytes);
+
+    // Без выгрузки счётчики пересчитываются только при её включении
+    paged.SetMemoryBudget(size_t(1) << 30);
+    for (Sheet* sheet : { &paged, &reference }) {
+        sheet->DeleteRows(10, 70);
+        sheet->InsertCols(1);
+        sheet->InsertRows(0, 3);
+        sheet->DeleteCols(2);
+    }
+    ASSERT_EQUAL(paged.GetPagingStats().resident_bytes, reference.GetPagingStats().resident_bytes);
+    reference.SetMemoryBudget(5000);
+    ASSERT(reference.GetPagingStats().paged_blocks > 0);
+    ASSERT_EQUAL(print(paged), print(reference));
+}
+
+void TestFork() {
+    auto print = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    auto fill = [](Sheet& sheet) {
+        for (int row = 0; row < 300; ++row) {
+            std::string r = std::to_string(row + 1);
+            sheet.SetCell(Position{ row, 0 }, r);
+            sheet.SetCell(Position{ row, 1 }, row == 0 ? "=A1" : "=A" + r + "+B" + std::to_string(row));
+            sheet.SetCell(Position{ row, 3 }, "a long label of the row " + r);
+        }
+        sheet.SetCell("C1"_pos, "=B300*2");
+    };
+    Sheet sheet;
+    fill(sheet);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 90300.0);
+
+    SheetMemoryReport before_fork = sheet.GetMemoryReport();
+    std::unique_ptr<Sheet> fork = sheet.Fork();
+    ASSERT_EQUAL(fork->GetMemoryReport().shared_blocks, 5u);
+    ASSERT(fork->GetMemoryReport().shared_bytes > 0);
+    ASSERT_EQUAL(fork->GetVersion(), sheet.GetVersion());
+    // Строки листа переходят в общие блоки без копирования ячеек
+    SheetMemoryReport after_fork = sheet.GetMemoryReport();
+    ASSERT_EQUAL(after_fork.lent_blocks, 5u);
+    ASSERT_EQUAL(after_fork.cells, before_fork.cells);
+    ASSERT_EQUAL(after_fork.total_bytes, before_fork.total_bytes);
+
+    // Значения берутся из скопированного кэша, чтение копирует только формулы
+    ASSERT_EQUAL(std::get<double>(fork->GetCell("C1"_pos)->GetValue()), 90300.0);
+    bool stats_enabled = fork->GetStats().enabled;
+    ASSERT_EQUAL(fork->GetStats().formulas_evaluated, 0u);
+    ASSERT_EQUAL(fork->GetCell("D290"_pos)->GetText(), "a long label of the row 290");
+    ASSERT_EQUAL(fork->GetMemoryReport().shared_blocks, 5u);
+    ASSERT_EQUAL(fork->GetMemoryReport().cells, 1u);
+
+    // Изменение копирует блок, пересчитываются только зависящие от него формулы
+    fork->SetCell("A201"_pos, "1201");
+    ASSERT_EQUAL(fork->GetMemoryReport().shared_blocks, 4u);
+    ASSERT_EQUAL(std::get<double>(fork->GetCell("C1"_pos)->GetValue()), 92300.0);
+    ASSERT_EQUAL(fork->GetStats().formulas_evaluated, stats_enabled ? 101u : 0u);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 90300.0);
+
+    // Изменения листа не видны в копии
+    sheet.SetCell("A1"_pos, "=A2*0");
+    sheet.SetCell("D1"_pos, "changed after the fork");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 90298.0);
+    ASSERT_EQUAL(std::get<double>(fork->GetCell("C1"_pos)->GetValue()), 92300.0);
+    ASSERT_EQUAL(fork->GetCell("D1"_pos)->GetText(), "a long label of the row 1");
+
+    Sheet reference;
+    fill(reference);
+    reference.SetCell("A201"_pos, "1201");
+    ASSERT_EQUAL(print(*fork), print(reference));
+
+    // Общие формулы копируются перед обновлением ссылок
+    std::unique_ptr<Sheet> fork_of_fork = fork->Fork();
+    sheet.InsertRows(0, 2);
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=B302*2");
+    ASSERT_EQUAL(fork->GetCell("C1"_pos)->GetText(), "=B300*2");
+    fork->DeleteRows(100, 10);
+    reference.DeleteRows(100, 10);
+    ASSERT_EQUAL(print(*fork), print(reference));
+
+    fork_of_fork->SetCell("D5"_pos, "edited by the second fork");
+    fork_of_fork->SetMemoryBudget(10000);
+    ASSERT_EQUAL(fork_of_fork->GetMemoryReport().shared_blocks, 0u);
+    ASSERT_EQUAL(fork_of_fork->GetCell("D5"_pos)->GetText(), "edited by the second fork");
+    ASSERT_EQUAL(std::get<double>(fork_of_fork->GetCell("C1"_pos)->GetValue()), 92300.0);
+
+    // Копия переживает исходный лист
+    fork.reset();
+    double before_edit = std::get<double>(sheet.GetCell("C3"_pos)->GetValue());
+    std::unique_ptr<Sheet> last_fork = sheet.Fork();
+    sheet.SetCell("D3"_pos, "x");
+    Sheet().Fork();
+    ASSERT_EQUAL(last_fork->GetCell("D3"_pos)->GetText(), "changed after the fork");
+
+    // Лист сохраняет для копии значения кэша, которые он меняет
+    sheet.SetCell("A5"_pos, "1000");
+    ASSERT(std::get<double>(sheet.GetCell("C3"_pos)->GetValue()) != before_edit);
+    ASSERT_EQUAL(std::get<double>(last_fork->GetCell("C3"_pos)->GetValue()), before_edit);
+    ASSERT_EQUAL(last_fork->GetStats().formulas_evaluated, 0u);
+
+    // Без копий лист забирает свои строки обратно: ячейки остаются на месте
+    last_fork.reset();
+    const CellInterface* label = sheet.GetCell("D250"_pos);
+    sheet.Fork();
+    sheet.SetCell("D251"_pos, "y");
+    ASSERT(sheet.GetCell("D250"_pos) == label);
+    ASSERT_EQUAL(sheet.GetMemoryReport().lent_blocks, 4u);
+    ASSERT_EQUAL(label->GetText(), "a long label of the row 248");
+}
+
+void TestSweep() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1*2+A2");
+    sheet.SetCell("B2"_pos, "=B1/A2");
+    sheet.SetCell("C1"_pos, "=B2+D1");
+    sheet.SetCell("D1"_pos, "10");
+    sheet.SetCell("E1"_pos, "=D1*3");
+    sheet.SetCell("F1"_pos, "5");
+    sheet.SetCell("G1"_pos, "=A1+A1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 12.0);
+    SheetVersion version = sheet.GetVersion();
+
+    std::vector<std::vector<double>> input_values;
+    for (int i = 0; i < 1000; ++i) {
+        input_values.push_back({ static_cast<double>(i), static_cast<double>(i % 3) });
+    }
+    std::vector<Position> outputs = { "C1"_pos, "E1"_pos, "F1"_pos, "A2"_pos, "G1"_pos };
+    SweepResult result = sheet.Sweep({ "A1"_pos, "A2"_pos }, input_values, outputs, 4);
+    ASSERT_EQUAL(result.rows, 1000u);
+    ASSERT_EQUAL(result.cols, outputs.size());
+    for (int i = 0; i < 1000; ++i) {
+        double a2 = i % 3;
+        if (a2 == 0) {
+            ASSERT_EQUAL(std::get<FormulaError>(result.At(i, 0)), FormulaError(FormulaError::Category::Div0));
+        }
+        else {
+            ASSERT_EQUAL(std::get<double>(result.At(i, 0)), (2.0 * i + a2) / a2 + 10);
+        }
+        ASSERT_EQUAL(std::get<double>(result.At(i, 1)), 30.0);
+        ASSERT_EQUAL(std::get<double>(result.At(i, 2)), 5.0);
+        ASSERT_EQUAL(std::get<double>(result.At(i, 3)), a2);
+        ASSERT_EQUAL(std::get<double>(result.At(i, 4)), 2.0 * i);
+    }
+
+    // Лист не изменился
+    ASSERT_EQUAL(sheet.GetVersion(), version);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 12.0);
+
+    // Один поток даёт те же значения
+    SweepResult sequential = sheet.Sweep({ "A1"_pos, "A2"_pos }, input_values, outputs, 1);
+    ASSERT(sequential.values == result.values);
+
+    try {
+        sheet.Sweep({ "A1"_pos }, { { 1.0, 2.0 } }, outputs);
+        ASSERT(false);
+    }
+    catch (const std::invalid_argument&) {
+    }
+    ASSERT_EQUAL(sheet.Sweep({ "A1"_pos }, {}, outputs).values.size(), 0u);
+}
+void TestIterativeCalculation() {
+    auto near = [](const CellInterface* cell, double expected) {
+        return std::abs(std::get<double>(cell->GetValue()) - expected) < 1e-6;
+    };
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1000");
+    sheet.SetCell("B1"_pos, "=C1*0.05");
+    sheet.SetCell("C1"_pos, "=(A1+D1)/2");
+    // Без итеративного режима цикл запрещён
+    try {
+        sheet.SetCell("D1"_pos, "=A1+B1");
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+
+    // Проценты зависят от среднего остатка: C1 = A1 / 0.975
+    sheet.SetIterativeCalculation(true, 100, 1e-9);
+    sheet.SetCell("D1"_pos, "=A1+B1");
+    sheet.SetCell("E1"_pos, "=D1*2");
+    sheet.SetCell("F1"_pos, "=G1/2+1");
+    sheet.SetCell("G1"_pos, "=F1");
+    sheet.SetCell("H1"_pos, "=H1*2+1");
+    ASSERT(near(sheet.GetCell("E1"_pos), 2000 * 1.025 / 0.975));
+    ASSERT(near(sheet.GetCell("C1"_pos), 1000 / 0.975));
+    ASSERT(near(sheet.GetCell("F1"_pos), 2.0));
+    ASSERT(std::get<double>(sheet.GetCell("H1"_pos)->GetValue()) > 1e20);
+
+    std::vector<CycleStatus> cycles = sheet.GetCycleStatus();
+    ASSERT_EQUAL(cycles.size(), 3u);
+    ASSERT(cycles[0].cells == std::vector<Position>({ "B1"_pos, "C1"_pos, "D1"_pos }));
+    ASSERT(cycles[0].converged);
+    ASSERT(cycles[0].iterations > 1 && cycles[0].max_change <= 1e-9);
+    ASSERT(cycles[1].cells == std::vector<Position>({ "F1"_pos, "G1"_pos }));
+    ASSERT(cycles[1].converged);
+    // Расходящийся цикл останавливается после max_iterations
+    ASSERT(cycles[2].cells == std::vector<Position>({ "H1"_pos }));
+    ASSERT(!cycles[2].converged);
+    ASSERT_EQUAL(cycles[2].iterations, 100);
+
+    // Правка пересчитывает только зависящий от неё цикл
+    sheet.SetCell("A1"_pos, "2000");
+    sheet.ResetStats();
+    ASSERT(near(sheet.GetCell("E1"_pos), 4000 * 1.025 / 0.975));
+    ASSERT(near(sheet.GetCell("F1"_pos), 2.0));
+    std::vector<CycleStatus> after_edit = sheet.GetCycleStatus();
+    if (sheet.GetStats().enabled) {
+        ASSERT_EQUAL(sheet.GetStats().formulas_evaluated, 3u * after_edit[0].iterations + 1);
+    }
+    ASSERT_EQUAL(after_edit[1].iterations, cycles[1].iterations);
+
+    try {
+        sheet.Sweep({ "A1"_pos }, { { 1.0 } }, { "E1"_pos });
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetIterativeCalculation(false);
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+
+    // Без циклов режим можно выключить
+    sheet.SetCell("B1"_pos, "0");
+    sheet.SetCell("G1"_pos, "1");
+    sheet.SetCell("H1"_pos, "1");
+    ASSERT(sheet.GetCycleStatus().empty());
+    sheet.SetIterativeCalculation(false);
+    ASSERT(near(sheet.GetCell("E1"_pos), 4000.0));
+}
+void TestPrecedentsAndDependents() {
+    using Positions = std::vector<Position>;
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+A1");
+    sheet.SetCell("D1"_pos, "=C1+E1");
+    sheet.SetCell("E1"_pos, "5");
+    sheet.SetCell("F1"_pos, "7");
+
+    ASSERT(sheet.GetPrecedents("C1"_pos) == Positions({ "A1"_pos, "B1"_pos }));
+    ASSERT(sheet.GetPrecedents("D1"_pos, true) == Positions({ "A1"_pos, "B1"_pos, "C1"_pos, "E1"_pos }));
+    ASSERT(sheet.GetPrecedents("A1"_pos, true).empty());
+    ASSERT(sheet.GetDependents("A1"_pos) == Positions({ "B1"_pos, "C1"_pos }));
+    ASSERT(sheet.GetDependents("A1"_pos, true) == Positions({ "B1"_pos, "C1"_pos, "D1"_pos }));
+    ASSERT(sheet.GetDependents("F1"_pos, true).empty());
+    ASSERT(sheet.GetDependents("Z100"_pos, true).empty());
+    try {
+        sheet.GetDependents(Position{ -1, 0 });
+        ASSERT(false);
+    }
+    catch (const InvalidPositionException&) {
+    }
+
+    // Индекс перестраивается после изменения зависимостей
+    std::unique_ptr<Sheet> fork = sheet.Fork();
+    sheet.SetCell("C1"_pos, "=5");
+    ASSERT(sheet.GetDependents("A1"_pos, true) == Positions({ "B1"_pos }));
+    ASSERT(sheet.GetPrecedents("D1"_pos, true) == Positions({ "C1"_pos, "E1"_pos }));
+    ASSERT(fork->GetDependents("A1"_pos, true) == Positions({ "B1"_pos, "C1"_pos, "D1"_pos }));
+    sheet.InsertRows(0);
+    ASSERT(sheet.GetDependents("A2"_pos, true) == Positions({ "B2"_pos }));
+
+    // В цикле ячейка влияет сама на себя
+    sheet.SetIterativeCalculation(true);
+    sheet.SetCell("A2"_pos, "=B2/2");
+    ASSERT(sheet.GetDependents("A2"_pos, true) == Positions({ "A2"_pos, "B2"_pos }));
+    ASSERT(sheet.GetPrecedents("A2"_pos, true) == Positions({ "A2"_pos, "B2"_pos }));
+}
+void TestCompressedDependencies() {
+    using Positions = std::vector<Position>;
+    auto value = [](const Sheet& sheet, Position pos) {
+        return std::get<double>(sheet.GetCell(pos)->GetValue());
+    };
+    Sheet sheet;
+    for (int r = 0; r < 1000; ++r) {
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell(Position{ r, 0 }, row);
+        sheet.SetCell(Position{ r, 1 }, "2");
+        sheet.SetCell(Position{ r, 2 }, "=A" + row + "*B" + row);
+    }
+    // Столбец формул хранится одной серией рёбер
+    SheetStats stats = sheet.GetStats();
+    if (stats.enabled) {
+        ASSERT_EQUAL(stats.graph_runs, 1u);
+        ASSERT_EQUAL(stats.graph_edges, 2000u);
+        ASSERT_EQUAL(stats.graph_vertices, 3000u);
+        ASSERT(stats.graph_bytes * 10 < stats.graph_uncompressed_bytes);
+    }
+    ASSERT_EQUAL(value(sheet, "C1000"_pos), 2000.0);
+    ASSERT(sheet.GetDependents("A500"_pos) == Positions({ "C500"_pos }));
+    ASSERT(sheet.GetPrecedents("C500"_pos) == Positions({ "A500"_pos, "B500"_pos }));
+    sheet.ResetStats();
+    sheet.SetCell("A500"_pos, "7");
+    if (stats.enabled) {
+        ASSERT_EQUAL(sheet.GetStats().cells_invalidated, 2u);
+    }
+    ASSERT_EQUAL(value(sheet, "C500"_pos), 14.0);
+
+    // Изменение в середине разбивает серию, возврат формулы соединяет её
+    sheet.SetCell("C500"_pos, "=A500+1");
+    ASSERT_EQUAL(value(sheet, "C500"_pos), 8.0);
+    ASSERT(sheet.GetDependents("B500"_pos).empty());
+    ASSERT(sheet.GetDependents("B501"_pos) == Positions({ "C501"_pos }));
+    if (stats.enabled) {
+        ASSERT_EQUAL(sheet.GetStats().graph_runs, 2u);
+        ASSERT_EQUAL(sheet.GetStats().graph_edges, 1999u);
+    }
+    sheet.SetCell("C500"_pos, "=A500*B500");
+    ASSERT_EQUAL(value(sheet, "C500"_pos), 14.0);
+    if (stats.enabled) {
+        ASSERT_EQUAL(sheet.GetStats().graph_runs, 1u);
+    }
+
+    // Цепочка D{n} = D{n-1}+1 тоже серия, циклы в ней находятся
+    sheet.SetCell("D1"_pos, "1");
+    for (int r = 1; r < 1000; ++r) {
+        sheet.SetCell(Position{ r, 3 }, "=D" + std::to_string(r) + "+1");
+    }
+    ASSERT_EQUAL(value(sheet, "D1000"_pos), 1000.0);
+    try {
+        sheet.SetCell("D1"_pos, "=D1000");
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet.GetDependents("D1"_pos, true).size() == 999u);
+
+    // Вставка и удаление строк сдвигают серии
+    sheet.InsertRows(499, 2);
+    ASSERT_EQUAL(sheet.GetCell("C502"_pos)->GetText(), "=A502*B502");
+    ASSERT_EQUAL(value(sheet, "C502"_pos), 14.0);
+    ASSERT(sheet.GetDependents("A502"_pos) == Positions({ "C502"_pos }));
+    ASSERT(sheet.GetDependents("D499"_pos) == Positions({ "D502"_pos }));
+    sheet.SetCell("A502"_pos, "10");
+    ASSERT_EQUAL(value(sheet, "C502"_pos), 20.0);
+    ASSERT_EQUAL(value(sheet, "D1002"_pos), 1000.0);
+    sheet.DeleteRows(499, 2);
+    ASSERT(sheet.GetDependents("A500"_pos) == Positions({ "C500"_pos }));
+    ASSERT_EQUAL(value(sheet, "C1000"_pos), 2000.0);
+    sheet.DeleteRows(0);
+    ASSERT(sheet.GetPrecedents("D1"_pos).empty());
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=#REF!+1");
+    ASSERT(sheet.GetDependents("D1"_pos, true).size() == 998u);
+
+    // Серия вдоль строки
+    Sheet row_sheet;
+    row_sheet.SetCell("A1"_pos, "1");
+    for (int c = 1; c < 100; ++c) {
+        row_sheet.SetCell(Position{ 1, c }, "=" + Position{ 0, c - 1 }.ToString() + "*2");
+        row_sheet.SetCell(Position{ 0, c }, "=" + Position{ 1, c }.ToString());
+    }
+    ASSERT_EQUAL(std::get<double>(row_sheet.GetCell(Position{ 0, 10 })->GetValue()), 1024.0);
+    if (row_sheet.GetStats().enabled) {
+        ASSERT_EQUAL(row_sheet.GetStats().graph_runs, 2u);
+    }
+
+    // Вставка между формулами серии и их ячейками режет серию только там, где
+    // меняется смещение; серия целиком после вставки сдвигается как есть
+    Sheet shifted;
+    for (int r = 0; r < 23; ++r) {
+        shifted.SetCell(Position{ r, 4 }, std::to_string(r + 1));
+    }
+    for (int r = 0; r < 20; ++r) {
+        shifted.SetCell(Position{ r, 5 }, "=E" + std::to_string(r + 4));
+    }
+    shifted.InsertRows(9, 2);
+    if (shifted.GetStats().enabled) {
+        ASSERT_EQUAL(shifted.GetStats().graph_runs, 3u);
+    }
+    ASSERT(shifted.GetPrecedents("F6"_pos) == Positions({ "E9"_pos }));
+    ASSERT(shifted.GetPrecedents("F7"_pos) == Positions({ "E12"_pos }));
+    ASSERT(shifted.GetPrecedents("F12"_pos) == Positions({ "E15"_pos }));
+    ASSERT(shifted.GetDependents("E25"_pos) == Positions({ "F22"_pos }));
+    ASSERT_EQUAL(value(shifted, "F7"_pos), 10.0);
+    shifted.InsertCols(0);
+    shifted.InsertRows(30, 5);
+    ASSERT(shifted.GetPrecedents("G7"_pos) == Positions({ "F12"_pos }));
+    shifted.SetCell("F12"_pos, "100");
+    ASSERT_EQUAL(value(shifted, "G7"_pos), 100.0);
+    shifted.DeleteRows(9, 2);
+    ASSERT(shifted.GetPrecedents("G7"_pos) == Positions({ "F10"_pos }));
+    ASSERT(shifted.GetDependents("F23"_pos) == Positions({ "G20"_pos }));
+    ASSERT_EQUAL(value(shifted, "G20"_pos), 23.0);
+}
+
+void TestBackgroundRecalculation() {
+    auto number = [](const CellInterface::Value& value) {
+        return std::get<double>(value);
+    };
+    // Без фонового пересчёта: последнее значение помечено устаревшим
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(number(sheet.GetCell("B1"_pos)->GetValue()), 2.0);
+    sheet.SetCell("A1"_pos, "5");
+    CachedValue cached = sheet.GetCachedValue("B1"_pos);
+    ASSERT(cached.stale);
+    ASSERT_EQUAL(number(cached.value), 2.0);
+    ASSERT_EQUAL(number(sheet.GetCell("B1"_pos)->GetValue()), 10.0);
+    ASSERT(!sheet.GetCachedValue("B1"_pos).stale);
+    ASSERT(!sheet.GetRecalcStats().enabled);
+
+    // Цепочка D{n} = D{n-1}+1: формулы, не вычисленные до включения, пересчитываются
+    sheet.SetCell("D1"_pos, "0");
+    for (int r = 1; r < 2000; ++r) {
+        sheet.SetCell(Position{ r, 3 }, "=D" + std::to_string(r) + "+1");
+    }
+    sheet.SetBackgroundRecalculation(true);
+    sheet.WaitForRecalculation();
+    ASSERT(sheet.GetRecalcStats().recalculated >= 1999u);
+    cached = sheet.GetCachedValue("D2000"_pos);
+    ASSERT(!cached.stale);
+    ASSERT_EQUAL(number(cached.value), 1999.0);
+
+    // Правка возвращается сразу: значение либо старое и устаревшее, либо уже новое
+    sheet.SetCell("D1"_pos, "10");
+    cached = sheet.GetCachedValue("D2000"_pos);
+    ASSERT_EQUAL(number(cached.value), cached.stale ? 1999.0 : 2009.0);
+    // GetValue ждёт только нужную ячейку
+    ASSERT_EQUAL(number(sheet.GetCell("D2000"_pos)->GetValue()), 2009.0);
+
+    // Правки во время пересчёта отменяют его и ставят ячейки в очередь заново
+    for (int i = 1; i <= 50; ++i) {
+        sheet.SetCell("D1"_pos, std::to_string(i));
+    }
+    // Чтения идут параллельно с пересчётом
+    std::thread reader([&sheet, &number]() {
+        for (int r = 1999; r > 0; r -= 100) {
+            ASSERT_EQUAL(number(sheet.GetCell(Position{ r, 3 })->GetValue()), 50.0 + r);
+        }
+    });
+    reader.join();
+    sheet.WaitForRecalculation();
+    RecalcStats stats = sheet.GetRecalcStats();
+    ASSERT(stats.enabled);
+    ASSERT_EQUAL(stats.queued, 0u);
+    for (int r = 100; r < 2000; r += 100) {
+        cached = sheet.GetCachedValue(Position{ r, 3 });
+        ASSERT(!cached.stale);
+        ASSERT_EQUAL(number(cached.value), 50.0 + r);
+    }
+
+    // Вставка строк перестраивает очередь по новым позициям
+    sheet.SetCell("D1"_pos, "100");
+    sheet.InsertRows(1000, 3);
+    sheet.WaitForRecalculation();
+    cached = sheet.GetCachedValue("D2003"_pos);
+    ASSERT(!cached.stale);
+    ASSERT_EQUAL(number(cached.value), 2099.0);
+
+    // Новая формула без значения вычисляется при чтении
+    sheet.SetCell("E1"_pos, "=D2003+1");
+    cached = sheet.GetCachedValue("E1"_pos);
+    ASSERT(!cached.stale);
+    ASSERT_EQUAL(number(cached.value), 2100.0);
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCachedValue("Z100"_pos).value), "");
+
+    // Несовместимые режимы
+    try {
+        sheet.SetIterativeCalculation(true);
+        ASSERT(false);
+    }
+    catch (const std::logic_error&) {
+    }
+    try {
+        sheet.SetMemoryBudget(1 << 20);
+        ASSERT(false);
+    }
+    catch (const std::logic_error&) {
+    }
+
+    // Копия не наследует фоновый пересчёт
+    std::unique_ptr<Sheet> fork = sheet.Fork();
+    ASSERT(!fork->GetRecalcStats().enabled);
+    fork->SetCell("D1"_pos, "0");
+    ASSERT_EQUAL(number(fork->GetCell("D2003"_pos)->GetValue()), 1999.0);
+
+    sheet.SetBackgroundRecalculation(false);
+    ASSERT(!sheet.GetRecalcStats().enabled);
+    sheet.SetCell("D1"_pos, "1");
+    ASSERT(sheet.GetCachedValue("D2003"_pos).stale);
+    ASSERT_EQUAL(number(sheet.GetCell("D2003"_pos)->GetValue()), 2000.0);
+}
+
+void TestRecalculateFor() {
+    using namespace std::chrono_literals;
+    auto number = [](const CellInterface::Value& value) {
+        return std::get<double>(value);
+    };
+    // D2..D300 и E2..E100 — цепочки, F1 читает конец цепочки D
+    Sheet sheet;
+    sheet.SetCell("D1"_pos, "0");
+    sheet.SetCell("E1"_pos, "0");
+    for (int r = 1; r < 300; ++r) {
+        sheet.SetCell(Position{ r, 3 }, "=D" + std::to_string(r) + "+1");
+        if (r < 100) {
+            sheet.SetCell(Position{ r, 4 }, "=E" + std::to_string(r) + "+1");
+        }
+    }
+    sheet.SetCell("F1"_pos, "=D300*2");
+    const size_t formulas = 299 + 99 + 1;
+
+    // Без бюджета срез делает один шаг обхода и продолжается со следующего
+    sheet.ResetStats();
+    RecalcProgress progress = sheet.RecalculateFor(0us);
+    ASSERT_EQUAL(progress.evaluated, 0u);
+    ASSERT_EQUAL(progress.remaining, formulas);
+    ASSERT(!progress.complete);
+    size_t evaluated = 0;
+    while (!progress.complete) {
+        progress = sheet.RecalculateFor(100us);
+        evaluated += progress.evaluated;
+    }
+    ASSERT_EQUAL(evaluated, formulas);
+    // Порядок зависимостей: каждая формула вычисляется один раз
+    if (sheet.GetStats().enabled) {
+        ASSERT_EQUAL(sheet.GetStats().formulas_evaluated, formulas);
+        ASSERT_EQUAL(sheet.GetStats().cache_misses, formulas);
+    }
+    ASSERT(!sheet.GetCachedValue("F1"_pos).stale);
+    ASSERT_EQUAL(number(sheet.GetCachedValue("F1"_pos).value), 598.0);
+    ASSERT(sheet.RecalculateFor(0us).complete);
+
+    // Правки между срезами добавляются к плану
+    sheet.SetCell("E1"_pos, "10");
+    for (int i = 0; i < 10; ++i) {
+        ASSERT(!sheet.RecalculateFor(0us).complete);
+    }
+    sheet.SetCell("D1"_pos, "1");
+    sheet.SetCell("E50"_pos, "=E49*2");
+    while (!sheet.RecalculateFor(0us).complete) {
+    }
+    ASSERT(!sheet.GetCachedValue("E100"_pos).stale);
+    ASSERT_EQUAL(number(sheet.GetCachedValue("E100"_pos).value), 2.0 * 58 + 50);
+    ASSERT_EQUAL(number(sheet.GetCachedValue("F1"_pos).value), 600.0);
+
+    // Приоритетная область (и то, что она читает) вычисляется первой
+    sheet.SetCell("D1"_pos, "2");
+    sheet.SetCell("E1"_pos, "0");
+    CellRange viewport{ "F1"_pos, "G10"_pos };
+    size_t slices = 0;
+    do {
+        progress = sheet.RecalculateFor(0us, viewport);
+        ++slices;
+    } while (!progress.priority_done);
+    // F1 и D2..D300: по шагу на вход в формулу и на её вычисление
+    ASSERT_EQUAL(slices, 600u);
+    ASSERT(!sheet.GetCachedValue("F1"_pos).stale);
+    ASSERT_EQUAL(number(sheet.GetCachedValue("F1"_pos).value), 602.0);
+    ASSERT(sheet.GetCachedValue("E100"_pos).stale);
+    while (!sheet.RecalculateFor(1ms, viewport).complete) {
+    }
+    ASSERT(!sheet.GetCachedValue("E100"_pos).stale);
+
+    // Вставка строк между срезами: план строится заново
+    sheet.SetCell("D1"_pos, "3");
+    sheet.RecalculateFor(0us);
+    sheet.InsertRows(0, 2);
+    while (!sheet.RecalculateFor(1ms).complete) {
+    }
+    ASSERT(!sheet.GetCachedValue("F3"_pos).stale);
+    ASSERT_EQUAL(number(sheet.GetCachedValue("F3"_pos).value), 604.0);
+
+    // Циклы итеративного режима вычисляются без обхода
+    Sheet circular;
+    circular.SetIterativeCalculation(true, 100, 1e-9);
+    circular.SetCell("A1"_pos, "=B1/2+1");
+    circular.SetCell("B1"_pos, "=A1");
+    circular.SetCell("C1"_pos, "=B1*10");
+    while (!circular.RecalculateFor(1ms).complete) {
+    }
+    ASSERT(!circular.GetCachedValue("C1"_pos).stale);
+    ASSERT(std::abs(number(circular.GetCachedValue("C1"_pos).value) - 20.0) < 1e-6);
+
+    // Формула, заменённая текстом, не остаётся в плане пересчёта
+    Sheet replaced;
+    replaced.SetCell("A1"_pos, "=1+1");
+    replaced.SetCell("B1"_pos, "=A1*2");
+    replaced.SetCell("A1"_pos, "text");
+    progress = replaced.RecalculateFor(1ms);
+    ASSERT(progress.complete);
+    ASSERT_EQUAL(progress.evaluated, 1u);
+    ASSERT_EQUAL(progress.remaining, 0u);
+    replaced.SetCell("B1"_pos, "");
+    progress = replaced.RecalculateFor(0us);
+    ASSERT(progress.complete);
+    ASSERT_EQUAL(progress.remaining, 0u);
+
+    try {
+        sheet.RecalculateFor(1ms, CellRange{ "B2"_pos, "A1"_pos });
+        ASSERT(false);
+    }
+    catch (const InvalidPositionException&) {
+    }
+}
+void TestTicks() {
+    auto number = [](const CellInterface::Value& value) {
+        return std::get<double>(value);
+    };
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "=A2+A3");
+    sheet.SetCell("C1"_pos, "=B1+B2");
+    ASSERT_EQUAL(number(sheet.GetCell("C1"_pos)->GetValue()), 8.0);
+
+    // Тик меняет текст и значение ячейки без разбора формулы
+    sheet.ResetStats();
+    sheet.SetNumber("A1"_pos, 1.5);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1.5");
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A1"_pos)->GetValue()), "1.5");
+    ASSERT_EQUAL(number(sheet.GetCell("C1"_pos)->GetValue()), 8.5);
+    if (sheet.GetStats().enabled) {
+        ASSERT_EQUAL(sheet.GetStats().formulas_parsed, 0u);
+        ASSERT_EQUAL(sheet.GetStats().cells_invalidated, 3u);
+    }
+
+    std::vector<SheetChanges> changes;
+    sheet.Subscribe(CellRange{ "A1"_pos, "C3"_pos }, [&changes](const SheetChanges& change) {
+        changes.push_back(change);
+    });
+    auto fork = sheet.Fork();
+    SheetVersion version = sheet.GetVersion();
+
+    // Пачка тиков: последний тик ячейки побеждает, зависимые сбрасываются один раз
+    sheet.ResetStats();
+    size_t changed = sheet.ApplyTicks({ { "A3"_pos, 5 }, { "A1"_pos, 7 }, { "A3"_pos, 10 }, { "A2"_pos, 2 } });
+    ASSERT_EQUAL(changed, 2u);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "10");
+    ASSERT_EQUAL(number(sheet.GetCell("C1"_pos)->GetValue()), 21.0);
+    if (sheet.GetStats().enabled) {
+        ASSERT_EQUAL(sheet.GetStats().edits, 1u);
+        ASSERT_EQUAL(sheet.GetStats().cells_invalidated, 5u);
+    }
+    ASSERT_EQUAL(sheet.GetVersion(), version + 1);
+    ASSERT_EQUAL(changes.size(), 1u);
+    ASSERT_EQUAL(changes[0].cells, (std::vector<Position>{ "A1"_pos, "B1"_pos, "C1"_pos, "B2"_pos, "A3"_pos }));
+
+    // Копия не видит тиков
+    ASSERT_EQUAL(fork->GetCell("A3"_pos)->GetText(), "3");
+    ASSERT_EQUAL(number(fork->GetCell("C1"_pos)->GetValue()), 8.5);
+
+    // Тики без изменений не создают версию
+    ASSERT_EQUAL(sheet.ApplyTicks({ { "A1"_pos, 7 } }), 0u);
+    sheet.SetNumber("A2"_pos, 2);
+    ASSERT_EQUAL(sheet.GetVersion(), version + 1);
+    ASSERT_EQUAL(changes.size(), 1u);
+
+    // Новая ячейка и формула идут через SetCell
+    ASSERT_EQUAL(sheet.ApplyTicks({ { "A4"_pos, 4 }, { "B2"_pos, -1 } }), 2u);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "4");
+    ASSERT(sheet.GetCell("B2"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(number(sheet.GetCell("C1"_pos)->GetValue()), 8.0);
+    sheet.SetNumber("A3"_pos, 1);
+    ASSERT_EQUAL(number(sheet.GetCell("C1"_pos)->GetValue()), 8.0);
+    sheet.SetNumber("A2"_pos, 0.25);
+    ASSERT_EQUAL(number(sheet.GetCell("C1"_pos)->GetValue()), 6.25);
+
+    // Неверная позиция: ни один тик пачки не применяется
+    try {
+        sheet.ApplyTicks({ { "A1"_pos, 100 }, { Position{ -1, 0 }, 1 } });
+        ASSERT(false);
+    }
+    catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "7");
+    try {
+        sheet.SetNumber(Position{ 0, -1 }, 1);
+        ASSERT(false);
+    }
+    catch (const InvalidPositionException&) {
+    }
+
+    // Значения, вычисленные в другом месте: ошибка закрепляется в ячейке
+    const FormulaError ref(FormulaError::Category::Ref);
+    ASSERT_EQUAL(sheet.ApplyValueTicks({ { "A1"_pos, ref }, { "A3"_pos, 2.0 }, { "A5"_pos, ref } }), 3u);
+    ASSERT(sheet.GetCell("A1"_pos)->GetValue() == CellInterface::Value(ref));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "#REF!");
+    ASSERT(sheet.GetCell("A5"_pos)->GetValue() == CellInterface::Value(ref));
+    ASSERT(sheet.GetCell("C1"_pos)->GetValue() == CellInterface::Value(ref));
+    ASSERT_EQUAL(sheet.ApplyValueTicks({ { "A1"_pos, ref } }), 0u);
+    // Ошибка формулы меняется на число тиком
+    ASSERT_EQUAL(sheet.ApplyValueTicks({ { "A1"_pos, 1.0 } }), 1u);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(number(sheet.GetCell("C1"_pos)->GetValue()), 0.25);
+    // Формула заменяется закреплённой ошибкой
+    sheet.ApplyValueTicks({ { "B1"_pos, FormulaError(FormulaError::Category::Value) } });
+    ASSERT(sheet.GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet.GetCell("C1"_pos)->GetValue() == CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+}
+#ifndef _WIN32
+void TestShardedRecalculation() {
+    // Значения формул листа, по позициям
+    auto sheet_values = [](const Sheet& sheet) {
+        std::vector<std::pair<Position, FormulaInterface::Value>> values;
+        sheet.VisitCells(Position{ 0, 0 }, Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 },
+            [&values](Position pos, const Cell& cell) {
+                if (cell.GetFormula() == nullptr) {
+                    return;
+                }
+                CellInterface::Value value = cell.GetValue();
+                if (std::holds_alternative<double>(value)) {
+                    values.push_back({ pos, std::get<double>(value) });
+                }
+                else {
+                    values.push_back({ pos, std::get<FormulaError>(value) });
+                }
+            });
+        std::sort(values.begin(), values.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+        return values;
+    };
+
+    // Входы A1..A20, тексты, ошибки и случайный граф формул в столбцах C..H
+    Sheet sheet;
+    for (int r = 0; r < 20; ++r) {
+        sheet.SetCell(Position{ r, 0 }, std::to_string(r * 3 % 7) + ".5");
+    }
+    sheet.SetCell("B1"_pos, "abc");
+    sheet.SetCell("B2"_pos, "'12");
+    sheet.SetCell("B3"_pos, "=1/(A1-A1)");
+    sheet.SetCell("B4"_pos, "=B1+1");
+    sheet.SetCell("B5"_pos, "=Z1");
+    sheet.DeleteCols(25);
+    sheet.SetCell("B6"_pos, "=B2*2");
+    std::mt19937 generator(7);
+    std::vector<Position> formulas{ "B6"_pos };
+    for (int c = 2; c < 8; ++c) {
+        for (int r = 0; r < 40; ++r) {
+            Position pos{ r, c };
+            std::string text = "=A" + std::to_string(r % 20 + 1);
+            for (int k = 0; k < 2; ++k) {
+                Position ref = formulas[std::uniform_int_distribution<size_t>(0, formulas.size() - 1)(generator)];
+                text += (k == 0 ? "+" : "*0.5+") + ref.ToString();
+            }
+            sheet.SetCell(pos, text);
+            formulas.push_back(pos);
+        }
+    }
+    // Ошибки читаются только цепочками столбцов I..K (иначе они заполнили бы весь граф),
+    // достаточно длинными, чтобы разрезаться между процессами
+    formulas.insert(formulas.end(), { "B3"_pos, "B4"_pos, "B5"_pos });
+    for (int c = 8; c < 11; ++c) {
+        for (int r = 0; r < 60; ++r) {
+            Position previous = r == 0 ? Position{ c - 6, 1 } : Position{ r - 1, c };
+            sheet.SetCell(Position{ r, c }, "=" + previous.ToString() + "+" + Position{ r % 40, c - 6 }.ToString());
+            formulas.push_back(Position{ r, c });
+        }
+    }
+    auto expected = sheet_values(sheet);
+    ASSERT_EQUAL(expected.size(), formulas.size());
+
+    for (int shards = 1; shards <= 4; ++shards) {
+        ShardedRecalculation sharded(sheet, shards);
+        ShardingStats stats = sharded.GetStats();
+        ASSERT_EQUAL(stats.formulas, formulas.size());
+        ASSERT(stats.max_shard_formulas * shards <= formulas.size() * 21 / 20 + shards);
+        ASSERT_EQUAL(stats.cut_edges == 0, shards == 1);
+        ASSERT(stats.rounds >= 1 && stats.rounds <= stats.cut_edges + 1);
+
+        // Значения совпадают с вычислением в одном процессе ячейка в ячейку
+        sharded.Recalculate();
+        ASSERT(sharded.GetValues() == expected);
+        // Ошибки всех видов передаются между процессами
+        std::set<FormulaError::Category> crossed;
+        for (const auto& [pos, value] : expected) {
+            for (Position ref : sheet.GetCell(pos)->GetReferencedCells()) {
+                int ref_shard = sharded.GetShard(ref);
+                CellInterface::Value ref_value = sheet.GetCell(ref)->GetValue();
+                if (ref_shard >= 0 && ref_shard != sharded.GetShard(pos) && std::holds_alternative<FormulaError>(ref_value)) {
+                    crossed.insert(std::get<FormulaError>(ref_value).GetCategory());
+                }
+            }
+        }
+        ASSERT_EQUAL(crossed.size(), shards == 1 ? 0u : 3u);
+
+        // Новые входы: передаются только изменившиеся значения разрезанных рёбер
+        std::vector<std::pair<Position, double>> ticks{ { "A3"_pos, 0.25 }, { "A1"_pos, -4 }, { "A3"_pos, 100 } };
+        auto copy = sheet.Fork();
+        copy->ApplyTicks(ticks);
+        sharded.SetNumbers(ticks);
+        std::uint64_t exchanged = sharded.GetStats().values_exchanged;
+        sharded.Recalculate();
+        ASSERT(sharded.GetValues() == sheet_values(*copy));
+        sharded.Recalculate();
+        if (shards > 1) {
+            ASSERT(sharded.GetStats().values_exchanged > exchanged);
+        }
+        exchanged = sharded.GetStats().values_exchanged;
+        sharded.Recalculate();
+        ASSERT_EQUAL(sharded.GetStats().values_exchanged, exchanged);
+
+        try {
+            sharded.SetNumbers({ { "C1"_pos, 1 } });
+            ASSERT(false);
+        }
+        catch (const std::invalid_argument&) {
+        }
+    }
+
+    // Независимые цепочки не разрезаются
+    Sheet chains;
+    chains.SetCell("A1"_pos, "1");
+    chains.SetCell("B1"_pos, "2");
+    for (int r = 1; r < 100; ++r) {
+        chains.SetCell(Position{ r, 0 }, "=A" + std::to_string(r) + "+1");
+        chains.SetCell(Position{ r, 1 }, "=B" + std::to_string(r) + "*2");
+    }
+    ShardedRecalculation sharded_chains(chains, 2);
+    ASSERT_EQUAL(sharded_chains.GetStats().cut_edges, 0u);
+    ASSERT_EQUAL(sharded_chains.GetStats().rounds, 1u);
+    ASSERT_EQUAL(sharded_chains.GetStats().max_shard_formulas, 99u);
+    ASSERT(sharded_chains.GetShard("A50"_pos) != sharded_chains.GetShard("B50"_pos));
+    ASSERT_EQUAL(sharded_chains.GetShard("A1"_pos), -1);
+    sharded_chains.Recalculate();
+    ASSERT(sharded_chains.GetValues() == sheet_values(chains));
+
+    // Занятый последний столбец и удалённые ссылки: формулы передаются разобранными
+    Sheet edge;
+    Position last{ 0, Position::MAX_COLS - 1 };
+    edge.SetCell("C1"_pos, "=D1+1");
+    edge.DeleteCols(3);
+    edge.SetCell("B1"_pos, "5");
+    edge.SetCell("A1"_pos, "=B1*2");
+    for (int r = 1; r < 40; ++r) {
+        edge.SetCell(Position{ r, 0 }, "=A" + std::to_string(r) + "+B1");
+    }
+    edge.SetCell(last, "=A40+1");
+    edge.SetCell(Position{ 1, last.col }, "=" + last.ToString() + "+C1");
+    ShardedRecalculation sharded_edge(edge, 2);
+    ASSERT(sharded_edge.GetStats().cut_edges > 0);
+    sharded_edge.Recalculate();
+    auto edge_values = sharded_edge.GetValues();
+    ASSERT(edge_values == sheet_values(edge));
+    ASSERT(edge_values[2] == std::make_pair(last, FormulaInterface::Value(206.0)));
+    ASSERT(edge_values[4].second == FormulaInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+    try {
+        ShardedRecalculation none(chains, 0);
+        ASSERT(false);
+    }
+    catch (const std::invalid_argument&) {
+    }
+}
+
+void TestSheetServer() {
+    std::string socket_path = "/tmp/spreadsheet_test_" + std::to_string(getpid()) + ".sock";
+    SheetServer server(socket_path);
+    std::thread thread([&server]() { server.Run(); });
+
+    // Сервер останавливается и при проваленной проверке
+    try {
+        {
+            SheetClient client(socket_path);
+            // Конвейер: ответы приходят по порядку, с идентификаторами запросов
+            std::uint32_t open_a = client.OpenSheet("a");
+            std::uint32_t open_b = client.OpenSheet("b");
+            std::uint32_t open_a_again = client.OpenSheet("a");
+            std::uint32_t a = client.Call(open_a_again).fields.GetU32();
+            ServerResponse response = client.Receive();
+            ASSERT_EQUAL(response.id, open_a);
+            ASSERT_EQUAL(response.fields.GetU32(), a);
+            response = client.Receive();
+            ASSERT_EQUAL(response.id, open_b);
+            ASSERT(response.fields.GetU32() != a);
+            std::uint32_t subscription = client.Call(client.Subscribe(a, "A1"_pos, "B2"_pos)).fields.GetU32();
+
+            Sheet expected;
+            std::vector<std::pair<Position, std::string>> cells = {
+                { "A1"_pos, "1" }, { "B1"_pos, "=A1*2" }, { "A2"_pos, "text" }, { "B2"_pos, "=1/0" } };
+            for (const auto& [pos, text] : cells) {
+                expected.SetCell(pos, text);
+            }
+            std::ostringstream expected_values;
+            expected.PrintValues(expected_values, "A1"_pos, "B2"_pos);
+            std::ostringstream expected_texts;
+            expected.PrintTexts(expected_texts, "A1"_pos, "B2"_pos);
+
+            std::vector<std::uint32_t> requests = {
+                client.SetCells(a, cells),
+                client.GetValues(a, "A1"_pos, "C2"_pos),
+                client.Print(a, "A1"_pos, "B2"_pos),
+                client.Print(a, "A1"_pos, "B2"_pos, true),
+                client.SetCells(a, { { "D1"_pos, "4" }, { "C1"_pos, "=)" } }),
+                client.GetValues(a, "D1"_pos, "D1"_pos),
+                client.SetNumbers(a, { { "A1"_pos, 5 }, { "A1"_pos, 6 } }),
+                client.Unsubscribe(subscription),
+                client.SetNumbers(a, { { "A1"_pos, 7 } }),
+                client.GetValues(a, "A1"_pos, "B1"_pos),
+                client.Unsubscribe(subscription),
+                client.GetValues(99, "A1"_pos, "A1"_pos),
+                client.GetValues(a, "B2"_pos, "A1"_pos),
+            };
+            client.Flush();
+            auto next = [&client](std::uint32_t id, ServerStatus status) {
+                ServerResponse response = client.Receive();
+                ASSERT_EQUAL(response.id, id);
+                ASSERT(response.status == status);
+                return response;
+            };
+
+            next(requests[0], ServerStatus::Ok);
+            // Событие подписки следует за ответом на изменивший диапазон запрос
+            response = next(subscription, ServerStatus::Event);
+            SheetChanges changes = SheetClient::ReadChanges(response.fields);
+            ASSERT(!changes.layout_changed);
+            ASSERT(changes.cells == std::vector<Position>({ "A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos }));
+
+            response = next(requests[1], ServerStatus::Ok);
+            auto values = SheetClient::ReadValues(response.fields);
+            ASSERT_EQUAL(values.size(), 2u);
+            ASSERT_EQUAL(values[0].size(), 3u);
+            ASSERT_EQUAL(std::get<std::string>(values[0][0]), "1");
+            ASSERT_EQUAL(std::get<double>(values[0][1]), 2.0);
+            ASSERT_EQUAL(std::get<std::string>(values[0][2]), "");
+            ASSERT_EQUAL(std::get<std::string>(values[1][0]), "text");
+            ASSERT(std::get<FormulaError>(values[1][1]).GetCategory() == FormulaError::Category::Div0);
+            ASSERT(response.fields.AtEnd());
+
+            ASSERT_EQUAL(next(requests[2], ServerStatus::Ok).fields.GetString(), expected_values.str());
+            ASSERT_EQUAL(next(requests[3], ServerStatus::Ok).fields.GetString(), expected_texts.str());
+
+            // Ошибка останавливает пакет на ячейке, предыдущие ячейки заданы
+            std::string error = next(requests[4], ServerStatus::Error).fields.GetString();
+            ASSERT(error.find("C1") != std::string::npos);
+            response = next(requests[5], ServerStatus::Ok);
+            values = SheetClient::ReadValues(response.fields);
+            ASSERT_EQUAL(std::get<std::string>(values[0][0]), "4");
+
+            // Числа одной ячейки объединяются
+            ASSERT_EQUAL(next(requests[6], ServerStatus::Ok).fields.GetU32(), 1u);
+            response = next(subscription, ServerStatus::Event);
+            changes = SheetClient::ReadChanges(response.fields);
+            ASSERT(changes.cells == std::vector<Position>({ "A1"_pos, "B1"_pos }));
+
+            // После отписки событий нет
+            next(requests[7], ServerStatus::Ok);
+            next(requests[8], ServerStatus::Ok);
+            response = next(requests[9], ServerStatus::Ok);
+            values = SheetClient::ReadValues(response.fields);
+            ASSERT_EQUAL(std::get<std::string>(values[0][0]), "7");
+            ASSERT_EQUAL(std::get<double>(values[0][1]), 14.0);
+            next(requests[10], ServerStatus::Error);
+            next(requests[11], ServerStatus::Error);
+            next(requests[12], ServerStatus::Error);
+
+            try {
+                client.Call(client.GetValues(99, "A1"_pos, "A1"_pos));
+                ASSERT(false);
+            }
+            catch (const std::runtime_error&) {
+            }
+
+            // События изменений, сделанных другим соединением
+            SheetClient watcher(socket_path);
+            ASSERT_EQUAL(watcher.Call(watcher.OpenSheet("a")).fields.GetU32(), a);
+            std::uint32_t watched = watcher.Call(watcher.Subscribe(a, "B1"_pos, "B1"_pos)).fields.GetU32();
+            ASSERT(watched != subscription);
+            {
+                // Подписки закрытого соединения удаляются
+                SheetClient closed(socket_path);
+                closed.Call(closed.Subscribe(a, "A1"_pos, "B1"_pos));
+            }
+            client.Call(client.SetNumbers(a, { { "A1"_pos, 8 } }));
+            response = watcher.Receive();
+            ASSERT_EQUAL(response.id, watched);
+            ASSERT(response.status == ServerStatus::Event);
+            ASSERT(SheetClient::ReadChanges(response.fields).cells == std::vector<Position>({ "B1"_pos }));
+            response = watcher.Call(watcher.GetValues(a, "B1"_pos, "B1"_pos));
+            values = SheetClient::ReadValues(response.fields);
+            ASSERT_EQUAL(std::get<double>(values[0][0]), 16.0);
+        }
+
+        // Клиент, закрывший свою сторону, получает ответы на последние запросы
+        {
+            SheetClient client(socket_path);
+            std::uint32_t c = client.Call(client.OpenSheet("c")).fields.GetU32();
+            std::uint32_t set = client.SetCells(c, { { "A1"_pos, "3" }, { "B1"_pos, "=A1+1" } });
+            std::uint32_t get = client.GetValues(c, "B1"_pos, "B1"_pos);
+            client.Shutdown();
+            ASSERT_EQUAL(client.Receive().id, set);
+            ServerResponse response = client.Receive();
+            ASSERT_EQUAL(response.id, get);
+            ASSERT_EQUAL(std::get<double>(SheetClient::ReadValues(response.fields)[0][0]), 4.0);
+            try {
+                client.Receive();
+                ASSERT(false);
+            }
+            catch (const std::runtime_error&) {
+            }
+
+            // Ответы, которые клиент не читает, задерживают его запросы, а не теряются
+            SheetClient reader(socket_path);
+            std::vector<std::uint32_t> requests;
+            for (int i = 0; i < 24; ++i) {
+                requests.push_back(reader.GetValues(c, "A1"_pos, Position{ 1023, 1023 }));
+            }
+            reader.Flush();
+            for (std::uint32_t request : requests) {
+                response = reader.Receive();
+                ASSERT_EQUAL(response.id, request);
+                ASSERT(response.status == ServerStatus::Ok);
+            }
+
+            // События подписчика, который не читает, сливаются в одно: диапазон читается заново
+            std::uint32_t subscription = reader.Call(reader.Subscribe(c, "A1"_pos, Position{ 9999, 9 })).fields.GetU32();
+            std::vector<std::pair<Position, double>> numbers;
+            for (int row = 0; row < 10000; ++row) {
+                for (int col = 0; col < 10; ++col) {
+                    numbers.emplace_back(Position{ row, col }, row);
+                }
+            }
+            SheetClient writer(socket_path);
+            for (int i = 0; i < 50; ++i) {
+                for (auto& number : numbers) {
+                    number.second = i;
+                }
+                writer.Call(writer.SetNumbers(c, numbers));
+            }
+            size_t cell_events = 0;
+            while (true) {
+                response = reader.Receive();
+                ASSERT_EQUAL(response.id, subscription);
+                SheetChanges changes = SheetClient::ReadChanges(response.fields);
+                if (changes.layout_changed) {
+                    ASSERT(changes.cells.empty());
+                    break;
+                }
+                ++cell_events;
+            }
+            ASSERT(cell_events < 50u);
+            response = reader.Call(reader.GetValues(c, "A1"_pos, "A1"_pos));
+            auto values = SheetClient::ReadValues(response.fields);
+            ASSERT_EQUAL(std::get<std::string>(values[0][0]), "49");
+        }
+
+        // Слишком большой запрос закрывает соединение до чтения его тела
+        {
+            int raw = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            std::copy(socket_path.begin(), socket_path.end(), address.sun_path);
+            ASSERT(connect(raw, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+            std::uint32_t size = MAX_MESSAGE_SIZE + 1;
+            WriteAll(raw, std::string_view(reinterpret_cast<const char*>(&size), sizeof(size)));
+            char byte = 0;
+            ASSERT(read(raw, &byte, 1) <= 0);
+            close(raw);
+        }
+
+        // Пустое и слишком большое сообщения отличаются от конца потока
+        int sockets[2];
+        ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+        for (std::uint32_t size : { 0u, MAX_MESSAGE_SIZE + 1 }) {
+            WriteAll(sockets[1], std::string_view(reinterpret_cast<const char*>(&size), sizeof(size)));
+            try {
+                ReadMessage(sockets[0]);
+                ASSERT(false);
+            }
+            catch (const std::runtime_error& e) {
+                ASSERT_EQUAL(std::string(e.what()), size == 0 ? "empty message" : "message too large");
+            }
+        }
+        close(sockets[1]);
+        ASSERT(ReadMessage(sockets[0]).empty());
+        close(sockets[0]);
+    }
+    catch (...) {
+        server.Stop();
+        thread.join();
+        throw;
+    }
+    server.Stop();
+    thread.join();
+    ServerStats stats = server.GetStats();
+    ASSERT_EQUAL(stats.connections, 7u);
+    ASSERT(stats.events_coalesced > 0);
+    ASSERT_EQUAL(stats.accept_backoffs, 0u);
+    ASSERT_EQUAL(stats.errors, 5u);
+    ASSERT(stats.events > 3u);
+    ASSERT(stats.bytes_received > 0 && stats.bytes_sent > 0);
+}
+#endif
+}  // namespace
+
+int main() {
+    TestRunner tr;
+    RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionToStringInvalid);
+    RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionKey);
+    RUN_TEST(tr, TestEmpty);
+    RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestFormulaInvalidPosition);
+    RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestConcurrentGetValue);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestFormulaProfiler);
+    RUN_TEST(tr, TestInsertRowsAndCols);
+    RUN_TEST(tr, TestDeleteRowsAndCols);
+    RUN_TEST(tr, TestClearReferencedCell);
+    RUN_TEST(tr, TestFormulaConstantFolding);
+    RUN_TEST(tr, TestEvaluateColumn);
+    RUN_TEST(tr, TestCompactCells);
+    RUN_TEST(tr, TestTextPool);
+    RUN_TEST(tr, TestAllocationFreeReads);
+    RUN_TEST(tr, TestSubscriptions);
+    RUN_TEST(tr, TestVersionedDelta);
+    RUN_TEST(tr, TestPrintViewport);
+    RUN_TEST(tr, TestPaging);
+    RUN_TEST(tr, TestFork);
+    RUN_TEST(tr, TestSweep);
+    RUN_TEST(tr, TestIterativeCalculation);
+    RUN_TEST(tr, TestPrecedentsAndDependents);
+    RUN_TEST(tr, TestCompressedDependencies);
+    RUN_TEST(tr, TestBackgroundRecalculation);
+    RUN_TEST(tr, TestRecalculateFor);
+    RUN_TEST(tr, TestTicks);
+#ifndef _WIN32
+    RUN_TEST(tr, TestShardedRecalculation);
+    RUN_TEST(tr, TestSheetServer);
+#endif
+}
@@ -0,0 +1,187 @@
+#include "paging.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+
+PageFile::~PageFile() {
+    if (file_.is_open()) {
+        file_.close();
+        std::error_code error;
+        std::filesystem::remove(path_, error);
+    }
+}
+
+void PageFile::SetPath(std::string path) {
+    if (!file_.is_open()) {
+        path_ = std::move(path);
+    }
+}
+
+void PageFile::Open() {
+    if (path_.empty()) {
+        std::random_device random;
+        std::string name = "spreadsheet-" + std::to_string(random()) + "-" + std::to_string(random()) + ".pages";
+        path_ = (std::filesystem::temp_directory_path() / name).string();
+    }
+    file_.open(path_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file_.is_open()) {
+        throw std::runtime_error("Cannot create the paging file " + path_);
+    }
+}
+
+PageFile::Record PageFile::Write(std::string_view data) {
+    Record record{ size_, data.size() };
+    if (data.empty()) {
+        return record;
+    }
+    if (!file_.is_open()) {
+        Open();
+    }
+    //best fit: the smallest free space holding the data
+    auto free_it = free_.lower_bound(data.size());
+    if (free_it != free_.end()) {
+        record.offset = free_it->second;
+        if (free_it->first > data.size()) {
+            free_.emplace(free_it->first - data.size(), free_it->second + data.size());
+        }
+        free_.erase(free_it);
+    }
+    else {
+        size_ += data.size();
+    }
+    file_.seekp(static_cast<std::streamoff>(record.offset));
+    file_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    if (!file_) {
+        throw std::runtime_error("Cannot write the paging file " + path_);
+    }
+    return record;
+}
+
+std::string PageFile::Take(Record record) {
+    std::string data(record.size, '\0');
+    if (record.size == 0) {
+        return data;
+    }
+    file_.seekg(static_cast<std::streamoff>(record.offset));
+    file_.read(data.data(), static_cast<std::streamsize>(record.size));
+    if (!file_) {
+        throw std::runtime_error("Cannot read the paging file " + path_);
+    }
+    free_.emplace(record.size, record.offset);
+    return data;
+}
+
+std::uint64_t PageFile::GetSize() const {
+    return size_;
+}
+
+
+int BlockPager::GetBlock(int row) {
+    return row / BLOCK_ROWS;
+}
+
+void BlockPager::SetBudget(size_t bytes) {
+    budget_ = bytes;
+}
+
+size_t BlockPager::GetBudget() const {
+    return budget_;
+}
+
+bool BlockPager::IsEnabled() const {
+    return budget_ > 0;
+}
+
+void BlockPager::SetPath(std::string path) {
+    file_.SetPath(std::move(path));
+}
+
+void BlockPager::Resize(int rows) {
+    rows_ = rows;
+    size_t blocks = (rows + BLOCK_ROWS - 1) / BLOCK_ROWS;
+    //the blocks are only removed by the deletion of rows, after the sheet paged them in
+    while (blocks_.size() > blocks) {
+        lru_.erase(blocks_.back().lru);
+        blocks_.pop_back();
+    }
+    while (blocks_.size() < blocks) {
+        blocks_.emplace_back();
+        lru_.push_back(static_cast<int>(blocks_.size()) - 1);
+        blocks_.back().lru = std::prev(lru_.end());
+    }
+}
+
+bool BlockPager::IsResident(int block) const {
+    return static_cast<size_t>(block) >= blocks_.size() || blocks_[block].resident;
+}
+
+void BlockPager::Touch(int block) {
+    Block& data = blocks_[block];
+    lru_.splice(lru_.begin(), lru_, data.lru);
+}
+
+void BlockPager::CountCells(int block, int cells, int formulas) {
+    blocks_[block].cells += cells;
+    blocks_[block].formulas += formulas;
+}
+
+void BlockPager::ClearCounts(int first_block) {
+    for (size_t block = first_block; block < blocks_.size(); ++block) {
+        blocks_[block].cells = 0;
+        blocks_[block].formulas = 0;
+    }
+}
+
+int BlockPager::GetRows(int block) const {
+    return std::min(BLOCK_ROWS, rows_ - block * BLOCK_ROWS);
+}
+
+size_t BlockPager::GetResidentBytes(size_t row_bytes, size_t cell_bytes) const {
+    size_t bytes = 0;
+    for (int block : lru_) {
+        bytes += GetRows(block) * row_bytes + blocks_[block].cells * cell_bytes;
+    }
+    return bytes;
+}
+
+int BlockPager::FindVictim(int keep) const {
+    for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+        if (*it != keep && blocks_[*it].formulas == 0) {
+            return *it;
+        }
+    }
+    return -1;
+}
+
+void BlockPager::PageOut(int block, std::string_view data) {
+    Block& paged = blocks_[block];
+    paged.record = file_.Write(data);
+    paged.resident = false;
+    lru_.erase(paged.lru);
+    ++evictions_;
+}
+
+std::string BlockPager::PageIn(int block) {
+    Block& resident = blocks_[block];
+    std::string data = file_.Take(resident.record);
+    resident.resident = true;
+    lru_.push_front(block);
+    resident.lru = lru_.begin();
+    ++page_faults_;
+    return data;
+}
+
+PagingStats BlockPager::GetStats(size_t row_bytes, size_t cell_bytes) const {
+    PagingStats stats;
+    stats.memory_budget = budget_;
+    stats.resident_bytes = GetResidentBytes(row_bytes, cell_bytes);
+    stats.resident_blocks = lru_.size();
+    stats.paged_blocks = blocks_.size() - lru_.size();
+    stats.page_faults = page_faults_;
+    stats.evictions = evictions_;
+    stats.file_bytes = file_.GetSize();
+    return stats;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//Paging of the cells of a sheet (Sheet::SetMemoryBudget).
+struct PagingStats {
+    //0: the paging is disabled
+    size_t memory_budget = 0;
+    //grid and cells of the resident blocks (estimated)
+    size_t resident_bytes = 0;
+    size_t resident_blocks = 0;
+    size_t paged_blocks = 0;
+    //accesses to a paged block: the block was read back from the file
+    size_t page_faults = 0;
+    //blocks written to the file
+    size_t evictions = 0;
+    size_t file_bytes = 0;
+};
+
+/// <summary>
+/// File of records. The file is created on the first write and removed
+/// by the destructor. The space of a record read back is reused by the
+/// next records fitting in it.
+/// </summary>
+class PageFile {
+public:
+    struct Record {
+        std::uint64_t offset = 0;
+        std::uint64_t size = 0;
+    };
+
+    PageFile() = default;
+    PageFile(const PageFile&) = delete;
+    PageFile& operator=(const PageFile&) = delete;
+    ~PageFile();
+
+    //Path of the file, a new file of the temporary directory if empty.
+    //Only before the first write.
+    void SetPath(std::string path);
+
+    Record Write(std::string_view data);
+    //Read the record and free its space.
+    std::string Take(Record record);
+
+    std::uint64_t GetSize() const;
+
+private:
+    void Open();
+
+    std::string path_;
+    std::fstream file_;
+    std::uint64_t size_ = 0;
+    //free space: size -> offsets
+    std::multimap<std::uint64_t, std::uint64_t> free_;
+};
+
+/// <summary>
+/// Blocks of BLOCK_ROWS rows of the grid of a sheet. A block is resident
+/// (its cells are in memory) or paged (its cells are a record of the
+/// PageFile). The resident blocks are kept in LRU order; the blocks holding
+/// formulas are never paged out, so the formulas and their caches stay in
+/// memory. The sheet counts the cells of the blocks while the paging is
+/// enabled, serializes the blocks and decides when to page them out.
+/// </summary>
+class BlockPager {
+public:
+    static constexpr int BLOCK_ROWS = 64;
+
+    static int GetBlock(int row);
+
+    //0 disables the paging.
+    void SetBudget(size_t bytes);
+    size_t GetBudget() const;
+    bool IsEnabled() const;
+    void SetPath(std::string path);
+
+    //The grid has rows rows: the new blocks are resident and empty.
+    void Resize(int rows);
+    bool IsResident(int block) const;
+    //The block is the most recently used.
+    void Touch(int block);
+
+    //Cells (formulas) added to a resident block, negative if removed.
+    void CountCells(int block, int cells, int formulas);
+    //Counts of the blocks from first_block.
+    void ClearCounts(int first_block = 0);
+
+    //Bytes of the resident blocks: rows of row_bytes and cells of cell_bytes.
+    size_t GetResidentBytes(size_t row_bytes, size_t cell_bytes) const;
+    //Least recently used resident block without formulas other than keep, -1 if none.
+    int FindVictim(int keep) const;
+
+    //Write the cells of a resident block (data) to the file.
+    void PageOut(int block, std::string_view data);
+    //Read back the cells of a paged block.
+    std::string PageIn(int block);
+
+    PagingStats GetStats(size_t row_bytes, size_t cell_bytes) const;
+
+private:
+    struct Block {
+        bool resident = true;
+        size_t cells = 0;
+        size_t formulas = 0;
+        PageFile::Record record;
+        //position in lru_ while resident
+        std::list<int>::iterator lru;
+    };
+
+    int GetRows(int block) const;
+
+    size_t budget_ = 0;
+    int rows_ = 0;
+    std::vector<Block> blocks_;
+    //resident blocks, the most recently used first
+    std::list<int> lru_;
+    PageFile file_;
+
+    size_t page_faults_ = 0;
+    size_t evictions_ = 0;
+};
@@ -0,0 +1,197 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+namespace {
+using ProfilerClock = std::chrono::steady_clock;
+
+struct Frame {
+    std::uint64_t node = 0;
+    ProfilerClock::time_point start;
+    std::uint64_t children_ns = 0;
+    int max_child_depth = 0;
+};
+
+//Evaluation stack of the current thread. Formulas only reference cells of
+//their own sheet, so one stack per thread is enough for all the profilers.
+struct ThreadState {
+    std::vector<Frame> frames;
+    std::uint32_t top_level_count = 0;
+    //depth of the evaluations left out by sampling
+    int skipped_depth = 0;
+};
+
+thread_local ThreadState thread_state;
+}  // namespace
+
+FormulaProfiler::Scope::Scope(FormulaProfiler& profiler, Position pos) {
+    if (!profiler.IsEnabled()) {
+        return;
+    }
+    if (thread_state.frames.empty()) {
+        //sampling is decided by the top-level evaluations only
+        std::uint32_t rate = profiler.sample_rate_.load(std::memory_order_relaxed);
+        if (thread_state.skipped_depth > 0 || thread_state.top_level_count++ % rate != 0) {
+            skipped_ = true;
+            ++thread_state.skipped_depth;
+            return;
+        }
+    }
+    profiler_ = &profiler;
+    pos_ = pos;
+    std::uint64_t parent = thread_state.frames.empty() ? NO_NODE : thread_state.frames.back().node;
+    node_ = profiler.InternNode(parent, pos);
+    thread_state.frames.push_back({ node_, ProfilerClock::now() });
+}
+
+FormulaProfiler::Scope::~Scope() {
+    if (skipped_) {
+        --thread_state.skipped_depth;
+        return;
+    }
+    if (profiler_ == nullptr) {
+        return;
+    }
+    Frame frame = thread_state.frames.back();
+    thread_state.frames.pop_back();
+
+    auto inclusive = std::chrono::duration_cast<std::chrono::nanoseconds>(ProfilerClock::now() - frame.start);
+    std::uint64_t inclusive_ns = static_cast<std::uint64_t>(inclusive.count());
+    std::uint64_t exclusive_ns = inclusive_ns > frame.children_ns ? inclusive_ns - frame.children_ns : 0;
+    int depth = frame.max_child_depth + 1;
+
+    profiler_->Record(node_, pos_, inclusive_ns, exclusive_ns, depth);
+
+    if (!thread_state.frames.empty()) {
+        Frame& parent = thread_state.frames.back();
+        parent.children_ns += inclusive_ns;
+        parent.max_child_depth = std::max(parent.max_child_depth, depth);
+    }
+}
+
+void FormulaProfiler::Enable(std::uint32_t sample_rate) {
+    sample_rate_.store(std::max<std::uint32_t>(sample_rate, 1), std::memory_order_relaxed);
+    enabled_.store(true, std::memory_order_relaxed);
+}
+
+void FormulaProfiler::Disable() {
+    enabled_.store(false, std::memory_order_relaxed);
+}
+
+bool FormulaProfiler::IsEnabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+void FormulaProfiler::Reset() {
+    for (Shard& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.cells.clear();
+        shard.nodes.clear();
+        shard.node_ids.clear();
+    }
+}
+
+size_t FormulaProfiler::GetShard(Position pos) {
+    return PositionHasher{}(pos) % SHARDS;
+}
+
+std::uint64_t FormulaProfiler::InternNode(std::uint64_t parent, Position pos) {
+    size_t shard_index = GetShard(pos);
+    Shard& shard = shards_[shard_index];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto [it, inserted] = shard.node_ids.emplace(StackKey{ parent, pos }, 0);
+    if (inserted) {
+        it->second = shard.nodes.size() * SHARDS + shard_index;
+        shard.nodes.push_back({ parent, pos });
+    }
+    return it->second;
+}
+
+void FormulaProfiler::Record(std::uint64_t node, Position pos, std::uint64_t inclusive_ns,
+    std::uint64_t exclusive_ns, int depth) {
+    Shard& shard = shards_[GetShard(pos)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    CellProfile& profile = shard.cells[pos];
+    profile.pos = pos;
+    ++profile.evaluations;
+    profile.inclusive_ns += inclusive_ns;
+    profile.exclusive_ns += exclusive_ns;
+    profile.max_depth = std::max(profile.max_depth, depth);
+    //the node of the same shard as pos, unless Reset forgot it
+    size_t index = node / SHARDS;
+    if (index < shard.nodes.size()) {
+        shard.nodes[index].exclusive_ns += exclusive_ns;
+    }
+}
+
+std::vector<CellProfile> FormulaProfiler::GetTopCells(size_t top_n) const {
+    std::vector<CellProfile> result;
+    for (const Shard& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto& [pos, profile] : shard.cells) {
+            result.push_back(profile);
+        }
+    }
+    std::sort(result.begin(), result.end(), [](const CellProfile& lhs, const CellProfile& rhs) {
+        if (lhs.exclusive_ns != rhs.exclusive_ns) {
+            return lhs.exclusive_ns > rhs.exclusive_ns;
+        }
+        return lhs.pos < rhs.pos;
+    });
+    if (top_n != 0 && result.size() > top_n) {
+        result.resize(top_n);
+    }
+    return result;
+}
+
+void FormulaProfiler::PrintReport(std::ostream& output, size_t top_n) const {
+    output << std::left << std::setw(10) << "cell"
+        << std::right << std::setw(12) << "evaluations"
+        << std::setw(16) << "exclusive_ns"
+        << std::setw(16) << "inclusive_ns"
+        << std::setw(8) << "depth" << '\n';
+    for (const CellProfile& profile : GetTopCells(top_n)) {
+        output << std::left << std::setw(10) << profile.pos.ToString()
+            << std::right << std::setw(12) << profile.evaluations
+            << std::setw(16) << profile.exclusive_ns
+            << std::setw(16) << profile.inclusive_ns
+            << std::setw(8) << profile.max_depth << '\n';
+    }
+}
+
+void FormulaProfiler::PrintFoldedStacks(std::ostream& output) const {
+    std::array<std::unique_lock<std::mutex>, SHARDS> locks;
+    for (size_t i = 0; i < SHARDS; ++i) {
+        locks[i] = std::unique_lock<std::mutex>(shards_[i].mutex);
+    }
+    size_t node_count = 0;
+    for (const Shard& shard : shards_) {
+        node_count += shard.nodes.size();
+    }
+    //the stack of a node is rebuilt from its parents (a parent forgotten by a Reset
+    //during the evaluation ends the stack)
+    std::vector<Position> stack;
+    for (const Shard& shard : shards_) {
+        for (const StackNode& node : shard.nodes) {
+            stack.clear();
+            for (const StackNode* current = &node; ; ) {
+                stack.push_back(current->pos);
+                const Shard& parent_shard = shards_[current->parent % SHARDS];
+                if (current->parent == NO_NODE || current->parent / SHARDS >= parent_shard.nodes.size()
+                    || stack.size() > node_count) {
+                    break;
+                }
+                current = &parent_shard.nodes[current->parent / SHARDS];
+            }
+            for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+                if (it != stack.rbegin()) {
+                    output << ';';
+                }
+                output << it->ToString();
+            }
+            output << ' ' << node.exclusive_ns << '\n';
+        }
+    }
+}
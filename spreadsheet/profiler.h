@@ -0,0 +1,119 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+//Profile of one formula cell.
+struct CellProfile {
+    Position pos;
+    std::uint64_t evaluations = 0;
+    //Time spent in the evaluation of the cell, including the cells it evaluated.
+    std::uint64_t inclusive_ns = 0;
+    //Time spent in the cell itself.
+    std::uint64_t exclusive_ns = 0;
+    //Longest chain of formulas evaluated under the cell (1: no formula evaluated below).
+    int max_depth = 0;
+};
+
+/// <summary>
+/// Opt-in profiler of the formula evaluations (FormulaImpl::GetValue).
+/// Disabled, it costs one relaxed atomic load per evaluation.
+/// Enabled, it records per cell the evaluation count, the inclusive and exclusive
+/// time and the dependency depth, as well as the evaluation stacks for flamegraphs
+/// (a tree of stacks: an evaluation adds its time to the node of its stack).
+/// With a sample rate N, only one top-level evaluation out of N (per thread) is
+/// recorded together with the evaluations it triggers.
+/// </summary>
+class FormulaProfiler {
+public:
+    //Profile the evaluation of one formula for the lifetime of the object.
+    class Scope {
+    public:
+        Scope(FormulaProfiler& profiler, Position pos);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        FormulaProfiler* profiler_ = nullptr;
+        Position pos_;
+        //node of the evaluation stack ending with the cell
+        std::uint64_t node_ = 0;
+        //true when the evaluation belongs to a top-level evaluation left out by sampling
+        bool skipped_ = false;
+    };
+
+    void Enable(std::uint32_t sample_rate = 1);
+    void Disable();
+    bool IsEnabled() const;
+
+    //Forget all the recorded data.
+    void Reset();
+
+    //Profiles sorted by decreasing exclusive time, at most top_n of them (0: all).
+    std::vector<CellProfile> GetTopCells(size_t top_n = 0) const;
+
+    //Table of the top_n hottest cells.
+    void PrintReport(std::ostream& output, size_t top_n = 20) const;
+
+    //One line per evaluation stack, "A1;B2;C3 <exclusive ns of C3>",
+    //as expected by flamegraph.pl and similar tools.
+    void PrintFoldedStacks(std::ostream& output) const;
+
+private:
+    //The evaluation stacks are stored as a tree: a node is a cell evaluated under
+    //the stack of its parent node (NO_NODE for a top-level evaluation). A node is
+    //identified by its index in the nodes of its shard and by the shard.
+    struct StackNode {
+        std::uint64_t parent = 0;
+        Position pos;
+        std::uint64_t exclusive_ns = 0;
+    };
+
+    struct StackKey {
+        std::uint64_t parent = 0;
+        PositionKey pos;
+
+        bool operator==(const StackKey& rhs) const {
+            return parent == rhs.parent && pos == rhs.pos;
+        }
+    };
+
+    struct StackKeyHasher {
+        size_t operator()(const StackKey& key) const {
+            return PositionHasher{}(key.pos) ^ (std::hash<std::uint64_t>{}(key.parent) * 31);
+        }
+    };
+
+    //Data of the recorded cells (and the stack nodes ending with them) is split in
+    //shards to limit the contention between threads evaluating different cells.
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<PositionKey, CellProfile, PositionHasher> cells;
+        std::deque<StackNode> nodes;
+        std::unordered_map<StackKey, std::uint64_t, StackKeyHasher> node_ids;
+    };
+    static const size_t SHARDS = 16;
+    static const std::uint64_t NO_NODE = ~std::uint64_t{ 0 };
+
+    static size_t GetShard(Position pos);
+    //Node of pos evaluated under the stack of parent, created if needed.
+    std::uint64_t InternNode(std::uint64_t parent, Position pos);
+    //A node forgotten by Reset is not recorded.
+    void Record(std::uint64_t node, Position pos, std::uint64_t inclusive_ns,
+        std::uint64_t exclusive_ns, int depth);
+
+    std::atomic<bool> enabled_{ false };
+    std::atomic<std::uint32_t> sample_rate_{ 1 };
+    std::array<Shard, SHARDS> shards_;
+};
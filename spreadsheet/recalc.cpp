@@ -0,0 +1,180 @@
+#include "recalc.h"
+
+namespace {
+//Cancellation flag of the worker running on this thread (nullptr: not a worker).
+thread_local const std::atomic<bool>* worker_cancelled = nullptr;
+}  // namespace
+
+RecalcWorker::RecalcWorker(Evaluate evaluate)
+    : evaluate_(std::move(evaluate)) {
+    thread_ = std::thread([this]() {
+        Run();
+    });
+}
+
+RecalcWorker::~RecalcWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+    changed_.notify_all();
+    thread_.join();
+}
+
+RecalcWorker::EditScope::EditScope(RecalcWorker* worker)
+    : worker_(worker) {
+    if (worker_ != nullptr) {
+        worker_->BeginEdit();
+    }
+}
+
+RecalcWorker::EditScope::~EditScope() {
+    if (worker_ != nullptr) {
+        worker_->EndEdit();
+    }
+}
+
+void RecalcWorker::BeginEdit() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++edits_;
+    cancelled_.store(true, std::memory_order_relaxed);
+    changed_.wait(lock, [this]() {
+        return !evaluating_;
+    });
+}
+
+void RecalcWorker::EndEdit() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--edits_ == 0 && !stopping_) {
+            cancelled_.store(false, std::memory_order_relaxed);
+        }
+    }
+    changed_.notify_all();
+}
+
+void RecalcWorker::Enqueue(const std::vector<Position>& cells) {
+    if (cells.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.push_back(cells);
+    queued_cells_ += cells.size();
+}
+
+void RecalcWorker::ResetQueue(const std::vector<Position>& cells) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.clear();
+    pending_.push_back(cells);
+    reset_ = true;
+    queued_cells_ = cells.size();
+}
+
+void RecalcWorker::WaitIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this]() {
+        return (queued_cells_ == 0 && !reset_ && !evaluating_) || stopping_;
+    });
+}
+
+RecalcStats RecalcWorker::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RecalcStats stats;
+    stats.enabled = true;
+    stats.queued = queued_cells_;
+    stats.recalculated = recalculated_;
+    stats.cancelled = cancellations_;
+    return stats;
+}
+
+void RecalcWorker::ThrowIfCancelled() {
+    if (worker_cancelled != nullptr && worker_cancelled->load(std::memory_order_relaxed)) {
+        throw RecalcCancelled();
+    }
+}
+
+void RecalcWorker::Merge(std::vector<std::vector<Position>> batches, bool reset) {
+    //a batch lists the cells invalidated by an edit after the cells they depend on:
+    //the batches go first, in order, the cells of the queue they invalidated again
+    //move with them (evaluated first, they would evaluate the batch recursively)
+    std::deque<Position> queue;
+    std::unordered_set<PositionKey, PositionHasher> queued;
+    for (const std::vector<Position>& cells : batches) {
+        for (Position pos : cells) {
+            if (queued.insert(pos).second) {
+                queue.push_back(pos);
+            }
+        }
+    }
+    if (!reset) {
+        for (Position pos : queue_) {
+            if (queued.insert(pos).second) {
+                queue.push_back(pos);
+            }
+        }
+    }
+    queue_.swap(queue);
+    queued_.swap(queued);
+}
+
+void RecalcWorker::Run() {
+    worker_cancelled = &cancelled_;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        changed_.wait(lock, [this]() {
+            return stopping_ || (edits_ == 0 && queued_cells_ > 0) || reset_;
+        });
+        if (stopping_) {
+            return;
+        }
+        if (!pending_.empty() || reset_) {
+            //the edits may go on meanwhile: they only hand over more cells
+            std::vector<std::vector<Position>> batches = std::move(pending_);
+            pending_.clear();
+            bool reset = reset_;
+            reset_ = false;
+            lock.unlock();
+            Merge(std::move(batches), reset);
+            lock.lock();
+            queued_cells_ = queue_.size();
+            for (const std::vector<Position>& cells : pending_) {
+                queued_cells_ += cells.size();
+            }
+            changed_.notify_all();
+            continue;
+        }
+        if (edits_ > 0) {
+            continue;
+        }
+        Position pos = queue_.front();
+        queue_.pop_front();
+        queued_.erase(pos);
+        --queued_cells_;
+        evaluating_ = true;
+        lock.unlock();
+
+        bool cancelled = false;
+        try {
+            evaluate_(pos);
+        }
+        catch (const RecalcCancelled&) {
+            cancelled = true;
+        }
+
+        lock.lock();
+        evaluating_ = false;
+        if (!cancelled) {
+            ++recalculated_;
+        }
+        else {
+            //evaluated again first once the edits are over
+            ++cancellations_;
+            if (queued_.insert(pos).second) {
+                queue_.push_front(pos);
+                ++queued_cells_;
+            }
+        }
+        changed_.notify_all();
+    }
+}
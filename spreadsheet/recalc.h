@@ -0,0 +1,132 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+//Background recalculation of a sheet (Sheet::SetBackgroundRecalculation).
+struct RecalcStats {
+    bool enabled = false;
+    //cells waiting for the worker
+    size_t queued = 0;
+    //cells evaluated by the worker (already clean if a reader evaluated them first)
+    size_t recalculated = 0;
+    //evaluations abandoned because an edit arrived, queued again
+    size_t cancelled = 0;
+};
+
+//Result of a slice of Sheet::RecalculateFor.
+struct RecalcProgress {
+    //formulas evaluated by the slice
+    size_t evaluated = 0;
+    //formulas left to the next slices (at most: some of them may be evaluated by the
+    //reads meanwhile, or repeated)
+    size_t remaining = 0;
+    //the formulas of the priority region and the formulas they read are evaluated
+    bool priority_done = true;
+    //no formula left to evaluate
+    bool complete = false;
+};
+
+//Thrown through the evaluation of the worker when an edit cancels it.
+class RecalcCancelled : public std::exception {
+public:
+    const char* what() const noexcept override {
+        return "recalculation cancelled";
+    }
+};
+
+/// <summary>
+/// Worker thread recalculating the cells invalidated by the edits of a sheet.
+/// The edits queue the cells they invalidate (Enqueue) and the worker evaluates
+/// them one by one with evaluate. The worker and the edits exclude
+/// each other: an edit (EditScope) cancels the evaluation in progress, which
+/// throws RecalcCancelled from the next formula it evaluates (ThrowIfCancelled),
+/// and the cancelled cell is queued again, first. The worker starts again when
+/// the last edit scope ends. The readers are not excluded: they evaluate the
+/// cells they need through the cache, together with the worker.
+/// </summary>
+class RecalcWorker {
+public:
+    //Evaluate the cell at pos through the cache (nothing if it is not a formula).
+    using Evaluate = std::function<void(Position)>;
+
+    //Start the thread.
+    explicit RecalcWorker(Evaluate evaluate);
+    RecalcWorker(const RecalcWorker&) = delete;
+    RecalcWorker& operator=(const RecalcWorker&) = delete;
+    //Cancel the evaluation in progress and join the thread.
+    ~RecalcWorker();
+
+    //Exclusive access to the sheet for an edit, nothing if worker is nullptr.
+    //The scopes can be nested.
+    class EditScope {
+    public:
+        explicit EditScope(RecalcWorker* worker);
+        EditScope(const EditScope&) = delete;
+        EditScope& operator=(const EditScope&) = delete;
+        ~EditScope();
+
+    private:
+        RecalcWorker* worker_;
+    };
+
+    //Queue the cells (within an edit scope) in the order of their invalidation, before
+    //the cells queued by the previous edits. The edit only hands the cells over, the
+    //worker merges them into its queue.
+    void Enqueue(const std::vector<Position>& cells);
+    //Replace the queue (within an edit scope), after the cells moved.
+    void ResetQueue(const std::vector<Position>& cells);
+
+    //Block until the queue is empty and the worker is idle.
+    void WaitIdle();
+
+    RecalcStats GetStats() const;
+
+    //Called before evaluating a formula: throw RecalcCancelled if the calling
+    //thread is a worker whose evaluation is cancelled.
+    static void ThrowIfCancelled();
+
+private:
+    void Run();
+    void BeginEdit();
+    void EndEdit();
+    //Append the cells handed over by the edits to the queue (worker thread, unlocked).
+    void Merge(std::vector<std::vector<Position>> batches, bool reset);
+
+    Evaluate evaluate_;
+
+    //cells to evaluate in order, without duplicates (worker thread only)
+    std::deque<Position> queue_;
+    std::unordered_set<PositionKey, PositionHasher> queued_;
+
+    //protects the members below, except cancelled_ (read by ThrowIfCancelled)
+    mutable std::mutex mutex_;
+    //the cells, the edits, the evaluation or stopping_ changed
+    std::condition_variable changed_;
+    //cells handed over by the edits and not merged yet
+    std::vector<std::vector<Position>> pending_;
+    //the queue is out of date: cleared before merging pending_
+    bool reset_ = false;
+    //cells pending and queued (the pending ones may be duplicates)
+    size_t queued_cells_ = 0;
+    //edit scopes open
+    int edits_ = 0;
+    //the worker is evaluating a cell: the edits wait for it
+    bool evaluating_ = false;
+    bool stopping_ = false;
+    std::atomic<bool> cancelled_{ false };
+    size_t recalculated_ = 0;
+    size_t cancellations_ = 0;
+
+    std::thread thread_;
+};
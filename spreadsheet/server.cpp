@@ -0,0 +1,716 @@
+#include "server.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+//Output not read by the client above which its requests wait.
+constexpr size_t MAX_PENDING_OUTPUT = size_t(16) << 20;
+//Pause of accept when the process is out of file descriptors.
+constexpr std::chrono::milliseconds ACCEPT_BACKOFF{ 100 };
+//Bytes read from a connection per turn of the poll loop.
+constexpr size_t MAX_READ_PER_TURN = size_t(1) << 20;
+//Cells of a GetValues or Print range.
+constexpr std::uint64_t MAX_RANGE_CELLS = std::uint64_t(1) << 22;
+
+constexpr std::uint8_t TEXT_TAG = 4;
+constexpr std::uint8_t EMPTY_TAG = 5;
+
+[[noreturn]] void ThrowSystemError(const std::string& what) {
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+sockaddr_un MakeAddress(const std::string& socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("invalid socket path: " + socket_path);
+    }
+    std::memcpy(address.sun_path, socket_path.data(), socket_path.size());
+    return address;
+}
+
+//false if the size of the first request of input (once received) is above MAX_MESSAGE_SIZE.
+bool IsValidRequestSize(std::string_view input) {
+    std::uint32_t size = 0;
+    if (input.size() < sizeof(size)) {
+        return true;
+    }
+    std::memcpy(&size, input.data(), sizeof(size));
+    return size <= MAX_MESSAGE_SIZE;
+}
+
+void SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ThrowSystemError("fcntl failed");
+    }
+}
+
+//Rows and columns of [top_left, bottom_right].
+std::pair<int, int> GetRangeSize(Position top_left, Position bottom_right) {
+    if (bottom_right.row < top_left.row || bottom_right.col < top_left.col) {
+        throw InvalidPositionException("invalid range");
+    }
+    int rows = bottom_right.row - top_left.row + 1;
+    int cols = bottom_right.col - top_left.col + 1;
+    if (std::uint64_t(rows) * std::uint64_t(cols) > MAX_RANGE_CELLS) {
+        throw std::runtime_error("range too large");
+    }
+    return { rows, cols };
+}
+
+//Edits between BeginUpdate and EndUpdate, even when one of them throws.
+class UpdateScope {
+public:
+    explicit UpdateScope(Sheet& sheet)
+        : sheet_(sheet) {
+        sheet_.BeginUpdate();
+    }
+    UpdateScope(const UpdateScope&) = delete;
+    UpdateScope& operator=(const UpdateScope&) = delete;
+    ~UpdateScope() {
+        sheet_.EndUpdate();
+    }
+
+private:
+    Sheet& sheet_;
+};
+}  // namespace
+
+void PutCellValue(WireWriter& writer, const CellInterface* cell) {
+    if (!cell) {
+        writer.PutU8(EMPTY_TAG);
+        return;
+    }
+    CellInterface::ValueView value = cell->GetValueView();
+    if (std::holds_alternative<double>(value)) {
+        writer.PutValue(std::get<double>(value));
+    }
+    else if (std::holds_alternative<FormulaError>(value)) {
+        writer.PutValue(std::get<FormulaError>(value));
+    }
+    else {
+        writer.PutU8(TEXT_TAG);
+        writer.PutString(std::get<std::string_view>(value));
+    }
+}
+
+CellInterface::Value GetCellValue(WireReader& reader) {
+    std::uint8_t tag = reader.GetU8();
+    switch (tag) {
+    case 0:
+        return reader.GetDouble();
+    case TEXT_TAG:
+        return reader.GetString();
+    case EMPTY_TAG:
+        return std::string();
+    default:
+        if (tag > 1 + static_cast<int>(FormulaError::Category::Div0)) {
+            throw std::runtime_error("invalid value in message");
+        }
+        return FormulaError(static_cast<FormulaError::Category>(tag - 1));
+    }
+}
+
+SheetServer::SheetServer(std::string socket_path)
+    : socket_path_(std::move(socket_path)) {
+    sockaddr_un address = MakeAddress(socket_path_);
+    struct stat status {};
+    if (lstat(socket_path_.c_str(), &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            throw std::runtime_error("not a socket: " + socket_path_);
+        }
+        unlink(socket_path_.c_str());
+    }
+    listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener_ < 0) {
+        ThrowSystemError("socket failed");
+    }
+    if (bind(listener_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        int error = errno;
+        close(listener_);
+        errno = error;
+        ThrowSystemError("bind failed on " + socket_path_);
+    }
+    try {
+        if (listen(listener_, SOMAXCONN) < 0) {
+            ThrowSystemError("listen failed");
+        }
+        SetNonBlocking(listener_);
+        if (pipe(wake_pipe_) < 0) {
+            ThrowSystemError("pipe failed");
+        }
+        SetNonBlocking(wake_pipe_[0]);
+        SetNonBlocking(wake_pipe_[1]);
+    }
+    catch (...) {
+        close(listener_);
+        unlink(socket_path_.c_str());
+        throw;
+    }
+}
+
+SheetServer::~SheetServer() {
+    for (auto& [socket, connection] : connections_) {
+        close(socket);
+    }
+    close(listener_);
+    unlink(socket_path_.c_str());
+    close(wake_pipe_[0]);
+    close(wake_pipe_[1]);
+}
+
+void SheetServer::Run() {
+    std::vector<pollfd> fds;
+    while (!stopping_) {
+        fds.clear();
+        fds.push_back({ wake_pipe_[0], POLLIN, 0 });
+        //out of file descriptors, the pending connections wait in the backlog
+        int timeout = -1;
+        auto now = std::chrono::steady_clock::now();
+        if (now < accept_resume_) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(accept_resume_ - now);
+            timeout = static_cast<int>(wait.count()) + 1;
+        }
+        fds.push_back({ listener_, static_cast<short>(timeout < 0 ? POLLIN : 0), 0 });
+        for (const auto& [socket, connection] : connections_) {
+            short events = 0;
+            size_t pending = connection.output.size() - connection.written;
+            if (!connection.at_end && pending < MAX_PENDING_OUTPUT) {
+                events |= POLLIN;
+            }
+            if (pending > 0 || !connection.coalesced.empty()) {
+                events |= POLLOUT;
+            }
+            fds.push_back({ socket, events, 0 });
+        }
+        if (poll(fds.data(), fds.size(), timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ThrowSystemError("poll failed");
+        }
+        if (fds[0].revents != 0) {
+            char buffer[64];
+            while (read(wake_pipe_[0], buffer, sizeof(buffer)) > 0) {
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            Accept();
+        }
+        for (size_t i = 2; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            Connection& connection = connections_.at(fds[i].fd);
+            bool open = true;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                open = ReadFrom(connection);
+            }
+            //the responses just written are sent without waiting for the next turn, and
+            //the requests waiting for the output to drain go on as soon as it does
+            while (open) {
+                open = HandleRequests(connection) && WriteTo(connection);
+                if (connection.output.size() - connection.written >= MAX_PENDING_OUTPUT
+                    || GetWireMessageSize(connection.input) == 0) {
+                    break;
+                }
+            }
+            if (open && !connection.coalesced.empty()) {
+                FlushCoalescedEvents(connection);
+                open = WriteTo(connection);
+            }
+            //the input left is an incomplete request: it will not be completed
+            if (open && connection.at_end && connection.output.empty()) {
+                open = false;
+            }
+            if (!open) {
+                Close(fds[i].fd);
+            }
+        }
+    }
+}
+
+void SheetServer::Stop() {
+    stopping_ = true;
+    char byte = 0;
+    //a full pipe already wakes up poll
+    [[maybe_unused]] ssize_t result = write(wake_pipe_[1], &byte, 1);
+}
+
+ServerStats SheetServer::GetStats() const {
+    return stats_;
+}
+
+void SheetServer::Accept() {
+    while (true) {
+        int socket = accept(listener_, nullptr, nullptr);
+        if (socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                //the connections are accepted again once some are closed
+                accept_resume_ = std::chrono::steady_clock::now() + ACCEPT_BACKOFF;
+                ++stats_.accept_backoffs;
+                return;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+                ThrowSystemError("accept failed");
+            }
+            return;
+        }
+        fcntl(socket, F_SETFD, FD_CLOEXEC);
+        SetNonBlocking(socket);
+        connections_[socket].socket = socket;
+        ++stats_.connections;
+    }
+}
+
+bool SheetServer::ReadFrom(Connection& connection) {
+    char buffer[65536];
+    size_t received = 0;
+    //the size of a request is checked before the rest of it is read
+    while (received < MAX_READ_PER_TURN && IsValidRequestSize(connection.input)) {
+        ssize_t result = read(connection.socket, buffer, sizeof(buffer));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        if (result == 0) {
+            connection.at_end = true;
+            break;
+        }
+        connection.input.append(buffer, static_cast<size_t>(result));
+        received += static_cast<size_t>(result);
+    }
+    stats_.bytes_received += received;
+    return IsValidRequestSize(connection.input);
+}
+
+bool SheetServer::WriteTo(Connection& connection) {
+    while (connection.written < connection.output.size()) {
+        ssize_t result = send(connection.socket, connection.output.data() + connection.written,
+            connection.output.size() - connection.written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection.written += static_cast<size_t>(result);
+        stats_.bytes_sent += static_cast<std::uint64_t>(result);
+    }
+    connection.output.clear();
+    connection.written = 0;
+    return true;
+}
+
+void SheetServer::Close(int socket) {
+    auto it = connections_.find(socket);
+    for (const Subscription& subscription : it->second.subscriptions) {
+        sheets_[subscription.sheet]->Unsubscribe(subscription.sheet_subscription);
+    }
+    connections_.erase(it);
+    close(socket);
+}
+
+bool SheetServer::HandleRequests(Connection& connection) {
+    std::string_view input(connection.input);
+    size_t offset = 0;
+    bool valid = true;
+    while (connection.output.size() - connection.written < MAX_PENDING_OUTPUT) {
+        if (!IsValidRequestSize(input.substr(offset))) {
+            valid = false;
+            break;
+        }
+        size_t size = GetWireMessageSize(input.substr(offset));
+        if (size == 0) {
+            break;
+        }
+        WireReader request(std::string(input.substr(offset + sizeof(std::uint32_t), size - sizeof(std::uint32_t))));
+        offset += size;
+        ++stats_.requests;
+
+        //a failed request leaves no partial result: its response is written again
+        size_t start = connection.output.size();
+        std::uint32_t id = 0;
+        try {
+            id = request.GetU32();
+            WireWriter response(connection.output);
+            response.PutU32(id);
+            response.PutU8(static_cast<std::uint8_t>(ServerStatus::Ok));
+            Handle(connection, request, response);
+            response.Finish();
+        }
+        catch (const std::exception& e) {
+            ++stats_.errors;
+            connection.output.resize(start);
+            WireWriter response(connection.output);
+            response.PutU32(id);
+            response.PutU8(static_cast<std::uint8_t>(ServerStatus::Error));
+            response.PutString(e.what());
+            response.Finish();
+        }
+        FlushEvents();
+    }
+    connection.input.erase(0, offset);
+    return valid;
+}
+
+void SheetServer::Handle(Connection& connection, WireReader& request, WireWriter& response) {
+    switch (static_cast<ServerOp>(request.GetU8())) {
+    case ServerOp::OpenSheet: {
+        std::string name = request.GetString();
+        auto [it, inserted] = sheet_ids_.emplace(std::move(name), static_cast<std::uint32_t>(sheets_.size()));
+        if (inserted) {
+            sheets_.push_back(std::make_unique<Sheet>());
+        }
+        response.PutU32(it->second);
+        return;
+    }
+    case ServerOp::SetCells: {
+        Sheet& sheet = GetSheet(request.GetU32());
+        std::uint32_t count = request.GetU32();
+        UpdateScope update(sheet);
+        for (std::uint32_t i = 0; i < count; ++i) {
+            Position pos = request.GetPosition();
+            std::string text = request.GetString();
+            try {
+                sheet.SetCell(pos, std::move(text));
+            }
+            catch (const std::exception& e) {
+                throw std::runtime_error("cell " + pos.ToString() + ": " + e.what());
+            }
+            ++stats_.cells;
+        }
+        return;
+    }
+    case ServerOp::SetNumbers: {
+        Sheet& sheet = GetSheet(request.GetU32());
+        std::uint32_t count = request.GetU32();
+        std::vector<std::pair<Position, double>> numbers;
+        for (std::uint32_t i = 0; i < count; ++i) {
+            Position pos = request.GetPosition();
+            numbers.emplace_back(pos, request.GetDouble());
+        }
+        response.PutU32(static_cast<std::uint32_t>(sheet.ApplyTicks(numbers)));
+        stats_.cells += count;
+        return;
+    }
+    case ServerOp::GetValues: {
+        const Sheet& sheet = GetSheet(request.GetU32());
+        Position top_left = request.GetPosition();
+        Position bottom_right = request.GetPosition();
+        auto [rows, cols] = GetRangeSize(top_left, bottom_right);
+        response.PutU32(static_cast<std::uint32_t>(rows));
+        response.PutU32(static_cast<std::uint32_t>(cols));
+        for (int row = top_left.row; row <= bottom_right.row; ++row) {
+            for (int col = top_left.col; col <= bottom_right.col; ++col) {
+                PutCellValue(response, sheet.GetCell({ row, col }));
+            }
+        }
+        stats_.cells += std::uint64_t(rows) * std::uint64_t(cols);
+        return;
+    }
+    case ServerOp::Print: {
+        const Sheet& sheet = GetSheet(request.GetU32());
+        Position top_left = request.GetPosition();
+        Position bottom_right = request.GetPosition();
+        bool texts = request.GetU8() != 0;
+        auto [rows, cols] = GetRangeSize(top_left, bottom_right);
+        std::ostringstream output;
+        if (texts) {
+            sheet.PrintTexts(output, top_left, bottom_right);
+        }
+        else {
+            sheet.PrintValues(output, top_left, bottom_right);
+        }
+        response.PutString(output.str());
+        stats_.cells += std::uint64_t(rows) * std::uint64_t(cols);
+        return;
+    }
+    case ServerOp::Subscribe: {
+        std::uint32_t sheet_id = request.GetU32();
+        Sheet& sheet = GetSheet(sheet_id);
+        Position top_left = request.GetPosition();
+        Position bottom_right = request.GetPosition();
+        GetRangeSize(top_left, bottom_right);
+        std::uint32_t id = next_subscription_++;
+        int socket = connection.socket;
+        SubscriptionId sheet_subscription = sheet.Subscribe({ top_left, bottom_right },
+            [this, socket, id](const SheetChanges& changes) {
+                AddEvent(socket, id, changes);
+            });
+        connection.subscriptions.push_back({ id, sheet_id, sheet_subscription });
+        response.PutU32(id);
+        return;
+    }
+    case ServerOp::Unsubscribe: {
+        std::uint32_t id = request.GetU32();
+        auto& subscriptions = connection.subscriptions;
+        auto it = std::find_if(subscriptions.begin(), subscriptions.end(),
+            [id](const Subscription& subscription) { return subscription.id == id; });
+        if (it == subscriptions.end()) {
+            throw std::runtime_error("unknown subscription");
+        }
+        sheets_[it->sheet]->Unsubscribe(it->sheet_subscription);
+        subscriptions.erase(it);
+        auto& coalesced = connection.coalesced;
+        coalesced.erase(std::remove(coalesced.begin(), coalesced.end(), id), coalesced.end());
+        return;
+    }
+    }
+    throw std::runtime_error("unknown operation");
+}
+
+void SheetServer::AddEvent(int socket, std::uint32_t subscription, const SheetChanges& changes) {
+    Connection& connection = connections_.at(socket);
+    auto& coalesced = connection.coalesced;
+    bool is_coalesced = std::find(coalesced.begin(), coalesced.end(), subscription) != coalesced.end();
+    size_t pending = connection.output.size() - connection.written + connection.events.size();
+    size_t event_size = 2 * sizeof(std::uint32_t) + 2 + changes.cells.size() * sizeof(std::uint32_t)
+        + sizeof(std::uint32_t);
+    if (is_coalesced || pending + event_size > MAX_PENDING_OUTPUT) {
+        //the client does not read: its events do not grow the output any more
+        if (!is_coalesced) {
+            coalesced.push_back(subscription);
+        }
+        ++stats_.events_coalesced;
+        return;
+    }
+    if (connection.events.empty()) {
+        pending_events_.push_back(socket);
+    }
+    WireWriter event(connection.events);
+    event.PutU32(subscription);
+    event.PutU8(static_cast<std::uint8_t>(ServerStatus::Event));
+    event.PutU8(changes.layout_changed ? 1 : 0);
+    event.PutU32(static_cast<std::uint32_t>(changes.cells.size()));
+    for (Position pos : changes.cells) {
+        event.PutPosition(pos);
+    }
+    event.Finish();
+    ++stats_.events;
+}
+
+void SheetServer::FlushEvents() {
+    for (int socket : pending_events_) {
+        Connection& connection = connections_.at(socket);
+        connection.output += connection.events;
+        connection.events.clear();
+    }
+    pending_events_.clear();
+}
+
+void SheetServer::FlushCoalescedEvents(Connection& connection) {
+    if (connection.output.size() - connection.written >= MAX_PENDING_OUTPUT) {
+        return;
+    }
+    for (std::uint32_t subscription : connection.coalesced) {
+        WireWriter event(connection.output);
+        event.PutU32(subscription);
+        event.PutU8(static_cast<std::uint8_t>(ServerStatus::Event));
+        event.PutU8(1);
+        event.PutU32(0);
+        event.Finish();
+        ++stats_.events;
+    }
+    connection.coalesced.clear();
+}
+
+Sheet& SheetServer::GetSheet(std::uint32_t sheet) {
+    if (sheet >= sheets_.size()) {
+        throw std::runtime_error("unknown sheet");
+    }
+    return *sheets_[sheet];
+}
+
+SheetClient::SheetClient(const std::string& socket_path) {
+    sockaddr_un address = MakeAddress(socket_path);
+    socket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_ < 0) {
+        ThrowSystemError("socket failed");
+    }
+    if (connect(socket_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        int error = errno;
+        close(socket_);
+        errno = error;
+        ThrowSystemError("cannot connect to " + socket_path);
+    }
+}
+
+SheetClient::~SheetClient() {
+    close(socket_);
+}
+
+std::uint32_t SheetClient::OpenSheet(std::string_view name) {
+    WireWriter request(output_);
+    std::uint32_t id = Begin(ServerOp::OpenSheet, request);
+    request.PutString(name);
+    request.Finish();
+    return id;
+}
+
+std::uint32_t SheetClient::SetCells(std::uint32_t sheet, const std::vector<std::pair<Position, std::string>>& cells) {
+    WireWriter request(output_);
+    std::uint32_t id = Begin(ServerOp::SetCells, request);
+    request.PutU32(sheet);
+    request.PutU32(static_cast<std::uint32_t>(cells.size()));
+    for (const auto& [pos, text] : cells) {
+        request.PutPosition(pos);
+        request.PutString(text);
+    }
+    request.Finish();
+    return id;
+}
+
+std::uint32_t SheetClient::SetNumbers(std::uint32_t sheet, const std::vector<std::pair<Position, double>>& numbers) {
+    WireWriter request(output_);
+    std::uint32_t id = Begin(ServerOp::SetNumbers, request);
+    request.PutU32(sheet);
+    request.PutU32(static_cast<std::uint32_t>(numbers.size()));
+    for (const auto& [pos, number] : numbers) {
+        request.PutPosition(pos);
+        request.PutDouble(number);
+    }
+    request.Finish();
+    return id;
+}
+
+std::uint32_t SheetClient::GetValues(std::uint32_t sheet, Position top_left, Position bottom_right) {
+    WireWriter request(output_);
+    std::uint32_t id = Begin(ServerOp::GetValues, request);
+    request.PutU32(sheet);
+    request.PutPosition(top_left);
+    request.PutPosition(bottom_right);
+    request.Finish();
+    return id;
+}
+
+std::uint32_t SheetClient::Print(std::uint32_t sheet, Position top_left, Position bottom_right, bool texts) {
+    WireWriter request(output_);
+    std::uint32_t id = Begin(ServerOp::Print, request);
+    request.PutU32(sheet);
+    request.PutPosition(top_left);
+    request.PutPosition(bottom_right);
+    request.PutU8(texts ? 1 : 0);
+    request.Finish();
+    return id;
+}
+
+std::uint32_t SheetClient::Subscribe(std::uint32_t sheet, Position top_left, Position bottom_right) {
+    WireWriter request(output_);
+    std::uint32_t id = Begin(ServerOp::Subscribe, request);
+    request.PutU32(sheet);
+    request.PutPosition(top_left);
+    request.PutPosition(bottom_right);
+    request.Finish();
+    return id;
+}
+
+std::uint32_t SheetClient::Unsubscribe(std::uint32_t subscription) {
+    WireWriter request(output_);
+    std::uint32_t id = Begin(ServerOp::Unsubscribe, request);
+    request.PutU32(subscription);
+    request.Finish();
+    return id;
+}
+
+void SheetClient::Flush() {
+    WriteAll(socket_, output_);
+    output_.clear();
+}
+
+void SheetClient::Shutdown() {
+    Flush();
+    if (shutdown(socket_, SHUT_WR) < 0) {
+        ThrowSystemError("shutdown failed");
+    }
+}
+
+ServerResponse SheetClient::Receive() {
+    if (!received_.empty()) {
+        ServerResponse response = std::move(received_.front());
+        received_.pop_front();
+        return response;
+    }
+    return ReadResponse();
+}
+
+ServerResponse SheetClient::Call(std::uint32_t request) {
+    Flush();
+    while (true) {
+        ServerResponse response = ReadResponse();
+        if (response.status != ServerStatus::Event && response.id == request) {
+            if (response.status == ServerStatus::Error) {
+                throw std::runtime_error(response.fields.GetString());
+            }
+            return response;
+        }
+        received_.push_back(std::move(response));
+    }
+}
+
+std::vector<std::vector<CellInterface::Value>> SheetClient::ReadValues(WireReader& fields) {
+    std::uint32_t rows = fields.GetU32();
+    std::uint32_t cols = fields.GetU32();
+    if (std::uint64_t(rows) * std::uint64_t(cols) > MAX_RANGE_CELLS) {
+        throw std::runtime_error("invalid range in message");
+    }
+    std::vector<std::vector<CellInterface::Value>> values(rows);
+    for (auto& row : values) {
+        row.reserve(cols);
+        for (std::uint32_t col = 0; col < cols; ++col) {
+            row.push_back(GetCellValue(fields));
+        }
+    }
+    return values;
+}
+
+SheetChanges SheetClient::ReadChanges(WireReader& fields) {
+    SheetChanges changes;
+    changes.layout_changed = fields.GetU8() != 0;
+    std::uint32_t count = fields.GetU32();
+    for (std::uint32_t i = 0; i < count; ++i) {
+        changes.cells.push_back(fields.GetPosition());
+    }
+    return changes;
+}
+
+std::uint32_t SheetClient::Begin(ServerOp op, WireWriter& request) {
+    std::uint32_t id = next_id_++;
+    request.PutU32(id);
+    request.PutU8(static_cast<std::uint8_t>(op));
+    return id;
+}
+
+ServerResponse SheetClient::ReadResponse() {
+    std::string message = ReadMessage(socket_);
+    if (message.empty()) {
+        throw std::runtime_error("the server closed the connection");
+    }
+    WireReader header(message.substr(0, sizeof(std::uint32_t) + 1));
+    ServerResponse response;
+    response.id = header.GetU32();
+    response.status = static_cast<ServerStatus>(header.GetU8());
+    response.fields = WireReader(message.substr(sizeof(std::uint32_t) + 1));
+    return response;
+}
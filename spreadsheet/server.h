@@ -0,0 +1,212 @@
+#pragma once
+
+#include "common.h"
+#include "subscriptions.h"
+#include "wire.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+//Protocol of the SheetServer: binary messages of wire.h over a Unix-domain socket.
+//A request is its id (u32, chosen by the client), its operation (u8) and the fields of
+//the operation. The client can send any number of requests without waiting (pipelining):
+//the server answers them in order, with a response of the same id, its status (u8) and
+//the fields of the result (the text of the error for Error). The changes of a subscribed
+//range arrive as Event messages (the id of the subscription) between the responses.
+enum class ServerOp : std::uint8_t {
+    //name -> sheet (u32): the sheet of the name, created by its first request
+    OpenSheet = 1,
+    //sheet, count, (position, text) x count -> nothing; the cells are set in order as one
+    //batch of edits, an error stops at the failed cell (the cells before it are set)
+    SetCells = 2,
+    //sheet, count, (position, number) x count -> cells changed (u32) (Sheet::ApplyTicks)
+    SetNumbers = 3,
+    //sheet, top left, bottom right -> rows, cols, values row by row (PutCellValue)
+    GetValues = 4,
+    //sheet, top left, bottom right, texts (u8) -> the PrintValues (PrintTexts) of the range
+    Print = 5,
+    //sheet, top left, bottom right -> subscription (u32), unique in the server
+    Subscribe = 6,
+    //subscription -> nothing
+    Unsubscribe = 7,
+};
+
+enum class ServerStatus : std::uint8_t {
+    Ok = 0,
+    Error = 1,
+    //layout changed (u8), count, positions (SheetChanges)
+    Event = 2,
+};
+
+//Value of a cell in a message: the tags of WireWriter::PutValue for the numbers and the
+//errors, then a text (tag 4, string) or an empty cell (tag 5).
+void PutCellValue(WireWriter& writer, const CellInterface* cell);
+CellInterface::Value GetCellValue(WireReader& reader);
+
+//Counters of a SheetServer.
+struct ServerStats {
+    std::uint64_t connections = 0;
+    std::uint64_t requests = 0;
+    //cells of the requests: set, read or printed
+    std::uint64_t cells = 0;
+    std::uint64_t errors = 0;
+    std::uint64_t events = 0;
+    //events not written as the output of their connection was full: one event with
+    //layout changed and no cell replaces those of a subscription once the output drains
+    std::uint64_t events_coalesced = 0;
+    //accept failed for lack of file descriptors: new connections waited
+    std::uint64_t accept_backoffs = 0;
+    std::uint64_t bytes_received = 0;
+    std::uint64_t bytes_sent = 0;
+};
+
+/// <summary>
+/// Server hosting sheets for the clients of a Unix-domain socket. One thread serves
+/// all the connections (poll): it reads every complete request of a connection,
+/// answers them in order into the output buffer of the connection and writes what
+/// the socket accepts. While the output of a connection is not read, its requests
+/// wait (and are not read) until the output drains. A request larger than
+/// MAX_MESSAGE_SIZE closes the connection; a client that shuts down its side gets
+/// the responses of its last requests, then the connection is closed. The events of
+/// a subscription whose connection output is full are coalesced into one event
+/// (layout changed: read the whole range again). The subscriptions of a connection
+/// end with it. Out of file descriptors, the server stops accepting for a while.
+/// </summary>
+class SheetServer {
+public:
+    //Listen on socket_path (replacing a stale socket file).
+    //Throw std::runtime_error on failure.
+    explicit SheetServer(std::string socket_path);
+    SheetServer(const SheetServer&) = delete;
+    SheetServer& operator=(const SheetServer&) = delete;
+    //Close the connections and remove the socket file.
+    ~SheetServer();
+
+    //Serve until Stop.
+    void Run();
+    //Make Run return: from any thread, or a signal handler.
+    void Stop();
+
+    //Updated by Run: read from its thread or once it returned.
+    ServerStats GetStats() const;
+
+private:
+    struct Subscription {
+        std::uint32_t id = 0;
+        std::uint32_t sheet = 0;
+        SubscriptionId sheet_subscription = 0;
+    };
+
+    struct Connection {
+        int socket = -1;
+        std::string input;
+        std::string output;
+        //bytes of output already written
+        size_t written = 0;
+        //events raised while a response is written, appended to output after it
+        std::string events;
+        std::vector<Subscription> subscriptions;
+        //the client sent its last request
+        bool at_end = false;
+        //subscriptions whose events were coalesced, not written yet
+        std::vector<std::uint32_t> coalesced;
+    };
+
+    void Accept();
+    //false if the connection is closed.
+    bool ReadFrom(Connection& connection);
+    bool WriteTo(Connection& connection);
+    void Close(int socket);
+    //Answer the complete requests until the output is full, false if a request is too large.
+    bool HandleRequests(Connection& connection);
+    void Handle(Connection& connection, WireReader& request, WireWriter& response);
+    void AddEvent(int socket, std::uint32_t subscription, const SheetChanges& changes);
+    void FlushEvents();
+    //Write the coalesced events once the output of the connection has room for them.
+    void FlushCoalescedEvents(Connection& connection);
+    Sheet& GetSheet(std::uint32_t sheet);
+
+    std::string socket_path_;
+    int listener_ = -1;
+    //written by Stop to wake up poll
+    int wake_pipe_[2] = { -1, -1 };
+    std::atomic<bool> stopping_{ false };
+    //no connection is accepted before (accept failed for lack of file descriptors)
+    std::chrono::steady_clock::time_point accept_resume_;
+
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+    std::unordered_map<std::string, std::uint32_t> sheet_ids_;
+    std::unordered_map<int, Connection> connections_;
+    //connections with events
+    std::vector<int> pending_events_;
+    std::uint32_t next_subscription_ = 1;
+    ServerStats stats_;
+};
+
+//Response (or event) received by a SheetClient.
+struct ServerResponse {
+    //request, or subscription of an event
+    std::uint32_t id = 0;
+    ServerStatus status = ServerStatus::Ok;
+    //fields of the result
+    WireReader fields{ std::string() };
+};
+
+/// <summary>
+/// Blocking client of a SheetServer. The requests are queued and sent together
+/// by Flush; Receive returns the responses (and the events) in order.
+/// </summary>
+class SheetClient {
+public:
+    //Throw std::runtime_error if the server cannot be reached.
+    explicit SheetClient(const std::string& socket_path);
+    SheetClient(const SheetClient&) = delete;
+    SheetClient& operator=(const SheetClient&) = delete;
+    ~SheetClient();
+
+    //Queue a request, return its id.
+    std::uint32_t OpenSheet(std::string_view name);
+    std::uint32_t SetCells(std::uint32_t sheet, const std::vector<std::pair<Position, std::string>>& cells);
+    std::uint32_t SetNumbers(std::uint32_t sheet, const std::vector<std::pair<Position, double>>& numbers);
+    std::uint32_t GetValues(std::uint32_t sheet, Position top_left, Position bottom_right);
+    std::uint32_t Print(std::uint32_t sheet, Position top_left, Position bottom_right, bool texts = false);
+    std::uint32_t Subscribe(std::uint32_t sheet, Position top_left, Position bottom_right);
+    std::uint32_t Unsubscribe(std::uint32_t subscription);
+
+    //Send the queued requests.
+    void Flush();
+    //Flush, then tell the server that no request follows: the responses still arrive,
+    //then the server closes the connection.
+    void Shutdown();
+    //Next response or event. Throw std::runtime_error if the server closed the connection.
+    ServerResponse Receive();
+    //Flush, then the response of request (the other responses and the events before it
+    //are kept for Receive).
+    //Throw std::runtime_error with the text of the error for an Error response.
+    ServerResponse Call(std::uint32_t request);
+
+    //Fields of the results.
+    static std::vector<std::vector<CellInterface::Value>> ReadValues(WireReader& fields);
+    static SheetChanges ReadChanges(WireReader& fields);
+
+private:
+    std::uint32_t Begin(ServerOp op, WireWriter& request);
+    ServerResponse ReadResponse();
+
+    int socket_ = -1;
+    std::string output_;
+    std::uint32_t next_id_ = 1;
+    //received by Call before its response
+    std::deque<ServerResponse> received_;
+};
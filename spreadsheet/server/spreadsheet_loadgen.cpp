@@ -0,0 +1,246 @@
+#include "server.h"
+
+#include "bench/bench_runner.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//Load generator of the spreadsheet server: fills a sheet, then sends pipelined requests
+//from several connections and reports the throughput and the latencies.
+//Usage: spreadsheet_loadgen [--socket PATH] [--connections N] [--requests N] [--pipeline N]
+//    [--batch N] [--rows N] [--writes PCT] [--prints PCT] [--seed N]
+// * connections: clients sending requests at the same time (one thread each).
+// * requests: requests sent by each connection.
+// * pipeline: requests of a connection sent without waiting for their responses.
+// * batch: cells of a request (numbers set, or values read).
+// * rows: rows of the sheet: 5 columns of numbers, 5 columns of formulas reading them.
+// * writes, prints: percent of the requests setting numbers, printing a range; the
+//   other requests read the values of a range.
+//The latency of a request is the time from its sending to its response.
+
+namespace {
+
+constexpr int NUMBER_COLS = 5;
+constexpr int FORMULA_COLS = 5;
+
+struct LoadParams {
+    std::string socket_path = "/tmp/spreadsheet.sock";
+    int connections = 4;
+    int requests = 10000;
+    int pipeline = 16;
+    int batch = 100;
+    int rows = 1000;
+    int writes = 50;
+    int prints = 0;
+    unsigned seed = 42;
+};
+
+struct ConnectionResult {
+    //of the requests, in nanoseconds
+    std::vector<std::int64_t> latencies;
+    std::uint64_t cells = 0;
+};
+
+std::string GetFormula(int row, int col) {
+    std::string text = "=";
+    for (int i = 0; i <= col; ++i) {
+        text += (i ? "+" : "") + Position{ row, i }.ToString();
+    }
+    return text;
+}
+
+void FillSheet(const LoadParams& params) {
+    SheetClient client(params.socket_path);
+    std::uint32_t sheet = client.Call(client.OpenSheet("loadgen")).fields.GetU32();
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < params.rows; ++row) {
+        for (int col = 0; col < NUMBER_COLS; ++col) {
+            cells.emplace_back(Position{ row, col }, std::to_string(row + col));
+        }
+        for (int col = 0; col < FORMULA_COLS; ++col) {
+            cells.emplace_back(Position{ row, NUMBER_COLS + col }, GetFormula(row, col));
+        }
+        if (cells.size() >= 10000 || row + 1 == params.rows) {
+            client.Call(client.SetCells(sheet, cells));
+            cells.clear();
+        }
+    }
+}
+
+ConnectionResult RunConnection(const LoadParams& params, int index) {
+    ConnectionResult result;
+    result.latencies.reserve(params.requests);
+    std::mt19937 random(params.seed + index);
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::uniform_int_distribution<int> any_row(0, params.rows - 1);
+    std::uniform_int_distribution<int> any_col(0, NUMBER_COLS - 1);
+    //a range of about batch cells
+    int range_rows = std::max(1, std::min(params.rows, params.batch / (NUMBER_COLS + FORMULA_COLS)));
+    std::uniform_int_distribution<int> range_row(0, params.rows - range_rows);
+
+    SheetClient client(params.socket_path);
+    std::uint32_t sheet = client.Call(client.OpenSheet("loadgen")).fields.GetU32();
+    std::vector<std::pair<Position, double>> numbers;
+    //send times of the requests in flight, in order
+    std::deque<BenchClock::time_point> in_flight;
+
+    auto send = [&]() {
+        int kind = percent(random);
+        if (kind < params.writes) {
+            numbers.clear();
+            for (int i = 0; i < params.batch; ++i) {
+                numbers.emplace_back(Position{ any_row(random), any_col(random) }, percent(random));
+            }
+            client.SetNumbers(sheet, numbers);
+            result.cells += params.batch;
+        }
+        else {
+            Position top_left{ range_row(random), 0 };
+            Position bottom_right{ top_left.row + range_rows - 1, NUMBER_COLS + FORMULA_COLS - 1 };
+            if (kind < params.writes + params.prints) {
+                client.Print(sheet, top_left, bottom_right);
+            }
+            else {
+                client.GetValues(sheet, top_left, bottom_right);
+            }
+            result.cells += std::uint64_t(range_rows) * (NUMBER_COLS + FORMULA_COLS);
+        }
+        in_flight.push_back(BenchClock::now());
+    };
+
+    int sent = 0;
+    for (; sent < std::min(params.pipeline, params.requests); ++sent) {
+        send();
+    }
+    client.Flush();
+    while (!in_flight.empty()) {
+        ServerResponse response = client.Receive();
+        if (response.status == ServerStatus::Error) {
+            throw std::runtime_error("request failed: " + response.fields.GetString());
+        }
+        auto latency = BenchClock::now() - in_flight.front();
+        in_flight.pop_front();
+        result.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+        if (sent < params.requests) {
+            send();
+            ++sent;
+            client.Flush();
+        }
+    }
+    return result;
+}
+
+[[noreturn]] void PrintUsageAndExit(const char* program) {
+    std::cerr << "Usage: " << program
+        << " [--socket PATH] [--connections N] [--requests N] [--pipeline N] [--batch N] [--rows N]"
+        << " [--writes PCT] [--prints PCT] [--seed N]" << std::endl;
+    std::exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    LoadParams params;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            PrintUsageAndExit(argv[0]);
+        }
+        std::string value = argv[++i];
+        if (arg == "--socket") {
+            params.socket_path = value;
+        }
+        else if (arg == "--connections") {
+            params.connections = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--requests") {
+            params.requests = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--pipeline") {
+            params.pipeline = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--batch") {
+            params.batch = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--rows") {
+            params.rows = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--writes") {
+            params.writes = std::clamp(std::stoi(value), 0, 100);
+        }
+        else if (arg == "--prints") {
+            params.prints = std::clamp(std::stoi(value), 0, 100);
+        }
+        else if (arg == "--seed") {
+            params.seed = static_cast<unsigned>(std::stoul(value));
+        }
+        else {
+            PrintUsageAndExit(argv[0]);
+        }
+    }
+
+    try {
+        FillSheet(params);
+
+        std::vector<ConnectionResult> results(params.connections);
+        std::vector<std::exception_ptr> errors(params.connections);
+        auto start = BenchClock::now();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < params.connections; ++i) {
+            threads.emplace_back([&, i]() {
+                try {
+                    results[i] = RunConnection(params, i);
+                }
+                catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        double seconds = std::chrono::duration<double>(BenchClock::now() - start).count();
+        for (const std::exception_ptr& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        LatencySample sample;
+        sample.Reserve(size_t(params.connections) * params.requests);
+        std::uint64_t cells = 0;
+        for (const ConnectionResult& result : results) {
+            for (std::int64_t latency : result.latencies) {
+                sample.Add(latency);
+            }
+            cells += result.cells;
+        }
+        std::cout << "connections: " << params.connections << ", pipeline: " << params.pipeline
+            << ", batch: " << params.batch << ", writes: " << params.writes << "%, prints: "
+            << params.prints << "%\n"
+            << "requests: " << sample.Count() << " in " << seconds << " s, "
+            << static_cast<long long>(sample.Count() / seconds) << " requests/s, "
+            << static_cast<long long>(cells / seconds) << " cells/s\n"
+            << "latency (us): p50 " << sample.Percentile(50) / 1000
+            << ", p90 " << sample.Percentile(90) / 1000
+            << ", p99 " << sample.Percentile(99) / 1000
+            << ", p99.9 " << sample.Percentile(99.9) / 1000
+            << ", max " << sample.Percentile(100) / 1000 << std::endl;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "spreadsheet_loadgen: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "server.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+
+//Server hosting sheets over a Unix-domain socket (protocol of server.h).
+//Usage: spreadsheet_server [--socket PATH]
+// * socket: path of the socket, /tmp/spreadsheet.sock by default.
+//SIGINT or SIGTERM stop the server, which prints its counters.
+
+namespace {
+
+SheetServer* g_server = nullptr;
+
+void HandleSignal(int) {
+    if (g_server) {
+        g_server->Stop();
+    }
+}
+
+[[noreturn]] void PrintUsageAndExit(const char* program) {
+    std::cerr << "Usage: " << program << " [--socket PATH]" << std::endl;
+    std::exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::string socket_path = "/tmp/spreadsheet.sock";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            PrintUsageAndExit(argv[0]);
+        }
+        std::string value = argv[++i];
+        if (arg == "--socket") {
+            socket_path = value;
+        }
+        else {
+            PrintUsageAndExit(argv[0]);
+        }
+    }
+
+    try {
+        SheetServer server(socket_path);
+        g_server = &server;
+        std::signal(SIGINT, HandleSignal);
+        std::signal(SIGTERM, HandleSignal);
+        std::cerr << "listening on " << socket_path << std::endl;
+        server.Run();
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        g_server = nullptr;
+
+        ServerStats stats = server.GetStats();
+        std::cerr << "connections: " << stats.connections
+            << ", requests: " << stats.requests
+            << ", cells: " << stats.cells
+            << ", errors: " << stats.errors
+            << ", events: " << stats.events
+            << ", events coalesced: " << stats.events_coalesced
+            << ", accept backoffs: " << stats.accept_backoffs
+            << ", bytes received: " << stats.bytes_received
+            << ", bytes sent: " << stats.bytes_sent << std::endl;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "spreadsheet_server: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,625 @@
+#include "shard.h"
+
+#include "sheet.h"
+#include "wire.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+//Type (first field) of the messages (wire.h).
+enum class MessageType : std::uint8_t {
+    //coordinator -> worker
+    Load = 'L',     //proxies (position), cells (position, text), rounds (formulas (position, exported))
+    Round = 'R',    //round, proxies (position, value)
+    Numbers = 'N',  //numbers (position, number)
+    Collect = 'C',
+    Stop = 'S',
+    //worker -> coordinator
+    Values = 'V',   //values (position, value)
+    Done = 'D',
+    Error = 'E',    //text
+};
+
+//A message starting with its type.
+class MessageWriter : public WireWriter {
+public:
+    explicit MessageWriter(MessageType type) {
+        PutU8(static_cast<std::uint8_t>(type));
+    }
+
+    MessageWriter(std::string& buffer, MessageType type)
+        : WireWriter(buffer) {
+        PutU8(static_cast<std::uint8_t>(type));
+    }
+};
+
+class MessageReader : public WireReader {
+public:
+    explicit MessageReader(std::string message)
+        : WireReader(std::move(message)) {
+        type_ = static_cast<MessageType>(GetU8());
+    }
+
+    MessageType GetType() const {
+        return type_;
+    }
+
+private:
+    MessageType type_;
+};
+
+FormulaInterface::Value ToFormulaValue(const CellInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<FormulaError>(value)) {
+        return std::get<FormulaError>(value);
+    }
+    //a formula never evaluates to a text
+    throw std::logic_error("formula with a text value");
+}
+
+/// <summary>
+/// Worker process of a shard: a sheet with the formulas of the shard, the cells they
+/// read, and the proxies of the formulas of the other shards they read. The formulas
+/// are copies of the parsed formulas of the coordinator (the worker is forked from it),
+/// so their references to deleted cells stay #REF!. A proxy is pinned to the value sent
+/// by the coordinator, a number or an error (Sheet::ApplyValueTicks).
+/// </summary>
+class ShardWorker {
+public:
+    //formulas: the formulas of the shard in the memory of the coordinator, copied by Load.
+    explicit ShardWorker(const std::vector<std::pair<Position, const FormulaInterface*>>& formulas)
+        : formulas_of_shard_(formulas) {
+    }
+
+    //Serve the messages of the coordinator until Stop or the end of the stream.
+    void Run(int fd) {
+        while (true) {
+            std::string message = ReadMessage(fd);
+            if (message.empty()) {
+                return;
+            }
+            MessageReader reader(std::move(message));
+            if (reader.GetType() == MessageType::Stop) {
+                return;
+            }
+            std::string reply;
+            try {
+                reply = Handle(reader);
+            }
+            catch (const std::exception& e) {
+                MessageWriter error(MessageType::Error);
+                error.PutString(e.what());
+                reply = error.Finish();
+            }
+            WriteAll(fd, reply);
+        }
+    }
+
+private:
+    std::string Handle(MessageReader& reader) {
+        switch (reader.GetType()) {
+        case MessageType::Load:
+            Load(reader);
+            return MessageWriter(MessageType::Done).Finish();
+        case MessageType::Round:
+            return Round(reader);
+        case MessageType::Numbers: {
+            std::vector<std::pair<Position, double>> numbers(reader.GetU32());
+            for (auto& [pos, number] : numbers) {
+                pos = reader.GetPosition();
+                number = reader.GetDouble();
+            }
+            sheet_.ApplyTicks(numbers);
+            return MessageWriter(MessageType::Done).Finish();
+        }
+        case MessageType::Collect: {
+            MessageWriter values(MessageType::Values);
+            values.PutU32(static_cast<std::uint32_t>(formulas_));
+            for (const std::vector<std::pair<Position, bool>>& round : rounds_) {
+                for (const auto& [pos, exported] : round) {
+                    values.PutPosition(pos);
+                    values.PutValue(ToFormulaValue(sheet_.GetCell(pos)->GetValue()));
+                }
+            }
+            return values.Finish();
+        }
+        default:
+            throw std::runtime_error("unexpected message");
+        }
+    }
+
+    void Load(MessageReader& reader) {
+        //the proxies exist before the formulas: SetNumber does not create them
+        std::uint32_t proxies = reader.GetU32();
+        std::vector<std::pair<Position, double>> zeros;
+        for (std::uint32_t i = 0; i < proxies; ++i) {
+            zeros.push_back({ reader.GetPosition(), 0.0 });
+        }
+        sheet_.ApplyTicks(zeros);
+        for (const auto& [pos, formula] : formulas_of_shard_) {
+            sheet_.SetFormula(pos, formula->Clone());
+        }
+        std::uint32_t cells = reader.GetU32();
+        for (std::uint32_t i = 0; i < cells; ++i) {
+            Position pos = reader.GetPosition();
+            sheet_.SetCell(pos, reader.GetString());
+        }
+        rounds_.resize(reader.GetU32());
+        for (std::vector<std::pair<Position, bool>>& round : rounds_) {
+            round.resize(reader.GetU32());
+            for (auto& [pos, exported] : round) {
+                pos = reader.GetPosition();
+                exported = reader.GetU32() != 0;
+            }
+            formulas_ += round.size();
+        }
+    }
+
+    std::string Round(MessageReader& reader) {
+        size_t round = reader.GetU32();
+        if (round >= rounds_.size()) {
+            throw std::runtime_error("invalid round");
+        }
+        std::vector<std::pair<Position, FormulaInterface::Value>> proxies(reader.GetU32(), { Position::NONE, 0.0 });
+        for (auto& [pos, value] : proxies) {
+            pos = reader.GetPosition();
+            value = reader.GetValue();
+        }
+        sheet_.ApplyValueTicks(proxies);
+
+        //in dependency order: the evaluations do not recurse
+        std::vector<std::pair<Position, FormulaInterface::Value>> changed;
+        for (const auto& [pos, exported] : rounds_[round]) {
+            FormulaInterface::Value value = ToFormulaValue(sheet_.GetCell(pos)->GetValue());
+            if (!exported) {
+                continue;
+            }
+            auto [it, inserted] = exported_.emplace(pos, value);
+            if (inserted || !(it->second == value)) {
+                it->second = value;
+                changed.push_back({ pos, value });
+            }
+        }
+        MessageWriter values(MessageType::Values);
+        values.PutU32(static_cast<std::uint32_t>(changed.size()));
+        for (const auto& [pos, value] : changed) {
+            values.PutPosition(pos);
+            values.PutValue(value);
+        }
+        return values.Finish();
+    }
+
+    const std::vector<std::pair<Position, const FormulaInterface*>>& formulas_of_shard_;
+    Sheet sheet_;
+    //formulas of the shard per round, in dependency order, with the formulas read by
+    //other shards
+    std::vector<std::vector<std::pair<Position, bool>>> rounds_;
+    size_t formulas_ = 0;
+    //last values sent of the formulas read by other shards
+    std::unordered_map<PositionKey, FormulaInterface::Value, PositionHasher> exported_;
+};
+
+//Add shard to the readers of pos (once).
+void AddReader(std::unordered_map<PositionKey, std::vector<int>, PositionHasher>& readers, Position pos, int shard) {
+    std::vector<int>& shards = readers[pos];
+    if (std::find(shards.begin(), shards.end(), shard) == shards.end()) {
+        shards.push_back(shard);
+    }
+}
+}  // namespace
+
+std::vector<int> PartitionGraph(const std::vector<std::vector<int>>& adjacency, const std::vector<int>& order,
+    int shards) {
+    size_t vertices = adjacency.size();
+    size_t capacity = (vertices + shards - 1) / shards;
+    capacity = std::max<size_t>(capacity + capacity / 20, 1);
+    std::vector<int> shard(vertices, -1);
+    std::vector<size_t> load(shards, 0);
+    auto least_loaded = [&load]() {
+        return static_cast<int>(std::min_element(load.begin(), load.end()) - load.begin());
+    };
+
+    //connected components, their vertices in breadth-first order
+    std::vector<int> component(vertices, -1);
+    std::vector<std::vector<int>> components;
+    for (int first : order) {
+        if (component[first] != -1) {
+            continue;
+        }
+        std::vector<int> members{ first };
+        component[first] = static_cast<int>(components.size());
+        for (size_t i = 0; i < members.size(); ++i) {
+            for (int neighbour : adjacency[members[i]]) {
+                if (component[neighbour] == -1) {
+                    component[neighbour] = component[first];
+                    members.push_back(neighbour);
+                }
+            }
+        }
+        components.push_back(std::move(members));
+    }
+    std::stable_sort(components.begin(), components.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.size() > rhs.size();
+    });
+    for (const std::vector<int>& members : components) {
+        int target = least_loaded();
+        bool whole = load[target] + members.size() <= capacity;
+        for (int vertex : members) {
+            if (!whole && load[target] >= capacity) {
+                target = least_loaded();
+            }
+            shard[vertex] = target;
+            ++load[target];
+        }
+    }
+
+    //refinement: a vertex moves to the shard of most of its neighbours
+    std::vector<size_t> neighbours(shards, 0);
+    for (int pass = 0; pass < 4; ++pass) {
+        bool moved = false;
+        for (int vertex : order) {
+            for (int neighbour : adjacency[vertex]) {
+                ++neighbours[shard[neighbour]];
+            }
+            int best = shard[vertex];
+            for (int candidate = 0; candidate < shards; ++candidate) {
+                if (neighbours[candidate] > neighbours[best] && load[candidate] < capacity) {
+                    best = candidate;
+                }
+            }
+            for (int neighbour : adjacency[vertex]) {
+                neighbours[shard[neighbour]] = 0;
+            }
+            if (best != shard[vertex]) {
+                --load[shard[vertex]];
+                ++load[best];
+                shard[vertex] = best;
+                moved = true;
+            }
+        }
+        if (!moved) {
+            break;
+        }
+    }
+    return shard;
+}
+
+ShardedRecalculation::ShardedRecalculation(const Sheet& sheet, int shards) {
+    if (shards < 1) {
+        throw std::invalid_argument("at least one shard");
+    }
+    if (!sheet.GetCycleStatus().empty()) {
+        throw std::logic_error("sharded recalculation of a sheet with circular references");
+    }
+    //the formulas and the cells they read
+    std::vector<Position> formulas;
+    //parsed: the workers copy them, with their references to deleted cells
+    std::vector<const FormulaInterface*> parsed_formulas;
+    std::unordered_map<PositionKey, int, PositionHasher> index;
+    std::unordered_map<PositionKey, std::string, PositionHasher> texts;
+    sheet.VisitCells(Position{ 0, 0 }, Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 },
+        [&](Position pos, const Cell& cell) {
+            if (const FormulaInterface* formula = cell.GetFormula()) {
+                index.emplace(pos, static_cast<int>(formulas.size()));
+                formulas.push_back(pos);
+                parsed_formulas.push_back(formula);
+            }
+            else {
+                texts.emplace(pos, cell.GetText());
+            }
+        });
+    std::vector<std::vector<int>> precedents(formulas.size());
+    std::vector<std::vector<Position>> inputs(formulas.size());
+    std::vector<std::vector<int>> adjacency(formulas.size());
+    std::vector<int> missing(formulas.size(), 0);
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        for (Position ref : parsed_formulas[i]->GetReferencedCellsSpan()) {
+            auto it = index.find(ref);
+            if (it == index.end()) {
+                inputs[i].push_back(ref);
+                continue;
+            }
+            precedents[i].push_back(it->second);
+            adjacency[i].push_back(it->second);
+            adjacency[it->second].push_back(static_cast<int>(i));
+            ++missing[i];
+        }
+    }
+
+    //dependency order (Kahn)
+    std::vector<std::vector<int>> dependents(formulas.size());
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        for (int precedent : precedents[i]) {
+            dependents[precedent].push_back(static_cast<int>(i));
+        }
+    }
+    std::vector<int> order;
+    order.reserve(formulas.size());
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        if (missing[i] == 0) {
+            order.push_back(static_cast<int>(i));
+        }
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        for (int dependent : dependents[order[i]]) {
+            if (--missing[dependent] == 0) {
+                order.push_back(dependent);
+            }
+        }
+    }
+    if (order.size() != formulas.size()) {
+        throw std::logic_error("sharded recalculation of a sheet with circular references");
+    }
+
+    std::vector<int> shard = PartitionGraph(adjacency, order, shards);
+    std::vector<size_t> round(formulas.size(), 0);
+    stats_.shards = shards;
+    stats_.formulas = formulas.size();
+    for (int i : order) {
+        for (int precedent : precedents[i]) {
+            bool cut = shard[precedent] != shard[i];
+            stats_.cut_edges += cut;
+            round[i] = std::max(round[i], round[precedent] + cut);
+            if (cut) {
+                AddReader(readers_, formulas[precedent], shard[i]);
+            }
+        }
+        stats_.rounds = std::max(stats_.rounds, round[i] + 1);
+    }
+
+    //the sheets of the workers
+    workers_.resize(shards);
+    std::vector<std::string> loads(shards);
+    std::vector<std::vector<std::pair<Position, const FormulaInterface*>>> formulas_of_shards(shards);
+    std::vector<std::vector<std::pair<Position, std::string>>> cells(shards);
+    std::vector<std::vector<Position>> proxies(shards);
+    std::vector<std::vector<std::vector<std::pair<Position, bool>>>> rounds(shards,
+        std::vector<std::vector<std::pair<Position, bool>>>(stats_.rounds));
+    std::vector<size_t> shard_formulas(shards, 0);
+    for (int i : order) {
+        int owner = shard[i];
+        formula_shards_.emplace(formulas[i], owner);
+        ++shard_formulas[owner];
+        formulas_of_shards[owner].push_back({ formulas[i], parsed_formulas[i] });
+        rounds[owner][round[i]].push_back({ formulas[i], readers_.count(formulas[i]) != 0 });
+        for (int precedent : precedents[i]) {
+            if (shard[precedent] != owner) {
+                proxies[owner].push_back(formulas[precedent]);
+            }
+        }
+        for (Position input : inputs[i]) {
+            std::vector<int>& readers = input_readers_[input];
+            if (std::find(readers.begin(), readers.end(), owner) != readers.end()) {
+                continue;
+            }
+            readers.push_back(owner);
+            auto text = texts.find(input);
+            if (text != texts.end()) {
+                cells[owner].push_back({ input, text->second });
+            }
+        }
+    }
+    for (int s = 0; s < shards; ++s) {
+        stats_.max_shard_formulas = std::max(stats_.max_shard_formulas, shard_formulas[s]);
+        std::sort(proxies[s].begin(), proxies[s].end());
+        proxies[s].erase(std::unique(proxies[s].begin(), proxies[s].end()), proxies[s].end());
+        MessageWriter load(loads[s], MessageType::Load);
+        load.PutU32(static_cast<std::uint32_t>(proxies[s].size()));
+        for (Position pos : proxies[s]) {
+            load.PutPosition(pos);
+        }
+        load.PutU32(static_cast<std::uint32_t>(cells[s].size()));
+        for (const auto& [pos, text] : cells[s]) {
+            load.PutPosition(pos);
+            load.PutString(text);
+        }
+        load.PutU32(static_cast<std::uint32_t>(rounds[s].size()));
+        for (const auto& formulas_of_round : rounds[s]) {
+            workers_[s].round_sizes.push_back(formulas_of_round.size());
+            load.PutU32(static_cast<std::uint32_t>(formulas_of_round.size()));
+            for (const auto& [pos, exported] : formulas_of_round) {
+                load.PutPosition(pos);
+                load.PutU32(exported);
+            }
+        }
+        load.Finish();
+    }
+
+    try {
+        for (int s = 0; s < shards; ++s) {
+            StartWorker(s, loads[s], formulas_of_shards[s]);
+        }
+        for (int s = 0; s < shards; ++s) {
+            Receive(s);
+        }
+    }
+    catch (...) {
+        StopWorkers();
+        throw;
+    }
+}
+
+ShardedRecalculation::~ShardedRecalculation() {
+    StopWorkers();
+}
+
+void ShardedRecalculation::StartWorker(size_t shard, const std::string& load,
+    const std::vector<std::pair<Position, const FormulaInterface*>>& formulas) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        throw std::runtime_error(std::string("socketpair failed: ") + std::strerror(errno));
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sockets[0]);
+        close(sockets[1]);
+        throw std::runtime_error(std::string("fork failed: ") + std::strerror(errno));
+    }
+    if (pid == 0) {
+        //the worker keeps its own socket only, and leaves without the destructors
+        //of the coordinator
+        close(sockets[0]);
+        for (size_t s = 0; s < shard; ++s) {
+            close(workers_[s].socket);
+        }
+        int status = 0;
+        try {
+            ShardWorker(formulas).Run(sockets[1]);
+        }
+        catch (...) {
+            status = 1;
+        }
+        _exit(status);
+    }
+    close(sockets[1]);
+    workers_[shard].pid = pid;
+    workers_[shard].socket = sockets[0];
+    Send(shard, load);
+}
+
+void ShardedRecalculation::StopWorkers() {
+    for (Worker& worker : workers_) {
+        if (worker.socket >= 0) {
+            try {
+                WriteAll(worker.socket, MessageWriter(MessageType::Stop).Finish());
+            }
+            catch (const std::runtime_error&) {
+                //the worker is gone
+            }
+            close(worker.socket);
+            worker.socket = -1;
+        }
+        if (worker.pid > 0) {
+            int status = 0;
+            while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR) {
+            }
+            worker.pid = -1;
+        }
+    }
+}
+
+void ShardedRecalculation::Send(size_t shard, const std::string& message) {
+    WriteAll(workers_[shard].socket, message);
+    stats_.bytes_exchanged += message.size();
+}
+
+std::string ShardedRecalculation::Receive(size_t shard) {
+    std::string message = ReadMessage(workers_[shard].socket);
+    if (message.empty()) {
+        throw std::runtime_error("shard worker " + std::to_string(shard) + " exited");
+    }
+    stats_.bytes_exchanged += sizeof(std::uint32_t) + message.size();
+    if (static_cast<MessageType>(message[0]) == MessageType::Error) {
+        MessageReader reader(std::move(message));
+        throw std::runtime_error("shard worker " + std::to_string(shard) + ": " + reader.GetString());
+    }
+    return message;
+}
+
+void ShardedRecalculation::Recalculate() {
+    for (size_t round = 0; round < stats_.rounds; ++round) {
+        //the workers evaluate the round in parallel
+        std::vector<size_t> active;
+        for (size_t s = 0; s < workers_.size(); ++s) {
+            Worker& worker = workers_[s];
+            if (worker.round_sizes[round] == 0) {
+                continue;
+            }
+            MessageWriter message(MessageType::Round);
+            message.PutU32(static_cast<std::uint32_t>(round));
+            message.PutU32(static_cast<std::uint32_t>(worker.proxies.size()));
+            for (const auto& [pos, value] : worker.proxies) {
+                message.PutPosition(pos);
+                message.PutValue(value);
+            }
+            stats_.values_exchanged += worker.proxies.size();
+            worker.proxies.clear();
+            Send(s, message.Finish());
+            active.push_back(s);
+        }
+        for (size_t s : active) {
+            MessageReader reader(Receive(s));
+            std::uint32_t values = reader.GetU32();
+            for (std::uint32_t i = 0; i < values; ++i) {
+                Position pos = reader.GetPosition();
+                FormulaInterface::Value value = reader.GetValue();
+                for (int reader_shard : readers_.at(pos)) {
+                    workers_[reader_shard].proxies.push_back({ pos, value });
+                }
+            }
+        }
+    }
+}
+
+void ShardedRecalculation::SetNumbers(const std::vector<std::pair<Position, double>>& numbers) {
+    std::vector<std::vector<std::pair<Position, double>>> shard_numbers(workers_.size());
+    for (const auto& [pos, number] : numbers) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position");
+        }
+        if (formula_shards_.count(pos) != 0) {
+            throw std::invalid_argument("SetNumbers of a formula");
+        }
+        auto readers = input_readers_.find(pos);
+        if (readers == input_readers_.end()) {
+            //no formula reads the cell
+            continue;
+        }
+        for (int shard : readers->second) {
+            shard_numbers[shard].push_back({ pos, number });
+        }
+    }
+    std::vector<size_t> active;
+    for (size_t s = 0; s < workers_.size(); ++s) {
+        if (shard_numbers[s].empty()) {
+            continue;
+        }
+        MessageWriter message(MessageType::Numbers);
+        message.PutU32(static_cast<std::uint32_t>(shard_numbers[s].size()));
+        for (const auto& [pos, number] : shard_numbers[s]) {
+            message.PutPosition(pos);
+            message.PutDouble(number);
+        }
+        Send(s, message.Finish());
+        active.push_back(s);
+    }
+    for (size_t s : active) {
+        Receive(s);
+    }
+}
+
+std::vector<std::pair<Position, FormulaInterface::Value>> ShardedRecalculation::GetValues() {
+    std::vector<std::pair<Position, FormulaInterface::Value>> values;
+    for (size_t s = 0; s < workers_.size(); ++s) {
+        Send(s, MessageWriter(MessageType::Collect).Finish());
+    }
+    for (size_t s = 0; s < workers_.size(); ++s) {
+        MessageReader reader(Receive(s));
+        std::uint32_t count = reader.GetU32();
+        for (std::uint32_t i = 0; i < count; ++i) {
+            Position pos = reader.GetPosition();
+            values.push_back({ pos, reader.GetValue() });
+        }
+    }
+    std::sort(values.begin(), values.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    return values;
+}
+
+int ShardedRecalculation::GetShard(Position pos) const {
+    auto it = formula_shards_.find(pos);
+    return it == formula_shards_.end() ? -1 : it->second;
+}
+
+ShardingStats ShardedRecalculation::GetStats() const {
+    return stats_;
+}
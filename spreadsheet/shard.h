@@ -0,0 +1,113 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+//Partition and exchanges of a ShardedRecalculation.
+struct ShardingStats {
+    size_t shards = 0;
+    size_t formulas = 0;
+    //formulas of the largest shard
+    size_t max_shard_formulas = 0;
+    //references between formulas of different shards
+    size_t cut_edges = 0;
+    //rounds of a recalculation: 1 + the most cut edges on a path of references
+    size_t rounds = 0;
+    //values of the cut edges sent to the workers (only the changed ones are sent)
+    std::uint64_t values_exchanged = 0;
+    //bytes written to and read from the sockets of the workers
+    std::uint64_t bytes_exchanged = 0;
+};
+
+//Shard of every vertex (0..shards-1) of an undirected graph, balanced within 5% of
+//the vertices per shard and with few edges between the shards: the connected components
+//go whole to the least loaded shard, the ones too large for a shard are split in the
+//breadth-first order of their vertices (from the first one in order), then the vertices
+//move to the shard of most of their neighbours while it has room.
+std::vector<int> PartitionGraph(const std::vector<std::vector<int>>& adjacency, const std::vector<int>& order,
+    int shards);
+
+/// <summary>
+/// Recalculation of the formulas of a sheet split among worker processes of the same
+/// host. The formulas are partitioned into shards (PartitionGraph over the references
+/// between formulas), each shard is evaluated by a forked process holding a Sheet with
+/// the formulas of the shard, a copy of the other cells they read, and a proxy cell for
+/// every formula of another shard they read. The coordinator drives the recalculation in
+/// rounds: the round of a formula is the most cut edges on a path of references ending
+/// with it, so a round only reads the proxies set by the previous rounds. Every round,
+/// the workers evaluate their formulas of the round in dependency order (in parallel) and
+/// return the changed values read by other shards; the coordinator sends them with the
+/// next round to the shards reading them. The messages go over a Unix-domain socket pair
+/// per worker in the byte order of the host; the formulas are not sent as texts: each
+/// worker copies the parsed formulas of its shard (with their references to deleted
+/// cells) from the memory of the coordinator it was forked from.
+/// The sheet is copied when the coordinator starts: its later edits are not seen, except
+/// the numbers given to SetNumbers. The coordinator must be created while the process
+/// runs no other thread (fork), and used from one thread.
+/// </summary>
+class ShardedRecalculation {
+public:
+    //Partition the formulas of sheet into shards and start the workers.
+    //Throw std::invalid_argument if shards < 1, std::logic_error if the sheet has
+    //circular references (iterative calculation), std::runtime_error if a worker fails.
+    ShardedRecalculation(const Sheet& sheet, int shards);
+    ShardedRecalculation(const ShardedRecalculation&) = delete;
+    ShardedRecalculation& operator=(const ShardedRecalculation&) = delete;
+    //Stop the workers and wait for them.
+    ~ShardedRecalculation();
+
+    //Evaluate the formulas invalidated since the last recalculation (all of them the
+    //first time), in rounds.
+    void Recalculate();
+
+    //Set numbers to cells which are not formulas (as Sheet::ApplyTicks), in the workers
+    //whose formulas read them; the formulas are evaluated by the next Recalculate.
+    //Throw InvalidPositionException for an invalid position, std::invalid_argument for a
+    //formula.
+    void SetNumbers(const std::vector<std::pair<Position, double>>& numbers);
+
+    //Values of the formulas at the last recalculation, sorted by position.
+    std::vector<std::pair<Position, FormulaInterface::Value>> GetValues();
+
+    //Shard of the formula at pos, -1 if pos is not a formula.
+    int GetShard(Position pos) const;
+    ShardingStats GetStats() const;
+
+private:
+    struct Worker {
+        pid_t pid = -1;
+        int socket = -1;
+        //formulas of the worker per round
+        std::vector<size_t> round_sizes;
+        //values of other shards to send with the next round of the worker
+        std::vector<std::pair<Position, FormulaInterface::Value>> proxies;
+    };
+
+    //Fork the worker of shard and send it load; the worker copies the parsed formulas
+    //of the shard from its copy of the memory of the coordinator.
+    void StartWorker(size_t shard, const std::string& load,
+        const std::vector<std::pair<Position, const FormulaInterface*>>& formulas);
+    void StopWorkers();
+    void Send(size_t shard, const std::string& message);
+    //Next message of the worker (a Values or a Done message).
+    std::string Receive(size_t shard);
+
+    std::vector<Worker> workers_;
+    //shard of the formulas
+    std::unordered_map<PositionKey, int, PositionHasher> formula_shards_;
+    //other shards reading the value of a formula (cut edges)
+    std::unordered_map<PositionKey, std::vector<int>, PositionHasher> readers_;
+    //shards reading a cell which is not a formula
+    std::unordered_map<PositionKey, std::vector<int>, PositionHasher> input_readers_;
+    ShardingStats stats_;
+};
@@ -1,229 +1,1698 @@
-#include "sheet.h"
-
-#include "cell.h"
-#include "common.h"
-
-#include <algorithm>
-#include <functional>
-#include <iostream>
-#include <optional>
-
-using namespace std::literals;
-
-Sheet::~Sheet() {
-
-}
-
-
-Sheet::Sheet(){
-    printable_size_ = { 0,0 };
-}
-
-void Sheet::AddRowsToGrid(int missing_rows) {
-    for (int a = 1; a <= missing_rows; ++a) {
-        int grid_columns = cells_.size() == 0 ? 0 : cells_[0].size();
-        std::vector<std::shared_ptr<Cell>> empty_row(grid_columns, nullptr);
-        cells_.push_back(empty_row);
-    }
-}
-
-void Sheet::AddColumsToGrid(int missing_columns) {
-    for (size_t a = 0; a < cells_.size(); ++a) {
-        for (int b = 1; b <= missing_columns; ++b) {
-            cells_[a].push_back(nullptr);
-        }
-    }
-}
-
-void Sheet::SetCellInGrid(Position pos, std::string text) {
-    if (cells_[pos.row][pos.col] == nullptr) {
-        cells_[pos.row][pos.col] = std::make_shared<Cell>(*this, this->dependencies_manager,pos);
-    }
-    cells_[pos.row][pos.col]->Set(text);
-}
-
-
-void Sheet::CheckIfPositionIsValid(Position pos) {
-    if (pos.row < 0 || pos.col < 0) {
-        throw InvalidPositionException("Invalid position of cell");
-    }
-    if (pos.row >= Position::MAX_ROWS || pos.col >= Position::MAX_COLS) {
-        throw InvalidPositionException("Invalid position of cell");
-    }
-}
-
-
-bool Sheet::IsInGrid(Position pos) const {
-    if (pos.row < 0 || pos.col < 0) {
-        return false;
-    }
-    int grid_rows = cells_.size();
-    int grid_cols = cells_.size() == 0 ? 0 : cells_[0].size();
-    if (pos.row >= grid_rows || pos.col >= grid_cols) {
-        return false;
-    }
-    return true;
-}
-
-void Sheet::SetCell(Position pos, std::string text) {
-    CheckIfPositionIsValid(pos);
-
-    bool is_in_printable_zone = (pos.row < printable_size_.rows ) && (pos.col < printable_size_.cols);
-    if(is_in_printable_zone) {
-        SetCellInGrid(pos, text);
-    }
-    else {
-        int grid_rows = cells_.size();
-        int grid_columns = cells_.size() == 0 ? 0 : cells_[0].size();
-        bool is_in_grid = (pos.row < grid_rows) && (pos.col < (grid_columns));
-        if (is_in_grid) {
-            SetCellInGrid(pos, text);
-            printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
-            printable_size_.cols = std::max(printable_size_.rows, pos.col + 1);
-        }
-        else {
-            int missing_rows = pos.row - grid_rows + 1;
-            int missing_columns = pos.col - grid_columns + 1;
-            bool update_rows = false;
-            bool update_cols = false;
-            if (missing_rows > 0) {
-                AddRowsToGrid(missing_rows);
-                update_rows = true;
-            }
-            if (missing_columns > 0) {
-                AddColumsToGrid(missing_columns);
-                update_cols = true;
-            }
-            SetCellInGrid(pos, text);
-            
-            if (update_rows) {
-                printable_size_.rows = pos.row + 1;
-            }
-            if (update_cols) {
-                printable_size_.cols = pos.col + 1;
-            }
-        }
-    }
-    SetDependentCells(pos);
-}
-
-//A cell can have dependent cells. They also need to be added to
-//the sheet (as empty) if they do not exist.
-void Sheet::SetDependentCells(Position pos) {
-    //the cell at pos has just been created.
-    std::vector<Position> cells_references = GetCell(pos)->GetReferencedCells();
-    for (Position pos_cell : cells_references) {
-        if (GetCell(pos_cell)==nullptr) {
-            SetCell(pos_cell,"");
-        }
-    }
-}
-
-const CellInterface* Sheet::GetCell(Position pos) const {
-    CheckIfPositionIsValid(pos);
-
-    if (!IsInGrid(pos)) {
-        return nullptr;
-    }
-    if (cells_[pos.row][pos.col] == nullptr) {
-        return nullptr;
-    }
-
-    return cells_[pos.row][pos.col].get();
-}
-
-CellInterface* Sheet::GetCell(Position pos) {
-    CheckIfPositionIsValid(pos);
-
-    if (!IsInGrid(pos)) {
-        return nullptr;
-    }
-    if (cells_[pos.row][pos.col] == nullptr) {
-        return nullptr;
-    }
-    return cells_[pos.row][pos.col].get();
-}
-
-void Sheet::ClearCell(Position pos) {
-    CheckIfPositionIsValid(pos);
- 
-    if (!IsInGrid(pos)) {
-        return;
-    }
-
-    if (pos.row < printable_size_.rows && pos.col < printable_size_.cols) {
-        cells_[pos.row][pos.col] = nullptr;
-        //update size
-        UpdatePrintableZoneAfterClearingCell(pos);
-    }
-}
-
-void Sheet::UpdatePrintableZoneAfterClearingCell(Position pos) {
-    if (pos.row == printable_size_.rows - 1) {
-        int current_row = printable_size_.rows - 1;
-        while (current_row >= 0) {
-
-            int full_cells = count_if(cells_[current_row].begin(), cells_[current_row].end(), [](auto cell_ptr) {
-                return cell_ptr != nullptr;
-                });
-
-            if (full_cells >= 1) {
-                printable_size_.rows = current_row + 1;
-                break;
-            }
-            --current_row;
-        }
-        if (current_row < 0) {
-            //all rows are empty
-            printable_size_.rows = 0;
-            printable_size_.cols = 0;
-            return;
-        }
-    }
-    if (pos.col == printable_size_.cols - 1) {
-        int current_col = printable_size_.cols - 1;
-        while (current_col >= 0) {
-            int full_cells = 0;
-            for (size_t r = 0; r < cells_.size(); ++r) {
-                if (cells_[r][current_col] != nullptr) {
-                    ++full_cells;
-                    break;
-                }
-            }
-            if (full_cells >= 1) {
-                printable_size_.cols = current_col + 1;
-                break;
-            }
-            --current_col;
-        }
-    }
-}
-
-
-
-Size Sheet::GetPrintableSize() const {
-    return printable_size_;
-}
-
-void Sheet::PrintValues(std::ostream& output) const {
-    VisitPrintableZone(output, [&output](auto cell_ptr) {
-        auto value = cell_ptr->GetValue();
-        std::visit(
-            [&](const auto& x) {
-                output << x;
-            },
-            value);
-        });
-}
-
-void Sheet::PrintTexts(std::ostream& output) const {
-    VisitPrintableZone(output, [&output](auto cell_ptr) {
-        std::string val = cell_ptr->GetText();
-        output << val;
-        });
-}
-
-
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
+#include "sheet.h"
+
+#include "cell.h"
+#include "common.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std::literals;
+
+Sheet::~Sheet() {
+    //the sheets lending these blocks take their rows back once no fork reads them
+    for (const auto* blocks : { &shared_blocks_, &copied_blocks_ }) {
+        for (const auto& block : *blocks) {
+            if (block != nullptr) {
+                std::lock_guard<std::mutex> lock(block->mutex);
+                --block->readers;
+            }
+        }
+    }
+}
+
+
+Sheet::Sheet()
+    : texts_(std::make_shared<TextPool>()) {
+    printable_size_ = { 0,0 };
+    dependencies_manager.SetChangeLog(&invalidated_cells_);
+}
+
+void Sheet::AddRowsToGrid(int missing_rows) {
+    for (int a = 1; a <= missing_rows; ++a) {
+        cells_.emplace_back(grid_cols_);
+    }
+    pager_.Resize(cells_.size());
+}
+
+void Sheet::AddColumsToGrid(int missing_columns) {
+    grid_cols_ += missing_columns;
+    for (size_t a = 0; a < cells_.size(); ++a) {
+        //the paged (shared) rows get their columns when they are read back (copied)
+        int block = BlockPager::GetBlock(a);
+        if (!pager_.IsResident(block) || IsShared(block)) {
+            continue;
+        }
+        for (int b = 1; b <= missing_columns; ++b) {
+            cells_[a].push_back(nullptr);
+        }
+    }
+}
+
+namespace {
+bool IsEmptyContent(const std::string& text) {
+    return text.empty();
+}
+
+bool IsEmptyContent(const std::unique_ptr<FormulaInterface>& /* formula */) {
+    return false;
+}
+}  // namespace
+
+template <typename Content>
+void Sheet::SetCellInGrid(Position pos, Content content) {
+    FaultInForUpdate(pos.row);
+    std::unique_ptr<Cell>& cell = cells_[pos.row][pos.col];
+    bool is_new_cell = cell == nullptr;
+    bool was_formula = !is_new_cell && cell->GetFormula() != nullptr;
+    if (is_new_cell) {
+        cell = std::make_unique<Cell>();
+    }
+    bool is_empty = IsEmptyContent(content);
+    try {
+        cell->Set(std::move(content), CellContext{ *this, dependencies_manager, *texts_, pos });
+    }
+    catch (...) {
+        //a rejected text must not leave a new cell behind
+        if (is_new_cell) {
+            cell = nullptr;
+        }
+        throw;
+    }
+    CountCell(pos, is_new_cell ? 1 : 0, (cell->GetFormula() != nullptr) - was_formula);
+    //the empty cells created for the references of a formula do not change the sheet
+    if (!is_new_cell || !is_empty) {
+        edited_cells_.push_back(pos);
+    }
+}
+
+void Sheet::CheckIfPositionIsValid(Position pos) {
+    if (pos.row < 0 || pos.col < 0) {
+        throw InvalidPositionException("Invalid position of cell");
+    }
+    if (pos.row >= Position::MAX_ROWS || pos.col >= Position::MAX_COLS) {
+        throw InvalidPositionException("Invalid position of cell");
+    }
+}
+
+
+bool Sheet::IsInGrid(Position pos) const {
+    if (pos.row < 0 || pos.col < 0) {
+        return false;
+    }
+    int grid_rows = cells_.size();
+    if (pos.row >= grid_rows || pos.col >= grid_cols_) {
+        return false;
+    }
+    return true;
+}
+
+template <typename Content>
+void Sheet::PutCell(Position pos, Content content) {
+    CheckIfPositionIsValid(pos);
+
+    int grid_rows = cells_.size();
+    int grid_columns = grid_cols_;
+    int missing_rows = pos.row - grid_rows + 1;
+    int missing_columns = pos.col - grid_columns + 1;
+    if (missing_rows > 0) {
+        AddRowsToGrid(missing_rows);
+    }
+    if (missing_columns > 0) {
+        AddColumsToGrid(missing_columns);
+    }
+    SetCellInGrid(pos, std::move(content));
+
+    printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
+    printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
+    SetDependentCells(pos);
+}
+
+void Sheet::SetCell(Position pos, std::string text) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    PutCell(pos, std::move(text));
+    CommitEdit();
+}
+
+void Sheet::SetFormula(Position pos, std::unique_ptr<FormulaInterface> formula) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    PutCell(pos, std::move(formula));
+    CommitEdit();
+}
+
+void Sheet::SetNumber(Position pos, double value) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    CheckIfPositionIsValid(pos);
+    if (PutNumber(pos, value)) {
+        dependencies_manager.InvalidateCache(pos);
+    }
+    CommitEdit();
+}
+
+size_t Sheet::ApplyTicks(const std::vector<std::pair<Position, double>>& ticks) {
+    return ApplyTicks(ticks, [this](Position pos, double value) {
+        return PutNumber(pos, value);
+    });
+}
+
+size_t Sheet::ApplyValueTicks(const std::vector<std::pair<Position, FormulaInterface::Value>>& ticks) {
+    return ApplyTicks(ticks, [this](Position pos, const FormulaInterface::Value& value) {
+        return PutValue(pos, value);
+    });
+}
+
+template <typename Tick, typename Put>
+size_t Sheet::ApplyTicks(const std::vector<std::pair<Position, Tick>>& ticks, Put put) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    for (const auto& tick : ticks) {
+        CheckIfPositionIsValid(tick.first);
+    }
+    //the last tick of every cell
+    std::vector<std::pair<Position, Tick>> coalesced = ticks;
+    std::stable_sort(coalesced.begin(), coalesced.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    std::vector<Position> changed;
+    size_t edited = edited_cells_.size();
+    for (size_t i = 0; i < coalesced.size(); ++i) {
+        if (i + 1 < coalesced.size() && coalesced[i + 1].first == coalesced[i].first) {
+            continue;
+        }
+        if (put(coalesced[i].first, coalesced[i].second)) {
+            changed.push_back(coalesced[i].first);
+        }
+    }
+    if (!changed.empty()) {
+        dependencies_manager.InvalidateCache(changed);
+    }
+    size_t changed_cells = edited_cells_.size() - edited;
+    CommitEdit();
+    return changed_cells;
+}
+
+bool Sheet::PutNumber(Position pos, double value) {
+    Cell* cell = nullptr;
+    if (IsInGrid(pos)) {
+        FaultInForUpdate(pos.row);
+        cell = GetGridCell(pos);
+    }
+    if (cell == nullptr || cell->GetFormula() != nullptr) {
+        //creating a cell or removing the references of a formula is a change of the sheet
+        PutCell(pos, FormatNumber(value));
+        return false;
+    }
+    if (!cell->SetNumber(value, *texts_)) {
+        return false;
+    }
+    edited_cells_.push_back(pos);
+    return true;
+}
+
+bool Sheet::PutValue(Position pos, const FormulaInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        return PutNumber(pos, *number);
+    }
+    Cell* cell = nullptr;
+    if (IsInGrid(pos)) {
+        FaultInForUpdate(pos.row);
+        cell = GetGridCell(pos);
+    }
+    if (cell == nullptr || cell->GetFormula() != nullptr) {
+        //the cell is created (the references of the formula removed) empty, then pinned
+        PutCell(pos, std::string());
+        cell = GetGridCell(pos);
+    }
+    if (!cell->SetError(std::get<FormulaError>(value))) {
+        return false;
+    }
+    if (edited_cells_.empty() || !(edited_cells_.back() == pos)) {
+        edited_cells_.push_back(pos);
+    }
+    return true;
+}
+
+//A cell can have dependent cells. They also need to be added to
+//the sheet (as empty) if they do not exist.
+void Sheet::SetDependentCells(Position pos) {
+    //the cell at pos has just been created.
+    //SetCell of an empty cell does not change the formula at pos: the span stays valid
+    for (Position pos_cell : GetCell(pos)->GetReferencedCellsSpan()) {
+        if (GetCell(pos_cell)==nullptr) {
+            PutCell(pos_cell, std::string());
+        }
+    }
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    CheckIfPositionIsValid(pos);
+    return FindCell(pos);
+}
+
+CellInterface* Sheet::GetCell(Position pos) {
+    CheckIfPositionIsValid(pos);
+    return FindCell(pos);
+}
+
+Cell* Sheet::FindCell(Position pos) const {
+    if (!IsInGrid(pos)) {
+        return nullptr;
+    }
+    FaultIn(pos.row);
+    return GetGridCell(pos);
+}
+
+Cell* Sheet::GetGridCell(Position pos) const {
+    if (shared_block_count_ > 0 && IsShared(BlockPager::GetBlock(pos.row))) {
+        return FindSharedCell(pos);
+    }
+    return cells_[pos.row][pos.col].get();
+}
+
+void Sheet::ClearCell(Position pos) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    CheckIfPositionIsValid(pos);
+    if (IsInGrid(pos)) {
+        FaultInForUpdate(pos.row);
+    }
+ 
+    Cell* cell = FindCell(pos);
+    if (cell == nullptr) {
+        return;
+    }
+
+    //remove the references of the cell and invalidate its dependents
+    bool was_formula = cell->GetFormula() != nullptr;
+    cell->Clear(CellContext{ *this, dependencies_manager, *texts_, pos });
+    CountCell(pos, 0, -static_cast<int>(was_formula));
+    edited_cells_.push_back(pos);
+    if (!dependencies_manager.HasDependents(pos)) {
+        //not referenced by formulas anymore: the cell is removed
+        cells_[pos.row][pos.col] = nullptr;
+        CountCell(pos, -1, 0);
+        //update size
+        UpdatePrintableZoneAfterClearingCell(pos);
+    }
+    CommitEdit();
+}
+
+void Sheet::UpdatePrintableZoneAfterClearingCell(Position pos) {
+    if (pos.row == printable_size_.rows - 1) {
+        int current_row = printable_size_.rows - 1;
+        while (current_row >= 0) {
+            FaultInForUpdate(current_row);
+            int full_cells = count_if(cells_[current_row].begin(), cells_[current_row].end(), [](const auto& cell_ptr) {
+                return cell_ptr != nullptr;
+                });
+
+            if (full_cells >= 1) {
+                printable_size_.rows = current_row + 1;
+                break;
+            }
+            --current_row;
+        }
+        if (current_row < 0) {
+            //all rows are empty
+            printable_size_.rows = 0;
+            printable_size_.cols = 0;
+            return;
+        }
+    }
+    if (pos.col == printable_size_.cols - 1) {
+        int current_col = printable_size_.cols - 1;
+        while (current_col >= 0) {
+            int full_cells = 0;
+            for (size_t r = 0; r < cells_.size(); ++r) {
+                FaultIn(r);
+                if (GetGridCell(Position{ static_cast<int>(r), current_col }) != nullptr) {
+                    ++full_cells;
+                    break;
+                }
+            }
+            if (full_cells >= 1) {
+                printable_size_.cols = current_col + 1;
+                break;
+            }
+            --current_col;
+        }
+    }
+}
+
+
+
+void Sheet::InsertRows(int before, int count) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    InsertLines(Axis::Rows, before, count);
+    CommitEdit();
+}
+
+void Sheet::InsertCols(int before, int count) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    InsertLines(Axis::Cols, before, count);
+    CommitEdit();
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    DeleteLines(Axis::Rows, first, count);
+    CommitEdit();
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    DeleteLines(Axis::Cols, first, count);
+    CommitEdit();
+}
+
+int& Sheet::Coordinate(Position& pos, Axis axis) {
+    return axis == Axis::Rows ? pos.row : pos.col;
+}
+
+int Sheet::GetGridSize(Axis axis) const {
+    if (axis == Axis::Rows) {
+        return cells_.size();
+    }
+    return grid_cols_;
+}
+
+int& Sheet::GetPrintableSize(Axis axis) {
+    return axis == Axis::Rows ? printable_size_.rows : printable_size_.cols;
+}
+
+void Sheet::CheckStructureChange(Axis axis, int first, int count) const {
+    int max_lines = axis == Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (first < 0 || first >= max_lines || count < 0) {
+        throw InvalidPositionException("Invalid rows or columns");
+    }
+}
+
+std::vector<Position> Sheet::CollectCells(Axis axis, int first, int last) const {
+    std::vector<Position> result;
+    int grid_rows = GetGridSize(Axis::Rows);
+    int grid_cols = GetGridSize(Axis::Cols);
+    int first_row = axis == Axis::Rows ? first : 0;
+    int last_row = axis == Axis::Rows ? std::min(last, grid_rows) : grid_rows;
+    int first_col = axis == Axis::Cols ? first : 0;
+    int last_col = axis == Axis::Cols ? std::min(last, grid_cols) : grid_cols;
+    for (int r = first_row; r < last_row; ++r) {
+        for (int c = first_col; c < last_col; ++c) {
+            if (cells_[r][c] != nullptr) {
+                result.push_back({ r, c });
+            }
+        }
+    }
+    return result;
+}
+
+//Cost: the storage is shifted in bulk, only the moved cells and the formulas
+//referencing them (found through the dependency graph) are updated.
+void Sheet::InsertLines(Axis axis, int before, int count) {
+    CheckStructureChange(axis, before, count);
+    int& printable_lines = GetPrintableSize(axis);
+    if (count == 0 || before >= printable_lines) {
+        //no cell to move: the formulas only reference existing cells
+        return;
+    }
+    int max_lines = axis == Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (printable_lines + count > max_lines) {
+        throw TableTooBigException("Cells would move out of the table");
+    }
+    PageInAll();
+
+    //1. Moved cells and formulas referencing them.
+    std::vector<Position> moved = CollectCells(axis, before, printable_lines);
+    std::vector<Position> dependents = dependencies_manager.GetDependentCells(moved);
+    LineShift shift{ axis == Axis::Rows, before, count };
+
+    //2. Dependencies and cache follow the cells: the values do not change.
+    dependencies_manager.RenameVertices(moved, shift);
+
+    //3. Storage.
+    //the cells are not copyable: append the empty lines and rotate them into place
+    if (axis == Axis::Rows) {
+        int grid_cols = GetGridSize(Axis::Cols);
+        cells_.resize(cells_.size() + count);
+        for (auto it = cells_.end() - count; it != cells_.end(); ++it) {
+            it->resize(grid_cols);
+        }
+        std::rotate(cells_.begin() + before, cells_.end() - count, cells_.end());
+    }
+    else {
+        for (auto& row : cells_) {
+            row.resize(row.size() + count);
+            std::rotate(row.begin() + before, row.end() - count, row.end());
+        }
+        grid_cols_ += count;
+    }
+    for (Position pos : moved) {
+        Position new_pos = shift(pos);
+        cells_[new_pos.row][new_pos.col]->SetPosition(new_pos);
+    }
+
+    //4. References of the formulas.
+    for (Position pos : dependents) {
+        Position new_pos = shift(pos);
+        FormulaInterface* formula = cells_[new_pos.row][new_pos.col]->GetFormulaForUpdate();
+        if (axis == Axis::Rows) {
+            formula->HandleInsertedRows(before, count);
+        }
+        else {
+            formula->HandleInsertedCols(before, count);
+        }
+        //the text of the formula shows the new references
+        edited_cells_.push_back(new_pos);
+    }
+    printable_lines += count;
+    LogLayoutChange(axis, true, before, count);
+    CountMovedLines(axis, before);
+}
+
+void Sheet::DeleteLines(Axis axis, int first, int count) {
+    CheckStructureChange(axis, first, count);
+    int& printable_lines = GetPrintableSize(axis);
+    if (count == 0 || first >= printable_lines) {
+        return;
+    }
+    int end = std::min(first + count, printable_lines);
+    PageInAll();
+
+    //1. Deleted cells, moved cells and formulas referencing them.
+    std::vector<Position> deleted = CollectCells(axis, first, end);
+    std::vector<Position> moved = CollectCells(axis, end, printable_lines);
+    std::vector<Position> touched(deleted);
+    touched.insert(touched.end(), moved.begin(), moved.end());
+    std::vector<Position> dependents;
+    for (Position pos : dependencies_manager.GetDependentCells(touched)) {
+        int coordinate = Coordinate(pos, axis);
+        if (coordinate < first || coordinate >= end) {
+            dependents.push_back(pos);
+        }
+    }
+    LineShift shift{ axis == Axis::Rows, end, first - end };
+
+    //2. Dependencies and cache.
+    dependencies_manager.RemoveVertices(deleted);
+    dependencies_manager.RenameVertices(moved, shift);
+
+    //3. Storage.
+    if (axis == Axis::Rows) {
+        cells_.erase(cells_.begin() + first, cells_.begin() + end);
+    }
+    else {
+        if (pager_.IsEnabled()) {
+            for (Position pos : deleted) {
+                CountCell(pos, -1, -static_cast<int>(cells_[pos.row][pos.col]->GetFormula() != nullptr));
+            }
+        }
+        for (auto& row : cells_) {
+            row.erase(row.begin() + first, row.begin() + end);
+        }
+        grid_cols_ -= end - first;
+    }
+    for (Position pos : moved) {
+        Position new_pos = shift(pos);
+        cells_[new_pos.row][new_pos.col]->SetPosition(new_pos);
+    }
+
+    //4. References of the formulas: the ones referencing deleted cells change value.
+    for (Position pos : dependents) {
+        Position new_pos = shift(pos);
+        FormulaInterface* formula = cells_[new_pos.row][new_pos.col]->GetFormulaForUpdate();
+        FormulaInterface::HandlingResult result = axis == Axis::Rows
+            ? formula->HandleDeletedRows(first, count)
+            : formula->HandleDeletedCols(first, count);
+        if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+            dependencies_manager.InvalidateCache(new_pos);
+        }
+        edited_cells_.push_back(new_pos);
+    }
+
+    LogLayoutChange(axis, false, first, end - first);
+    printable_lines -= end - first;
+    if (printable_size_.rows > 0 && printable_size_.cols > 0) {
+        //the new last row/column may be empty
+        UpdatePrintableZoneAfterClearingCell({ printable_size_.rows - 1, printable_size_.cols - 1 });
+    }
+    else {
+        printable_size_ = { 0, 0 };
+    }
+    CountMovedLines(axis, first);
+}
+
+SubscriptionId Sheet::Subscribe(CellRange range, ChangeCallback callback) {
+    return subscriptions_.Subscribe(range, std::move(callback));
+}
+
+void Sheet::Unsubscribe(SubscriptionId id) {
+    subscriptions_.Unsubscribe(id);
+}
+
+void Sheet::BeginUpdate() {
+    subscriptions_.BeginBatch();
+}
+
+void Sheet::EndUpdate() {
+    subscriptions_.EndBatch();
+}
+
+SheetVersion Sheet::GetVersion() const {
+    return version_;
+}
+
+void Sheet::SetDeltaExport(bool enabled) {
+    if (!enabled) {
+        versions_.Stop();
+    }
+    else if (!versions_.IsStarted()) {
+        versions_.Start(version_);
+    }
+}
+
+CellVersion Sheet::GetCellVersion(Position pos) const {
+    CheckIfPositionIsValid(pos);
+    if (!versions_.IsStarted()) {
+        throw std::logic_error("The cell versions need the delta export enabled");
+    }
+    return versions_.GetCellVersion(pos);
+}
+
+namespace {
+//Field of a delta line: the tabs, the line breaks and the backslashes are escaped.
+void WriteDeltaField(std::ostream& output, std::string_view field) {
+    for (char c : field) {
+        switch (c) {
+        case '\\':
+            output << "\\\\";
+            break;
+        case '\t':
+            output << "\\t";
+            break;
+        case '\n':
+            output << "\\n";
+            break;
+        case '\r':
+            output << "\\r";
+            break;
+        default:
+            output << c;
+        }
+    }
+}
+}  // namespace
+
+void Sheet::ExportDelta(SheetVersion since_version, std::ostream& output) const {
+    if (!versions_.IsStarted() || since_version < versions_.GetStartVersion()) {
+        throw std::logic_error("The delta export was not enabled at the version requested");
+    }
+    output << "version\t" << version_ << '\n';
+    for (const LayoutChange& change : versions_.GetLayoutChangesSince(since_version)) {
+        output << (change.insert ? "insert_" : "delete_") << (change.rows ? "rows" : "cols")
+            << '\t' << change.first << '\t' << change.count << '\n';
+    }
+    std::ostringstream field;
+    for (Position pos : versions_.GetCellsSince(since_version)) {
+        output << "cell\t" << pos.ToString() << '\t';
+        if (const Cell* cell = FindCell(pos)) {
+            field.str({});
+            cell->PrintText(field);
+            WriteDeltaField(output, field.str());
+            output << '\t';
+            field.str({});
+            cell->PrintValue(field);
+            WriteDeltaField(output, field.str());
+        }
+        else {
+            output << '\t';
+        }
+        output << '\n';
+    }
+}
+
+void Sheet::LogLayoutChange(Axis axis, bool insert, int first, int count) {
+    //the change belongs to the version created by CommitEdit
+    versions_.LogLayoutChange(LayoutChange{ version_ + 1, axis == Axis::Rows, insert, first, count });
+    subscriptions_.LogLayoutChange(axis == Axis::Rows, first);
+    layout_changed_ = true;
+}
+
+void Sheet::CommitEdit() {
+    TrimMemory();
+    if (edited_cells_.empty() && invalidated_cells_.empty() && !layout_changed_) {
+        return;
+    }
+    ++version_;
+    for (Position pos : edited_cells_) {
+        versions_.LogText(pos, version_);
+        subscriptions_.LogChange(pos);
+    }
+    for (Position pos : invalidated_cells_) {
+        versions_.LogValue(pos, version_);
+        subscriptions_.LogChange(pos);
+    }
+    if (recalc_worker_ != nullptr) {
+        //the cells queued before moved with the rows or columns
+        if (layout_changed_) {
+            recalc_worker_->ResetQueue(dependencies_manager.GetDirtyVertices());
+        }
+        else {
+            recalc_worker_->Enqueue(invalidated_cells_);
+        }
+    }
+    if (recalc_tracking_ && !recalc_replan_) {
+        RestartRecalcWalk();
+        //the priority region goes first again
+        recalc_priority_active_ = false;
+        recalc_roots_.insert(recalc_roots_.end(), invalidated_cells_.begin(), invalidated_cells_.end());
+        //more cells than formulas: starting from all the dirty formulas is cheaper
+        recalc_replan_ = layout_changed_ || recalc_roots_.size() > dependencies_manager.GetCacheSize() + 1024;
+    }
+    edited_cells_.clear();
+    invalidated_cells_.clear();
+    layout_changed_ = false;
+    subscriptions_.Deliver();
+}
+
+SheetStats Sheet::GetStats() const {
+    SheetStats stats;
+    dependencies_manager.FillStats(stats);
+    return stats;
+}
+
+void Sheet::ResetStats() {
+    dependencies_manager.GetCounters().Reset();
+}
+
+FormulaProfiler& Sheet::GetProfiler() {
+    return dependencies_manager.GetProfiler();
+}
+
+size_t Sheet::EvaluateColumn(Position first, int count) {
+    CheckIfPositionIsValid(first);
+    if (count <= 0) {
+        return 0;
+    }
+    CheckIfPositionIsValid(Position{ first.row + count - 1, first.col });
+
+    size_t evaluated = 0;
+    const BatchProgram* run_program = nullptr;
+    Position run_first = Position::NONE;
+    int run_lanes = 0;
+    for (Position pos = first; pos.row < first.row + count; ++pos.row) {
+        const FormulaInterface* formula = nullptr;
+        if (Cell* cell = FindCell(pos)) {
+            formula = cell->GetFormula();
+        }
+        if (formula == nullptr) {
+            evaluated += EvaluateBatch(run_program, run_first, run_lanes);
+            run_lanes = 0;
+            continue;
+        }
+        const BatchProgram& program = formula->GetProgram();
+        if (run_lanes > 0 && IsShiftedProgram(*run_program, program, run_lanes)) {
+            ++run_lanes;
+            continue;
+        }
+        evaluated += EvaluateBatch(run_program, run_first, run_lanes);
+        run_program = &program;
+        run_first = pos;
+        run_lanes = 1;
+    }
+    evaluated += EvaluateBatch(run_program, run_first, run_lanes);
+    return evaluated;
+}
+
+size_t Sheet::EvaluateBatch(const BatchProgram* program, Position first, int lanes) {
+    //a lone formula is evaluated as well as by the lazy evaluation
+    if (lanes < 2) {
+        return 0;
+    }
+    BatchEvaluator evaluator(*program);
+    const std::vector<Position>& operands = evaluator.GetOperands();
+    std::vector<double> operand_values(operands.size() * lanes);
+    std::vector<BatchError> operand_errors(operands.size() * lanes);
+
+    //gather the operands: the evaluation of the referenced formulas goes through the cache
+    for (size_t operand = 0; operand < operands.size(); ++operand) {
+        double* values = operand_values.data() + operand * lanes;
+        BatchError* errors = operand_errors.data() + operand * lanes;
+        if (!operands[operand].IsValid()) {
+            std::fill(errors, errors + lanes, ToBatchError(FormulaError(FormulaError::Category::Ref)));
+            continue;
+        }
+        for (int lane = 0; lane < lanes; ++lane) {
+            Position pos{ operands[operand].row + lane, operands[operand].col };
+            const Cell* cell = FindCell(pos);
+            FormulaInterface::Value value = GetCellNumber(cell);
+            if (std::holds_alternative<double>(value)) {
+                values[lane] = std::get<double>(value);
+            }
+            else {
+                errors[lane] = ToBatchError(std::get<FormulaError>(value));
+            }
+        }
+    }
+
+    std::vector<double> results(lanes);
+    std::vector<BatchError> errors(lanes);
+    evaluator.Execute(lanes, operand_values.data(), operand_errors.data(), results.data(), errors.data());
+
+    //scatter the results into the cache
+    size_t evaluated = 0;
+    for (int lane = 0; lane < lanes; ++lane) {
+        CellInterface::Value value;
+        if (errors[lane] != 0) {
+            value = FromBatchError(errors[lane]);
+        }
+        else {
+            value = results[lane];
+        }
+        if (dependencies_manager.StoreCache(Position{ first.row + lane, first.col }, std::move(value))) {
+            dependencies_manager.GetCounters().OnFormulaEvaluated();
+            ++evaluated;
+        }
+    }
+    return evaluated;
+}
+
+namespace {
+//Where a sweep reads an operand: the column of an input, the results of a formula
+//evaluated by the sweep, or a value of the sheet.
+struct SweepSource {
+    enum class Kind {
+        Input,
+        Formula,
+        Value,
+    };
+
+    Kind kind = Kind::Value;
+    size_t index = 0;
+    double value = 0;
+    BatchError error = 0;
+};
+
+//Rows evaluated together by a thread of a sweep.
+const size_t SWEEP_CHUNK_ROWS = 256;
+}  // namespace
+
+SweepResult Sheet::Sweep(const std::vector<Position>& inputs, const std::vector<std::vector<double>>& input_values,
+    const std::vector<Position>& outputs, unsigned threads) const {
+    for (Position pos : inputs) {
+        CheckIfPositionIsValid(pos);
+    }
+    for (Position pos : outputs) {
+        CheckIfPositionIsValid(pos);
+    }
+    for (const std::vector<double>& row : input_values) {
+        if (row.size() != inputs.size()) {
+            throw std::invalid_argument("Sweep: one value per input expected");
+        }
+    }
+
+    //1. Formulas depending on the inputs (the inputs excluded) and needed by the outputs.
+    std::unordered_map<PositionKey, size_t, PositionHasher> input_index;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        input_index[inputs[i]] = i;
+    }
+    std::vector<Position> downstream = dependencies_manager.GetDownstream(inputs);
+    std::unordered_set<PositionKey, PositionHasher> affected;
+    for (Position pos : downstream) {
+        const Cell* cell = FindCell(pos);
+        if (input_index.count(pos) == 0 && cell != nullptr && cell->GetFormula() != nullptr) {
+            affected.insert(pos);
+        }
+    }
+    std::unordered_set<PositionKey, PositionHasher> needed;
+    std::vector<Position> pending;
+    for (Position pos : outputs) {
+        if (affected.count(pos) > 0 && needed.insert(pos).second) {
+            pending.push_back(pos);
+        }
+    }
+    while (!pending.empty()) {
+        Position pos = pending.back();
+        pending.pop_back();
+        for (Position referenced : FindCell(pos)->GetReferencedCellsSpan()) {
+            if (affected.count(referenced) > 0 && needed.insert(referenced).second) {
+                pending.push_back(referenced);
+            }
+        }
+    }
+    for (PositionKey pos : needed) {
+        if (dependencies_manager.IsInCycle(pos.ToPosition())) {
+            throw CircularDependencyException("Sweep: the formulas of a cycle are evaluated by iterations");
+        }
+    }
+    //in the order of the dependencies
+    std::vector<const BatchProgram*> programs;
+    std::unordered_map<PositionKey, size_t, PositionHasher> formula_index;
+    for (Position pos : downstream) {
+        if (needed.count(pos) > 0) {
+            formula_index[pos] = programs.size();
+            programs.push_back(&FindCell(pos)->GetFormula()->GetProgram());
+        }
+    }
+
+    //2. Sources of the operands of the formulas and of the outputs.
+    auto make_source = [&](Position pos) {
+        SweepSource source;
+        if (!pos.IsValid()) {
+            source.error = ToBatchError(FormulaError(FormulaError::Category::Ref));
+        }
+        else if (auto it = input_index.find(pos); it != input_index.end()) {
+            source.kind = SweepSource::Kind::Input;
+            source.index = it->second;
+        }
+        else if (auto it = formula_index.find(pos); it != formula_index.end()) {
+            source.kind = SweepSource::Kind::Formula;
+            source.index = it->second;
+        }
+        else {
+            //not affected by the inputs: evaluated once, through the cache
+            FormulaInterface::Value value = GetCellNumber(FindCell(pos));
+            if (std::holds_alternative<double>(value)) {
+                source.value = std::get<double>(value);
+            }
+            else {
+                source.error = ToBatchError(std::get<FormulaError>(value));
+            }
+        }
+        return source;
+    };
+    std::vector<std::vector<SweepSource>> operand_sources(programs.size());
+    for (size_t formula = 0; formula < programs.size(); ++formula) {
+        BatchEvaluator evaluator(*programs[formula]);
+        for (Position operand : evaluator.GetOperands()) {
+            operand_sources[formula].push_back(make_source(operand));
+        }
+    }
+    std::vector<SweepSource> output_sources;
+    for (Position pos : outputs) {
+        output_sources.push_back(make_source(pos));
+    }
+
+    //3. Evaluation: the threads take chunks of rows, the sheet is not accessed anymore.
+    SweepResult result;
+    result.rows = input_values.size();
+    result.cols = outputs.size();
+    result.values.resize(result.rows * result.cols, 0.0);
+    size_t chunks = (result.rows + SWEEP_CHUNK_ROWS - 1) / SWEEP_CHUNK_ROWS;
+    if (chunks == 0 || result.cols == 0) {
+        return result;
+    }
+    std::atomic<size_t> next_chunk{ 0 };
+    auto evaluate_chunks = [&]() {
+        std::vector<BatchEvaluator> evaluators;
+        evaluators.reserve(programs.size());
+        for (const BatchProgram* program : programs) {
+            evaluators.emplace_back(*program);
+        }
+        std::vector<std::vector<double>> results(programs.size(), std::vector<double>(SWEEP_CHUNK_ROWS));
+        std::vector<std::vector<BatchError>> errors(programs.size(), std::vector<BatchError>(SWEEP_CHUNK_ROWS));
+        std::vector<double> operand_values;
+        std::vector<BatchError> operand_errors;
+        std::vector<double> output_values(SWEEP_CHUNK_ROWS);
+        std::vector<BatchError> output_errors(SWEEP_CHUNK_ROWS);
+        //values and errors of the lanes [first, first + lanes) of a source
+        auto gather = [&](const SweepSource& source, size_t first, size_t lanes, double* values, BatchError* value_errors) {
+            for (size_t lane = 0; lane < lanes; ++lane) {
+                switch (source.kind) {
+                case SweepSource::Kind::Input:
+                    values[lane] = input_values[first + lane][source.index];
+                    value_errors[lane] = 0;
+                    break;
+                case SweepSource::Kind::Formula:
+                    values[lane] = results[source.index][lane];
+                    value_errors[lane] = errors[source.index][lane];
+                    break;
+                case SweepSource::Kind::Value:
+                    values[lane] = source.value;
+                    value_errors[lane] = source.error;
+                    break;
+                }
+            }
+        };
+        for (size_t chunk = next_chunk++; chunk < chunks; chunk = next_chunk++) {
+            size_t first = chunk * SWEEP_CHUNK_ROWS;
+            size_t lanes = std::min(SWEEP_CHUNK_ROWS, result.rows - first);
+            for (size_t formula = 0; formula < programs.size(); ++formula) {
+                const std::vector<SweepSource>& sources = operand_sources[formula];
+                operand_values.resize(sources.size() * lanes);
+                operand_errors.resize(sources.size() * lanes);
+                for (size_t operand = 0; operand < sources.size(); ++operand) {
+                    gather(sources[operand], first, lanes, operand_values.data() + operand * lanes,
+                        operand_errors.data() + operand * lanes);
+                }
+                evaluators[formula].Execute(lanes, operand_values.data(), operand_errors.data(),
+                    results[formula].data(), errors[formula].data());
+            }
+            for (size_t col = 0; col < result.cols; ++col) {
+                gather(output_sources[col], first, lanes, output_values.data(), output_errors.data());
+                for (size_t lane = 0; lane < lanes; ++lane) {
+                    FormulaInterface::Value& output = result.values[(first + lane) * result.cols + col];
+                    if (output_errors[lane] != 0) {
+                        output = FromBatchError(output_errors[lane]);
+                    }
+                    else {
+                        output = output_values[lane];
+                    }
+                }
+            }
+        }
+    };
+    size_t thread_count = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    thread_count = std::min(thread_count, chunks);
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < thread_count; ++t) {
+        workers.emplace_back(evaluate_chunks);
+    }
+    evaluate_chunks();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return result;
+}
+
+namespace {
+//A paged block is a sequence of records: row in the block, column, size of the text, text.
+void AppendNumber(std::string& data, std::uint32_t number) {
+    char bytes[sizeof(number)];
+    std::memcpy(bytes, &number, sizeof(number));
+    data.append(bytes, sizeof(number));
+}
+
+//Size of the record of a pinned error (Cell::SetError): the flag and the category
+//of the error, without a text.
+const std::uint32_t ERROR_RECORD = 0x80000000u;
+
+std::uint32_t ReadNumber(std::string_view& data) {
+    std::uint32_t number;
+    std::memcpy(&number, data.data(), sizeof(number));
+    data.remove_prefix(sizeof(number));
+    return number;
+}
+}  // namespace
+
+void Sheet::SetMemoryBudget(size_t bytes, std::string file_path) {
+    if (bytes != 0 && recalc_worker_ != nullptr) {
+        throw std::logic_error("The paging needs the background recalculation disabled");
+    }
+    if (bytes == 0) {
+        PageInAll();
+        pager_.SetBudget(0);
+        return;
+    }
+    //the pager only handles the blocks of the sheet
+    CopySharedBlocks();
+    if (block_counts_outdated_) {
+        RecountBlocks();
+    }
+    if (!file_path.empty()) {
+        pager_.SetPath(std::move(file_path));
+    }
+    pager_.SetBudget(bytes);
+    TrimMemory();
+}
+
+PagingStats Sheet::GetPagingStats() const {
+    if (block_counts_outdated_) {
+        RecountBlocks();
+    }
+    return pager_.GetStats(GetRowBytes(), sizeof(Cell));
+}
+
+size_t Sheet::GetRowBytes() const {
+    return sizeof(cells_[0]) + grid_cols_ * sizeof(std::unique_ptr<Cell>);
+}
+
+void Sheet::CountCell(Position pos, int cells, int formulas) {
+    pager_.CountCells(BlockPager::GetBlock(pos.row), cells, formulas);
+}
+
+void Sheet::RecountBlocks(int first_row) const {
+    int first_block = BlockPager::GetBlock(first_row);
+    pager_.Resize(cells_.size());
+    pager_.ClearCounts(first_block);
+    for (size_t r = static_cast<size_t>(first_block) * BlockPager::BLOCK_ROWS; r < cells_.size(); ++r) {
+        int block = BlockPager::GetBlock(r);
+        const auto* row = &cells_[r];
+        if (IsLent(block)) {
+            //the cells of the block are still the cells of the sheet
+            size_t row_in_block = r - static_cast<size_t>(block) * BlockPager::BLOCK_ROWS;
+            const auto& lent_rows = lent_blocks_[block]->rows;
+            if (row_in_block >= lent_rows.size()) {
+                continue;
+            }
+            row = &lent_rows[row_in_block];
+        }
+        for (const auto& cell : *row) {
+            if (cell != nullptr) {
+                pager_.CountCells(block, 1, cell->GetFormula() != nullptr);
+            }
+        }
+    }
+    if (first_block == 0) {
+        block_counts_outdated_ = false;
+    }
+}
+
+void Sheet::CountMovedLines(Axis axis, int first) {
+    pager_.Resize(cells_.size());
+    if (!pager_.IsEnabled()) {
+        block_counts_outdated_ = true;
+        return;
+    }
+    //the columns move within their blocks: only the deleted cells were uncounted
+    if (axis == Axis::Rows) {
+        RecountBlocks(first);
+    }
+}
+
+void Sheet::FaultInForUpdate(int row) {
+    if (shared_block_count_ > 0 && row < static_cast<int>(cells_.size())) {
+        CopySharedBlock(BlockPager::GetBlock(row));
+    }
+    FaultIn(row);
+}
+
+void Sheet::FaultIn(int row) const {
+    if (!pager_.IsEnabled() || row >= static_cast<int>(cells_.size())) {
+        return;
+    }
+    int block = BlockPager::GetBlock(row);
+    if (pager_.IsResident(block)) {
+        pager_.Touch(block);
+        return;
+    }
+    PageIn(block);
+    TrimMemory(block);
+}
+
+void Sheet::PageIn(int block) const {
+    std::string data = pager_.PageIn(block);
+    int first_row = block * BlockPager::BLOCK_ROWS;
+    int last_row = std::min(first_row + BlockPager::BLOCK_ROWS, static_cast<int>(cells_.size()));
+    for (int r = first_row; r < last_row; ++r) {
+        cells_[r].resize(grid_cols_);
+    }
+    std::string_view records = data;
+    while (!records.empty()) {
+        int r = first_row + ReadNumber(records);
+        int c = ReadNumber(records);
+        std::uint32_t size = ReadNumber(records);
+        cells_[r][c] = std::make_unique<Cell>();
+        if ((size & ERROR_RECORD) != 0) {
+            cells_[r][c]->SetError(FormulaError(static_cast<FormulaError::Category>(size & ~ERROR_RECORD)));
+            continue;
+        }
+        cells_[r][c]->Restore(records.substr(0, size), *texts_);
+        records.remove_prefix(size);
+    }
+}
+
+void Sheet::PageOut(int block) const {
+    int first_row = block * BlockPager::BLOCK_ROWS;
+    int last_row = std::min(first_row + BlockPager::BLOCK_ROWS, static_cast<int>(cells_.size()));
+    std::string data;
+    for (int r = first_row; r < last_row; ++r) {
+        for (int c = 0; c < static_cast<int>(cells_[r].size()); ++c) {
+            if (cells_[r][c] != nullptr) {
+                //the block holds no formula: the texts (or the errors) are the whole cells
+                const CellPayload& payload = cells_[r][c]->GetPayload();
+                AppendNumber(data, r - first_row);
+                AppendNumber(data, c);
+                if (payload.GetKind() == CellPayload::Kind::Error) {
+                    AppendNumber(data, ERROR_RECORD | static_cast<std::uint32_t>(payload.GetError().GetCategory()));
+                    continue;
+                }
+                std::string_view text = payload.GetTextView();
+                AppendNumber(data, text.size());
+                data.append(text);
+            }
+        }
+    }
+    pager_.PageOut(block, data);
+    for (int r = first_row; r < last_row; ++r) {
+        //release the memory of the row, not only its cells
+        std::vector<std::unique_ptr<Cell>>().swap(cells_[r]);
+    }
+}
+
+void Sheet::TrimMemory(int keep_block) const {
+    if (!pager_.IsEnabled()) {
+        return;
+    }
+    while (pager_.GetResidentBytes(GetRowBytes(), sizeof(Cell)) > pager_.GetBudget()) {
+        int block = pager_.FindVictim(keep_block);
+        if (block < 0) {
+            //the other resident blocks hold formulas
+            break;
+        }
+        PageOut(block);
+    }
+}
+
+void Sheet::PageInAll() {
+    CopySharedBlocks();
+    if (!pager_.IsEnabled()) {
+        return;
+    }
+    for (size_t r = 0; r < cells_.size(); r += BlockPager::BLOCK_ROWS) {
+        int block = BlockPager::GetBlock(r);
+        if (!pager_.IsResident(block)) {
+            PageIn(block);
+        }
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::Fork() const {
+    //the cells are shared while no evaluation of the worker reads them
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    auto fork = std::make_unique<Sheet>();
+    int blocks = cells_.empty() ? 0 : BlockPager::GetBlock(cells_.size() - 1) + 1;
+    fork->shared_blocks_.resize(blocks);
+    for (int block = 0; block < blocks; ++block) {
+        std::shared_ptr<const SharedBlock> shared = ShareBlock(block);
+        {
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            ++shared->readers;
+        }
+        fork->shared_blocks_[block] = std::move(shared);
+    }
+    fork->shared_block_count_ = blocks;
+    //the rows are empty until their block is copied
+    fork->cells_.resize(cells_.size());
+    fork->grid_cols_ = grid_cols_;
+    fork->pager_.Resize(cells_.size());
+    fork->printable_size_ = printable_size_;
+    fork->dependencies_manager.ShareDependencies(dependencies_manager);
+    fork->shared_texts_ = shared_texts_;
+    fork->shared_texts_.push_back(texts_);
+    fork->version_ = version_;
+    return fork;
+}
+
+std::shared_ptr<const Sheet::SharedBlock> Sheet::ShareBlock(int block) const {
+    if (IsShared(block)) {
+        //not copied by this sheet: share it further
+        return IsLent(block) ? lent_blocks_[block] : shared_blocks_[block];
+    }
+    int first_row = block * BlockPager::BLOCK_ROWS;
+    int last_row = std::min(first_row + BlockPager::BLOCK_ROWS, static_cast<int>(cells_.size()));
+    auto shared = std::make_shared<SharedBlock>();
+    shared->rows.resize(last_row - first_row);
+    if (pager_.IsEnabled()) {
+        //the pager only handles the blocks of the grid: the fork gets copies of the cells
+        FaultIn(first_row);
+        for (int r = first_row; r < last_row; ++r) {
+            std::vector<std::unique_ptr<Cell>>& row = shared->rows[r - first_row];
+            row.resize(cells_[r].size());
+            for (size_t c = 0; c < row.size(); ++c) {
+                if (cells_[r][c] != nullptr) {
+                    row[c] = std::make_unique<Cell>();
+                    row[c]->Share(*cells_[r][c]);
+                }
+            }
+        }
+        return shared;
+    }
+    //the cells stay the cells of this sheet: its formulas are evaluated in place
+    for (int r = first_row; r < last_row; ++r) {
+        shared->rows[r - first_row].swap(cells_[r]);
+    }
+    if (lent_blocks_.size() <= static_cast<size_t>(block)) {
+        lent_blocks_.resize(block + 1);
+    }
+    lent_blocks_[block] = shared;
+    ++shared_block_count_;
+    return shared;
+}
+
+Cell* Sheet::SharedBlock::Find(int row, int col) const {
+    if (row >= static_cast<int>(rows.size()) || col >= static_cast<int>(rows[row].size())) {
+        //a row added to the grid since, or a column
+        return nullptr;
+    }
+    return rows[row][col].get();
+}
+
+bool Sheet::IsShared(int block) const {
+    return (static_cast<size_t>(block) < shared_blocks_.size() && shared_blocks_[block] != nullptr) || IsLent(block);
+}
+
+bool Sheet::IsLent(int block) const {
+    return static_cast<size_t>(block) < lent_blocks_.size() && lent_blocks_[block] != nullptr;
+}
+
+void Sheet::CopySharedBlock(int block) const {
+    if (!IsShared(block)) {
+        return;
+    }
+    int first_row = block * BlockPager::BLOCK_ROWS;
+    int last_row = std::min(first_row + BlockPager::BLOCK_ROWS, static_cast<int>(cells_.size()));
+    if (IsLent(block)) {
+        std::shared_ptr<const SharedBlock> lent = std::move(lent_blocks_[block]);
+        std::unique_lock<std::mutex> lock(lent->mutex);
+        if (lent->readers == 0) {
+            //no fork reads the rows anymore
+            for (size_t i = 0; i < lent->rows.size(); ++i) {
+                cells_[first_row + i].swap(lent->rows[i]);
+            }
+            lock.unlock();
+            for (int r = first_row; r < last_row; ++r) {
+                cells_[r].resize(grid_cols_);
+            }
+        }
+        else {
+            lock.unlock();
+            //the forks keep the cells: the sheet goes on with copies (already counted and registered)
+            for (int r = first_row; r < last_row; ++r) {
+                cells_[r].resize(grid_cols_);
+            }
+            for (size_t i = 0; i < lent->rows.size(); ++i) {
+                int r = first_row + static_cast<int>(i);
+                for (size_t c = 0; c < lent->rows[i].size(); ++c) {
+                    if (const Cell* lent_cell = lent->rows[i][c].get()) {
+                        auto cell = std::make_unique<Cell>();
+                        cell->Share(*lent_cell);
+                        cell->Bind(CellContext{ *this, dependencies_manager, *texts_, Position{ r, static_cast<int>(c) } });
+                        cells_[r][c] = std::move(cell);
+                    }
+                }
+            }
+        }
+    }
+    else {
+        for (int r = first_row; r < last_row; ++r) {
+            cells_[r].resize(grid_cols_);
+        }
+        const SharedBlock& shared = *shared_blocks_[block];
+        for (size_t i = 0; i < shared.rows.size(); ++i) {
+            int r = first_row + static_cast<int>(i);
+            for (size_t c = 0; c < shared.rows[i].size(); ++c) {
+                std::unique_ptr<Cell>& cell = cells_[r][c];
+                //the formulas read before are already copied
+                if (shared.rows[i][c] != nullptr && cell == nullptr) {
+                    cell = CopySharedCell(*shared.rows[i][c], Position{ r, static_cast<int>(c) });
+                }
+            }
+        }
+        //GetCell may have handed out the text cells of the block
+        copied_blocks_.push_back(std::move(shared_blocks_[block]));
+    }
+    if (--shared_block_count_ == 0) {
+        shared_blocks_.clear();
+        lent_blocks_.clear();
+        //every formula shared by the sheet this one was forked from is copied
+        dependencies_manager.ReleaseInheritedCache();
+    }
+}
+
+Cell* Sheet::FindSharedCell(Position pos) const {
+    int block = BlockPager::GetBlock(pos.row);
+    int row_in_block = pos.row - block * BlockPager::BLOCK_ROWS;
+    if (IsLent(block)) {
+        //the cells of this sheet, read in place
+        return lent_blocks_[block]->Find(row_in_block, pos.col);
+    }
+    std::vector<std::unique_ptr<Cell>>& row = cells_[pos.row];
+    if (pos.col < static_cast<int>(row.size()) && row[pos.col] != nullptr) {
+        //formula copied by a previous access
+        return row[pos.col].get();
+    }
+    Cell* shared_cell = shared_blocks_[block]->Find(row_in_block, pos.col);
+    if (shared_cell == nullptr) {
+        return nullptr;
+    }
+    if (shared_cell->GetFormula() == nullptr) {
+        //the text cells are read from the block
+        return shared_cell;
+    }
+    //the formulas are copied to be evaluated (and cached) by this sheet
+    row.resize(std::max(static_cast<int>(row.size()), grid_cols_));
+    row[pos.col] = CopySharedCell(*shared_cell, pos);
+    return row[pos.col].get();
+}
+
+std::unique_ptr<Cell> Sheet::CopySharedCell(const Cell& shared_cell, Position pos) const {
+    auto cell = std::make_unique<Cell>();
+    cell->Share(shared_cell);
+    bool is_formula = cell->GetFormula() != nullptr;
+    if (is_formula) {
+        cell->Bind(CellContext{ *this, dependencies_manager, *texts_, pos });
+        dependencies_manager.InheritVertex(pos);
+    }
+    pager_.CountCells(BlockPager::GetBlock(pos.row), 1, is_formula);
+    return cell;
+}
+
+void Sheet::CopySharedBlocks() const {
+    size_t blocks = std::max(shared_blocks_.size(), lent_blocks_.size());
+    for (size_t block = 0; block < blocks && shared_block_count_ > 0; ++block) {
+        CopySharedBlock(block);
+    }
+}
+
+std::vector<Position> Sheet::GetPrecedents(Position pos, bool transitive) const {
+    CheckIfPositionIsValid(pos);
+    return dependencies_manager.GetPrecedents(pos, transitive);
+}
+
+std::vector<Position> Sheet::GetDependents(Position pos, bool transitive) const {
+    CheckIfPositionIsValid(pos);
+    return dependencies_manager.GetDependents(pos, transitive);
+}
+
+void Sheet::SetIterativeCalculation(bool enabled, int max_iterations, double epsilon) {
+    if (enabled && recalc_worker_ != nullptr) {
+        throw std::logic_error("The iterative calculation needs the background recalculation disabled");
+    }
+    if (!dependencies_manager.SetIterative(enabled, max_iterations, epsilon)) {
+        throw CircularDependencyException("The sheet has circular references");
+    }
+}
+
+std::vector<CycleStatus> Sheet::GetCycleStatus() const {
+    return dependencies_manager.GetCycleStatus();
+}
+
+void Sheet::SetBackgroundRecalculation(bool enabled) {
+    if (!enabled) {
+        recalc_worker_ = nullptr;
+        return;
+    }
+    if (recalc_worker_ != nullptr) {
+        return;
+    }
+    if (pager_.IsEnabled() || dependencies_manager.IsIterative()) {
+        throw std::logic_error("The background recalculation needs the paging and the iterative calculation disabled");
+    }
+    //the worker reads the cells concurrently with the readers: no block is copied on access
+    CopySharedBlocks();
+    recalc_worker_ = std::make_unique<RecalcWorker>([this](Position pos) {
+        const Cell* cell = FindCell(pos);
+        if (cell != nullptr && cell->GetFormula() != nullptr) {
+            cell->GetValue();
+        }
+    });
+    //the formulas invalidated before are recalculated too
+    RecalcWorker::EditScope edit(recalc_worker_.get());
+    recalc_worker_->Enqueue(dependencies_manager.GetDirtyVertices());
+}
+
+CachedValue Sheet::GetCachedValue(Position pos) const {
+    CheckIfPositionIsValid(pos);
+    const Cell* cell = FindCell(pos);
+    if (cell == nullptr) {
+        return CachedValue{ std::string(), false };
+    }
+    if (cell->GetFormula() != nullptr) {
+        if (std::optional<CachedValue> cached = dependencies_manager.PeekCache(pos)) {
+            return *cached;
+        }
+    }
+    return CachedValue{ cell->GetValue(), false };
+}
+
+void Sheet::WaitForRecalculation() const {
+    if (recalc_worker_ != nullptr) {
+        recalc_worker_->WaitIdle();
+    }
+}
+
+RecalcStats Sheet::GetRecalcStats() const {
+    return recalc_worker_ != nullptr ? recalc_worker_->GetStats() : RecalcStats{};
+}
+
+RecalcProgress Sheet::RecalculateFor(std::chrono::microseconds budget) {
+    return RecalculateSlice(budget, nullptr);
+}
+
+RecalcProgress Sheet::RecalculateFor(std::chrono::microseconds budget, CellRange priority) {
+    CheckIfRangeIsValid(priority.first, priority.last);
+    return RecalculateSlice(budget, &priority);
+}
+
+void Sheet::RestartRecalcWalk() {
+    //the outermost formula of the walk first
+    for (auto it = recalc_walk_.rbegin(); it != recalc_walk_.rend(); ++it) {
+        recalc_roots_.push_front(it->cell);
+    }
+    recalc_walk_.clear();
+}
+
+RecalcProgress Sheet::RecalculateSlice(std::chrono::microseconds budget, const CellRange* priority) {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point deadline = Clock::now() + budget;
+    if (!recalc_tracking_ || recalc_replan_) {
+        std::vector<Position> dirty = dependencies_manager.GetDirtyVertices();
+        recalc_roots_.assign(dirty.begin(), dirty.end());
+        recalc_walk_.clear();
+        recalc_tracking_ = true;
+        recalc_replan_ = false;
+    }
+
+    //dirty formulas of the priority region (clipped to the grid)
+    auto collect_priority = [this, priority]() {
+        std::vector<Position> cells;
+        if (priority == nullptr) {
+            return cells;
+        }
+        int last_row = std::min(priority->last.row, static_cast<int>(cells_.size()) - 1);
+        int last_col = std::min(priority->last.col, grid_cols_ - 1);
+        for (int r = priority->first.row; r <= last_row; ++r) {
+            for (int c = priority->first.col; c <= last_col; ++c) {
+                if (dependencies_manager.IsDirty({ r, c })) {
+                    cells.push_back({ r, c });
+                }
+            }
+        }
+        return cells;
+    };
+    std::vector<Position> priority_cells = collect_priority();
+    bool same_priority = priority != nullptr && recalc_priority_active_ && priority->first == recalc_priority_.first
+        && priority->last == recalc_priority_.last;
+    if (priority_cells.empty()) {
+        recalc_priority_active_ = false;
+    }
+    else if (!same_priority) {
+        //the region goes before the walk in progress (the previous slices already put it first otherwise)
+        RestartRecalcWalk();
+        recalc_roots_.insert(recalc_roots_.begin(), priority_cells.begin(), priority_cells.end());
+        recalc_priority_active_ = true;
+        recalc_priority_ = *priority;
+    }
+    //the cycles of the iterative calculation are evaluated together: no walk through them
+    bool walk_precedents = !dependencies_manager.IsIterative();
+    auto get_precedents = [this, walk_precedents](Position pos) {
+        return walk_precedents ? dependencies_manager.GetPrecedents(pos, false) : std::vector<Position>();
+    };
+
+    RecalcProgress progress;
+    bool first_step = true;
+    while (first_step || Clock::now() < deadline) {
+        first_step = false;
+        if (recalc_walk_.empty()) {
+            //the formulas evaluated meanwhile (or cleared) are clean: skipped
+            while (!recalc_roots_.empty() && !dependencies_manager.IsDirty(recalc_roots_.front())) {
+                recalc_roots_.pop_front();
+            }
+            if (recalc_roots_.empty()) {
+                break;
+            }
+            Position root = recalc_roots_.front();
+            recalc_roots_.pop_front();
+            recalc_walk_.push_back({ root, get_precedents(root) });
+            continue;
+        }
+        RecalcFrame& frame = recalc_walk_.back();
+        while (!frame.precedents.empty() && !dependencies_manager.IsDirty(frame.precedents.back())) {
+            frame.precedents.pop_back();
+        }
+        if (!frame.precedents.empty()) {
+            Position precedent = frame.precedents.back();
+            frame.precedents.pop_back();
+            recalc_walk_.push_back({ precedent, get_precedents(precedent) });
+            continue;
+        }
+        //the cells read by the formula are clean
+        const Cell* cell = FindCell(frame.cell);
+        if (cell != nullptr && cell->GetFormula() != nullptr && dependencies_manager.IsDirty(frame.cell)) {
+            cell->GetValue();
+            ++progress.evaluated;
+        }
+        recalc_walk_.pop_back();
+    }
+    for (Position pos : priority_cells) {
+        if (dependencies_manager.IsDirty(pos)) {
+            progress.priority_done = false;
+            break;
+        }
+    }
+    progress.remaining = recalc_roots_.size() + recalc_walk_.size();
+    progress.complete = progress.priority_done && progress.remaining == 0;
+    return progress;
+}
+
+SheetMemoryReport Sheet::GetMemoryReport() const {
+    //former layout: make_shared control block + Cell{unique_ptr<Impl>, 2 references, Position},
+    //Impl{vptr, std::string expression_} (+ a sheet reference in FormulaImpl)
+    const size_t legacy_slot = sizeof(std::shared_ptr<Cell>);
+    const size_t legacy_cell = 16 + sizeof(void*) * 3 + sizeof(Position);
+    const size_t legacy_impl = sizeof(void*) + sizeof(std::string);
+    const size_t legacy_formula_impl = legacy_impl + sizeof(void*);
+    const size_t legacy_sso_capacity = 15;
+
+    SheetMemoryReport report;
+    size_t slots = 0;
+    //the cells of the blocks of another sheet are counted apart
+    SheetMemoryReport shared;
+    size_t shared_slots = 0;
+    auto count_row = [&](const std::vector<std::unique_ptr<Cell>>& row, SheetMemoryReport& counted, size_t& counted_slots) {
+        counted_slots += row.size();
+        for (const auto& cell : row) {
+            if (cell == nullptr) {
+                continue;
+            }
+            ++counted.cells;
+            const CellPayload& payload = cell->GetPayload();
+            counted.heap_bytes += payload.GetHeapBytes();
+            size_t text_size = 0;
+            switch (payload.GetKind()) {
+            case CellPayload::Kind::Empty:
+                ++counted.empty_cells;
+                break;
+            case CellPayload::Kind::ShortText:
+            case CellPayload::Kind::Error:
+                ++counted.short_texts;
+                break;
+            case CellPayload::Kind::LongText:
+                ++counted.long_texts;
+                text_size = payload.GetTextView().size();
+                break;
+            case CellPayload::Kind::Formula:
+                ++counted.formulas;
+                text_size = cell->GetTextView().size();
+                break;
+            }
+            counted.legacy_bytes += legacy_cell;
+            counted.legacy_bytes += payload.GetKind() == CellPayload::Kind::Formula ? legacy_formula_impl : legacy_impl;
+            if (text_size > legacy_sso_capacity) {
+                counted.legacy_bytes += text_size + 1;
+            }
+        }
+    };
+    for (size_t r = 0; r < cells_.size(); ++r) {
+        count_row(cells_[r], report, slots);
+        int block = BlockPager::GetBlock(r);
+        if (r % BlockPager::BLOCK_ROWS != 0 || !IsShared(block)) {
+            continue;
+        }
+        if (IsLent(block)) {
+            ++report.lent_blocks;
+            for (const auto& row : lent_blocks_[block]->rows) {
+                count_row(row, report, slots);
+            }
+        }
+        else {
+            ++report.shared_blocks;
+            for (const auto& row : shared_blocks_[block]->rows) {
+                count_row(row, shared, shared_slots);
+            }
+        }
+    }
+    size_t row_headers = cells_.size() * sizeof(cells_[0]);
+    report.grid_bytes = row_headers + slots * sizeof(std::unique_ptr<Cell>);
+    report.cell_bytes = report.cells * sizeof(Cell);
+    report.pooled_texts = texts_->GetCount();
+    report.pool_bytes = texts_->GetBytes();
+    report.shared_bytes = shared_slots * sizeof(std::unique_ptr<Cell>) + shared.cells * sizeof(Cell) + shared.heap_bytes;
+    report.version_log_bytes = versions_.GetBytes();
+    report.total_bytes = report.grid_bytes + report.cell_bytes + report.heap_bytes + report.pool_bytes + report.version_log_bytes;
+    report.legacy_bytes += row_headers + slots * legacy_slot;
+    return report;
+}
+
+std::ostream& operator<<(std::ostream& output, const SheetMemoryReport& report) {
+    output << "cells: " << report.cells
+        << " (empty: " << report.empty_cells
+        << ", short texts: " << report.short_texts
+        << ", long texts: " << report.long_texts
+        << ", formulas: " << report.formulas << ")\n";
+    output << "grid: " << report.grid_bytes << " bytes\n";
+    output << "cells: " << report.cell_bytes << " bytes (" << sizeof(Cell) << " per cell)\n";
+    output << "formula records: " << report.heap_bytes << " bytes\n";
+    output << "text pool: " << report.pool_bytes << " bytes (" << report.pooled_texts << " distinct long texts)\n";
+    output << "shared: " << report.shared_blocks << " blocks of another sheet (" << report.shared_bytes
+        << " bytes), " << report.lent_blocks << " blocks lent to the forks\n";
+    output << "version log: " << report.version_log_bytes << " bytes\n";
+    output << "total: " << report.total_bytes << " bytes, former layout: " << report.legacy_bytes << " bytes\n";
+    return output;
+}
+
+Size Sheet::GetPrintableSize() const {
+    return printable_size_;
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    VisitPrintableZone(output, [&output](const auto& cell_ptr) {
+        cell_ptr->PrintValue(output);
+        });
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    VisitPrintableZone(output, [&output](const auto& cell_ptr) {
+        cell_ptr->PrintText(output);
+        });
+}
+
+
+void Sheet::PrintValues(std::ostream& output, Position top_left, Position bottom_right) const {
+    CheckIfRangeIsValid(top_left, bottom_right);
+    VisitZone(output, top_left, bottom_right, [&output](const auto& cell_ptr) {
+        cell_ptr->PrintValue(output);
+        });
+}
+
+void Sheet::PrintTexts(std::ostream& output, Position top_left, Position bottom_right) const {
+    CheckIfRangeIsValid(top_left, bottom_right);
+    VisitZone(output, top_left, bottom_right, [&output](const auto& cell_ptr) {
+        cell_ptr->PrintText(output);
+        });
+}
+
+void Sheet::VisitCells(Position top_left, Position bottom_right, const CellVisitor& visitor) const {
+    CheckIfRangeIsValid(top_left, bottom_right);
+    //the rows and the columns beyond the grid hold no cell
+    int last_row = std::min(bottom_right.row, GetGridSize(Axis::Rows) - 1);
+    int last_col = std::min(bottom_right.col, GetGridSize(Axis::Cols) - 1);
+    for (int r = top_left.row; r <= last_row; ++r) {
+        for (int c = top_left.col; c <= last_col; ++c) {
+            //the visitor may access other cells: the block of the row may have been paged out
+            FaultIn(r);
+            if (const Cell* cell = GetGridCell(Position{ r, c })) {
+                visitor(Position{ r, c }, *cell);
+            }
+        }
+    }
+}
+
+void Sheet::CheckIfRangeIsValid(Position top_left, Position bottom_right) {
+    CheckIfPositionIsValid(top_left);
+    CheckIfPositionIsValid(bottom_right);
+    if (top_left.row > bottom_right.row || top_left.col > bottom_right.col) {
+        throw InvalidPositionException("Invalid range of cells");
+    }
+}
+
+std::unique_ptr<SheetInterface> CreateSheet() {
+    return std::make_unique<Sheet>();
 }
\ No newline at end of file
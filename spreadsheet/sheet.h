@@ -1,88 +1,501 @@
-#pragma once
-
-#include "cell.h"
-#include "common.h"
-
-#include <functional>
-#include <vector>
-
-class Sheet : public SheetInterface {
-public:
-    ~Sheet();
-
-    Sheet();
-
-    void SetCell(Position pos, std::string text) override;
-
-    const CellInterface* GetCell(Position pos) const override;
-    CellInterface* GetCell(Position pos) override;
-
-    void ClearCell(Position pos) override;
-
-    Size GetPrintableSize() const override;
-
-    void PrintValues(std::ostream& output) const override;
-    void PrintTexts(std::ostream& output) const override;
-
-	// Можете дополнить ваш класс нужными полями и методами
-
-
-private:
-	// Можете дополнить ваш класс нужными полями и методами
-    
-
-    //Check if the position is valid and throw an exception otherwise.
-    static void CheckIfPositionIsValid(Position pos);
-
-    //Update the printable after deleting cell.
-    void UpdatePrintableZoneAfterClearingCell(Position pos);
-
-    //Check if the formula does not lead to circular dependencies.
-    //Invalidate cache if we update an already existing cell.
-    //bool ValidDependencies(Position pos, std::string text);
-
-    bool IsInGrid(Position pos) const;
-    void AddRowsToGrid(int n);
-    void AddColumsToGrid(int n);
-
-    //Create a cell in the grid with the text.
-    void SetCellInGrid(Position pos, std::string text);
-    //Create dependent empty cells.
-    void SetDependentCells(Position pos);
-    
-    //Traverse the printable zone and apply operation.
-    template <typename Func>
-    void VisitPrintableZone(std::ostream& output, Func operation) const;
-
-    // *first dimension: rows
-    // *second dimension: columns
-    std::vector<std::vector<std::shared_ptr<Cell>>> cells_ ;
-    
-    Size printable_size_;
-
-    DependenciesManager dependencies_manager;
-
-};
-
-
-template <typename Func>
-void Sheet::VisitPrintableZone(std::ostream& output, Func operation) const {
-    using namespace std::literals;
-    for (int r = 0; r < printable_size_.rows; ++r) {
-        bool is_first = true;
-        for (int c = 0; c < printable_size_.cols; ++c) {
-            if (is_first) {
-                is_first = false;
-            }
-            else {
-                //output << '\t';
-                output << "\t"sv;
-            }
-            if (cells_[r][c] != nullptr) {
-                operation(cells_[r][c]);
-            }
-        }
-        //output << '\n';
-        output << "\n"sv;
-    }
-}
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "paging.h"
+#include "recalc.h"
+#include "subscriptions.h"
+#include "version_log.h"
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//Memory used by the cells of a sheet: grid, cells and their out-of-line parts, and
+//the version log (the ASTs of the formulas, the dependencies and the cache are not counted).
+struct SheetMemoryReport {
+    size_t cells = 0;
+    size_t empty_cells = 0;
+    //texts (and pinned errors) stored inline in the cell
+    size_t short_texts = 0;
+    size_t long_texts = 0;
+    size_t formulas = 0;
+
+    size_t grid_bytes = 0;
+    size_t cell_bytes = 0;
+    //formula records
+    size_t heap_bytes = 0;
+    //distinct long texts interned in the text pool and the bytes of the pool
+    size_t pooled_texts = 0;
+    size_t pool_bytes = 0;
+    //blocks of rows shared by the sheet this one was forked from, not copied yet (their
+    //cells are counted in shared_bytes, not in the total)
+    size_t shared_blocks = 0;
+    size_t shared_bytes = 0;
+    //blocks of rows of the sheet read by its forks (counted as the cells of the sheet)
+    size_t lent_blocks = 0;
+    //versions of the changes logged for the delta export
+    size_t version_log_bytes = 0;
+    size_t total_bytes = 0;
+    //the same cells stored as before: shared_ptr<Cell> holding an Impl with a std::string
+    size_t legacy_bytes = 0;
+};
+
+std::ostream& operator<<(std::ostream& output, const SheetMemoryReport& report);
+
+//Values of the output cells of Sheet::Sweep for every row of input values.
+struct SweepResult {
+    size_t rows = 0;
+    size_t cols = 0;
+    //rows x cols values, row by row
+    std::vector<FormulaInterface::Value> values;
+
+    const FormulaInterface::Value& At(size_t row, size_t col) const {
+        return values[row * cols + col];
+    }
+};
+
+class Sheet : public SheetInterface {
+public:
+    ~Sheet();
+
+    Sheet();
+
+    void SetCell(Position pos, std::string text) override;
+    //SetCell of a formula parsed elsewhere: the copy of the formula of another sheet,
+    //with its references to deleted cells (they stay #REF!).
+    //Throw InvalidPositionException for an invalid position, CircularDependencyException.
+    void SetFormula(Position pos, std::unique_ptr<FormulaInterface> formula);
+
+    //SetCell(pos, FormatNumber(value)) for the input cells updated at a high rate: the
+    //text of a cell which is not a formula is replaced without parsing it and without
+    //changing the dependency graph (a new cell or a formula goes through SetCell), the
+    //dependents are invalidated only if the text changed.
+    //Throw InvalidPositionException for an invalid position.
+    void SetNumber(Position pos, double value);
+    //SetNumber for a batch of ticks, as one edit: the ticks of a cell are coalesced
+    //(the last one wins) and the union of the dependents of the changed cells is
+    //invalidated in one traversal. The positions are checked before any change.
+    //Return the number of cells whose text changed.
+    size_t ApplyTicks(const std::vector<std::pair<Position, double>>& ticks);
+    //ApplyTicks of the values of formulas computed elsewhere (the proxies of a
+    //ShardedRecalculation): a number is set as by ApplyTicks, an error pins the cell
+    //to it (its value is the error, its text the text of the error).
+    size_t ApplyValueTicks(const std::vector<std::pair<Position, FormulaInterface::Value>>& ticks);
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    //PrintValues/PrintTexts of the rectangle [top_left, bottom_right] (it may extend
+    //beyond the printable area). Only the formulas of the rectangle and the cells
+    //they depend on are evaluated: the cost depends on the size of the rectangle
+    //and on the depth of the dependencies, not on the size of the sheet.
+    void PrintValues(std::ostream& output, Position top_left, Position bottom_right) const;
+    void PrintTexts(std::ostream& output, Position top_left, Position bottom_right) const;
+
+    //Call visitor for every non-empty cell of the rectangle [top_left, bottom_right],
+    //row by row. The cells are not evaluated before the visitor reads them.
+    using CellVisitor = std::function<void(Position, const Cell&)>;
+    void VisitCells(Position top_left, Position bottom_right, const CellVisitor& visitor) const;
+
+	// Можете дополнить ваш класс нужными полями и методами
+
+    //Runtime statistics: evaluations, cache, invalidations, cycle checks,
+    //parsing, graph size and the latencies of the phases of SetCell.
+    SheetStats GetStats() const;
+    void ResetStats();
+
+    //Insert count empty rows (columns) before the row (column) before.
+    //The cells below (on the right) move, the formulas referencing them are updated.
+    //Throw TableTooBigException if cells would move out of the table.
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+
+    //Delete count rows (columns) starting from first. The references to the
+    //deleted cells become #REF!, the references to the moved cells are updated.
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    //Memory used by the cells, compared with the former layout of the cells
+    //(the cells of the paged blocks are not in memory and are not counted).
+    SheetMemoryReport GetMemoryReport() const;
+
+    //Opt-in profiler of the formula evaluations (disabled by default):
+    //hottest cells report and flamegraph-compatible folded stacks.
+    FormulaProfiler& GetProfiler();
+
+    //Call callback with the cells of range whose displayed values may have changed,
+    //once per batch of edits touching the range. A batch is one SetCell, ClearCell,
+    //Insert*/Delete* call, or all the calls between BeginUpdate and EndUpdate.
+    //The changed cells come from the cache invalidation, the sheet is not compared.
+    SubscriptionId Subscribe(CellRange range, ChangeCallback callback);
+    void Unsubscribe(SubscriptionId id);
+
+    //Group the following edits into one batch (the batches can be nested).
+    void BeginUpdate();
+    void EndUpdate();
+
+    //Version of the sheet: increased by every SetCell, ClearCell, Insert*/Delete*
+    //call changing the sheet.
+    SheetVersion GetVersion() const;
+    //Delta export (disabled by default): the sheet logs the versions of the changes of
+    //its cells from the version it is enabled at. Disabling frees the log.
+    void SetDeltaExport(bool enabled);
+    //Versions of the last changes of the text and of the value of the cell at pos since
+    //the delta export was enabled. Throw std::logic_error if it is disabled.
+    CellVersion GetCellVersion(Position pos) const;
+
+    //Write what changed after since_version, in time proportional to the changes:
+    // version<TAB>current version
+    // insert_rows|insert_cols|delete_rows|delete_cols<TAB>first<TAB>count (in order)
+    // cell<TAB>position<TAB>text<TAB>value (for every changed cell, empty if cleared)
+    //The text and the value escape the backslashes (\\), the tabs (\t) and the line
+    //breaks (\n, \r): a line is always one record.
+    //A client at since_version replays the layout changes, then sets the cells.
+    //Throw std::logic_error if the delta export was not enabled at since_version.
+    void ExportDelta(SheetVersion since_version, std::ostream& output) const;
+
+    //Evaluate the formulas of the cells [first, first + count rows) of a column:
+    //runs of consecutive rows filled with the same formula (references moved
+    //down row by row) are evaluated together by the BatchEvaluator and stored
+    //in the cache. The other cells are left to the lazy evaluation.
+    //Can run concurrently with GetValue. Return the number of cells evaluated in batches.
+    size_t EvaluateColumn(Position first, int count);
+
+    //Values of the outputs for every row of input_values (one number per input) as if
+    //the inputs held these numbers, without changing the sheet: the formulas depending
+    //on the inputs and needed by the outputs are found once, then evaluated in order by
+    //the BatchEvaluator with the rows as lanes, the rows split among threads (0: one per
+    //core). The other cells keep their values; an output which is not a formula is read
+    //like a formula operand. The sheet must not change during the sweep.
+    //Throw InvalidPositionException for an invalid position, std::invalid_argument
+    //if a row of input_values does not have one number per input and
+    //CircularDependencyException if a formula to evaluate belongs to a cycle.
+    SweepResult Sweep(const std::vector<Position>& inputs, const std::vector<std::vector<double>>& input_values,
+        const std::vector<Position>& outputs, unsigned threads = 0) const;
+
+    //Keep the grid and the cells within bytes of memory (estimated like GetMemoryReport):
+    //the least recently used blocks of rows without formulas are written to a paging
+    //file (a new file of the temporary directory unless file_path is given, removed
+    //with the sheet) and read back when one of their cells is accessed. The formulas,
+    //the dependency graph, the cache and the text pool stay in memory. Insert*/Delete*
+    //read all the blocks back before moving the cells. 0 (default) disables the paging.
+    //While the paging is enabled, the sheet must be used from one thread, and a pointer
+    //returned by GetCell to a cell which is not a formula stays valid until the next
+    //call to the sheet.
+    void SetMemoryBudget(size_t bytes, std::string file_path = {});
+    PagingStats GetPagingStats() const;
+
+    //Copy of the sheet to edit independently ("what if" scenarios), in time proportional
+    //to the number of blocks of rows, not to the number of cells or formulas:
+    // * the blocks of rows are shared: the rows of a block move out of the grid of the
+    //   sheet, which reads its cells there until it edits the block, and copies it then
+    //   if a fork still reads it (a sheet with the paging enabled copies its blocks for
+    //   the fork). The fork copies a block when it first edits it, and a formula when
+    //   it first reads it;
+    // * the formulas are shared until one of the sheets updates their references;
+    // * the dependency graph is shared until one of the sheets changes it;
+    // * the values of the cache are shared: the fork reads them as it copies its formulas,
+    //   the sheet copies a value for its forks before it changes it. The fork only
+    //   evaluates the formulas depending on its own edits.
+    //The fork starts at the version of the sheet (its deltas and cell versions cover its
+    //own edits), without subscriptions, paging, profiling or background recalculation. It keeps alive what it shares.
+    //Fork is an edit of the sheet: it does not run concurrently with its readers.
+    //A fork and its sheet can be used from different threads; until it has copied all its
+    //blocks, a fork must be used from one thread (and enabling its paging copies them all).
+    std::unique_ptr<Sheet> Fork() const;
+
+    //Auditing of the dependencies (sorted positions):
+    // * GetPrecedents: the cells referenced by the formula of pos (transitive: and the
+    //   cells they depend on, and so on);
+    // * GetDependents: the formulas referencing pos (transitive: and the formulas
+    //   depending on them, and so on).
+    //The transitive queries search a dense copy of the dependency graph (forward and
+    //reverse edges in arrays, cells numbered in position order, visited cells in a
+    //bitset) built by the first query after a change of the dependencies: they cost
+    //the cells and edges reached, without hash lookups or sorting.
+    //Throw InvalidPositionException for an invalid position.
+    std::vector<Position> GetPrecedents(Position pos, bool transitive = false) const;
+    std::vector<Position> GetDependents(Position pos, bool transitive = false) const;
+
+    //Iterative calculation (disabled by default) for models with circular references:
+    //SetCell accepts the formulas making cycles instead of throwing CircularDependencyException.
+    //The formulas of a cycle (strongly connected component of the dependencies) are evaluated
+    //together, starting from their previous values, until no value changes by more than
+    //epsilon or max_iterations iterations; the other formulas are evaluated once. An edit
+    //only evaluates again the cycles depending on it. While the sheet has cycles, it must be
+    //evaluated from one thread, and disabling the iterative calculation throws
+    //CircularDependencyException.
+    void SetIterativeCalculation(bool enabled, int max_iterations = 100, double epsilon = 0.001);
+    //Cycles of the sheet and the convergence of their last evaluation (not converged
+    //before their first evaluation), ordered by their first cell.
+    std::vector<CycleStatus> GetCycleStatus() const;
+
+    //Background recalculation (disabled by default): the edits invalidate the formulas
+    //depending on them and return, a worker thread evaluates the invalidated formulas
+    //in the order of the invalidation. An edit arriving while the worker evaluates a
+    //formula cancels the evaluation (the cells already evaluated stay in the cache),
+    //the formula is evaluated again after the edit. GetValue returns the current value:
+    //it evaluates the cells it needs, waiting only for the cells being evaluated by the
+    //worker; GetCachedValue does not wait for the recalculation. The readers can run
+    //concurrently with the worker, not with the edits. Enabling the paging or the
+    //iterative calculation together with the background recalculation throws std::logic_error.
+    void SetBackgroundRecalculation(bool enabled);
+    //Value of the cell at pos without waiting for the recalculation: the last value
+    //computed, stale if the cell was invalidated since. A formula never evaluated is
+    //evaluated like GetValue. Throw InvalidPositionException for an invalid position.
+    CachedValue GetCachedValue(Position pos) const;
+    //Block until the worker has evaluated every invalidated formula.
+    void WaitForRecalculation() const;
+    RecalcStats GetRecalcStats() const;
+
+    //Evaluate the dirty formulas for about budget (at least one step), in dependency
+    //order: a depth-first walk from the formulas to evaluate through their dirty
+    //precedents evaluates a formula once the cells it reads are clean, so that no
+    //evaluation recurses and the walk stops at any step. The formulas of priority (e.g.
+    //the visible viewport) and their dirty precedents go first. The next slice resumes
+    //the walk; the formulas invalidated by the edits in between are added to the walk
+    //(the walk starts again from its formulas, their references may have changed). The
+    //first slice starts from all the dirty formulas, the edits following it feed the
+    //walk. With the iterative calculation, the formulas are evaluated without the walk.
+    //Throw InvalidPositionException for an invalid priority region.
+    RecalcProgress RecalculateFor(std::chrono::microseconds budget);
+    RecalcProgress RecalculateFor(std::chrono::microseconds budget, CellRange priority);
+
+private:
+	// Можете дополнить ваш класс нужными полями и методами
+    
+
+    //Check if the position is valid and throw an exception otherwise.
+    static void CheckIfPositionIsValid(Position pos);
+
+    //Update the printable after deleting cell.
+    void UpdatePrintableZoneAfterClearingCell(Position pos);
+
+    enum class Axis {
+        Rows,
+        Cols,
+    };
+
+    //Structural changes along one axis.
+    void InsertLines(Axis axis, int before, int count);
+    void DeleteLines(Axis axis, int first, int count);
+    void CheckStructureChange(Axis axis, int first, int count) const;
+
+    //Positions of the cells whose row (column) is in [first, last).
+    std::vector<Position> CollectCells(Axis axis, int first, int last) const;
+
+    //Row or column of pos along the axis.
+    static int& Coordinate(Position& pos, Axis axis);
+    int GetGridSize(Axis axis) const;
+    int& GetPrintableSize(Axis axis);
+
+    //Check if the formula does not lead to circular dependencies.
+    //Invalidate cache if we update an already existing cell.
+    //bool ValidDependencies(Position pos, std::string text);
+
+    bool IsInGrid(Position pos) const;
+    void AddRowsToGrid(int n);
+    void AddColumsToGrid(int n);
+
+    //Make the block of row resident (read back if it was paged out) and the most recently used.
+    void FaultIn(int row) const;
+    //Same before changing a cell of the row: a block shared with the sheet of a fork is copied.
+    void FaultInForUpdate(int row);
+    //Write a resident block to the paging file and release its rows.
+    void PageOut(int block) const;
+    //Page out the least recently used blocks until the budget is met (except keep_block).
+    void TrimMemory(int keep_block = -1) const;
+    //Read a paged block back from the paging file.
+    void PageIn(int block) const;
+    void PageInAll();
+    //Count the cells of the blocks from the one of first_row again (after the cells moved).
+    void RecountBlocks(int first_row = 0) const;
+    //The lines from first were inserted or deleted: count the blocks they moved through
+    //again, or only mark the counts outdated while the paging is disabled.
+    void CountMovedLines(Axis axis, int first);
+    //A cell (formula) was added to the grid at pos, negative if removed.
+    void CountCell(Position pos, int cells, int formulas);
+    size_t GetRowBytes() const;
+
+    //Cells of a block of rows shared by a sheet and its forks (never modified while shared):
+    //the rows moved out of the grid of the sheet, or copies of its cells.
+    struct SharedBlock {
+        //the rows of the block when it was shared (taken back by the sheet once no fork reads them)
+        mutable std::vector<std::vector<std::unique_ptr<Cell>>> rows;
+        mutable std::mutex mutex;
+        //forks holding the block
+        mutable int readers = 0;
+
+        //Cell at row (in the block) and col, nullptr if there is none.
+        Cell* Find(int row, int col) const;
+    };
+
+    //Block shared with a fork: the block shared by the sheet this one was forked from,
+    //or the rows of the sheet moved to a block lent to the forks (copies if the paging
+    //is enabled).
+    std::shared_ptr<const SharedBlock> ShareBlock(int block) const;
+    //The block is shared by another sheet or lent to the forks.
+    bool IsShared(int block) const;
+    bool IsLent(int block) const;
+    //Bring the cells of a shared or lent block back into the grid (nothing if the block is
+    //not shared): the rows of a block no fork reads anymore are taken back, the others copied.
+    void CopySharedBlock(int block) const;
+    void CopySharedBlocks() const;
+    //Cell at pos of a shared block: a cell of a lent block, a text cell of a block of
+    //another sheet, or a copy of a formula of it.
+    Cell* FindSharedCell(Position pos) const;
+    std::unique_ptr<Cell> CopySharedCell(const Cell& shared_cell, Position pos) const;
+
+    //Cell at pos, nullptr if there is no cell.
+    Cell* FindCell(Position pos) const;
+    //Same for a position of the grid whose row is resident (FaultIn).
+    Cell* GetGridCell(Position pos) const;
+
+    //SetCell without creating a version: used for the cells created by SetCell itself.
+    //The content is a text (std::string) or a parsed formula (unique_ptr).
+    template <typename Content>
+    void PutCell(Position pos, Content content);
+    //SetNumber without creating a version. Return true if the text of an existing cell
+    //changed: its dependents are left to invalidate.
+    bool PutNumber(Position pos, double value);
+    //Same for a value: a number or an error pinned to the cell.
+    bool PutValue(Position pos, const FormulaInterface::Value& value);
+    //ApplyTicks with put (PutNumber or PutValue) for every coalesced tick.
+    template <typename Tick, typename Put>
+    size_t ApplyTicks(const std::vector<std::pair<Position, Tick>>& ticks, Put put);
+
+    //Create a cell in the grid with the content.
+    template <typename Content>
+    void SetCellInGrid(Position pos, Content content);
+    //Create dependent empty cells.
+    void SetDependentCells(Position pos);
+    
+    //Slice of RecalculateFor, priority may be nullptr.
+    RecalcProgress RecalculateSlice(std::chrono::microseconds budget, const CellRange* priority);
+    //The walk of the slices starts again from the formulas it was visiting.
+    void RestartRecalcWalk();
+
+    //Evaluate the run of lanes formulas with the shape program starting at first.
+    size_t EvaluateBatch(const BatchProgram* program, Position first, int lanes);
+
+    //Log a layout change with the version of the current edit.
+    void LogLayoutChange(Axis axis, bool insert, int first, int count);
+    //End of an edit: stamp its changes with a new version and notify the subscriptions.
+    void CommitEdit();
+
+    //Check if [top_left, bottom_right] is a valid rectangle and throw an exception otherwise.
+    static void CheckIfRangeIsValid(Position top_left, Position bottom_right);
+
+    //Traverse the printable zone and apply operation.
+    template <typename Func>
+    void VisitPrintableZone(std::ostream& output, Func operation) const;
+
+    //Print the rectangle [top_left, bottom_right]: operation prints the non-empty
+    //cells, the columns are separated by tabs, every row ends with a new line.
+    template <typename Func>
+    void VisitZone(std::ostream& output, Position top_left, Position bottom_right, Func operation) const;
+
+    //Long texts of the cells (declared before the cells: outlives them), shared with the forks.
+    //The texts of the cells read back from the paging file are interned again.
+    std::shared_ptr<TextPool> texts_;
+    //Pools of the long texts of the cells shared with the sheet of a fork.
+    std::vector<std::shared_ptr<const TextPool>> shared_texts_;
+
+    // *first dimension: rows
+    // *second dimension: columns
+    //The rows of the paged blocks are empty (mutable: read back by the const accessors).
+    mutable std::vector<std::vector<std::unique_ptr<Cell>>> cells_ ;
+    int grid_cols_ = 0;
+    mutable BlockPager pager_;
+    //lines moved while the paging was disabled: recounted before the pager reads the counts
+    mutable bool block_counts_outdated_ = false;
+    //Blocks shared with the sheet of a fork and not copied yet (null: own block).
+    mutable std::vector<std::shared_ptr<const SharedBlock>> shared_blocks_;
+    //Blocks of the sheet lent to its forks: their rows are read there (null: in the grid).
+    mutable std::vector<std::shared_ptr<const SharedBlock>> lent_blocks_;
+    //shared and lent blocks
+    mutable size_t shared_block_count_ = 0;
+    //Shared blocks copied since: kept, GetCell may have handed out their text cells.
+    mutable std::vector<std::shared_ptr<const SharedBlock>> copied_blocks_;
+    
+    Size printable_size_;
+
+    //Mutable: the formulas copied from a shared block by the const accessors are bound to it.
+    mutable DependenciesManager dependencies_manager;
+
+    ChangeSubscriptions subscriptions_;
+
+    SheetVersion version_ = 0;
+    VersionLog versions_;
+    //changes of the current edit: cells whose text changed, cells invalidated
+    //by the DependenciesManager, rows or columns inserted or deleted
+    std::vector<Position> edited_cells_;
+    std::vector<Position> invalidated_cells_;
+    bool layout_changed_ = false;
+
+    //Slices of RecalculateFor: formulas to evaluate (the walk skips the clean ones and
+    //the repeated ones) and the walk in progress from one of them, every formula with
+    //its precedents left to visit. Once the first slice ran, the edits add the cells
+    //they invalidate to recalc_roots_, or start from all the dirty formulas again.
+    struct RecalcFrame {
+        Position cell;
+        std::vector<Position> precedents;
+    };
+    std::deque<Position> recalc_roots_;
+    std::vector<RecalcFrame> recalc_walk_;
+    bool recalc_tracking_ = false;
+    bool recalc_replan_ = false;
+    //the dirty formulas of recalc_priority_ were put first, no edit since
+    bool recalc_priority_active_ = false;
+    CellRange recalc_priority_;
+
+    //Worker of the background recalculation, null if disabled (declared last: stopped
+    //before the cells it evaluates are destroyed).
+    std::unique_ptr<RecalcWorker> recalc_worker_;
+};
+
+
+template <typename Func>
+void Sheet::VisitPrintableZone(std::ostream& output, Func operation) const {
+    if (printable_size_.rows == 0 || printable_size_.cols == 0) {
+        return;
+    }
+    VisitZone(output, Position{ 0, 0 }, Position{ printable_size_.rows - 1, printable_size_.cols - 1 }, operation);
+}
+
+template <typename Func>
+void Sheet::VisitZone(std::ostream& output, Position top_left, Position bottom_right, Func operation) const {
+    using namespace std::literals;
+    for (int r = top_left.row; r <= bottom_right.row; ++r) {
+        FaultIn(r);
+        bool is_first = true;
+        for (int c = top_left.col; c <= bottom_right.col; ++c) {
+            if (is_first) {
+                is_first = false;
+            }
+            else {
+                //output << '\t';
+                output << "\t"sv;
+            }
+            if (!IsInGrid({ r, c })) {
+                continue;
+            }
+            if (const Cell* cell = GetGridCell({ r, c })) {
+                operation(cell);
+            }
+        }
+        //output << '\n';
+        output << "\n"sv;
+    }
+}
@@ -0,0 +1,144 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace {
+int BucketOf(std::uint64_t nanoseconds) {
+    int bucket = 0;
+    while (nanoseconds > 0 && bucket < HistogramSnapshot::BUCKETS - 1) {
+        nanoseconds >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+void PrintHistogram(std::ostream& output, const char* name, const HistogramSnapshot& histogram) {
+    output << name << ": count=" << histogram.count
+        << " total_ns=" << histogram.total_ns
+        << " p50<=" << histogram.Percentile(50) << "ns"
+        << " p99<=" << histogram.Percentile(99) << "ns\n";
+}
+}  // namespace
+
+std::uint64_t HistogramSnapshot::Percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+    std::uint64_t rank = static_cast<std::uint64_t>(p / 100.0 * count);
+    rank = std::min(std::max<std::uint64_t>(rank, 1), count);
+    std::uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; ++b) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            return b == 0 ? 0 : (std::uint64_t{ 1 } << b);
+        }
+    }
+    return std::uint64_t{ 1 } << (BUCKETS - 1);
+}
+
+void LatencyHistogram::Record(std::uint64_t nanoseconds) {
+    buckets_[BucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_ns_.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+HistogramSnapshot LatencyHistogram::GetSnapshot() const {
+    HistogramSnapshot snapshot;
+    for (int b = 0; b < HistogramSnapshot::BUCKETS; ++b) {
+        snapshot.buckets[b] = buckets_[b].load(std::memory_order_relaxed);
+    }
+    snapshot.count = count_.load(std::memory_order_relaxed);
+    snapshot.total_ns = total_ns_.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void LatencyHistogram::Reset() {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    total_ns_.store(0, std::memory_order_relaxed);
+}
+
+#if SPREADSHEET_STATS
+void SheetCounters::OnEditInvalidated(std::uint64_t cells) {
+    Increment(edits_);
+    Increment(cells_invalidated_, cells);
+    std::uint64_t current_max = max_cells_invalidated_per_edit_.load(std::memory_order_relaxed);
+    while (cells > current_max
+        && !max_cells_invalidated_per_edit_.compare_exchange_weak(current_max, cells, std::memory_order_relaxed)) {
+    }
+}
+
+void SheetCounters::OnPhase(Phase phase, std::uint64_t nanoseconds) {
+    switch (phase) {
+    case Phase::Parse:
+        set_cell_parse_.Record(nanoseconds);
+        break;
+    case Phase::CycleCheck:
+        set_cell_cycle_check_.Record(nanoseconds);
+        break;
+    case Phase::Invalidate:
+        set_cell_invalidate_.Record(nanoseconds);
+        break;
+    }
+}
+
+void SheetCounters::FillStats(SheetStats& stats) const {
+    auto load = [](const std::atomic<std::uint64_t>& counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+    stats.formulas_evaluated = load(formulas_evaluated_);
+    stats.cache_hits = load(cache_hits_);
+    stats.cache_misses = load(cache_misses_);
+    stats.cache_waits = load(cache_waits_);
+    stats.edits = load(edits_);
+    stats.cells_invalidated = load(cells_invalidated_);
+    stats.max_cells_invalidated_per_edit = load(max_cells_invalidated_per_edit_);
+    stats.cycle_checks = load(cycle_checks_);
+    stats.cycle_check_vertices_visited = load(cycle_check_vertices_visited_);
+    stats.formulas_parsed = load(formulas_parsed_);
+    stats.parse_time_ns = load(parse_time_ns_);
+    stats.set_cell_parse = set_cell_parse_.GetSnapshot();
+    stats.set_cell_cycle_check = set_cell_cycle_check_.GetSnapshot();
+    stats.set_cell_invalidate = set_cell_invalidate_.GetSnapshot();
+}
+
+void SheetCounters::Reset() {
+    for (auto* counter : { &formulas_evaluated_, &cache_hits_, &cache_misses_, &cache_waits_, &edits_,
+        &cells_invalidated_, &max_cells_invalidated_per_edit_, &cycle_checks_,
+        &cycle_check_vertices_visited_, &formulas_parsed_, &parse_time_ns_ }) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+    set_cell_parse_.Reset();
+    set_cell_cycle_check_.Reset();
+    set_cell_invalidate_.Reset();
+}
+#endif
+
+std::ostream& operator<<(std::ostream& output, const SheetStats& stats) {
+    if (!stats.enabled) {
+        return output << "statistics disabled (SPREADSHEET_STATS=0)\n";
+    }
+    output << "formulas_evaluated: " << stats.formulas_evaluated << '\n'
+        << "cache_hits: " << stats.cache_hits << '\n'
+        << "cache_misses: " << stats.cache_misses << '\n'
+        << "cache_waits: " << stats.cache_waits << '\n'
+        << "edits: " << stats.edits << '\n'
+        << "cells_invalidated: " << stats.cells_invalidated << '\n'
+        << "max_cells_invalidated_per_edit: " << stats.max_cells_invalidated_per_edit << '\n'
+        << "cycle_checks: " << stats.cycle_checks << '\n'
+        << "cycle_check_vertices_visited: " << stats.cycle_check_vertices_visited << '\n'
+        << "formulas_parsed: " << stats.formulas_parsed << '\n'
+        << "parse_time_ns: " << stats.parse_time_ns << '\n'
+        << "graph_vertices: " << stats.graph_vertices << '\n'
+        << "graph_edges: " << stats.graph_edges << '\n'
+        << "graph_runs: " << stats.graph_runs << '\n'
+        << "graph_bytes: " << stats.graph_bytes << '\n'
+        << "graph_uncompressed_bytes: " << stats.graph_uncompressed_bytes << '\n';
+    PrintHistogram(output, "set_cell_parse", stats.set_cell_parse);
+    PrintHistogram(output, "set_cell_cycle_check", stats.set_cell_cycle_check);
+    PrintHistogram(output, "set_cell_invalidate", stats.set_cell_invalidate);
+    return output;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+//Runtime statistics of a sheet.
+//Define SPREADSHEET_STATS=0 to compile the counters out: SheetCounters then has
+//no member and every method of SheetCounters and StatsTimer is an empty inline function.
+#ifndef SPREADSHEET_STATS
+#define SPREADSHEET_STATS 1
+#endif
+
+//Snapshot of a latency histogram.
+//Bucket i counts the latencies in [2^(i-1), 2^i) nanoseconds (bucket 0: below 1ns).
+struct HistogramSnapshot {
+    static const int BUCKETS = 40;
+
+    std::array<std::uint64_t, BUCKETS> buckets{};
+    std::uint64_t count = 0;
+    std::uint64_t total_ns = 0;
+
+    //Upper bound (in nanoseconds) of the bucket holding the p-th percentile, p in [0, 100].
+    std::uint64_t Percentile(double p) const;
+};
+
+//Histogram of latencies with power-of-two buckets, updated without locks.
+class LatencyHistogram {
+public:
+    void Record(std::uint64_t nanoseconds);
+    HistogramSnapshot GetSnapshot() const;
+    void Reset();
+
+private:
+    std::array<std::atomic<std::uint64_t>, HistogramSnapshot::BUCKETS> buckets_{};
+    std::atomic<std::uint64_t> count_{ 0 };
+    std::atomic<std::uint64_t> total_ns_{ 0 };
+};
+
+//Statistics returned by Sheet::GetStats().
+struct SheetStats {
+    //false when the library was built with SPREADSHEET_STATS=0 (all counters are zero).
+    bool enabled = SPREADSHEET_STATS != 0;
+
+    //Evaluation.
+    std::uint64_t formulas_evaluated = 0;
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    //GetValue calls that waited for another thread evaluating the same cell.
+    std::uint64_t cache_waits = 0;
+
+    //Edits and cache invalidation.
+    std::uint64_t edits = 0;
+    std::uint64_t cells_invalidated = 0;
+    std::uint64_t max_cells_invalidated_per_edit = 0;
+
+    //Cycle checks.
+    std::uint64_t cycle_checks = 0;
+    std::uint64_t cycle_check_vertices_visited = 0;
+
+    //Formula parsing.
+    std::uint64_t formulas_parsed = 0;
+    std::uint64_t parse_time_ns = 0;
+
+    //Size of the dependency graph.
+    std::uint64_t graph_vertices = 0;
+    std::uint64_t graph_edges = 0;
+    //Runs of formulas filled down a column (along a row) stored as one edge pattern.
+    std::uint64_t graph_runs = 0;
+    //Estimated memory of the graph, and of the same edges stored one by one.
+    std::uint64_t graph_bytes = 0;
+    std::uint64_t graph_uncompressed_bytes = 0;
+
+    //Latency of the phases of SetCell.
+    HistogramSnapshot set_cell_parse;
+    HistogramSnapshot set_cell_cycle_check;
+    HistogramSnapshot set_cell_invalidate;
+};
+
+std::ostream& operator<<(std::ostream& output, const SheetStats& stats);
+
+//Counters updated on the hot paths (Cell, DependenciesManager, Graph).
+//All updates are relaxed atomic increments: safe with concurrent GetValue.
+class SheetCounters {
+public:
+    enum class Phase {
+        Parse,
+        CycleCheck,
+        Invalidate,
+    };
+
+#if SPREADSHEET_STATS
+    void OnFormulaEvaluated() { Increment(formulas_evaluated_); }
+    void OnCacheHit() { Increment(cache_hits_); }
+    void OnCacheMiss() { Increment(cache_misses_); }
+    void OnCacheWait() { Increment(cache_waits_); }
+    void OnCycleCheck(std::uint64_t vertices_visited) {
+        Increment(cycle_checks_);
+        Increment(cycle_check_vertices_visited_, vertices_visited);
+    }
+    void OnFormulaParsed(std::uint64_t nanoseconds) {
+        Increment(formulas_parsed_);
+        Increment(parse_time_ns_, nanoseconds);
+    }
+    void OnEditInvalidated(std::uint64_t cells);
+    void OnPhase(Phase phase, std::uint64_t nanoseconds);
+
+    //Fill the counters of stats (the graph size is filled by the caller).
+    void FillStats(SheetStats& stats) const;
+    void Reset();
+#else
+    void OnFormulaEvaluated() {}
+    void OnCacheHit() {}
+    void OnCacheMiss() {}
+    void OnCacheWait() {}
+    void OnCycleCheck(std::uint64_t) {}
+    void OnFormulaParsed(std::uint64_t) {}
+    void OnEditInvalidated(std::uint64_t) {}
+    void OnPhase(Phase, std::uint64_t) {}
+
+    void FillStats(SheetStats&) const {}
+    void Reset() {}
+#endif
+
+#if SPREADSHEET_STATS
+private:
+    static void Increment(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    std::atomic<std::uint64_t> formulas_evaluated_{ 0 };
+    std::atomic<std::uint64_t> cache_hits_{ 0 };
+    std::atomic<std::uint64_t> cache_misses_{ 0 };
+    std::atomic<std::uint64_t> cache_waits_{ 0 };
+    std::atomic<std::uint64_t> edits_{ 0 };
+    std::atomic<std::uint64_t> cells_invalidated_{ 0 };
+    std::atomic<std::uint64_t> max_cells_invalidated_per_edit_{ 0 };
+    std::atomic<std::uint64_t> cycle_checks_{ 0 };
+    std::atomic<std::uint64_t> cycle_check_vertices_visited_{ 0 };
+    std::atomic<std::uint64_t> formulas_parsed_{ 0 };
+    std::atomic<std::uint64_t> parse_time_ns_{ 0 };
+    LatencyHistogram set_cell_parse_;
+    LatencyHistogram set_cell_cycle_check_;
+    LatencyHistogram set_cell_invalidate_;
+#endif
+};
+
+//Measure the duration of a scope and report it to func(nanoseconds).
+//Does not read the clock when the statistics are compiled out.
+template <typename Func>
+class StatsTimer {
+public:
+    explicit StatsTimer(Func func)
+        : func_(func)
+#if SPREADSHEET_STATS
+        , start_(std::chrono::steady_clock::now())
+#endif
+    {
+    }
+
+    ~StatsTimer() {
+#if SPREADSHEET_STATS
+        auto duration = std::chrono::steady_clock::now() - start_;
+        func_(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+#endif
+    }
+
+    StatsTimer(const StatsTimer&) = delete;
+    StatsTimer& operator=(const StatsTimer&) = delete;
+
+private:
+    Func func_;
+#if SPREADSHEET_STATS
+    std::chrono::steady_clock::time_point start_;
+#endif
+};
@@ -1,108 +1,149 @@
-#include "common.h"
-
-#include <cctype>
-#include <sstream>
-#include <algorithm>
-
-const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
-
-const Position Position::NONE = {-1, -1};
-
-bool Position::operator==(const Position rhs) const {
-    return row == rhs.row && col == rhs.col;
-}
-
-bool Position::operator<(const Position rhs) const {
-    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
-}
-
-bool Position::IsValid() const {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
-}
-
-std::string Position::ToString() const {
-    if (!IsValid()) {
-        return "";
-    }
-
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
-    }
-
-    result += std::to_string(row + 1);
-
-    return result;
-}
-
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
-
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
-    }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
-        return Position::NONE;
-    }
-
-    if (!std::isdigit(digits[0])) {
-        return Position::NONE;
-    }
-
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
-    }
-
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
-    }
-
-    return {row - 1, col - 1};
-}
-
-bool Size::operator==(Size rhs) const {
-    return cols == rhs.cols && rows == rhs.rows;
-}
-
-
-
-FormulaError::FormulaError(Category category) : category_(category) {
-
-}
-
-bool FormulaError::operator==(FormulaError rhs) const {
-    return category_ == rhs.category_;
-}
-
-FormulaError::Category FormulaError::GetCategory() const {
-    return category_;
-}
-
-std::string_view FormulaError::ToString() const {
-
-    using namespace std::literals;
-    if (category_ == Category::Ref) {
-        return "#REF!"sv;
-    }
-    else if (category_ == Category::Value) {
-        return "#VALUE!"sv;
-    }
-    else {
-        //Category::Div0
-        return "#ARITHM!"sv;
-    }
-
+#include "common.h"
+
+#include <climits>
+#include <cstring>
+#include <algorithm>
+
+const int LETTERS = 26;
+const int MAX_POS_LETTER_COUNT = 3;
+
+const Position Position::NONE = {-1, -1};
+
+bool Position::operator==(const Position rhs) const {
+    return row == rhs.row && col == rhs.col;
+}
+
+bool Position::operator<(const Position rhs) const {
+    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
+}
+
+bool Position::IsValid() const {
+    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+}
+
+namespace {
+//"00", "01", ..., "99": the digits of the row are written two at a time.
+struct DigitPairs {
+    char digits[200];
+
+    DigitPairs() {
+        for (int i = 0; i < 100; ++i) {
+            digits[2 * i] = static_cast<char>('0' + i / 10);
+            digits[2 * i + 1] = static_cast<char>('0' + i % 10);
+        }
+    }
+};
+
+const DigitPairs DIGIT_PAIRS;
+
+//Number of letters of the columns: A..Z, AA..ZZ, AAA..XFD.
+int GetLetterCount(int col) {
+    return 1 + (col >= LETTERS) + (col >= LETTERS + LETTERS * LETTERS);
+}
+
+int GetDigitCount(int number) {
+    return 1 + (number >= 10) + (number >= 100) + (number >= 1000) + (number >= 10000);
+}
+
+bool IsUpperLetter(char c) {
+    return static_cast<unsigned char>(c - 'A') < LETTERS;
+}
+
+bool IsDigit(char c) {
+    return static_cast<unsigned char>(c - '0') < 10;
+}
+}  // namespace
+
+size_t Position::ToChars(char* buffer) const {
+    if (!IsValid()) {
+        return 0;
+    }
+    int letter_count = GetLetterCount(col);
+    int number = row + 1;
+    int digit_count = GetDigitCount(number);
+
+    //letters and digits are written from the end
+    int c = col;
+    for (int i = letter_count - 1; i >= 0; --i) {
+        buffer[i] = static_cast<char>('A' + c % LETTERS);
+        c = c / LETTERS - 1;
+    }
+    char* digits_end = buffer + letter_count + digit_count;
+    while (number >= 10) {
+        digits_end -= 2;
+        std::memcpy(digits_end, DIGIT_PAIRS.digits + 2 * (number % 100), 2);
+        number /= 100;
+    }
+    if (number > 0) {
+        *--digits_end = static_cast<char>('0' + number);
+    }
+    return letter_count + digit_count;
+}
+
+std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
+}
+
+Position Position::FromString(std::string_view str) {
+    size_t letter_count = 0;
+    int col = 0;
+    while (letter_count < str.size() && IsUpperLetter(str[letter_count])) {
+        if (letter_count == MAX_POS_LETTER_COUNT) {
+            return Position::NONE;
+        }
+        col = col * LETTERS + (str[letter_count] - 'A' + 1);
+        ++letter_count;
+    }
+    if (letter_count == 0 || letter_count == str.size()) {
+        return Position::NONE;
+    }
+
+    //the row must fit in an int, leading zeros are accepted
+    std::int64_t row = 0;
+    for (size_t i = letter_count; i < str.size(); ++i) {
+        if (!IsDigit(str[i])) {
+            return Position::NONE;
+        }
+        row = row * 10 + (str[i] - '0');
+        if (row > INT_MAX) {
+            return Position::NONE;
+        }
+    }
+
+    return {static_cast<int>(row) - 1, col - 1};
+}
+
+bool Size::operator==(Size rhs) const {
+    return cols == rhs.cols && rows == rhs.rows;
+}
+
+
+
+FormulaError::FormulaError(Category category) : category_(category) {
+
+}
+
+bool FormulaError::operator==(FormulaError rhs) const {
+    return category_ == rhs.category_;
+}
+
+FormulaError::Category FormulaError::GetCategory() const {
+    return category_;
+}
+
+std::string_view FormulaError::ToString() const {
+
+    using namespace std::literals;
+    if (category_ == Category::Ref) {
+        return "#REF!"sv;
+    }
+    else if (category_ == Category::Value) {
+        return "#VALUE!"sv;
+    }
+    else {
+        //Category::Div0
+        return "#ARITHM!"sv;
+    }
+
 }
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include "subscriptions.h"
+
+#include <algorithm>
+
+bool CellRange::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+SubscriptionId ChangeSubscriptions::Subscribe(CellRange range, ChangeCallback callback) {
+    if (!range.first.IsValid() || !range.last.IsValid()
+        || range.first.row > range.last.row || range.first.col > range.last.col) {
+        throw InvalidPositionException("Invalid range of cells");
+    }
+    SubscriptionId id = next_id_++;
+    subscriptions_[id] = Subscription{ range, std::move(callback) };
+    ForEachTile(range, [this, id](int tile_key) {
+        tile_to_subscriptions_[tile_key].push_back(id);
+    });
+    return id;
+}
+
+void ChangeSubscriptions::Unsubscribe(SubscriptionId id) {
+    auto it = subscriptions_.find(id);
+    if (it == subscriptions_.end()) {
+        return;
+    }
+    ForEachTile(it->second.range, [this, id](int tile_key) {
+        auto tile_it = tile_to_subscriptions_.find(tile_key);
+        std::vector<SubscriptionId>& ids = tile_it->second;
+        ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+        if (ids.empty()) {
+            tile_to_subscriptions_.erase(tile_it);
+        }
+    });
+    subscriptions_.erase(it);
+    if (subscriptions_.empty()) {
+        change_log_.clear();
+        layout_changed_ = false;
+    }
+}
+
+bool ChangeSubscriptions::IsEmpty() const {
+    return subscriptions_.empty();
+}
+
+void ChangeSubscriptions::LogChange(Position pos) {
+    //a cell of a tile without subscription is delivered to nobody
+    if (subscriptions_.empty()) {
+        return;
+    }
+    auto [tile_row, tile_col] = GetTile(pos);
+    if (tile_to_subscriptions_.count(GetTileKey(tile_row, tile_col)) > 0) {
+        change_log_.push_back(pos);
+    }
+}
+
+void ChangeSubscriptions::LogLayoutChange(bool rows, int first) {
+    for (auto& [id, subscription] : subscriptions_) {
+        //the ranges before the first moved line do not move
+        int last = rows ? subscription.range.last.row : subscription.range.last.col;
+        if (last >= first) {
+            subscription.layout_changed = true;
+            layout_changed_ = true;
+        }
+    }
+}
+
+void ChangeSubscriptions::BeginBatch() {
+    ++batch_depth_;
+}
+
+void ChangeSubscriptions::EndBatch() {
+    if (batch_depth_ > 0) {
+        --batch_depth_;
+    }
+    Deliver();
+}
+
+void ChangeSubscriptions::Deliver() {
+    if (batch_depth_ > 0 || (change_log_.empty() && !layout_changed_)) {
+        return;
+    }
+    //the log is taken first: a callback may edit the sheet and start a new log
+    std::vector<Position> changes;
+    changes.swap(change_log_);
+    layout_changed_ = false;
+    std::sort(changes.begin(), changes.end());
+    changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+
+    std::map<SubscriptionId, SheetChanges> notifications;
+    for (auto& [id, subscription] : subscriptions_) {
+        if (subscription.layout_changed) {
+            notifications[id].layout_changed = true;
+            subscription.layout_changed = false;
+        }
+    }
+    for (Position pos : changes) {
+        auto [tile_row, tile_col] = GetTile(pos);
+        auto tile_it = tile_to_subscriptions_.find(GetTileKey(tile_row, tile_col));
+        if (tile_it == tile_to_subscriptions_.end()) {
+            continue;
+        }
+        for (SubscriptionId id : tile_it->second) {
+            if (subscriptions_.at(id).range.Contains(pos)) {
+                notifications[id].cells.push_back(pos);
+            }
+        }
+    }
+
+    for (const auto& [id, notification] : notifications) {
+        //a previous callback may have removed the subscription
+        auto it = subscriptions_.find(id);
+        if (it != subscriptions_.end()) {
+            ChangeCallback callback = it->second.callback;
+            callback(notification);
+        }
+    }
+}
+
+std::pair<int, int> ChangeSubscriptions::GetTile(Position pos) {
+    return { pos.row / TILE_SIZE, pos.col / TILE_SIZE };
+}
+
+int ChangeSubscriptions::GetTileKey(int tile_row, int tile_col) {
+    return tile_row * (Position::MAX_COLS / TILE_SIZE) + tile_col;
+}
+
+template <typename Func>
+void ChangeSubscriptions::ForEachTile(const CellRange& range, Func func) {
+    auto [first_row, first_col] = GetTile(range.first);
+    auto [last_row, last_col] = GetTile(range.last);
+    for (int tile_row = first_row; tile_row <= last_row; ++tile_row) {
+        for (int tile_col = first_col; tile_col <= last_col; ++tile_col) {
+            func(GetTileKey(tile_row, tile_col));
+        }
+    }
+}
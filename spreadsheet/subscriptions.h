@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+//Rectangle of cells from first to last (both included), like A1:C10.
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool Contains(Position pos) const;
+};
+
+//Changes of a subscribed range after one batch of edits.
+struct SheetChanges {
+    //cells of the range whose displayed value may have changed: the edited cells
+    //and the formulas invalidated by the edits (sorted, without duplicates)
+    std::vector<Position> cells;
+    //rows or columns were inserted or deleted across the range: its cells may
+    //have moved, the whole range must be read again
+    bool layout_changed = false;
+};
+
+using ChangeCallback = std::function<void(const SheetChanges&)>;
+using SubscriptionId = size_t;
+
+/// <summary>
+/// Subscriptions of a sheet to the changes of ranges of cells.
+/// The changes of a batch of edits (edited cells and cells invalidated by the
+/// DependenciesManager) are logged and delivered once, when the batch ends,
+/// to the subscriptions whose range contains them. The subscriptions
+/// are indexed by tiles of TILE_SIZE x TILE_SIZE cells: a change is logged only
+/// if a subscription covers its tile and only visits those subscriptions, the
+/// edits far from the ranges cost one lookup. Nothing is logged while there is
+/// no subscription.
+/// </summary>
+class ChangeSubscriptions {
+public:
+    SubscriptionId Subscribe(CellRange range, ChangeCallback callback);
+    void Unsubscribe(SubscriptionId id);
+
+    bool IsEmpty() const;
+
+    void LogChange(Position pos);
+    //Lines [first, ...) of the rows (columns) moved.
+    void LogLayoutChange(bool rows, int first);
+
+    //Nested batches are delivered when the outermost one ends.
+    void BeginBatch();
+    void EndBatch();
+
+    //Deliver the logged changes unless a batch is open.
+    void Deliver();
+
+private:
+    static constexpr int TILE_SIZE = 128;
+
+    struct Subscription {
+        CellRange range;
+        ChangeCallback callback;
+        bool layout_changed = false;
+    };
+
+    static std::pair<int, int> GetTile(Position pos);
+    static int GetTileKey(int tile_row, int tile_col);
+
+    template <typename Func>
+    static void ForEachTile(const CellRange& range, Func func);
+
+    //ordered by id: the callbacks are called in the order of the subscriptions
+    std::map<SubscriptionId, Subscription> subscriptions_;
+    std::unordered_map<int, std::vector<SubscriptionId>> tile_to_subscriptions_;
+    SubscriptionId next_id_ = 0;
+
+    std::vector<Position> change_log_;
+    bool layout_changed_ = false;
+    int batch_depth_ = 0;
+};
@@ -0,0 +1,57 @@
+#include "text_pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+TextPool::TextPool() {
+}
+
+const char* TextPool::Intern(std::string_view text) {
+    if (auto it = index_.find(text); it != index_.end()) {
+        return it->data() - sizeof(std::uint32_t);
+    }
+    std::uint32_t size = static_cast<std::uint32_t>(text.size());
+    char* handle = Allocate(sizeof(size) + text.size());
+    std::memcpy(handle, &size, sizeof(size));
+    std::memcpy(handle + sizeof(size), text.data(), text.size());
+    index_.insert(std::string_view(handle + sizeof(size), text.size()));
+    return handle;
+}
+
+std::string_view TextPool::GetText(const char* handle) {
+    std::uint32_t size;
+    std::memcpy(&size, handle, sizeof(size));
+    return std::string_view(handle + sizeof(size), size);
+}
+
+size_t TextPool::GetCount() const {
+    return index_.size();
+}
+
+size_t TextPool::GetBytes() const {
+    //node of the index: next pointer, the view and the cached hash
+    const size_t index_node = sizeof(void*) + sizeof(std::string_view) + sizeof(size_t);
+    return arena_bytes_ + blocks_.capacity() * sizeof(blocks_[0])
+        + index_.size() * index_node + index_.bucket_count() * sizeof(void*);
+}
+
+char* TextPool::Allocate(size_t size) {
+    if (size > MAX_BLOCK_SIZE / 4) {
+        //a large text gets a block of its own, the free space of the current block is kept
+        blocks_.push_back(std::make_unique<char[]>(size));
+        arena_bytes_ += size;
+        return blocks_.back().get();
+    }
+    if (size > free_size_) {
+        size_t block_size = blocks_.empty() ? MIN_BLOCK_SIZE : std::min(arena_bytes_, MAX_BLOCK_SIZE);
+        block_size = std::max(block_size, size);
+        blocks_.push_back(std::make_unique<char[]>(block_size));
+        arena_bytes_ += block_size;
+        free_ = blocks_.back().get();
+        free_size_ = block_size;
+    }
+    char* result = free_;
+    free_ += size;
+    free_size_ -= size;
+    return result;
+}
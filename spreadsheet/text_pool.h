@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+/// <summary>
+/// Append-only arena holding the distinct long texts of a sheet.
+/// Intern returns the same handle for equal texts, so a label repeated in
+/// many cells is stored once. A handle points to the size of the text
+/// followed by its characters; it stays valid until the pool is destroyed
+/// (texts are never removed, the pool lives as long as the sheet).
+/// </summary>
+class TextPool {
+public:
+    TextPool();
+    TextPool(const TextPool&) = delete;
+    TextPool& operator=(const TextPool&) = delete;
+
+    const char* Intern(std::string_view text);
+
+    //Text of a handle returned by Intern.
+    static std::string_view GetText(const char* handle);
+
+    //Number of distinct texts.
+    size_t GetCount() const;
+    //Bytes of the arena blocks and of the index (approximate).
+    size_t GetBytes() const;
+
+private:
+    //blocks grow from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE: small sheets stay small
+    static constexpr size_t MIN_BLOCK_SIZE = 256;
+    static constexpr size_t MAX_BLOCK_SIZE = 64 * 1024;
+
+    char* Allocate(size_t size);
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    size_t arena_bytes_ = 0;
+    //free space of the last block
+    char* free_ = nullptr;
+    size_t free_size_ = 0;
+    //views of the texts stored in the arena
+    std::unordered_set<std::string_view> index_;
+};
@@ -0,0 +1,192 @@
+#include "version_log.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+namespace {
+//Move pos as change moves its cell: false if the change deletes it.
+bool ApplyLayoutChange(Position& pos, const LayoutChange& change) {
+    int& coordinate = change.rows ? pos.row : pos.col;
+    if (change.insert) {
+        if (coordinate >= change.first) {
+            coordinate += change.count;
+        }
+    }
+    else if (coordinate >= change.first + change.count) {
+        coordinate -= change.count;
+    }
+    else if (coordinate >= change.first) {
+        return false;
+    }
+    return true;
+}
+
+//Undo change on pos: false if the change inserted the line of pos.
+bool UndoLayoutChange(Position& pos, const LayoutChange& change) {
+    int& coordinate = change.rows ? pos.row : pos.col;
+    if (change.insert) {
+        if (coordinate >= change.first + change.count) {
+            coordinate -= change.count;
+        }
+        else if (coordinate >= change.first) {
+            return false;
+        }
+    }
+    else if (coordinate >= change.first) {
+        coordinate += change.count;
+    }
+    return true;
+}
+}  // namespace
+
+void VersionLog::Start(SheetVersion version) {
+    Stop();
+    started_ = true;
+    start_version_ = version;
+}
+
+void VersionLog::Stop() {
+    started_ = false;
+    start_version_ = 0;
+    std::vector<Entry>().swap(entries_);
+    compacted_entries_ = 0;
+    std::vector<LayoutEpoch>().swap(epochs_);
+    std::vector<LayoutChange>().swap(layout_changes_);
+}
+
+bool VersionLog::IsStarted() const {
+    return started_;
+}
+
+SheetVersion VersionLog::GetStartVersion() const {
+    return start_version_;
+}
+
+void VersionLog::LogText(Position pos, SheetVersion version) {
+    Log(pos, version, true);
+}
+
+void VersionLog::LogValue(Position pos, SheetVersion version) {
+    Log(pos, version, false);
+}
+
+void VersionLog::Log(Position pos, SheetVersion version, bool text) {
+    if (!started_) {
+        return;
+    }
+    auto layout = static_cast<std::uint32_t>(layout_changes_.size());
+    if (epochs_.empty() || epochs_.back().layout != layout) {
+        epochs_.push_back(LayoutEpoch{ layout, {} });
+    }
+    CellVersion& cell_version = epochs_.back().cells[pos];
+    (text ? cell_version.text : cell_version.value) = version;
+    entries_.push_back(Entry{ version, pos, layout, text });
+    if (entries_.size() > 2 * compacted_entries_ + MIN_COMPACTION_ENTRIES) {
+        Compact();
+    }
+}
+
+void VersionLog::LogLayoutChange(const LayoutChange& change) {
+    if (!started_) {
+        return;
+    }
+    layout_changes_.push_back(change);
+}
+
+std::optional<Position> VersionLog::Translate(Position pos, size_t layout) const {
+    for (size_t i = layout; i < layout_changes_.size(); ++i) {
+        if (!ApplyLayoutChange(pos, layout_changes_[i])) {
+            //deleted: the clients delete it when they replay the change
+            return std::nullopt;
+        }
+    }
+    return pos;
+}
+
+CellVersion VersionLog::GetCellVersion(Position pos) const {
+    CellVersion result;
+    size_t layout = layout_changes_.size();
+    //from the latest epoch: pos is moved back through the layout changes
+    for (auto it = epochs_.rbegin(); it != epochs_.rend(); ++it) {
+        for (; layout > it->layout; --layout) {
+            if (!UndoLayoutChange(pos, layout_changes_[layout - 1])) {
+                //the line was inserted later: no older change
+                return result;
+            }
+        }
+        auto found = it->cells.find(pos);
+        if (found == it->cells.end()) {
+            continue;
+        }
+        if (result.text == 0) {
+            result.text = found->second.text;
+        }
+        if (result.value == 0) {
+            result.value = found->second.value;
+        }
+        if (result.text != 0 && result.value != 0) {
+            break;
+        }
+    }
+    return result;
+}
+
+std::vector<Position> VersionLog::GetCellsSince(SheetVersion version) const {
+    auto first = std::upper_bound(entries_.begin(), entries_.end(), version, [](SheetVersion version, const Entry& entry) {
+        return version < entry.version;
+    });
+    //from the last change: the first entry met of a cell is its last change
+    std::unordered_set<PositionKey, PositionHasher> seen;
+    std::vector<Position> cells;
+    for (auto it = entries_.rbegin(); it != std::make_reverse_iterator(first); ++it) {
+        std::optional<Position> pos = Translate(it->pos, it->layout);
+        if (pos && seen.insert(*pos).second) {
+            cells.push_back(*pos);
+        }
+    }
+    std::reverse(cells.begin(), cells.end());
+    return cells;
+}
+
+std::vector<LayoutChange> VersionLog::GetLayoutChangesSince(SheetVersion version) const {
+    auto first = std::upper_bound(layout_changes_.begin(), layout_changes_.end(), version, [](SheetVersion version, const LayoutChange& change) {
+        return version < change.version;
+    });
+    return std::vector<LayoutChange>(first, layout_changes_.end());
+}
+
+size_t VersionLog::GetBytes() const {
+    //a node of a map holds the next pointer and the pair
+    const size_t node = sizeof(void*) + sizeof(std::pair<const PositionKey, CellVersion>);
+    size_t bytes = entries_.capacity() * sizeof(Entry)
+        + epochs_.capacity() * sizeof(LayoutEpoch)
+        + layout_changes_.capacity() * sizeof(LayoutChange);
+    for (const LayoutEpoch& epoch : epochs_) {
+        bytes += epoch.cells.bucket_count() * sizeof(void*) + epoch.cells.size() * node;
+    }
+    return bytes;
+}
+
+void VersionLog::Compact() {
+    //the last entry of every cell and kind of change, in the current coordinates
+    auto layout = static_cast<std::uint32_t>(layout_changes_.size());
+    LayoutEpoch epoch{ layout, {} };
+    std::vector<Entry> entries;
+    for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+        std::optional<Position> pos = Translate(it->pos, it->layout);
+        if (!pos) {
+            continue;
+        }
+        auto [cell, inserted] = epoch.cells.try_emplace(*pos);
+        SheetVersion& version = it->text ? cell->second.text : cell->second.value;
+        if (version == 0) {
+            version = it->version;
+            entries.push_back(Entry{ it->version, *pos, layout, it->text });
+        }
+    }
+    std::reverse(entries.begin(), entries.end());
+    entries_.swap(entries);
+    compacted_entries_ = entries_.size();
+    epochs_.clear();
+    epochs_.push_back(std::move(epoch));
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+using SheetVersion = std::uint64_t;
+
+//Insertion or deletion of rows or columns, replayed by the clients before the changed cells.
+struct LayoutChange {
+    SheetVersion version = 0;
+    bool rows = true;
+    bool insert = true;
+    int first = 0;
+    int count = 0;
+};
+
+//Versions of the last changes of the text and of the value of a cell (0: never changed).
+struct CellVersion {
+    SheetVersion text = 0;
+    SheetVersion value = 0;
+};
+
+/// <summary>
+/// Versions of the changes of the cells of a sheet.
+/// Every change of a cell appends an entry, ordered by version: the cells
+/// changed since a version are thus found in time proportional to the number
+/// of changes since this version. The entries are compacted (one per cell and
+/// kind of change) once they doubled since the last compaction.
+/// Nothing is logged before Start: the log costs an entry and a node of the
+/// map of its epoch per changed cell, only the sheets exporting deltas pay it.
+/// A layout change is only logged: an entry keeps the coordinates of the cell
+/// when it was logged, and is moved through the layout changes logged after
+/// it when it is read (dropped if one of them deleted the cell). A layout
+/// change thus costs nothing, the reads pay for the layout changes they cross.
+/// </summary>
+class VersionLog {
+public:
+    //Log the changes after version (the versions of the earlier changes are unknown).
+    void Start(SheetVersion version);
+    //Stop logging and free the log.
+    void Stop();
+    bool IsStarted() const;
+    SheetVersion GetStartVersion() const;
+
+    void LogText(Position pos, SheetVersion version);
+    void LogValue(Position pos, SheetVersion version);
+    void LogLayoutChange(const LayoutChange& change);
+
+    CellVersion GetCellVersion(Position pos) const;
+
+    //Cells whose text or value changed after version (in the order of their last change).
+    std::vector<Position> GetCellsSince(SheetVersion version) const;
+    //Layout changes after version, in the order they happened.
+    std::vector<LayoutChange> GetLayoutChangesSince(SheetVersion version) const;
+
+    //Bytes allocated by the log.
+    size_t GetBytes() const;
+
+private:
+    static constexpr size_t MIN_COMPACTION_ENTRIES = 1024;
+
+    struct Entry {
+        SheetVersion version;
+        //in the coordinates after the first layout changes
+        Position pos;
+        std::uint32_t layout;
+        bool text;
+    };
+
+    //Versions of the cells logged while there were layout layout changes,
+    //in the coordinates of that time.
+    struct LayoutEpoch {
+        std::uint32_t layout;
+        std::unordered_map<PositionKey, CellVersion, PositionHasher> cells;
+    };
+
+    void Log(Position pos, SheetVersion version, bool text);
+    //Position of pos (in the coordinates after the first layout changes) now,
+    //nullopt if a later layout change deleted it.
+    std::optional<Position> Translate(Position pos, size_t layout) const;
+    void Compact();
+
+    bool started_ = false;
+    SheetVersion start_version_ = 0;
+    std::vector<Entry> entries_;
+    //entries kept by the last compaction
+    size_t compacted_entries_ = 0;
+    std::vector<LayoutEpoch> epochs_;
+    std::vector<LayoutChange> layout_changes_;
+};
@@ -0,0 +1,190 @@
+#include "wire.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+WireWriter::WireWriter()
+    : buffer_(own_) {
+    buffer_.append(sizeof(std::uint32_t), '\0');
+}
+
+WireWriter::WireWriter(std::string& buffer)
+    : buffer_(buffer)
+    , start_(buffer.size()) {
+    buffer_.append(sizeof(std::uint32_t), '\0');
+}
+
+void WireWriter::PutU8(std::uint8_t value) {
+    buffer_.push_back(static_cast<char>(value));
+}
+
+void WireWriter::PutU32(std::uint32_t value) {
+    buffer_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WireWriter::PutDouble(double value) {
+    buffer_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WireWriter::PutPosition(Position pos) {
+    PutU32(PositionKey(pos).GetValue());
+}
+
+void WireWriter::PutString(std::string_view text) {
+    PutU32(static_cast<std::uint32_t>(text.size()));
+    buffer_.append(text);
+}
+
+void WireWriter::PutValue(const FormulaInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) {
+        PutU8(0);
+        PutDouble(std::get<double>(value));
+    }
+    else {
+        PutU8(static_cast<std::uint8_t>(1 + static_cast<int>(std::get<FormulaError>(value).GetCategory())));
+    }
+}
+
+const std::string& WireWriter::Finish() {
+    size_t message_size = buffer_.size() - start_ - sizeof(std::uint32_t);
+    if (message_size > MAX_MESSAGE_SIZE) {
+        buffer_.resize(start_);
+        throw std::runtime_error("message too large");
+    }
+    std::uint32_t size = static_cast<std::uint32_t>(message_size);
+    std::memcpy(buffer_.data() + start_, &size, sizeof(size));
+    return buffer_;
+}
+
+WireReader::WireReader(std::string message)
+    : message_(std::move(message)) {
+}
+
+std::uint8_t WireReader::GetU8() {
+    std::uint8_t value = 0;
+    Get(&value, sizeof(value));
+    return value;
+}
+
+std::uint32_t WireReader::GetU32() {
+    std::uint32_t value = 0;
+    Get(&value, sizeof(value));
+    return value;
+}
+
+double WireReader::GetDouble() {
+    double value = 0;
+    Get(&value, sizeof(value));
+    return value;
+}
+
+Position WireReader::GetPosition() {
+    std::uint32_t key = GetU32();
+    Position pos{ static_cast<int>(key >> PositionKey::COORDINATE_BITS),
+        static_cast<int>(key & ((1u << PositionKey::COORDINATE_BITS) - 1)) };
+    if (key >> (2 * PositionKey::COORDINATE_BITS) != 0 || !pos.IsValid()) {
+        throw std::runtime_error("invalid position in message");
+    }
+    return pos;
+}
+
+std::string WireReader::GetString() {
+    std::uint32_t size = GetU32();
+    if (message_.size() - offset_ < size) {
+        throw std::runtime_error("truncated message");
+    }
+    std::string text = message_.substr(offset_, size);
+    offset_ += size;
+    return text;
+}
+
+FormulaInterface::Value WireReader::GetValue() {
+    std::uint8_t tag = GetU8();
+    if (tag == 0) {
+        return GetDouble();
+    }
+    if (tag > 1 + static_cast<int>(FormulaError::Category::Div0)) {
+        throw std::runtime_error("invalid value in message");
+    }
+    return FormulaError(static_cast<FormulaError::Category>(tag - 1));
+}
+
+bool WireReader::AtEnd() const {
+    return offset_ == message_.size();
+}
+
+void WireReader::Get(void* data, size_t size) {
+    if (message_.size() - offset_ < size) {
+        throw std::runtime_error("truncated message");
+    }
+    std::memcpy(data, message_.data() + offset_, size);
+    offset_ += size;
+}
+
+size_t GetWireMessageSize(std::string_view buffer) {
+    std::uint32_t size = 0;
+    if (buffer.size() < sizeof(size)) {
+        return 0;
+    }
+    std::memcpy(&size, buffer.data(), sizeof(size));
+    return buffer.size() - sizeof(size) < size ? 0 : sizeof(size) + size;
+}
+
+void WriteAll(int fd, std::string_view data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t result = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("socket write failed: ") + std::strerror(errno));
+        }
+        written += static_cast<size_t>(result);
+    }
+}
+
+namespace {
+//false at the end of the stream before the first byte.
+bool ReadAll(int fd, char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t result = read(fd, data + done, size - done);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("socket read failed: ") + std::strerror(errno));
+        }
+        if (result == 0) {
+            if (done == 0) {
+                return false;
+            }
+            throw std::runtime_error("truncated message");
+        }
+        done += static_cast<size_t>(result);
+    }
+    return true;
+}
+}  // namespace
+
+std::string ReadMessage(int fd) {
+    std::uint32_t size = 0;
+    if (!ReadAll(fd, reinterpret_cast<char*>(&size), sizeof(size))) {
+        return {};
+    }
+    if (size == 0) {
+        throw std::runtime_error("empty message");
+    }
+    if (size > MAX_MESSAGE_SIZE) {
+        throw std::runtime_error("message too large");
+    }
+    std::string message(size, '\0');
+    if (!ReadAll(fd, message.data(), size)) {
+        throw std::runtime_error("truncated message");
+    }
+    return message;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+//Binary messages between the processes of one host (ShardedRecalculation, SheetServer):
+//the size of the rest of the message (u32), then the fields in the byte order of the host.
+//A position is its PositionKey (u32), a string its size (u32) and its bytes.
+
+//Largest size of a message (without its size): a larger one is neither written nor read.
+constexpr std::uint32_t MAX_MESSAGE_SIZE = std::uint32_t(256) << 20;
+
+/// <summary>
+/// Writes a message at the end of a buffer (its own buffer by default): the fields are
+/// appended after room for the size, Finish writes the size. Several messages can be
+/// written one after the other to the same buffer.
+/// </summary>
+class WireWriter {
+public:
+    WireWriter();
+    explicit WireWriter(std::string& buffer);
+    WireWriter(const WireWriter&) = delete;
+    WireWriter& operator=(const WireWriter&) = delete;
+
+    void PutU8(std::uint8_t value);
+    void PutU32(std::uint32_t value);
+    void PutDouble(double value);
+    void PutPosition(Position pos);
+    void PutString(std::string_view text);
+    //A double (tag 0), or the category of an error (tag 1 + category).
+    void PutValue(const FormulaInterface::Value& value);
+
+    //Write the size of the message and return the buffer.
+    //Throw std::runtime_error (the message is removed from the buffer) if it is
+    //larger than MAX_MESSAGE_SIZE.
+    const std::string& Finish();
+
+private:
+    std::string own_;
+    std::string& buffer_;
+    size_t start_ = 0;
+};
+
+/// <summary>
+/// Reads the fields of a message (without its size).
+/// Throw std::runtime_error if the message is shorter than its fields.
+/// </summary>
+class WireReader {
+public:
+    explicit WireReader(std::string message);
+
+    std::uint8_t GetU8();
+    std::uint32_t GetU32();
+    double GetDouble();
+    //Throw std::runtime_error for an invalid position.
+    Position GetPosition();
+    std::string GetString();
+    FormulaInterface::Value GetValue();
+
+    bool AtEnd() const;
+
+private:
+    void Get(void* data, size_t size);
+
+    std::string message_;
+    size_t offset_ = 0;
+};
+
+//Size of the first message of buffer (with its size), 0 if it is not complete yet.
+size_t GetWireMessageSize(std::string_view buffer);
+
+//Blocking writes and reads of a socket (or a pipe): throw std::runtime_error on a
+//failure or a truncated message.
+void WriteAll(int fd, std::string_view data);
+//The fields of the next message (without its size), empty at the end of the stream.
+//An empty message, or one larger than MAX_MESSAGE_SIZE (not read), is an error.
+std::string ReadMessage(int fd);